@@ -44,7 +44,11 @@ LOCAL_SRC_FILES := \
     twrp.cpp \
     fixContexts.cpp \
     twrpTar.cpp \
+    twrpManifest.cpp \
+    twrpChunkStore.cpp \
     twrpDU.cpp \
+    twrpTrace.cpp \
+    twrpMountTable.cpp \
     twrpDigest.cpp \
     digest/md5.c \
     find_file.cpp \
@@ -113,6 +117,7 @@ LOCAL_SHARED_LIBRARIES :=
 
 LOCAL_STATIC_LIBRARIES += libguitwrp
 LOCAL_SHARED_LIBRARIES += libz libc libcutils libstdc++ libtar libblkid libminuitwrp libminadbd libmtdutils libminzip libaosprecovery libtwadbbu
+LOCAL_SHARED_LIBRARIES += libmincrypttwrp
 LOCAL_SHARED_LIBRARIES += libcrecovery
 
 ifeq ($(shell test $(PLATFORM_SDK_VERSION) -lt 23; echo $$?),0)
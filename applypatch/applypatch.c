@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/statfs.h>
 #include <sys/types.h>
@@ -32,7 +33,8 @@
 #include "mtdutils/mtdutils.h"
 #include "edify/expr.h"
 
-static int LoadPartitionContents(const char* filename, FileContents* file);
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int map);
 static ssize_t FileSink(const unsigned char* data, ssize_t len, void* token);
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
@@ -52,13 +54,14 @@ static int mtd_partitions_scanned = 0;
 // Return 0 on success.
 int LoadFileContents(const char* filename, FileContents* file) {
     file->data = NULL;
+    file->mapped = 0;
 
     // A special 'filename' beginning with "MTD:" or "EMMC:" means to
     // load the contents of a partition.
     if (strncmp(filename, "MTD:", 4) == 0 ||
         strncmp(filename, "EMMC:", 5) == 0 ||
         strncmp(filename, "BML:", 4) == 0) {
-        return LoadPartitionContents(filename, file);
+        return LoadPartitionContents(filename, file, 0);
     }
 
     if (stat(filename, &file->st) != 0) {
@@ -91,6 +94,64 @@ int LoadFileContents(const char* filename, FileContents* file) {
     return 0;
 }
 
+// Like LoadFileContents(), but maps a regular file instead of reading
+// it, so that patching does not need memory for the whole source.  Its
+// pages are read as the patch gets to them and can be dropped again
+// under memory pressure.  EMMC and BML partitions are mapped the same
+// way; MTD partitions, which are small and can't be mapped, are loaded
+// as before.  Free the contents with FreeFileContents().
+//
+// Return 0 on success.
+int MapFileContents(const char* filename, FileContents* file) {
+    file->data = NULL;
+    file->mapped = 0;
+
+    if (strncmp(filename, "MTD:", 4) == 0 ||
+        strncmp(filename, "EMMC:", 5) == 0 ||
+        strncmp(filename, "BML:", 4) == 0) {
+        return LoadPartitionContents(filename, file, 1);
+    }
+
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        printf("failed to open \"%s\": %s\n", filename, strerror(errno));
+        return -1;
+    }
+    if (fstat(fd, &file->st) != 0) {
+        printf("failed to stat \"%s\": %s\n", filename, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    file->size = file->st.st_size;
+    void* data = MAP_FAILED;
+    if (S_ISREG(file->st.st_mode) && file->size > 0) {
+        data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (data == MAP_FAILED) {
+        // Empty files can't be mapped
+        return LoadFileContents(filename, file);
+    }
+
+    file->data = data;
+    file->mapped = 1;
+    SHA_hash(file->data, file->size, file->sha1);
+    return 0;
+}
+
+void FreeFileContents(FileContents* file) {
+    if (file->data != NULL) {
+        if (file->mapped) {
+            munmap(file->data, file->size);
+        } else {
+            free(file->data);
+        }
+    }
+    file->data = NULL;
+    file->mapped = 0;
+}
+
 static size_t* size_array;
 // comparison function for qsort()ing an int array of indexes into
 // size_array[].
@@ -121,9 +182,18 @@ static int compare_size_indices(const void* a, const void* b) {
 // "end-of-file" marker), so the caller must specify the possible
 // lengths and the hash of the data, and we'll do the load expecting
 // to find one of those hashes.
+//
+// If map is set, EMMC partitions are hashed through a small buffer and
+// the matching prefix is then mapped, so that a large partition never
+// has to fit in memory.
 enum PartitionType { MTD, EMMC };
 
-static int LoadPartitionContents(const char* filename, FileContents* file) {
+// Pieces in which partitions are hashed and written
+#define PARTITION_IO_SIZE (1 << 20)
+
+static int LoadPartitionContents(const char* filename, FileContents* file,
+                                 int map) {
+    file->mapped = 0;
     char* copy = strdup(filename);
     const char* magic = strtok(copy, ":");
 
@@ -216,13 +286,15 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                 return -1;
             }
     }
+    map = map && type == EMMC;
 
     SHA_CTX sha_ctx;
     SHA_init(&sha_ctx);
     uint8_t parsed_sha[SHA_DIGEST_SIZE];
 
-    // allocate enough memory to hold the largest size.
-    file->data = malloc(size[index[pairs-1]]);
+    // allocate enough memory to hold the largest size, or just a buffer
+    // to hash through if the partition is going to be mapped.
+    file->data = malloc(map ? PARTITION_IO_SIZE : size[index[pairs-1]]);
     char* p = (char*)file->data;
     file->size = 0;                // # bytes read so far
 
@@ -231,26 +303,33 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
         // (again, we're trying the possibilities in order of increasing
         // size).
         size_t next = size[index[i]] - file->size;
-        size_t read = 0;
-        if (next > 0) {
+        while (next > 0) {
+            size_t want = next;
+            size_t read = 0;
+            if (map) {
+                if (want > PARTITION_IO_SIZE) want = PARTITION_IO_SIZE;
+                p = (char*)file->data;
+            }
             switch (type) {
                 case MTD:
-                    read = mtd_read_data(ctx, p, next);
+                    read = mtd_read_data(ctx, p, want);
                     break;
 
                 case EMMC:
-                    read = fread(p, 1, next, dev);
+                    read = fread(p, 1, want, dev);
                     break;
             }
-            if (next != read) {
+            if (want != read) {
                 printf("short read (%zu bytes of %zu) for partition \"%s\"\n",
-                       read, next, partition);
+                       read, want, partition);
                 free(file->data);
                 file->data = NULL;
                 return -1;
             }
             SHA_update(&sha_ctx, p, read);
             file->size += read;
+            next -= read;
+            p += read;
         }
 
         // Duplicate the SHA context and finalize the duplicate so we can
@@ -274,8 +353,24 @@ static int LoadPartitionContents(const char* filename, FileContents* file) {
                    size[index[i]], sha1sum[index[i]]);
             break;
         }
+    }
 
-        p += read;
+    if (map && i < pairs) {
+        free(file->data);
+        file->data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE,
+                          fileno(dev), 0);
+        if (file->data == MAP_FAILED) {
+            printf("failed to map partition \"%s\" (%s), reading it\n",
+                   partition, strerror(errno));
+            file->data = NULL;
+            fclose(dev);
+            free(copy);
+            free(index);
+            free(size);
+            free(sha1sum);
+            return LoadPartitionContents(filename, file, 0);
+        }
+        file->mapped = 1;
     }
 
     switch (type) {
@@ -357,10 +452,26 @@ int SaveFileContents(const char* filename, const FileContents* file) {
     return 0;
 }
 
-// Write a memory buffer to 'target' partition, a string of the form
-// "MTD:<partition>[:...]" or "EMMC:<partition_device>:".  Return 0 on
-// success.
-int WriteToPartition(unsigned char* data, size_t len,
+// Read exactly 'len' bytes from 'fd'.  Return 0 on success.
+static int ReadFully(int fd, unsigned char* buffer, size_t len) {
+    size_t so_far = 0;
+    while (so_far < len) {
+        ssize_t read_count =
+                TEMP_FAILURE_RETRY(read(fd, buffer+so_far, len-so_far));
+        if (read_count <= 0) {
+            return -1;
+        }
+        so_far += read_count;
+    }
+    return 0;
+}
+
+// Copy the first 'len' bytes of the file 'filename' to 'target'
+// partition, a string of the form "MTD:<partition>[:...]" or
+// "EMMC:<partition_device>:".  The data goes through in pieces of
+// PARTITION_IO_SIZE, so the target never has to fit in memory.  Return
+// 0 on success.
+int WriteToPartition(const char* filename, size_t len,
                         const char* target) {
     char* copy = strdup(target);
     const char* magic = strtok(copy, ":");
@@ -374,10 +485,17 @@ int WriteToPartition(unsigned char* data, size_t len,
         type = EMMC;
     } else {
         printf("WriteToPartition called with bad target (%s)\n", target);
+        free(copy);
         return -1;
     }
     const char* partition = strtok(NULL, ":");
 
+    if (partition == NULL) {
+        printf("bad partition target name \"%s\"\n", target);
+        free(copy);
+        return -1;
+    }
+
     if (strcmp(magic, "BML") == 0) {
         if (strcmp(partition, "boot") == 0) {
             partition = BOARD_BML_BOOT;
@@ -386,22 +504,35 @@ int WriteToPartition(unsigned char* data, size_t len,
         }
 
         int bmlpartition = open(partition, O_RDWR | O_LARGEFILE);
-        if (bmlpartition < 0)
+        if (bmlpartition < 0) {
+            free(copy);
             return -1;
+        }
         if (ioctl(bmlpartition, BML_UNLOCK_ALL, 0)) {
             printf("failed to unlock BML partition: (%s)\n", partition);
+            close(bmlpartition);
+            free(copy);
             return -1;
         }
         close(bmlpartition);
     }
 
-    if (partition == NULL) {
-        printf("bad partition target name \"%s\"\n", target);
+    int src = open(filename, O_RDONLY);
+    if (src < 0) {
+        printf("failed to open %s: %s\n", filename, strerror(errno));
         return -1;
     }
+    unsigned char* data = malloc(PARTITION_IO_SIZE);
+    unsigned char* buffer = malloc(PARTITION_IO_SIZE);
+    int result = -1;
+    if (data == NULL || buffer == NULL) {
+        printf("failed to alloc buffers for writing %s\n", partition);
+        goto done;
+    }
 
     switch (type) {
         case MTD:
+        {
             if (!mtd_partitions_scanned) {
                 mtd_scan_partitions();
                 mtd_partitions_scanned = 1;
@@ -411,35 +542,49 @@ int WriteToPartition(unsigned char* data, size_t len,
             if (mtd == NULL) {
                 printf("mtd partition \"%s\" not found for writing\n",
                        partition);
-                return -1;
+                goto done;
             }
 
             MtdWriteContext* ctx = mtd_write_partition(mtd);
             if (ctx == NULL) {
                 printf("failed to init mtd partition \"%s\" for writing\n",
                        partition);
-                return -1;
+                goto done;
             }
 
-            size_t written = mtd_write_data(ctx, (char*)data, len);
-            if (written != len) {
-                printf("only wrote %zu of %zu bytes to MTD %s\n",
-                       written, len, partition);
-                mtd_write_close(ctx);
-                return -1;
+            size_t p;
+            for (p = 0; p < len; p += PARTITION_IO_SIZE) {
+                size_t to_write = len - p;
+                if (to_write > PARTITION_IO_SIZE) to_write = PARTITION_IO_SIZE;
+
+                if (ReadFully(src, data, to_write) != 0) {
+                    printf("failed to read %s at %zu: %s\n",
+                           filename, p, strerror(errno));
+                    mtd_write_close(ctx);
+                    goto done;
+                }
+                // mtd_write_data() reads every block back to verify it
+                ssize_t written = mtd_write_data(ctx, (char*)data, to_write);
+                if (written != (ssize_t)to_write) {
+                    printf("only wrote %zd of %zu bytes to MTD %s at %zu\n",
+                           written, to_write, partition, p);
+                    mtd_write_close(ctx);
+                    goto done;
+                }
             }
 
             if (mtd_erase_blocks(ctx, -1) < 0) {
                 printf("error finishing mtd write of %s\n", partition);
                 mtd_write_close(ctx);
-                return -1;
+                goto done;
             }
 
             if (mtd_write_close(ctx)) {
                 printf("error closing mtd write of %s\n", partition);
-                return -1;
+                goto done;
             }
             break;
+        }
 
         case EMMC:
         {
@@ -448,42 +593,58 @@ int WriteToPartition(unsigned char* data, size_t len,
             int fd = open(partition, O_RDWR | O_SYNC);
             if (fd < 0) {
                 printf("failed to open %s: %s\n", partition, strerror(errno));
-                return -1;
+                goto done;
             }
             int attempt;
 
             for (attempt = 0; attempt < 2; ++attempt) {
-                if (TEMP_FAILURE_RETRY(lseek(fd, start, SEEK_SET)) == -1) {
+                // Write from the first piece that failed to verify,
+                // which is rounded down to a whole piece.
+                if (TEMP_FAILURE_RETRY(lseek(fd, start, SEEK_SET)) == -1 ||
+                    TEMP_FAILURE_RETRY(lseek(src, start, SEEK_SET)) == -1) {
                     printf("failed seek on %s: %s\n",
                            partition, strerror(errno));
-                    return -1;
+                    close(fd);
+                    goto done;
                 }
                 while (start < len) {
                     size_t to_write = len - start;
-                    if (to_write > 1<<20) to_write = 1<<20;
+                    if (to_write > PARTITION_IO_SIZE) to_write = PARTITION_IO_SIZE;
 
-                    ssize_t written = TEMP_FAILURE_RETRY(write(fd, data+start, to_write));
-                    if (written == -1) {
-                        printf("failed write writing to %s: %s\n", partition, strerror(errno));
-                        return -1;
+                    if (ReadFully(src, data, to_write) != 0) {
+                        printf("failed to read %s at %zu: %s\n",
+                               filename, start, strerror(errno));
+                        close(fd);
+                        goto done;
                     }
-                    start += written;
+                    size_t done_now = 0;
+                    while (done_now < to_write) {
+                        ssize_t written = TEMP_FAILURE_RETRY(write(fd, data+done_now, to_write-done_now));
+                        if (written == -1) {
+                            printf("failed write writing to %s: %s\n", partition, strerror(errno));
+                            close(fd);
+                            goto done;
+                        }
+                        done_now += written;
+                    }
+                    start += to_write;
                 }
                 if (fsync(fd) != 0) {
                    printf("failed to sync to %s (%s)\n",
                           partition, strerror(errno));
-                   return -1;
+                   close(fd);
+                   goto done;
                 }
                 if (close(fd) != 0) {
                    printf("failed to close %s (%s)\n",
                           partition, strerror(errno));
-                   return -1;
+                   goto done;
                 }
                 fd = open(partition, O_RDONLY);
                 if (fd < 0) {
                    printf("failed to reopen %s for verify (%s)\n",
                           partition, strerror(errno));
-                   return -1;
+                   goto done;
                 }
 
                 // drop caches so our subsequent verification read
@@ -499,35 +660,33 @@ int WriteToPartition(unsigned char* data, size_t len,
                 sleep(1);
 
                 // verify
-                if (TEMP_FAILURE_RETRY(lseek(fd, 0, SEEK_SET)) == -1) {
+                if (TEMP_FAILURE_RETRY(lseek(fd, 0, SEEK_SET)) == -1 ||
+                    TEMP_FAILURE_RETRY(lseek(src, 0, SEEK_SET)) == -1) {
                     printf("failed to seek back to beginning of %s: %s\n",
                            partition, strerror(errno));
-                    return -1;
+                    close(fd);
+                    goto done;
                 }
-                unsigned char buffer[4096];
                 start = len;
                 size_t p;
-                for (p = 0; p < len; p += sizeof(buffer)) {
+                for (p = 0; p < len; p += PARTITION_IO_SIZE) {
                     size_t to_read = len - p;
-                    if (to_read > sizeof(buffer)) to_read = sizeof(buffer);
-
-                    size_t so_far = 0;
-                    while (so_far < to_read) {
-                        ssize_t read_count =
-                                TEMP_FAILURE_RETRY(read(fd, buffer+so_far, to_read-so_far));
-                        if (read_count == -1) {
-                            printf("verify read error %s at %zu: %s\n",
-                                   partition, p, strerror(errno));
-                            return -1;
-                        }
-                        if ((size_t)read_count < to_read) {
-                            printf("short verify read %s at %zu: %zd %zu %s\n",
-                                   partition, p, read_count, to_read, strerror(errno));
-                        }
-                        so_far += read_count;
+                    if (to_read > PARTITION_IO_SIZE) to_read = PARTITION_IO_SIZE;
+
+                    if (ReadFully(src, data, to_read) != 0) {
+                        printf("failed to read %s at %zu: %s\n",
+                               filename, p, strerror(errno));
+                        close(fd);
+                        goto done;
+                    }
+                    if (ReadFully(fd, buffer, to_read) != 0) {
+                        printf("verify read error %s at %zu: %s\n",
+                               partition, p, strerror(errno));
+                        close(fd);
+                        goto done;
                     }
 
-                    if (memcmp(buffer, data+p, to_read)) {
+                    if (memcmp(buffer, data, to_read)) {
                         printf("verification failed starting at %zu\n", p);
                         start = p;
                         break;
@@ -539,24 +698,38 @@ int WriteToPartition(unsigned char* data, size_t len,
                     success = true;
                     break;
                 }
+
+                // write again from where the data differs
+                close(fd);
+                fd = open(partition, O_RDWR | O_SYNC);
+                if (fd < 0) {
+                    printf("failed to reopen %s: %s\n", partition, strerror(errno));
+                    goto done;
+                }
             }
 
             if (!success) {
                 printf("failed to verify after all attempts\n");
-                return -1;
+                close(fd);
+                goto done;
             }
 
             if (close(fd) != 0) {
                 printf("error closing %s (%s)\n", partition, strerror(errno));
-                return -1;
+                goto done;
             }
             sync();
             break;
         }
     }
+    result = 0;
 
+done:
+    free(data);
+    free(buffer);
+    close(src);
     free(copy);
-    return 0;
+    return result;
 }
 
 
@@ -618,13 +791,13 @@ int applypatch_check(const char* filename,
     // LoadFileContents is successful.  (Useful for reading
     // partitions, where the filename encodes the sha1s; no need to
     // check them twice.)
-    if (LoadFileContents(filename, &file) != 0 ||
+    if (MapFileContents(filename, &file) != 0 ||
         (num_patches > 0 &&
          FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0)) {
         printf("file \"%s\" doesn't have any of expected "
                "sha1 sums; checking cache\n", filename);
 
-        free(file.data);
+        FreeFileContents(&file);
         file.data = NULL;
 
         // If the source file is missing or corrupted, it might be because
@@ -633,19 +806,19 @@ int applypatch_check(const char* filename,
         // exists and matches the sha1 we're looking for, the check still
         // passes.
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &file) != 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &file) != 0) {
             printf("failed to load cache file\n");
             return 1;
         }
 
         if (FindMatchingPatch(file.sha1, patch_sha1_str, num_patches) < 0) {
             printf("cache bits don't match any sha1 for \"%s\"\n", filename);
-            free(file.data);
+            FreeFileContents(&file);
             return 1;
         }
     }
 
-    free(file.data);
+    FreeFileContents(&file);
     return 0;
 }
 
@@ -669,12 +842,6 @@ ssize_t FileSink(const unsigned char* data, ssize_t len, void* token) {
     return done;
 }
 
-typedef struct {
-    unsigned char* buffer;
-    ssize_t size;
-    ssize_t pos;
-} MemorySinkInfo;
-
 ssize_t MemorySink(const unsigned char* data, ssize_t len, void* token) {
     MemorySinkInfo* msi = (MemorySinkInfo*)token;
     if (msi->size - msi->pos < len) {
@@ -769,14 +936,14 @@ int applypatch(const char* source_filename,
     const Value* copy_patch_value = NULL;
 
     // We try to load the target file into the source_file object.
-    if (LoadFileContents(target_filename, &source_file) == 0) {
+    if (MapFileContents(target_filename, &source_file) == 0) {
         if (memcmp(source_file.sha1, target_sha1, SHA_DIGEST_SIZE) == 0) {
             // The early-exit case:  the patch was already applied, this file
             // has the desired hash, nothing for us to do.
             printf("already ");
             print_short_sha1(target_sha1);
             putchar('\n');
-            free(source_file.data);
+            FreeFileContents(&source_file);
             return 0;
         }
     }
@@ -786,9 +953,9 @@ int applypatch(const char* source_filename,
          strcmp(target_filename, source_filename) != 0)) {
         // Need to load the source file:  either we failed to load the
         // target file, or we did but it's different from the source file.
-        free(source_file.data);
+        FreeFileContents(&source_file);
         source_file.data = NULL;
-        LoadFileContents(source_filename, &source_file);
+        MapFileContents(source_filename, &source_file);
     }
 
     if (source_file.data != NULL) {
@@ -800,11 +967,11 @@ int applypatch(const char* source_filename,
     }
 
     if (source_patch_value == NULL) {
-        free(source_file.data);
+        FreeFileContents(&source_file);
         source_file.data = NULL;
         printf("source file is bad; trying copy\n");
 
-        if (LoadFileContents(CACHE_TEMP_SOURCE, &copy_file) < 0) {
+        if (MapFileContents(CACHE_TEMP_SOURCE, &copy_file) < 0) {
             // fail.
             printf("failed to read copy file\n");
             return 1;
@@ -819,7 +986,7 @@ int applypatch(const char* source_filename,
         if (copy_patch_value == NULL) {
             // fail.
             printf("copy file doesn't match source SHA-1s either\n");
-            free(copy_file.data);
+            FreeFileContents(&copy_file);
             return 1;
         }
     }
@@ -828,12 +995,28 @@ int applypatch(const char* source_filename,
                                 &copy_file, copy_patch_value,
                                 source_filename, target_filename,
                                 target_sha1, target_size, bonus_data);
-    free(source_file.data);
-    free(copy_file.data);
+    FreeFileContents(&source_file);
+    FreeFileContents(&copy_file);
 
     return result;
 }
 
+// Replaces the contents of source_file, which were just saved to
+// CACHE_TEMP_SOURCE, with that copy mapped.  Return 0 on success.
+static int ReloadFromCache(FileContents* source_file) {
+    struct stat st = source_file->st;
+    uint8_t sha1[SHA_DIGEST_SIZE];
+    memcpy(sha1, source_file->sha1, SHA_DIGEST_SIZE);
+    FreeFileContents(source_file);
+    if (MapFileContents(CACHE_TEMP_SOURCE, source_file) != 0 ||
+        memcmp(source_file->sha1, sha1, SHA_DIGEST_SIZE) != 0) {
+        printf("failed to reload source file from cache\n");
+        return 1;
+    }
+    source_file->st = st;
+    return 0;
+}
+
 static int GenerateTarget(FileContents* source_file,
                           const Value* source_patch_value,
                           FileContents* copy_file,
@@ -846,7 +1029,7 @@ static int GenerateTarget(FileContents* source_file,
     int retry = 1;
     SHA_CTX ctx;
     int output;
-    MemorySinkInfo msi;
+    int to_partition = 0;
     FileContents* source_to_use;
     char* outname;
     int made_copy = 0;
@@ -871,23 +1054,29 @@ static int GenerateTarget(FileContents* source_file,
         if (strncmp(target_filename, "MTD:", 4) == 0 ||
             strncmp(target_filename, "EMMC:", 5) == 0 ||
             strncmp(target_filename, "BML:", 4) == 0) {
-            // If the target is a partition, we're actually going to
-            // write the output to /tmp and then copy it to the
-            // partition.  statfs() always returns 0 blocks free for
-            // /tmp, so instead we'll just assume that /tmp has enough
-            // space to hold the file.
-
-            // We still write the original source to cache, in case
-            // the partition write is interrupted.
-            if (MakeFreeSpaceOnCache(source_file->size) < 0) {
+            // If the target is a partition, the output is staged in
+            // CACHE_TEMP_TARGET and only written to the partition once
+            // its SHA-1 checks out.
+
+            // We also write the original source to cache, in case the
+            // partition write is interrupted.  When patching from the
+            // copy it is there already.
+            to_partition = 1;
+            size_t cache_needed = target_size;
+            if (source_patch_value != NULL) {
+                cache_needed += source_file->size;
+            }
+            if (MakeFreeSpaceOnCache(cache_needed) < 0) {
                 printf("not enough free space on /cache\n");
                 return 1;
             }
-            if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
-                printf("failed to back up source file\n");
-                return 1;
+            if (source_patch_value != NULL) {
+                if (SaveFileContents(CACHE_TEMP_SOURCE, source_file) < 0) {
+                    printf("failed to back up source file\n");
+                    return 1;
+                }
+                made_copy = 1;
             }
-            made_copy = 1;
             retry = 0;
         } else {
             int enough_space = 0;
@@ -932,6 +1121,12 @@ static int GenerateTarget(FileContents* source_file,
                     return 1;
                 }
                 made_copy = 1;
+
+                // The blocks of a mapped file stay in use until it is
+                // unmapped, so continue from the copy.
+                if (source_file->mapped && ReloadFromCache(source_file) != 0) {
+                    return 1;
+                }
                 unlink(source_filename);
 
                 size_t free_space = FreeSpaceForFile(target_fs);
@@ -946,6 +1141,8 @@ static int GenerateTarget(FileContents* source_file,
         } else {
             source_to_use = copy_file;
             patch = copy_patch_value;
+            // The copy is only needed until this patch has been applied.
+            made_copy = 1;
         }
 
         if (patch->type != VAL_BLOB) {
@@ -957,36 +1154,25 @@ static int GenerateTarget(FileContents* source_file,
         void* token = NULL;
         output = -1;
         outname = NULL;
-        if (strncmp(target_filename, "MTD:", 4) == 0 ||
-            strncmp(target_filename, "EMMC:", 5) == 0 ||
-            strncmp(target_filename, "BML:", 4) == 0) {
-            // We store the decoded output in memory.
-            msi.buffer = malloc(target_size);
-            if (msi.buffer == NULL) {
-                printf("failed to alloc %ld bytes for output\n",
-                       (long)target_size);
-                return 1;
-            }
-            msi.pos = 0;
-            msi.size = target_size;
-            sink = MemorySink;
-            token = &msi;
+        if (to_partition) {
+            // We write the decoded output to CACHE_TEMP_TARGET.
+            outname = strdup(CACHE_TEMP_TARGET);
         } else {
             // We write the decoded output to "<tgt-file>.patch".
             outname = (char*)malloc(strlen(target_filename) + 10);
             strcpy(outname, target_filename);
             strcat(outname, ".patch");
+        }
 
-            output = open(outname, O_WRONLY | O_CREAT | O_TRUNC | O_SYNC,
-                S_IRUSR | S_IWUSR);
-            if (output < 0) {
-                printf("failed to open output file %s: %s\n",
-                       outname, strerror(errno));
-                return 1;
-            }
-            sink = FileSink;
-            token = &output;
+        output = open(outname, O_WRONLY | O_CREAT | O_TRUNC | O_SYNC,
+            S_IRUSR | S_IWUSR);
+        if (output < 0) {
+            printf("failed to open output file %s: %s\n",
+                   outname, strerror(errno));
+            return 1;
         }
+        sink = FileSink;
+        token = &output;
 
         char* header = patch->data;
         ssize_t header_bytes_read = patch->size;
@@ -1008,20 +1194,21 @@ static int GenerateTarget(FileContents* source_file,
             return 1;
         }
 
-        if (output >= 0) {
-            if (fsync(output) != 0) {
-                printf("failed to fsync file \"%s\" (%s)\n", outname, strerror(errno));
-                result = 1;
-            }
-            if (close(output) != 0) {
-                printf("failed to close file \"%s\" (%s)\n", outname, strerror(errno));
-                result = 1;
-            }
+        if (fsync(output) != 0) {
+            printf("failed to fsync file \"%s\" (%s)\n", outname, strerror(errno));
+            result = 1;
+        }
+        if (close(output) != 0) {
+            printf("failed to close file \"%s\" (%s)\n", outname, strerror(errno));
+            result = 1;
         }
 
         if (result != 0) {
             if (retry == 0) {
                 printf("applying patch failed\n");
+                if (to_partition) {
+                    unlink(outname);
+                }
                 return result != 0;
             } else {
                 printf("applying patch failed; retrying\n");
@@ -1038,6 +1225,9 @@ static int GenerateTarget(FileContents* source_file,
     const uint8_t* current_target_sha1 = SHA_final(&ctx);
     if (memcmp(current_target_sha1, target_sha1, SHA_DIGEST_SIZE) != 0) {
         printf("patch did not produce expected sha1\n");
+        if (to_partition) {
+            unlink(outname);
+        }
         return 1;
     } else {
         printf("now ");
@@ -1045,13 +1235,16 @@ static int GenerateTarget(FileContents* source_file,
         putchar('\n');
     }
 
-    if (output < 0) {
-        // Copy the temp file to the partition.
-        if (WriteToPartition(msi.buffer, msi.pos, target_filename) != 0) {
+    if (to_partition) {
+        // The staged output is known good; copy it to the partition.
+        // If that fails, the copy of the source on /cache is kept so
+        // that running the patch again can still recover.
+        int written = WriteToPartition(outname, target_size, target_filename);
+        unlink(outname);
+        if (written != 0) {
             printf("write of patched data to %s failed\n", target_filename);
             return 1;
         }
-        free(msi.buffer);
     } else {
         // Give the .patch file the same owner, group, and mode of the
         // original source file.
@@ -31,6 +31,7 @@ typedef struct _FileContents {
   unsigned char* data;
   ssize_t size;
   struct stat st;
+  int mapped;  // data is a read-only mapping of the file
 } FileContents;
 
 // When there isn't enough room on the target filesystem to hold the
@@ -40,8 +41,20 @@ typedef struct _FileContents {
 // and use it as the source instead.
 #define CACHE_TEMP_SOURCE "/cache/saved.file"
 
+// Patched output for a partition target is staged here, and only
+// written to the partition once its SHA-1 matches.
+#define CACHE_TEMP_TARGET "/cache/saved.target"
+
 typedef ssize_t (*SinkFn)(const unsigned char*, ssize_t, void*);
 
+typedef struct {
+    unsigned char* buffer;
+    ssize_t size;
+    ssize_t pos;
+} MemorySinkInfo;
+
+ssize_t MemorySink(const unsigned char* data, ssize_t len, void* token);
+
 // applypatch.c
 int ShowLicenses();
 size_t FreeSpaceForFile(const char* filename);
@@ -61,6 +74,7 @@ int applypatch_check(const char* filename,
                      char** const patch_sha1_str);
 
 int LoadFileContents(const char* filename, FileContents* file);
+int MapFileContents(const char* filename, FileContents* file);
 int SaveFileContents(const char* filename, const FileContents* file);
 void FreeFileContents(FileContents* file);
 int FindMatchingPatch(uint8_t* sha1, char* const * const patch_sha1_str,
@@ -50,6 +50,7 @@
 #include <bzlib.h>
 #include <err.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -57,19 +58,19 @@
 
 #define MIN(x,y) (((x)<(y)) ? (x) : (y))
 
-static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
+static void split(off_t *I,off_t *V,off_t *K,off_t start,off_t len,off_t h)
 {
 	off_t i,j,k,x,tmp,jj,kk;
 
 	if(len<16) {
 		for(k=start;k<start+len;k+=j) {
-			j=1;x=V[I[k]+h];
+			j=1;x=K[I[k]+h];
 			for(i=1;k+i<start+len;i++) {
-				if(V[I[k+i]+h]<x) {
-					x=V[I[k+i]+h];
+				if(K[I[k+i]+h]<x) {
+					x=K[I[k+i]+h];
 					j=0;
 				};
-				if(V[I[k+i]+h]==x) {
+				if(K[I[k+i]+h]==x) {
 					tmp=I[k+j];I[k+j]=I[k+i];I[k+i]=tmp;
 					j++;
 				};
@@ -80,19 +81,19 @@ static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
 		return;
 	};
 
-	x=V[I[start+len/2]+h];
+	x=K[I[start+len/2]+h];
 	jj=0;kk=0;
 	for(i=start;i<start+len;i++) {
-		if(V[I[i]+h]<x) jj++;
-		if(V[I[i]+h]==x) kk++;
+		if(K[I[i]+h]<x) jj++;
+		if(K[I[i]+h]==x) kk++;
 	};
 	jj+=start;kk+=jj;
 
 	i=start;j=0;k=0;
 	while(i<jj) {
-		if(V[I[i]+h]<x) {
+		if(K[I[i]+h]<x) {
 			i++;
-		} else if(V[I[i]+h]==x) {
+		} else if(K[I[i]+h]==x) {
 			tmp=I[i];I[i]=I[jj+j];I[jj+j]=tmp;
 			j++;
 		} else {
@@ -102,7 +103,7 @@ static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
 	};
 
 	while(jj+j<kk) {
-		if(V[I[jj+j]+h]==x) {
+		if(K[I[jj+j]+h]==x) {
 			j++;
 		} else {
 			tmp=I[jj+j];I[jj+j]=I[kk+k];I[kk+k]=tmp;
@@ -110,18 +111,69 @@ static void split(off_t *I,off_t *V,off_t start,off_t len,off_t h)
 		};
 	};
 
-	if(jj>start) split(I,V,start,jj-start,h);
+	if(jj>start) split(I,V,K,start,jj-start,h);
 
 	for(i=0;i<kk-jj;i++) V[I[jj+i]]=kk-1;
 	if(jj==kk-1) I[jj]=-1;
 
-	if(start+len>kk) split(I,V,kk,start+len-kk,h);
+	if(start+len>kk) split(I,V,K,kk,start+len-kk,h);
 }
 
-static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
+/*
+ * The groups of suffixes left unsorted by a doubling pass are independent
+ * of each other, so with more than one thread each pass lists the groups
+ * and then splits them in parallel.  The split keys are read from a copy
+ * of the ranks taken at the start of the pass, as another thread may be
+ * refining the ranks of its own group meanwhile.  Either way the result
+ * is the one suffix array of old.
+ */
+#define PARALLEL_SORT_MIN (1<<16)
+#define SPLIT_BATCH 4096
+
+struct sortpass {
+	off_t *I,*V,*K,h;
+	off_t *groups;		/* start and length of each unsorted group */
+	off_t ngroups,next;
+	pthread_mutex_t lock;
+};
+
+static void *splitgroups(void *arg)
+{
+	struct sortpass *p=arg;
+	off_t first,last,size;
+
+	for(;;) {
+		pthread_mutex_lock(&p->lock);
+		first=p->next;
+		for(last=first,size=0;(last<p->ngroups)&&(size<SPLIT_BATCH);last++)
+			size+=p->groups[2*last+1];
+		p->next=last;
+		pthread_mutex_unlock(&p->lock);
+		if(first==last) break;
+
+		for(;first<last;first++)
+			split(p->I,p->V,p->K,p->groups[2*first],p->groups[2*first+1],p->h);
+	};
+	return NULL;
+}
+
+static void splitpass(struct sortpass *p,int threads)
+{
+	pthread_t tid[threads];
+	int i,started;
+
+	p->next=0;
+	for(started=0;started<threads-1;started++)
+		if(pthread_create(&tid[started],NULL,splitgroups,p)!=0) break;
+	splitgroups(p);
+	for(i=0;i<started;i++) pthread_join(tid[i],NULL);
+}
+
+static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize,int threads)
 {
 	off_t buckets[256];
 	off_t i,h,len;
+	struct sortpass pass;
 
 	for(i=0;i<256;i++) buckets[i]=0;
 	for(i=0;i<oldsize;i++) buckets[old[i]]++;
@@ -136,7 +188,29 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 	for(i=1;i<256;i++) if(buckets[i]==buckets[i-1]+1) I[buckets[i]]=-1;
 	I[0]=-1;
 
+	pass.K=NULL;
+	pass.groups=NULL;
+	if((threads>1)&&(oldsize>=PARALLEL_SORT_MIN)) {
+		/* Unsorted groups hold at least two suffixes */
+		pass.K=malloc((oldsize+1)*sizeof(off_t));
+		pass.groups=malloc((oldsize+2)/2*2*sizeof(off_t));
+		if((pass.K==NULL)||(pass.groups==NULL)) {
+			free(pass.K);
+			free(pass.groups);
+			pass.K=NULL;
+		} else {
+			pass.I=I;
+			pass.V=V;
+			pthread_mutex_init(&pass.lock,NULL);
+		};
+	};
+
 	for(h=1;I[0]!=-(oldsize+1);h+=h) {
+		if(pass.K) {
+			memcpy(pass.K,V,(oldsize+1)*sizeof(off_t));
+			pass.h=h;
+			pass.ngroups=0;
+		};
 		len=0;
 		for(i=0;i<oldsize+1;) {
 			if(I[i]<0) {
@@ -145,12 +219,25 @@ static void qsufsort(off_t *I,off_t *V,u_char *old,off_t oldsize)
 			} else {
 				if(len) I[i-len]=-len;
 				len=V[I[i]]+1-i;
-				split(I,V,i,len,h);
+				if(pass.K) {
+					pass.groups[2*pass.ngroups]=i;
+					pass.groups[2*pass.ngroups+1]=len;
+					pass.ngroups++;
+				} else {
+					split(I,V,V,i,len,h);
+				};
 				i+=len;
 				len=0;
 			};
 		};
 		if(len) I[i-len]=-len;
+		if(pass.K) splitpass(&pass,threads);
+	};
+
+	if(pass.K) {
+		pthread_mutex_destroy(&pass.lock);
+		free(pass.K);
+		free(pass.groups);
 	};
 
 	for(i=0;i<oldsize+1;i++) I[V[i]]=i;
@@ -210,6 +297,21 @@ static void offtout(off_t x,u_char *buf)
 	if(x<0) buf[7]|=0x80;
 }
 
+// Builds the "I" block for bsdiff() of old, sorting on up to 'threads'
+// threads.  Callers diffing against the same old data on several threads
+// build it up front, as bsdiff() would fill in a shared *IP on each.
+off_t* bsdiff_sort(u_char* old, off_t oldsize, int threads)
+{
+	off_t *I,*V;
+
+	I=malloc((oldsize+1)*sizeof(off_t));
+	V=malloc((oldsize+1)*sizeof(off_t));
+	if((I==NULL)||(V==NULL)) err(1,NULL);
+	qsufsort(I,V,old,oldsize,threads);
+	free(V);
+	return I;
+}
+
 // This is main() from bsdiff.c, with the following changes:
 //
 //    - old, oldsize, new, newsize are arguments; we don't load this
@@ -241,11 +343,7 @@ int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
 	int bz2err;
 
         if (*IP == NULL) {
-            off_t* V;
-            *IP = malloc((oldsize+1) * sizeof(off_t));
-            V = malloc((oldsize+1) * sizeof(off_t));
-            qsufsort(*IP, V, old, oldsize);
-            free(V);
+            *IP = bsdiff_sort(old, oldsize, 1);
         }
         I = *IP;
 
@@ -24,6 +24,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -86,6 +87,7 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
     stream->next_out = (char*)buffer;
     stream->avail_out = size;
     while (stream->avail_out > 0) {
+        unsigned int avail_out = stream->avail_out;
         int bzerr = BZ2_bzDecompress(stream);
         if (bzerr != BZ_OK && bzerr != BZ_STREAM_END) {
             printf("bz error %d decompressing\n", bzerr);
@@ -93,35 +95,32 @@ int FillBuffer(unsigned char* buffer, int size, bz_stream* stream) {
         }
         if (stream->avail_out > 0) {
             printf("need %d more bytes\n", stream->avail_out);
+            // A truncated stream would keep us here forever
+            if (stream->avail_out == avail_out) {
+                return -1;
+            }
         }
     }
     return 0;
 }
 
-int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
-                     const Value* patch, ssize_t patch_offset,
-                     SinkFn sink, void* token, SHA_CTX* ctx) {
+// The target is produced and passed to the sink in pieces of at most
+// this size, so the memory needed does not grow with the target.
+#define BSPATCH_CHUNK_SIZE (1024 * 1024)
 
-    unsigned char* new_data;
-    ssize_t new_size;
-    if (ApplyBSDiffPatchMem(old_data, old_size, patch, patch_offset,
-                            &new_data, &new_size) != 0) {
-        return -1;
-    }
-
-    if (sink(new_data, new_size, token) < new_size) {
+static int WriteOutput(const unsigned char* data, ssize_t len,
+                       SinkFn sink, void* token, SHA_CTX* ctx) {
+    if (sink(data, len, token) < len) {
         printf("short write of output: %d (%s)\n", errno, strerror(errno));
         return 1;
     }
-    if (ctx) SHA_update(ctx, new_data, new_size);
-    free(new_data);
-
+    if (ctx) SHA_update(ctx, data, len);
     return 0;
 }
 
-int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
-                        const Value* patch, ssize_t patch_offset,
-                        unsigned char** new_data, ssize_t* new_size) {
+int ApplyBSDiffPatch(const unsigned char* old_data, ssize_t old_size,
+                     const Value* patch, ssize_t patch_offset,
+                     SinkFn sink, void* token, SHA_CTX* ctx) {
     // Patch data format:
     //   0       8       "BSDIFF40"
     //   8       8       X
@@ -140,12 +139,12 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         return 1;
     }
 
-    ssize_t ctrl_len, data_len;
+    ssize_t ctrl_len, data_len, new_size;
     ctrl_len = offtin(header+8);
     data_len = offtin(header+16);
-    *new_size = offtin(header+24);
+    new_size = offtin(header+24);
 
-    if (ctrl_len < 0 || data_len < 0 || *new_size < 0) {
+    if (ctrl_len < 0 || data_len < 0 || new_size < 0) {
         printf("corrupt patch file header (data lengths)\n");
         return 1;
     }
@@ -182,23 +181,26 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         printf("failed to bzinit extra stream (%d)\n", bzerr);
     }
 
-    *new_data = malloc(*new_size);
-    if (*new_data == NULL) {
-        printf("failed to allocate %ld bytes of memory for output file\n",
-               (long)*new_size);
+    ssize_t buffer_size = new_size < BSPATCH_CHUNK_SIZE ? new_size : BSPATCH_CHUNK_SIZE;
+    unsigned char* buffer = malloc(buffer_size > 0 ? buffer_size : 1);
+    if (buffer == NULL) {
+        printf("failed to allocate %ld bytes of memory for output\n",
+               (long)buffer_size);
         return 1;
     }
 
+    int result = 1;
     off_t oldpos = 0, newpos = 0;
     off_t ctrl[3];
-    off_t len_read;
+    off_t done;
+    ssize_t len;
     int i;
     unsigned char buf[24];
-    while (newpos < *new_size) {
+    while (newpos < new_size) {
         // Read control data
         if (FillBuffer(buf, 24, &cstream) != 0) {
             printf("error while reading control stream\n");
-            return 1;
+            goto done;
         }
         ctrl[0] = offtin(buf);
         ctrl[1] = offtin(buf+8);
@@ -206,25 +208,29 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
 
         if (ctrl[0] < 0 || ctrl[1] < 0) {
             printf("corrupt patch (negative byte counts)\n");
-            return 1;
+            goto done;
         }
 
         // Sanity check
-        if (newpos + ctrl[0] > *new_size) {
+        if (newpos + ctrl[0] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
-        }
-
-        // Read diff string
-        if (FillBuffer(*new_data + newpos, ctrl[0], &dstream) != 0) {
-            printf("error while reading diff stream\n");
-            return 1;
+            goto done;
         }
 
-        // Add old data to diff string
-        for (i = 0; i < ctrl[0]; ++i) {
-            if ((oldpos+i >= 0) && (oldpos+i < old_size)) {
-                (*new_data)[newpos+i] += old_data[oldpos+i];
+        // Read diff string and add old data to it, a piece at a time
+        for (done = 0; done < ctrl[0]; done += len) {
+            len = ctrl[0] - done < buffer_size ? ctrl[0] - done : buffer_size;
+            if (FillBuffer(buffer, len, &dstream) != 0) {
+                printf("error while reading diff stream\n");
+                goto done;
+            }
+            for (i = 0; i < len; ++i) {
+                if ((oldpos+done+i >= 0) && (oldpos+done+i < old_size)) {
+                    buffer[i] += old_data[oldpos+done+i];
+                }
+            }
+            if (WriteOutput(buffer, len, sink, token, ctx) != 0) {
+                goto done;
             }
         }
 
@@ -233,24 +239,68 @@ int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
         oldpos += ctrl[0];
 
         // Sanity check
-        if (newpos + ctrl[1] > *new_size) {
+        if (newpos + ctrl[1] > new_size) {
             printf("corrupt patch (new file overrun)\n");
-            return 1;
+            goto done;
         }
 
         // Read extra string
-        if (FillBuffer(*new_data + newpos, ctrl[1], &estream) != 0) {
-            printf("error while reading extra stream\n");
-            return 1;
+        for (done = 0; done < ctrl[1]; done += len) {
+            len = ctrl[1] - done < buffer_size ? ctrl[1] - done : buffer_size;
+            if (FillBuffer(buffer, len, &estream) != 0) {
+                printf("error while reading extra stream\n");
+                goto done;
+            }
+            if (WriteOutput(buffer, len, sink, token, ctx) != 0) {
+                goto done;
+            }
         }
 
         // Adjust pointers
         newpos += ctrl[1];
         oldpos += ctrl[2];
     }
+    result = 0;
 
+  done:
+    free(buffer);
     BZ2_bzDecompressEnd(&cstream);
     BZ2_bzDecompressEnd(&dstream);
     BZ2_bzDecompressEnd(&estream);
+    return result;
+}
+
+int ApplyBSDiffPatchMem(const unsigned char* old_data, ssize_t old_size,
+                        const Value* patch, ssize_t patch_offset,
+                        unsigned char** new_data, ssize_t* new_size) {
+    unsigned char* header = (unsigned char*) patch->data + patch_offset;
+    if (memcmp(header, "BSDIFF40", 8) != 0) {
+        printf("corrupt bsdiff patch file header (magic number)\n");
+        return 1;
+    }
+
+    *new_size = offtin(header+24);
+    if (*new_size < 0) {
+        printf("corrupt patch file header (data lengths)\n");
+        return 1;
+    }
+
+    *new_data = malloc(*new_size);
+    if (*new_data == NULL) {
+        printf("failed to allocate %ld bytes of memory for output file\n",
+               (long)*new_size);
+        return 1;
+    }
+
+    MemorySinkInfo msi;
+    msi.buffer = *new_data;
+    msi.size = *new_size;
+    msi.pos = 0;
+    if (ApplyBSDiffPatch(old_data, old_size, patch, patch_offset,
+                         MemorySink, &msi, NULL) != 0) {
+        free(*new_data);
+        *new_data = NULL;
+        return 1;
+    }
     return 0;
 }
@@ -122,10 +122,12 @@
  */
 
 #include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <unistd.h>
 #include <sys/types.h>
 
@@ -181,6 +183,29 @@ static int fileentry_compare(const void* a, const void* b) {
 // from bsdiff.c
 int bsdiff(u_char* old, off_t oldsize, off_t** IP, u_char* new, off_t newsize,
            const char* patch_filename);
+off_t* bsdiff_sort(u_char* old, off_t oldsize, int threads);
+
+// Chunks are diffed on up to this many threads unless -j says otherwise.
+#define MAX_DEFAULT_THREADS 8
+
+// Sources at least this big get their suffix array built on all threads
+// before the chunks are diffed, like the ones several chunks share.
+#define PRESORT_MIN_LEN (1 << 20)
+
+typedef struct {
+  ImageChunk* src;
+  ImageChunk* tgt;
+  unsigned char* patch_data;
+  size_t patch_size;
+  double seconds;       // time spent in MakePatch(), for -t
+} PatchJob;
+
+typedef struct {
+  PatchJob* jobs;
+  int num_jobs;
+  int next_job;
+  pthread_mutex_t lock;
+} PatchWork;
 
 unsigned char* ReadZip(const char* filename,
                        int* num_chunks, ImageChunk** chunks,
@@ -677,6 +702,65 @@ unsigned char* MakePatch(ImageChunk* src, ImageChunk* tgt, size_t* size) {
   return data;
 }
 
+static double Now() {
+  struct timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void* PatchWorker(void* cookie) {
+  PatchWork* work = (PatchWork*)cookie;
+
+  for (;;) {
+    pthread_mutex_lock(&work->lock);
+    int i = work->next_job++;
+    pthread_mutex_unlock(&work->lock);
+    if (i >= work->num_jobs) {
+      break;
+    }
+
+    PatchJob* job = work->jobs + i;
+    double start = Now();
+    job->patch_data = MakePatch(job->src, job->tgt, &job->patch_size);
+    job->seconds = Now() - start;
+  }
+  return NULL;
+}
+
+/*
+ * Compute the patch of every job, on up to 'threads' threads.  Each job
+ * only changes its own target chunk; a source chunk's suffix array must
+ * be built beforehand if more than one job uses it.
+ */
+static void MakePatches(PatchJob* jobs, int num_jobs, int threads) {
+  PatchWork work;
+  pthread_t* tids;
+  int started = 0;
+  int i;
+
+  work.jobs = jobs;
+  work.num_jobs = num_jobs;
+  work.next_job = 0;
+  pthread_mutex_init(&work.lock, NULL);
+
+  if (threads > num_jobs) {
+    threads = num_jobs;
+  }
+  tids = malloc(threads * sizeof(pthread_t));
+  for (; tids != NULL && started < threads - 1; ++started) {
+    if (pthread_create(tids + started, NULL, PatchWorker, &work) != 0) {
+      break;
+    }
+  }
+  PatchWorker(&work);
+  for (i = 0; i < started; ++i) {
+    pthread_join(tids[i], NULL);
+  }
+
+  free(tids);
+  pthread_mutex_destroy(&work.lock);
+}
+
 /*
  * Cause a gzip chunk to be treated as a normal chunk (ie, as a blob
  * of uninterpreted data).  The resulting patch will likely be about
@@ -790,42 +874,64 @@ void DumpChunks(ImageChunk* chunks, int num_chunks) {
 
 int main(int argc, char** argv) {
   int zip_mode = 0;
-
-  if (argc >= 2 && strcmp(argv[1], "-z") == 0) {
-    zip_mode = 1;
-    --argc;
-    ++argv;
+  int timing = 0;
+  long threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > MAX_DEFAULT_THREADS) {
+    threads = MAX_DEFAULT_THREADS;
   }
 
   size_t bonus_size = 0;
   unsigned char* bonus_data = NULL;
-  if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
-    struct stat st;
-    if (stat(argv[2], &st) != 0) {
-      printf("failed to stat bonus file %s: %s\n", argv[2], strerror(errno));
-      return 1;
-    }
-    bonus_size = st.st_size;
-    bonus_data = malloc(bonus_size);
-    FILE* f = fopen(argv[2], "rb");
-    if (f == NULL) {
-      printf("failed to open bonus file %s: %s\n", argv[2], strerror(errno));
-      return 1;
-    }
-    if (fread(bonus_data, 1, bonus_size, f) != bonus_size) {
-      printf("failed to read bonus file %s: %s\n", argv[2], strerror(errno));
-      return 1;
-    }
-    fclose(f);
+  while (argc >= 2 && argv[1][0] == '-') {
+    if (strcmp(argv[1], "-z") == 0) {
+      zip_mode = 1;
+      --argc;
+      ++argv;
+    } else if (strcmp(argv[1], "-t") == 0) {
+      timing = 1;
+      --argc;
+      ++argv;
+    } else if (argc >= 3 && strcmp(argv[1], "-j") == 0) {
+      char* end;
+      threads = strtol(argv[2], &end, 10);
+      if (*end != '\0' || threads < 1) {
+        goto usage;
+      }
+      argc -= 2;
+      argv += 2;
+    } else if (argc >= 3 && strcmp(argv[1], "-b") == 0) {
+      struct stat st;
+      if (stat(argv[2], &st) != 0) {
+        printf("failed to stat bonus file %s: %s\n", argv[2], strerror(errno));
+        return 1;
+      }
+      bonus_size = st.st_size;
+      bonus_data = malloc(bonus_size);
+      FILE* f = fopen(argv[2], "rb");
+      if (f == NULL) {
+        printf("failed to open bonus file %s: %s\n", argv[2], strerror(errno));
+        return 1;
+      }
+      if (fread(bonus_data, 1, bonus_size, f) != bonus_size) {
+        printf("failed to read bonus file %s: %s\n", argv[2], strerror(errno));
+        return 1;
+      }
+      fclose(f);
 
-    argc -= 2;
-    argv += 2;
+      argc -= 2;
+      argv += 2;
+    } else {
+      goto usage;
+    }
+  }
+  if (threads < 1) {
+    threads = 1;
   }
 
   if (argc != 4) {
     usage:
-    printf("usage: %s [-z] [-b <bonus-file>] <src-img> <tgt-img> <patch-file>\n",
-            argv[0]);
+    printf("usage: %s [-z] [-b <bonus-file>] [-j <threads>] [-t] "
+           "<src-img> <tgt-img> <patch-file>\n", argv[0]);
     return 2;
   }
 
@@ -953,17 +1059,15 @@ int main(int argc, char** argv) {
   DumpChunks(src_chunks, num_src_chunks);
 
   printf("Construct patches for %d chunks...\n", num_tgt_chunks);
-  unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
-  size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  PatchJob* jobs = malloc(num_tgt_chunks * sizeof(PatchJob));
+  int* src_uses = calloc(num_src_chunks, sizeof(int));
   for (i = 0; i < num_tgt_chunks; ++i) {
+    ImageChunk* src;
     if (zip_mode) {
-      ImageChunk* src;
-      if (tgt_chunks[i].type == CHUNK_DEFLATE &&
+      if (tgt_chunks[i].type != CHUNK_DEFLATE ||
           (src = FindChunkByName(tgt_chunks[i].filename, src_chunks,
-                                 num_src_chunks))) {
-        patch_data[i] = MakePatch(src, tgt_chunks+i, patch_size+i);
-      } else {
-        patch_data[i] = MakePatch(src_chunks, tgt_chunks+i, patch_size+i);
+                                 num_src_chunks)) == NULL) {
+        src = src_chunks;
       }
     } else {
       if (i == 1 && bonus_data) {
@@ -971,13 +1075,50 @@ int main(int argc, char** argv) {
         src_chunks[i].data = realloc(src_chunks[i].data, src_chunks[i].len + bonus_size);
         memcpy(src_chunks[i].data+src_chunks[i].len, bonus_data, bonus_size);
         src_chunks[i].len += bonus_size;
-     }
+      }
+      src = src_chunks+i;
+    }
+    jobs[i].src = src;
+    jobs[i].tgt = tgt_chunks+i;
+    // Small normal chunks are stored raw without diffing.
+    if (tgt_chunks[i].type != CHUNK_NORMAL || tgt_chunks[i].len > 160) {
+      src_uses[src - src_chunks]++;
+    }
+  }
 
-      patch_data[i] = MakePatch(src_chunks+i, tgt_chunks+i, patch_size+i);
+  // bsdiff() builds the suffix array of a source on first use, which
+  // must not happen on two threads at once.
+  double start = Now();
+  for (i = 0; i < num_src_chunks; ++i) {
+    if (src_uses[i] > 1 || (src_uses[i] == 1 && src_chunks[i].len >= PRESORT_MIN_LEN)) {
+      double sort_start = Now();
+      src_chunks[i].I = bsdiff_sort(src_chunks[i].data, src_chunks[i].len, threads);
+      if (timing) {
+        printf("sorted source %3d (%d bytes) in %.3f s\n",
+               i, src_chunks[i].len, Now() - sort_start);
+      }
     }
+  }
+  free(src_uses);
+
+  MakePatches(jobs, num_tgt_chunks, threads);
+
+  unsigned char** patch_data = malloc(num_tgt_chunks * sizeof(unsigned char*));
+  size_t* patch_size = malloc(num_tgt_chunks * sizeof(size_t));
+  for (i = 0; i < num_tgt_chunks; ++i) {
+    patch_data[i] = jobs[i].patch_data;
+    patch_size[i] = jobs[i].patch_size;
     printf("patch %3d is %d bytes (of %d)\n",
            i, patch_size[i], tgt_chunks[i].source_len);
+    if (timing) {
+      printf("patch %3d took %.3f s\n", i, jobs[i].seconds);
+    }
+  }
+  if (timing) {
+    printf("constructed %d patches in %.3f s on up to %ld threads\n",
+           num_tgt_chunks, Now() - start, threads);
   }
+  free(jobs);
 
   // Figure out how big the imgdiff file header is going to be, so
   // that we can correctly compute the offset of each bsdiff patch
@@ -22,6 +22,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <malloc.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 
@@ -31,6 +32,49 @@
 #include "imgdiff.h"
 #include "utils.h"
 
+// Compresses the target of a deflate chunk as bspatch produces it, so
+// that the uncompressed target never has to be held in memory.
+typedef struct {
+    z_stream strm;
+    unsigned char* buffer;
+    ssize_t size;
+    SinkFn sink;
+    void* token;
+    SHA_CTX* ctx;
+} DeflateSinkInfo;
+
+static int DeflateToSink(DeflateSinkInfo* dsi, int flush) {
+    int ret;
+    do {
+        dsi->strm.avail_out = dsi->size;
+        dsi->strm.next_out = dsi->buffer;
+        ret = deflate(&dsi->strm, flush);
+        if (ret == Z_STREAM_ERROR) {
+            printf("deflate failed\n");
+            return -1;
+        }
+        ssize_t have = dsi->size - dsi->strm.avail_out;
+
+        if (dsi->sink(dsi->buffer, have, dsi->token) != have) {
+            printf("failed to write %ld compressed bytes to output\n",
+                   (long)have);
+            return -1;
+        }
+        if (dsi->ctx) SHA_update(dsi->ctx, dsi->buffer, have);
+    } while (flush == Z_FINISH ? ret != Z_STREAM_END : dsi->strm.avail_out == 0);
+    return 0;
+}
+
+static ssize_t DeflateSink(const unsigned char* data, ssize_t len, void* token) {
+    DeflateSinkInfo* dsi = (DeflateSinkInfo*)token;
+    dsi->strm.next_in = (unsigned char*)data;
+    dsi->strm.avail_in = len;
+    if (DeflateToSink(dsi, Z_NO_FLUSH) != 0) {
+        return -1;
+    }
+    return len;
+}
+
 /*
  * Apply the patch given in 'patch_filename' to the source data given
  * by (old_data, old_size).  Write the patched output to the 'output'
@@ -80,8 +124,11 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size __unused,
             size_t src_len = Read8(normal_header+8);
             size_t patch_offset = Read8(normal_header+16);
 
-            ApplyBSDiffPatch(old_data + src_start, src_len,
-                             patch, patch_offset, sink, token, ctx);
+            if (ApplyBSDiffPatch(old_data + src_start, src_len,
+                                 patch, patch_offset, sink, token, ctx) != 0) {
+                printf("failed to apply chunk %d\n", i);
+                return -1;
+            }
         } else if (type == CHUNK_RAW) {
             char* raw_header = patch->data + pos;
             pos += 4;
@@ -175,55 +222,72 @@ int ApplyImagePatch(const unsigned char* old_data, ssize_t old_size __unused,
                        bonus_data->data, bonus_size);
             }
 
-            // Next, apply the bsdiff patch (in memory) to the uncompressed
-            // data.
-            unsigned char* uncompressed_target_data;
-            ssize_t uncompressed_target_size;
-            if (ApplyBSDiffPatchMem(expanded_source, expanded_len,
-                                    patch, patch_offset,
-                                    &uncompressed_target_data,
-                                    &uncompressed_target_size) != 0) {
+            // Next, apply the bsdiff patch to the uncompressed data and
+            // compress the target data as it comes, appending it to the
+            // output.  zlib only compresses the same no matter how the
+            // input is split up for levels above 0; stored chunks still
+            // get their whole target at once.
+            DeflateSinkInfo dsi;
+            dsi.strm.zalloc = Z_NULL;
+            dsi.strm.zfree = Z_NULL;
+            dsi.strm.opaque = Z_NULL;
+            dsi.strm.avail_in = 0;
+            dsi.strm.next_in = Z_NULL;
+            dsi.size = 32768;
+            dsi.buffer = malloc(dsi.size);
+            dsi.sink = sink;
+            dsi.token = token;
+            dsi.ctx = ctx;
+            if (dsi.buffer == NULL) {
+                printf("failed to allocate %ld bytes for deflate output\n",
+                       (long)dsi.size);
+                free(expanded_source);
                 return -1;
             }
-
-            // Now compress the target data and append it to the output.
-
-            // we're done with the expanded_source data buffer, so we'll
-            // reuse that memory to receive the output of deflate.
-            unsigned char* temp_data = expanded_source;
-            ssize_t temp_size = expanded_len;
-            if (temp_size < 32768) {
-                // ... unless the buffer is too small, in which case we'll
-                // allocate a fresh one.
-                free(temp_data);
-                temp_data = malloc(32768);
-                temp_size = 32768;
+            ret = deflateInit2(&dsi.strm, level, method, windowBits, memLevel, strategy);
+            if (ret != Z_OK) {
+                printf("failed to init target deflation: %d\n", ret);
+                free(dsi.buffer);
+                free(expanded_source);
+                return -1;
             }
 
-            // now the deflate stream
-            strm.zalloc = Z_NULL;
-            strm.zfree = Z_NULL;
-            strm.opaque = Z_NULL;
-            strm.avail_in = uncompressed_target_size;
-            strm.next_in = uncompressed_target_data;
-            ret = deflateInit2(&strm, level, method, windowBits, memLevel, strategy);
-            do {
-                strm.avail_out = temp_size;
-                strm.next_out = temp_data;
-                ret = deflate(&strm, Z_FINISH);
-                ssize_t have = temp_size - strm.avail_out;
-
-                if (sink(temp_data, have, token) != have) {
-                    printf("failed to write %ld compressed bytes to output\n",
-                           (long)have);
-                    return -1;
+            int failed;
+            if (level != 0) {
+                failed = ApplyBSDiffPatch(expanded_source, expanded_len,
+                                          patch, patch_offset,
+                                          DeflateSink, &dsi, NULL) != 0;
+            } else {
+                unsigned char* uncompressed_target_data;
+                ssize_t uncompressed_target_size;
+                failed = ApplyBSDiffPatchMem(expanded_source, expanded_len,
+                                             patch, patch_offset,
+                                             &uncompressed_target_data,
+                                             &uncompressed_target_size) != 0;
+                if (!failed) {
+                    // Stored blocks also depend on the output buffer, which
+                    // has always been the expanded source if big enough
+                    if (expanded_len >= (size_t)dsi.size) {
+                        free(dsi.buffer);
+                        dsi.buffer = expanded_source;
+                        dsi.size = expanded_len;
+                        expanded_source = NULL;
+                    }
+                    dsi.strm.avail_in = uncompressed_target_size;
+                    dsi.strm.next_in = uncompressed_target_data;
+                    failed = DeflateToSink(&dsi, Z_FINISH) != 0;
+                    free(uncompressed_target_data);
                 }
-                if (ctx) SHA_update(ctx, temp_data, have);
-            } while (ret != Z_STREAM_END);
-            deflateEnd(&strm);
-
-            free(temp_data);
-            free(uncompressed_target_data);
+            }
+            if (!failed && level != 0) {
+                failed = DeflateToSink(&dsi, Z_FINISH) != 0;
+            }
+            deflateEnd(&dsi.strm);
+            free(dsi.buffer);
+            free(expanded_source);
+            if (failed) {
+                return -1;
+            }
         } else {
             printf("patch chunk %d is unknown type %d\n", i, type);
             return -1;
@@ -27,6 +27,7 @@
 #include "data.hpp"
 #include "partitions.hpp"
 #include "twrp-functions.hpp"
+#include "twrpTrace.hpp"
 #ifndef TW_NO_SCREEN_TIMEOUT
 #include "gui/blanktimer.hpp"
 #endif
@@ -247,6 +248,7 @@ int DataManager::LoadValues(const string& filename)
 #ifndef TW_NO_SCREEN_TIMEOUT
 	blankTimer.setTime(mPersist.GetIntValue("tw_screen_timeout_secs"));
 #endif
+	twrpTrace::Set_Enabled(mPersist.GetIntValue(TW_TRACE_VAR) != 0);
 
 	pthread_mutex_unlock(&m_valuesLock);
 	string current = GetCurrentStoragePath();
@@ -426,6 +428,8 @@ int DataManager::SetValue(const string& varName, const string& value, const int
 #endif
 	if (varName == "tw_storage_path") {
 		SetBackupFolder();
+	} else if (varName == TW_TRACE_VAR) {
+		twrpTrace::Set_Enabled(atoi(value.c_str()) != 0);
 	}
 	gui_notifyVarChange(varName.c_str(), value.c_str());
 	return 0;
@@ -681,11 +685,21 @@ void DataManager::SetDefaultValues()
 	mPersist.SetValue(TW_FORCE_MD5_CHECK_VAR, "0");
 	mPersist.SetValue(TW_DISABLE_FREE_SPACE_VAR, "0");
 	mPersist.SetValue(TW_USE_COMPRESSION_VAR, "0");
+	mPersist.SetValue(TW_COMPRESSION_TYPE_VAR, "gzip");
+	mPersist.SetValue(TW_DEDUP_BACKUP_VAR, "0");
+	mPersist.SetValue(TW_CONCURRENT_BACKUP_VAR, "0");
+	mPersist.SetValue(TW_SPARSE_IMAGE_BACKUP_VAR, "0");
+	mPersist.SetValue(TW_COMPARE_IMAGE_RESTORE_VAR, "0");
+	mPersist.SetValue(TW_TAR_INDEX_VAR, "0");
+	mPersist.SetValue(TW_TRACE_VAR, "0");
 	mPersist.SetValue(TW_TIME_ZONE_VAR, "CST6CDT,M3.2.0,M11.1.0");
 	mPersist.SetValue(TW_GUI_SORT_ORDER, "1");
 	mPersist.SetValue(TW_RM_RF_VAR, "0");
 	mPersist.SetValue(TW_SKIP_MD5_CHECK_VAR, "0");
+	mPersist.SetValue(TW_INLINE_MD5_CHECK_VAR, "0");
 	mPersist.SetValue(TW_SKIP_MD5_GENERATE_VAR, "0");
+	mData.SetValue(TW_INCREMENTAL_BACKUP_VAR, "0");
+	mData.SetValue(TW_INCREMENTAL_BASE_VAR, "");
 	mPersist.SetValue(TW_SDEXT_SIZE, "0");
 	mPersist.SetValue(TW_SWAP_SIZE, "0");
 	mPersist.SetValue(TW_SDPART_FILE_SYSTEM, "ext3");
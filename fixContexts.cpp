@@ -18,90 +18,265 @@
 
 #include <string>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
 #include <cctype>
 #include "fixContexts.hpp"
 #include "twrp-functions.hpp"
+#include "twrpTrace.hpp"
 #include "twcommon.h"
 #ifdef HAVE_SELINUX
 #include "selinux/selinux.h"
 #include "selinux/label.h"
 #include "selinux/android.h"
-#include "selinux/label.h"
 #endif
 
 using namespace std;
 
 #ifdef HAVE_SELINUX
-struct selabel_handle *sehandle;
+// Most worker threads used for relabeling
+#define TW_RELABEL_THREADS 8
+// Subdirectories are handled by the thread that found them once this many
+// open directories are waiting
+#define TW_RELABEL_QUEUE_MAX 256
+
 struct selinux_opt selinux_options[] = {
 	{ SELABEL_OPT_PATH, "/file_contexts" }
 };
 
-int fixContexts::restorecon(string entry, struct stat *sb) {
-	char *oldcontext, *newcontext;
+bool fixContexts::Lookup(Relabel_Job* job, const string& path, mode_t mode, string& context) {
+	char *newcontext;
+	int ret;
 
-	if (lgetfilecon(entry.c_str(), &oldcontext) < 0) {
-		LOGINFO("Couldn't get selinux context for %s\n", entry.c_str());
-		return -1;
+	pthread_mutex_lock(&job->lookup_lock);
+	ret = selabel_lookup(job->handle, &newcontext, path.c_str(), mode);
+	pthread_mutex_unlock(&job->lookup_lock);
+	if (ret < 0) {
+		LOGINFO("Couldn't lookup selinux context for %s\n", path.c_str());
+		return false;
 	}
-	if (selabel_lookup(sehandle, &newcontext, entry.c_str(), sb->st_mode) < 0) {
-		LOGINFO("Couldn't lookup selinux context for %s\n", entry.c_str());
-		return -1;
+	context = newcontext;
+	freecon(newcontext);
+	return true;
+}
+
+// target names the entry for the kernel, path is the full path for the log
+bool fixContexts::restorecon(const char* target, const string& path, const string& context, unsigned long& relabeled) {
+	char *oldcontext;
+
+	if (lgetfilecon(target, &oldcontext) < 0) {
+		LOGINFO("Couldn't get selinux context for %s\n", path.c_str());
+		return false;
 	}
-	if (strcmp(oldcontext, newcontext) != 0) {
-		LOGINFO("Relabeling %s from %s to %s\n", entry.c_str(), oldcontext, newcontext);
-		if (lsetfilecon(entry.c_str(), newcontext) < 0) {
-			LOGINFO("Couldn't label %s with %s: %s\n", entry.c_str(), newcontext, strerror(errno));
-		}
+	if (context != oldcontext) {
+		LOGINFO("Relabeling %s from %s to %s\n", path.c_str(), oldcontext, context.c_str());
+		if (lsetfilecon(target, context.c_str()) < 0)
+			LOGINFO("Couldn't label %s with %s: %s\n", path.c_str(), context.c_str(), strerror(errno));
+		else
+			relabeled++;
 	}
 	freecon(oldcontext);
-	freecon(newcontext);
-	return 0;
+	return true;
+}
+
+static mode_t Dirent_Mode(int dir_fd, struct dirent* de) {
+	struct stat st;
+
+	switch (de->d_type) {
+		case DT_DIR: return S_IFDIR;
+		case DT_REG: return S_IFREG;
+		case DT_LNK: return S_IFLNK;
+		case DT_CHR: return S_IFCHR;
+		case DT_BLK: return S_IFBLK;
+		case DT_FIFO: return S_IFIFO;
+		case DT_SOCK: return S_IFSOCK;
+	}
+	if (fstatat(dir_fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+		return 0;
+	return st.st_mode & S_IFMT;
 }
 
-int fixContexts::fixContextsRecursively(string name, int level) {
+// Relabels the entries of the directory open as fd, which is closed when
+// done. Entries are reached relative to fd through /proc/self/fd, so the
+// kernel never walks the full path. Files of one type in one directory
+// share a context in practice, so they are looked up once per directory.
+// Subdirectories are always looked up as file_contexts often names them.
+void fixContexts::Relabel_Directory(Relabel_Job* job, int fd, const string& path) {
 	DIR *d;
 	struct dirent *de;
-	struct stat sb;
-	string path;
+	char target[PATH_MAX];
+	vector<mode_t> cached_modes;
+	vector<string> cached_contexts;
+	unsigned long entries = 0, relabeled = 0;
 
-	if (!(d = opendir(name.c_str())))
-		return -1;
-	if (!(de = readdir(d)))
-		return -1;
+	if (!(d = fdopendir(fd))) {
+		LOGINFO("Unable to open '%s' (%s)\n", path.c_str(), strerror(errno));
+		close(fd);
+		return;
+	}
+	while ((de = readdir(d))) {
+		if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+			continue;
+		mode_t mode = Dirent_Mode(fd, de);
+		string entry = path + "/" + de->d_name, context;
+		size_t i;
 
-	do {
-		if (de->d_type ==  DT_DIR) {
-			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0)
+		entries++;
+		if (mode != S_IFDIR) {
+			for (i = 0; i < cached_modes.size() && cached_modes[i] != mode; i++)
+				;
+			if (i < cached_modes.size()) {
+				context = cached_contexts[i];
+			} else if (Lookup(job, entry, mode, context)) {
+				cached_modes.push_back(mode);
+				cached_contexts.push_back(context);
+			} else {
 				continue;
-			path = name + "/" + de->d_name;
-			restorecon(path, &sb);
-			fixContextsRecursively(path, level + 1);
+			}
+		} else if (!Lookup(job, entry, mode, context)) {
+			continue;
+		}
+		snprintf(target, sizeof(target), "/proc/self/fd/%d/%s", fd, de->d_name);
+		restorecon(target, entry, context, relabeled);
+		if (mode != S_IFDIR)
+			continue;
+
+		int child_fd = openat(fd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (child_fd < 0) {
+			LOGINFO("Unable to open '%s' (%s)\n", entry.c_str(), strerror(errno));
+			continue;
 		}
-		else {
-			path = name + "/" + de->d_name;
-			restorecon(path, &sb);
+		pthread_mutex_lock(&job->lock);
+		if (job->queue.size() < TW_RELABEL_QUEUE_MAX) {
+			Relabel_Dir dir = {child_fd, entry};
+			job->queue.push_back(dir);
+			job->pending++;
+			pthread_cond_signal(&job->changed);
+			pthread_mutex_unlock(&job->lock);
+		} else {
+			pthread_mutex_unlock(&job->lock);
+			Relabel_Directory(job, child_fd, entry);
 		}
-	} while ((de = readdir(d)));
+	}
 	closedir(d);
-	return 0;
+	pthread_mutex_lock(&job->lock);
+	job->entries += entries;
+	job->relabeled += relabeled;
+	pthread_mutex_unlock(&job->lock);
 }
 
-int fixContexts::fixDataMediaContexts(string Mount_Point) {
-	DIR *d;
-	struct dirent *de;
-	struct stat sb;
+void* fixContexts::Relabel_Thread(void* cookie) {
+	Relabel_Job* job = (Relabel_Job*) cookie;
 
-	LOGINFO("Fixing media contexts on '%s'\n", Mount_Point.c_str());
+	pthread_mutex_lock(&job->lock);
+	for (;;) {
+		while (job->queue.empty() && job->pending > 0)
+			pthread_cond_wait(&job->changed, &job->lock);
+		if (job->queue.empty())
+			break;
+		// Taking the newest directory keeps the walk depth first and the
+		// number of open directories low
+		Relabel_Dir dir = job->queue.back();
+		job->queue.pop_back();
+		pthread_mutex_unlock(&job->lock);
+		Relabel_Directory(job, dir.fd, dir.path);
+		pthread_mutex_lock(&job->lock);
+		if (--job->pending == 0)
+			pthread_cond_broadcast(&job->changed);
+	}
+	pthread_mutex_unlock(&job->lock);
+	return NULL;
+}
+
+int fixContexts::Relabel(struct selabel_handle* handle, const vector<string>& Paths) {
+	Relabel_Job job;
+	pthread_t threads[TW_RELABEL_THREADS];
+	unsigned thread_count = 0, i;
+	struct stat st;
+	string context;
+	int ret = 0;
+	twrpTraceSpan span("contexts", "Relabel", Paths.empty() ? "" : Paths[0]);
+
+	job.handle = handle;
+	job.pending = 0;
+	job.entries = 0;
+	job.relabeled = 0;
+	pthread_mutex_init(&job.lock, NULL);
+	pthread_mutex_init(&job.lookup_lock, NULL);
+	pthread_cond_init(&job.changed, NULL);
+
+	for (vector<string>::const_iterator path = Paths.begin(); path != Paths.end(); path++) {
+		if (lstat(path->c_str(), &st) != 0) {
+			LOGINFO("Unable to stat '%s' (%s)\n", path->c_str(), strerror(errno));
+			ret = -1;
+			continue;
+		}
+		job.entries++;
+		if (Lookup(&job, *path, st.st_mode & S_IFMT, context))
+			restorecon(path->c_str(), *path, context, job.relabeled);
+		if (!S_ISDIR(st.st_mode))
+			continue;
+		int fd = open(path->c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (fd < 0) {
+			LOGINFO("Unable to open '%s' (%s)\n", path->c_str(), strerror(errno));
+			ret = -1;
+			continue;
+		}
+		Relabel_Dir dir = {fd, *path};
+		job.queue.push_back(dir);
+		job.pending++;
+	}
+
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	unsigned wanted = cores > 1 ? (unsigned)cores : 1;
+	if (wanted > TW_RELABEL_THREADS)
+		wanted = TW_RELABEL_THREADS;
+	for (i = 0; i < wanted; i++) {
+		if (pthread_create(&threads[thread_count], NULL, Relabel_Thread, &job) != 0) {
+			LOGINFO("Unable to create relabel thread %u\n", i);
+			break;
+		}
+		thread_count++;
+	}
+	if (thread_count == 0)
+		Relabel_Thread(&job);
+	for (i = 0; i < thread_count; i++)
+		pthread_join(threads[i], NULL);
+	LOGINFO("Relabeled %lu of %lu entries with %u threads\n", job.relabeled, job.entries, thread_count ? thread_count : 1);
+
+	pthread_cond_destroy(&job.changed);
+	pthread_mutex_destroy(&job.lookup_lock);
+	pthread_mutex_destroy(&job.lock);
+	return ret;
+}
+
+int fixContexts::Relabel_Tree(const string& Path) {
+	struct selabel_handle *sehandle;
+	vector<string> Paths;
 
 	sehandle = selabel_open(SELABEL_CTX_FILE, selinux_options, 1);
 	if (!sehandle) {
 		LOGINFO("Unable to open /file_contexts\n");
-		return 0;
+		return -1;
 	}
+	Paths.push_back(Path);
+	int ret = Relabel(sehandle, Paths);
+	selabel_close(sehandle);
+	return ret;
+}
+
+int fixContexts::fixDataMediaContexts(string Mount_Point) {
+	DIR *d;
+	struct dirent *de;
+	struct selabel_handle *sehandle;
+	vector<string> Paths;
+
+	LOGINFO("Fixing media contexts on '%s'\n", Mount_Point.c_str());
 
 	if (TWFunc::Path_Exists(Mount_Point + "/media/0")) {
 		string dir = Mount_Point + "/media";
@@ -109,13 +284,7 @@ int fixContexts::fixDataMediaContexts(string Mount_Point) {
 			LOGINFO("opendir failed (%s)\n", strerror(errno));
 			return -1;
 		}
-		if (!(de = readdir(d))) {
-			LOGINFO("readdir failed (%s)\n", strerror(errno));
-			closedir(d);
-			return -1;
-		}
-
-		do {
+		while ((de = readdir(d))) {
 			if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0 || de->d_type != DT_DIR)
 				continue;
 			size_t len = strlen(de->d_name);
@@ -128,32 +297,30 @@ int fixContexts::fixDataMediaContexts(string Mount_Point) {
 				}
 				folder_name++;
 			}
-			if (is_numeric) {
-				dir = Mount_Point + "/media/";
-				dir += de->d_name;
-				restorecon(dir, &sb);
-				fixContextsRecursively(dir, 0);
-			}
-		} while ((de = readdir(d)));
+			if (is_numeric)
+				Paths.push_back(dir + "/" + de->d_name);
+		}
 		closedir(d);
 	} else if (TWFunc::Path_Exists(Mount_Point + "/media")) {
-		restorecon(Mount_Point + "/media", &sb);
-		fixContextsRecursively(Mount_Point + "/media", 0);
+		Paths.push_back(Mount_Point + "/media");
 	} else {
 		LOGINFO("fixDataMediaContexts: %s/media does not exist!\n", Mount_Point.c_str());
 		return 0;
 	}
+
+	sehandle = selabel_open(SELABEL_CTX_FILE, selinux_options, 1);
+	if (!sehandle) {
+		LOGINFO("Unable to open /file_contexts\n");
+		return 0;
+	}
+	Relabel(sehandle, Paths);
 	selabel_close(sehandle);
 	return 0;
 }
 
 #else
 
-int fixContexts::restorecon(string entry __unused, struct stat *sb __unused) {
-	return -1;
-}
-
-int fixContexts::fixContextsRecursively(string name __unused, int level __unused) {
+int fixContexts::Relabel_Tree(const string& Path __unused) {
 	return -1;
 }
 
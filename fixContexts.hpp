@@ -19,17 +19,41 @@
 #ifndef __FIXCONTEXTS_HPP
 #define __FIXCONTEXTS_HPP
 
+#include <sys/types.h>
+#include <pthread.h>
 #include <string>
+#include <vector>
 
 using namespace std;
 
+struct selabel_handle;
+
 class fixContexts {
 	public:
 		static int fixDataMediaContexts(string Mount_Point);
+		static int Relabel_Tree(const string& Path);                      // Labels Path and everything below it as /file_contexts says
 
 	private:
-		static int restorecon(string entry, struct stat *sb);
-		static int fixContextsRecursively(string path, int level);
+		// Directories waiting to be relabeled, shared by the worker threads
+		struct Relabel_Dir {
+			int fd;
+			string path;
+		};
+		struct Relabel_Job {
+			struct selabel_handle* handle;
+			pthread_mutex_t lock;
+			pthread_mutex_t lookup_lock;                              // selabel_lookup compiles regexes on first use
+			pthread_cond_t changed;
+			vector<Relabel_Dir> queue;
+			unsigned pending;                                         // queued directories plus the ones being worked on
+			unsigned long entries;
+			unsigned long relabeled;
+		};
+		static int Relabel(struct selabel_handle* handle, const vector<string>& Paths);
+		static bool Lookup(Relabel_Job* job, const string& path, mode_t mode, string& context);
+		static bool restorecon(const char* target, const string& path, const string& context, unsigned long& relabeled);
+		static void Relabel_Directory(Relabel_Job* job, int fd, const string& path);
+		static void* Relabel_Thread(void* cookie);
 };
 
 #endif
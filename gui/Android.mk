@@ -7,6 +7,7 @@ LOCAL_SRC_FILES := \
     gui.cpp \
     resources.cpp \
     pages.cpp \
+    themecache.cpp \
     text.cpp \
     image.cpp \
     action.cpp \
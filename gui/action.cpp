@@ -38,6 +38,7 @@
 #include <sstream>
 #include "../partitions.hpp"
 #include "../twrp-functions.hpp"
+#include "../twrpTrace.hpp"
 #include "../openrecoveryscript.hpp"
 
 #include "../adb_install.h"
@@ -210,6 +211,7 @@ GUIAction::GUIAction(xml_node<>* node)
 		ADD_ACTION(nandroid);
 		ADD_ACTION(fixcontexts);
 		ADD_ACTION(fixpermissions);
+		ADD_ACTION(dedupgc);
 		ADD_ACTION(dd);
 		ADD_ACTION(partitionsd);
 		ADD_ACTION(installhtcdumlock);
@@ -644,6 +646,9 @@ int GUIAction::copylog(std::string arg __unused)
 		dst = DataManager::GetCurrentStoragePath() + "/recovery.log";
 		TWFunc::copy_file("/tmp/recovery.log", dst.c_str(), 0755);
 		tw_set_default_metadata(dst.c_str());
+		dst = DataManager::GetCurrentStoragePath() + "/recovery_trace.json";
+		if (twrpTrace::Enabled() && twrpTrace::Copy_Trace(dst))
+			tw_set_default_metadata(dst.c_str());
 		sync();
 		gui_msg(Msg("copy_log=Copied recovery log to {1}.")(DataManager::GetCurrentStoragePath()));
 	} else
@@ -1258,6 +1263,20 @@ int GUIAction::fixpermissions(std::string arg)
 	return fixcontexts(arg);
 }
 
+int GUIAction::dedupgc(std::string arg __unused)
+{
+	int op_status = 0;
+
+	operation_start("Remove Unused Chunks");
+	if (simulate) {
+		simulate_progress_bar();
+	} else {
+		op_status = PartitionManager.Collect_Chunk_Garbage();
+	}
+	operation_end(op_status);
+	return 0;
+}
+
 int GUIAction::dd(std::string arg)
 {
 	operation_start("imaging");
@@ -32,8 +32,10 @@
 #include <time.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <pthread.h>
 
 #include <string>
+#include <deque>
 
 extern "C" {
 #include "../twcommon.h"
@@ -46,13 +48,89 @@ extern "C" {
 #include "twmsg.h"
 
 #define GUI_CONSOLE_BUFFER_SIZE 512
+#define GUI_CONSOLE_MAX_LINES 2000      // printed lines kept for the consoles
+#define GUI_CONSOLE_MAX_MESSAGES 2000   // messages kept to translate again after a theme or language change
+#define GUI_CONSOLE_MAX_RENDERED 4000   // word wrapped lines kept by each console
+#define GUI_CONSOLE_MAX_COLORS 64
+
+// Printed lines shared by all consoles. The ring drops the oldest lines
+// once it is full, so memory stays the same during long ORS scripts, and
+// the strings of reused slots keep their buffers.
+struct LogLine {
+	std::string text;
+	unsigned char color; // index into log_colors
+};
+static LogLine log_lines[GUI_CONSOLE_MAX_LINES];
+static size_t log_line_count = 0; // lines ever printed, line n is in log_lines[n % GUI_CONSOLE_MAX_LINES]
+static size_t log_first_line = 0; // oldest line still in the ring
+static std::vector<std::string> log_colors; // each color name only once
+
+static std::deque<Message> gMessages;
+static size_t message_first = 0; // number of the message in gMessages[0]
+static size_t last_message_count = 0; // messages already translated into the ring
 
-size_t last_message_count = 0;
-std::vector<Message> gMessages;
-
-std::vector<std::string> gConsole;
-std::vector<std::string> gConsoleColor;
 static FILE* ors_file;
+// Partitions may be backed up on several threads at once
+static pthread_mutex_t console_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t console_once = PTHREAD_ONCE_INIT;
+
+// Forked children such as the tar processes of a backup print messages
+// too, so the lock must not be held by another thread when they are forked
+static void Lock_Before_Fork()
+{
+	pthread_mutex_lock(&console_lock);
+}
+
+static void Unlock_After_Fork()
+{
+	pthread_mutex_unlock(&console_lock);
+}
+
+static void Register_Fork_Handlers()
+{
+	pthread_atfork(Lock_Before_Fork, Unlock_After_Fork, Unlock_After_Fork);
+}
+
+static void Lock_Console()
+{
+	pthread_once(&console_once, Register_Fork_Handlers);
+	pthread_mutex_lock(&console_lock);
+}
+
+// The GUI thread looks for new lines on every frame. It leaves them for the
+// next frame rather than waiting for a backup thread or a fork.
+static bool Try_Lock_Console()
+{
+	pthread_once(&console_once, Register_Fork_Handlers);
+	return pthread_mutex_trylock(&console_lock) == 0;
+}
+
+// Must be called with console_lock held
+static unsigned char Log_Color(const char* color)
+{
+	if (log_colors.empty())
+		log_colors.push_back("normal");
+	for (size_t i = 0; i < log_colors.size(); i++) {
+		if (log_colors[i] == color)
+			return i;
+	}
+	if (log_colors.size() >= GUI_CONSOLE_MAX_COLORS)
+		return 0;
+	log_colors.push_back(color);
+	return log_colors.size() - 1;
+}
+
+// Must be called with console_lock held
+static void Add_Log_Line(const char* text, size_t len, unsigned char color)
+{
+	LogLine& line = log_lines[log_line_count % GUI_CONSOLE_MAX_LINES];
+
+	line.text.assign(text, len);
+	line.color = color;
+	log_line_count++;
+	if (log_line_count - log_first_line > GUI_CONSOLE_MAX_LINES)
+		log_first_line = log_line_count - GUI_CONSOLE_MAX_LINES;
+}
 
 extern "C" void __gui_print(const char *color, char *buf)
 {
@@ -63,14 +141,13 @@ extern "C" void __gui_print(const char *color, char *buf)
 		return;
 	}
 
+	Lock_Console();
+	unsigned char color_index = Log_Color(color);
 	for (start = next = buf; *next != '\0';)
 	{
 		if (*next == '\n')
 		{
-			*next = '\0';
-			gConsole.push_back(start);
-			gConsoleColor.push_back(color);
-
+			Add_Log_Line(start, next - start, color_index);
 			start = ++next;
 		}
 		else
@@ -78,10 +155,9 @@ extern "C" void __gui_print(const char *color, char *buf)
 	}
 
 	// The text after last \n (or whole string if there is no \n)
-	if(*start) {
-		gConsole.push_back(start);
-		gConsoleColor.push_back(color);
-	}
+	if(*start)
+		Add_Log_Line(start, next - start, color_index);
+	pthread_mutex_unlock(&console_lock);
 }
 
 extern "C" void gui_print(const char *fmt, ...)
@@ -168,27 +244,51 @@ void gui_msg(Message msg)
 		fprintf(ors_file, "%s", output.c_str());
 		fflush(ors_file);
 	}
+	Lock_Console();
 	gMessages.push_back(msg);
+	if (gMessages.size() > GUI_CONSOLE_MAX_MESSAGES) {
+		gMessages.pop_front();
+		message_first++;
+	}
+	pthread_mutex_unlock(&console_lock);
 }
 
-void GUIConsole::Translate_Now() {
-	size_t message_count = gMessages.size();
-	if (message_count <= last_message_count)
-		return;
-
-	for (size_t m = last_message_count; m < message_count; m++) {
-		std::string message = gMessages[m];
-		std::string color = "normal";
-		if (gMessages[m].GetKind() == msg::kError)
+void GUIConsole::Translate_Now(bool wait) {
+	std::vector<Message> messages;
+
+	if (!wait) {
+		if (!Try_Lock_Console())
+			return;
+	} else
+		Lock_Console();
+	if (last_message_count < message_first)
+		last_message_count = message_first;
+	for (size_t m = last_message_count - message_first; m < gMessages.size(); m++)
+		messages.push_back(gMessages[m]);
+	last_message_count = message_first + gMessages.size();
+	pthread_mutex_unlock(&console_lock);
+
+	// Translating looks up resources, so it is done without holding the lock
+	for (std::vector<Message>::iterator it = messages.begin(); it != messages.end(); ++it) {
+		std::string message = *it;
+		const char* color = "normal";
+		if (it->GetKind() == msg::kError)
 			color = "error";
-		else if (gMessages[m].GetKind() == msg::kHighlight)
+		else if (it->GetKind() == msg::kHighlight)
 			color = "highlight";
-		else if (gMessages[m].GetKind() == msg::kWarning)
+		else if (it->GetKind() == msg::kWarning)
 			color = "warning";
-		gConsole.push_back(message);
-		gConsoleColor.push_back(color);
+		Lock_Console();
+		Add_Log_Line(message.c_str(), message.size(), Log_Color(color));
+		pthread_mutex_unlock(&console_lock);
 	}
-	last_message_count = message_count;
+}
+
+void GUIConsole::Clear_Log() {
+	Lock_Console();
+	log_first_line = log_line_count;
+	last_message_count = 0;
+	pthread_mutex_unlock(&console_lock);
 }
 
 GUIConsole::GUIConsole(xml_node<>* node) : GUIScrollList(node)
@@ -241,6 +341,62 @@ GUIConsole::GUIConsole(xml_node<>* node) : GUIScrollList(node)
 	}
 }
 
+// Word wraps the lines printed since the last call into rConsole
+bool GUIConsole::AddLogLines(void)
+{
+	std::vector<std::string> lines;
+	std::vector<unsigned char> colors;
+
+	// Only the new lines are copied under the lock, wrapping them takes longer
+	if (!Try_Lock_Console())
+		return false;
+	if (mLastCount < log_first_line)
+		mLastCount = log_first_line; // the ring moved on while this console was not shown
+	for (; mLastCount < log_line_count; mLastCount++) {
+		const LogLine& line = log_lines[mLastCount % GUI_CONSOLE_MAX_LINES];
+		lines.push_back(line.text);
+		colors.push_back(line.color);
+	}
+	pthread_mutex_unlock(&console_lock);
+
+	if (lines.empty())
+		return false;
+	for (size_t i = 0; i < lines.size(); i++) {
+		size_t count = WrapLine(lines[i], &rConsole);
+		rConsoleColor.insert(rConsoleColor.end(), count, colors[i]);
+	}
+
+	if (rConsole.size() > GUI_CONSOLE_MAX_RENDERED + GUI_CONSOLE_MAX_RENDERED / 4) {
+		size_t drop = rConsole.size() - GUI_CONSOLE_MAX_RENDERED;
+		rConsole.erase(rConsole.begin(), rConsole.begin() + drop);
+		rConsoleColor.erase(rConsoleColor.begin(), rConsoleColor.begin() + drop);
+		// keep showing the same lines if they are still there
+		if (firstDisplayedItem >= (int)drop) {
+			firstDisplayedItem -= drop;
+		} else {
+			firstDisplayedItem = 0;
+			y_offset = 0;
+		}
+	}
+	return true;
+}
+
+const COLOR& GUIConsole::GetColor(unsigned char index)
+{
+	while (mColors.size() <= index) {
+		COLOR color = mFontColor;
+		Lock_Console();
+		std::string name = mColors.size() < log_colors.size() ? log_colors[mColors.size()] : "normal";
+		pthread_mutex_unlock(&console_lock);
+		if (name != "normal") {
+			ConvertStrToColor(name, &color);
+			color.alpha = 255;
+		}
+		mColors.push_back(color);
+	}
+	return mColors[index];
+}
+
 int GUIConsole::RenderSlideout(void)
 {
 	if (!mSlideoutImage || !mSlideoutImage->GetResource())
@@ -252,8 +408,8 @@ int GUIConsole::RenderSlideout(void)
 
 int GUIConsole::RenderConsole(void)
 {
-	Translate_Now();
-	AddLines(&gConsole, &gConsoleColor, &mLastCount, &rConsole, &rConsoleColor);
+	Translate_Now(false);
+	AddLogLines();
 	GUIScrollList::Render();
 
 	// if last line is fully visible, keep tracking the last line when new lines are added
@@ -304,7 +460,7 @@ int GUIConsole::Update(void)
 		scrollToEnd = true;
 	}
 
-	if (AddLines(&gConsole, &gConsoleColor, &mLastCount, &rConsole, &rConsoleColor)) {
+	if (AddLogLines()) {
 		// someone added new text
 		// at least the scrollbar must be updated, even if the new lines are currently not visible
 		mUpdate = 1;
@@ -370,15 +526,8 @@ size_t GUIConsole::GetItemCount()
 void GUIConsole::RenderItem(size_t itemindex, int yPos, bool selected __unused)
 {
 	// Set the color for the font
-	if (rConsoleColor[itemindex] == "normal") {
-		gr_color(mFontColor.red, mFontColor.green, mFontColor.blue, mFontColor.alpha);
-	} else {
-		COLOR FontColor;
-		std::string color = rConsoleColor[itemindex];
-		ConvertStrToColor(color, &FontColor);
-		FontColor.alpha = 255;
-		gr_color(FontColor.red, FontColor.green, FontColor.blue, FontColor.alpha);
-	}
+	const COLOR& FontColor = GetColor(rConsoleColor[itemindex]);
+	gr_color(FontColor.red, FontColor.green, FontColor.blue, FontColor.alpha);
 
 	// render text
 	const char* text = rConsole[itemindex].c_str();
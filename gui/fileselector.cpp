@@ -17,7 +17,11 @@
 */
 
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
+#include <sys/inotify.h>
 #include <dirent.h>
 #include <algorithm>
 
@@ -31,7 +35,16 @@ extern "C" {
 #include "../data.hpp"
 #include "../twrp-functions.hpp"
 
+// Entries handed from the listing thread to the list at a time
+#define LIST_BATCH_SIZE 256
+// Most folders whose listing is kept
+#define FOLDER_CACHE_SIZE 8
+
 int GUIFileSelector::mSortOrder = 0;
+std::map<std::string, GUIFileSelector::CachedFolder> GUIFileSelector::mFolderCache;
+pthread_mutex_t GUIFileSelector::mFolderCacheLock = PTHREAD_MUTEX_INITIALIZER;
+int GUIFileSelector::mInotifyFd = -1;
+unsigned long GUIFileSelector::mFolderCacheUse = 0;
 
 GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
 {
@@ -43,6 +56,13 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
 	mUpdate = 0;
 	mPathVar = "cwd";
 	updateFileList = false;
+	mListing = false;
+	mListThreadStarted = false;
+	mListStat = false;
+	mListCancel = false;
+	mListDone = false;
+	mListError = 0;
+	pthread_mutex_init(&mListLock, NULL);
 
 	// Load filter for filtering files (e.g. *.zip for only zips)
 	child = FindNode(node, "filter");
@@ -123,6 +143,8 @@ GUIFileSelector::GUIFileSelector(xml_node<>* node) : GUIScrollList(node)
 
 GUIFileSelector::~GUIFileSelector()
 {
+	StopListing();
+	pthread_mutex_destroy(&mListLock);
 }
 
 int GUIFileSelector::Update(void)
@@ -142,6 +164,8 @@ int GUIFileSelector::Update(void)
 		} else
 			return 0;
 	}
+	if (mListing && FetchListing())
+		mUpdate = 1;
 
 	if (mUpdate) {
 		mUpdate = 0;
@@ -178,7 +202,7 @@ int GUIFileSelector::NotifyVarChange(const std::string& varName, const std::stri
 	return 0;
 }
 
-bool GUIFileSelector::fileSort(FileData d1, FileData d2)
+bool GUIFileSelector::fileSort(const FileData& d1, const FileData& d2)
 {
 	if (d1.fileName == ".")
 		return -1;
@@ -214,34 +238,132 @@ bool GUIFileSelector::fileSort(FileData d1, FileData d2)
 	return 0;
 }
 
-int GUIFileSelector::GetFileList(const std::string folder)
+// Sizes and dates are only needed to sort by them
+bool GUIFileSelector::NeedsStat()
 {
-	DIR* d;
-	struct dirent* de;
-	struct stat st;
+	return mSortOrder == 2 || mSortOrder == -2 || mSortOrder == 3 || mSortOrder == -3;
+}
 
-	// Clear all data
-	mFolderList.clear();
-	mFileList.clear();
+// Marks the cached folders changed since they were listed, called with
+// mFolderCacheLock held
+void GUIFileSelector::ReadFolderEvents()
+{
+	char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+
+	if (mInotifyFd < 0)
+		return;
+	while ((len = read(mInotifyFd, buf, sizeof(buf))) > 0) {
+		for (char* ptr = buf; ptr < buf + len; ptr += sizeof(struct inotify_event) + ((struct inotify_event*)ptr)->len) {
+			struct inotify_event* event = (struct inotify_event*)ptr;
+			for (std::map<std::string, CachedFolder>::iterator folder = mFolderCache.begin(); folder != mFolderCache.end(); folder++) {
+				if (event->mask & IN_Q_OVERFLOW || folder->second.watch == event->wd) {
+					folder->second.valid = false;
+					folder->second.changed = true;
+					folder->second.entries.clear();
+					if (event->mask & IN_IGNORED)
+						folder->second.watch = -1;
+				}
+			}
+		}
+	}
+}
 
-	d = opendir(folder.c_str());
-	if (d == NULL) {
-		LOGINFO("Unable to open '%s'\n", folder.c_str());
-		if (folder != "/" && (mShowNavFolders != 0 || mShowFiles != 0)) {
-			size_t found;
-			found = folder.find_last_of('/');
-			if (found != string::npos) {
-				string new_folder = folder.substr(0, found);
+bool GUIFileSelector::GetCachedFolder(const std::string& folder, bool stated, std::vector<FileData>& entries)
+{
+	bool found = false;
+
+	pthread_mutex_lock(&mFolderCacheLock);
+	ReadFolderEvents();
+	std::map<std::string, CachedFolder>::iterator cached = mFolderCache.find(folder);
+	if (cached != mFolderCache.end() && cached->second.valid && (cached->second.stated || !stated)) {
+		entries = cached->second.entries;
+		cached->second.lastUse = ++mFolderCacheUse;
+		found = true;
+	}
+	pthread_mutex_unlock(&mFolderCacheLock);
+	return found;
+}
 
-				if (new_folder.length() < 2)
-					new_folder = "/";
-				DataManager::SetValue(mPathVar, new_folder);
-			}
+// Watches folder before it is listed, so that changes made while listing
+// keep the listing out of the cache. Returns the watch or -1.
+int GUIFileSelector::WatchFolder(const std::string& folder)
+{
+	int watch = -1;
+
+	pthread_mutex_lock(&mFolderCacheLock);
+	if (mInotifyFd < 0)
+		mInotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (mInotifyFd >= 0) {
+		ReadFolderEvents();
+		watch = inotify_add_watch(mInotifyFd, folder.c_str(), IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR);
+		if (watch >= 0) {
+			CachedFolder& cached = mFolderCache[folder];
+			cached.entries.clear();
+			cached.watch = watch;
+			cached.valid = false;
+			cached.changed = false;
+			cached.stated = false;
+			cached.lastUse = ++mFolderCacheUse;
 		}
-		return -1;
 	}
+	pthread_mutex_unlock(&mFolderCacheLock);
+	return watch;
+}
+
+void GUIFileSelector::StoreCachedFolder(const std::string& folder, int watch, const std::vector<FileData>& entries, bool stated)
+{
+	pthread_mutex_lock(&mFolderCacheLock);
+	ReadFolderEvents();
+	std::map<std::string, CachedFolder>::iterator cached = mFolderCache.find(folder);
+	// Another listing of the folder may have started in the meantime,
+	// and the folder must not have changed since it was watched
+	if (cached != mFolderCache.end() && cached->second.watch == watch && !cached->second.changed) {
+		cached->second.entries = entries;
+		cached->second.valid = true;
+		cached->second.stated = stated;
+		cached->second.lastUse = ++mFolderCacheUse;
+	}
+	while (mFolderCache.size() > FOLDER_CACHE_SIZE) {
+		std::map<std::string, CachedFolder>::iterator oldest = mFolderCache.begin();
+		for (cached = mFolderCache.begin(); cached != mFolderCache.end(); cached++) {
+			if (cached->second.lastUse < oldest->second.lastUse)
+				oldest = cached;
+		}
+		int old_watch = oldest->second.watch;
+		mFolderCache.erase(oldest);
+		// Paths like /sdcard and /data/media/0 share a watch
+		for (cached = mFolderCache.begin(); cached != mFolderCache.end() && cached->second.watch != old_watch; cached++)
+			;
+		if (old_watch >= 0 && cached == mFolderCache.end())
+			inotify_rm_watch(mInotifyFd, old_watch);
+	}
+	pthread_mutex_unlock(&mFolderCacheLock);
+}
+
+// Lists mListFolder in the background. Entries are stat'ed only when the
+// sort order or a missing d_type needs it.
+void* GUIFileSelector::ListThread(void* cookie)
+{
+	GUIFileSelector* selector = (GUIFileSelector*) cookie;
+	std::string folder = selector->mListFolder;
+	bool stated = selector->mListStat;
+	std::vector<FileData> batch, entries;
+	struct dirent* de;
+	struct stat st;
+
+	int watch = WatchFolder(folder);
+	DIR* d = opendir(folder.c_str());
+	if (d == NULL) {
+		pthread_mutex_lock(&selector->mListLock);
+		selector->mListError = errno ? errno : ENOENT;
+		selector->mListDone = true;
+		pthread_mutex_unlock(&selector->mListLock);
+		return NULL;
+	}
+	int fd = dirfd(d);
 
-	while ((de = readdir(d)) != NULL) {
+	while (!selector->mListCancel && (de = readdir(d)) != NULL) {
 		FileData data;
 
 		data.fileName = de->d_name;
@@ -251,34 +373,153 @@ int GUIFileSelector::GetFileList(const std::string folder)
 			continue;
 
 		data.fileType = de->d_type;
+		data.protection = 0;
+		data.userId = 0;
+		data.groupId = 0;
+		data.fileSize = 0;
+		data.lastAccess = data.lastModified = data.lastStatChange = 0;
+		if ((stated || data.fileType == DT_UNKNOWN) && fstatat(fd, de->d_name, &st, 0) == 0) {
+			data.protection = st.st_mode;
+			data.userId = st.st_uid;
+			data.groupId = st.st_gid;
+			data.fileSize = st.st_size;
+			data.lastAccess = st.st_atime;
+			data.lastModified = st.st_mtime;
+			data.lastStatChange = st.st_ctime;
+			if (data.fileType == DT_UNKNOWN) {
+				if (S_ISDIR(st.st_mode))
+					data.fileType = DT_DIR;
+				else if (S_ISREG(st.st_mode))
+					data.fileType = DT_REG;
+				else if (S_ISBLK(st.st_mode))
+					data.fileType = DT_BLK;
+			}
+		}
+		batch.push_back(data);
+		if (batch.size() >= LIST_BATCH_SIZE) {
+			pthread_mutex_lock(&selector->mListLock);
+			selector->mListed.insert(selector->mListed.end(), batch.begin(), batch.end());
+			pthread_mutex_unlock(&selector->mListLock);
+			entries.insert(entries.end(), batch.begin(), batch.end());
+			batch.clear();
+		}
+	}
+	closedir(d);
+	entries.insert(entries.end(), batch.begin(), batch.end());
+	if (!selector->mListCancel && watch >= 0)
+		StoreCachedFolder(folder, watch, entries, stated);
+
+	pthread_mutex_lock(&selector->mListLock);
+	selector->mListed.insert(selector->mListed.end(), batch.begin(), batch.end());
+	selector->mListDone = true;
+	pthread_mutex_unlock(&selector->mListLock);
+	return NULL;
+}
+
+void GUIFileSelector::StopListing()
+{
+	if (mListThreadStarted) {
+		mListCancel = true;
+		pthread_join(mListThread, NULL);
+		mListThreadStarted = false;
+		mListCancel = false;
+	}
+	mListing = false;
+	mListed.clear();
+}
 
-		std::string path = folder + "/" + data.fileName;
-		stat(path.c_str(), &st);
-		data.protection = st.st_mode;
-		data.userId = st.st_uid;
-		data.groupId = st.st_gid;
-		data.fileSize = st.st_size;
-		data.lastAccess = st.st_atime;
-		data.lastModified = st.st_mtime;
-		data.lastStatChange = st.st_ctime;
-
-		if (data.fileType == DT_UNKNOWN) {
-			data.fileType = TWFunc::Get_D_Type_From_Stat(path);
+// Filters new entries and merges them into the sorted lists
+void GUIFileSelector::AddEntries(std::vector<FileData>& entries)
+{
+	size_t folders = mFolderList.size(), files = mFileList.size();
+
+	for (std::vector<FileData>::iterator data = entries.begin(); data != entries.end(); data++) {
+		if (data->fileType == DT_DIR) {
+			if (mShowNavFolders || (data->fileName != "." && data->fileName != ".."))
+				mFolderList.push_back(*data);
+		} else if (data->fileType == DT_REG || data->fileType == DT_LNK || data->fileType == DT_BLK) {
+			if (mExtn.empty() || (data->fileName.length() > mExtn.length() && data->fileName.substr(data->fileName.length() - mExtn.length()) == mExtn)) {
+				mFileList.push_back(*data);
+			}
 		}
-		if (data.fileType == DT_DIR) {
-			if (mShowNavFolders || (data.fileName != "." && data.fileName != ".."))
-				mFolderList.push_back(data);
-		} else if (data.fileType == DT_REG || data.fileType == DT_LNK || data.fileType == DT_BLK) {
-			if (mExtn.empty() || (data.fileName.length() > mExtn.length() && data.fileName.substr(data.fileName.length() - mExtn.length()) == mExtn)) {
-				mFileList.push_back(data);
+	}
+	std::sort(mFolderList.begin() + folders, mFolderList.end(), fileSort);
+	std::inplace_merge(mFolderList.begin(), mFolderList.begin() + folders, mFolderList.end(), fileSort);
+	std::sort(mFileList.begin() + files, mFileList.end(), fileSort);
+	std::inplace_merge(mFileList.begin(), mFileList.begin() + files, mFileList.end(), fileSort);
+}
+
+// Moves the entries listed so far to the lists, returns true if the
+// lists changed or the listing ended
+bool GUIFileSelector::FetchListing()
+{
+	std::vector<FileData> entries;
+	bool done;
+	int error;
+
+	pthread_mutex_lock(&mListLock);
+	entries.swap(mListed);
+	done = mListDone;
+	error = mListError;
+	pthread_mutex_unlock(&mListLock);
+
+	if (!entries.empty())
+		AddEntries(entries);
+	if (!done)
+		return !entries.empty();
+
+	if (mListThreadStarted) {
+		pthread_join(mListThread, NULL);
+		mListThreadStarted = false;
+	}
+	mListing = false;
+	if (error) {
+		LOGINFO("Unable to open '%s'\n", mListFolder.c_str());
+		if (mListFolder != "/" && (mShowNavFolders != 0 || mShowFiles != 0)) {
+			size_t found;
+			found = mListFolder.find_last_of('/');
+			if (found != string::npos) {
+				string new_folder = mListFolder.substr(0, found);
+
+				if (new_folder.length() < 2)
+					new_folder = "/";
+				DataManager::SetValue(mPathVar, new_folder);
 			}
 		}
 	}
-	closedir(d);
+	return true;
+}
+
+// Shows a cached listing of folder right away, or starts listing it in the
+// background
+int GUIFileSelector::GetFileList(const std::string folder)
+{
+	std::vector<FileData> entries;
 
-	std::sort(mFolderList.begin(), mFolderList.end(), fileSort);
-	std::sort(mFileList.begin(), mFileList.end(), fileSort);
+	StopListing();
 
+	// Clear all data
+	mFolderList.clear();
+	mFileList.clear();
+
+	if (GetCachedFolder(folder, NeedsStat(), entries)) {
+		AddEntries(entries);
+		return 0;
+	}
+
+	mListFolder = folder;
+	mListStat = NeedsStat();
+	mListDone = false;
+	mListError = 0;
+	mListed.clear();
+	mListing = true;
+	if (pthread_create(&mListThread, NULL, ListThread, this) == 0) {
+		mListThreadStarted = true;
+	} else {
+		LOGINFO("Unable to create listing thread, listing '%s' in place\n", folder.c_str());
+		ListThread(this);
+		FetchListing();
+	}
 	return 0;
 }
 
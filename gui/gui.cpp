@@ -53,6 +53,7 @@ extern "C"
 #include "../orscmd/orscmd.h"
 #include "blanktimer.hpp"
 #include "../tw_atomic.hpp"
+#include "../twrpMountTable.hpp"
 
 // Enable to print render time of each frame to the log file
 //#define PRINT_RENDER_TIME 1
@@ -739,6 +740,14 @@ std::string gui_lookup(const std::string& resource_name, const std::string& defa
 	return PageManager::GetResources()->FindString(resource_name, default_value);
 }
 
+// Conditions with var1="mounted" are evaluated again when a variable of
+// that name changes
+static void gui_mount_changed(const twrpMountTable::Mount_Entry& Entry __unused, bool Mounted __unused, void* Cookie __unused)
+{
+	if (gGuiRunning.get_value())
+		PageManager::NotifyVarChange("mounted", "");
+}
+
 extern "C" int gui_init(void)
 {
 	gr_init();
@@ -762,6 +771,7 @@ extern "C" int gui_init(void)
 		LOGERR("Failed to init mutex\n");
 		return -1;
 	}
+	twrpMountTable::Add_Listener(gui_mount_changed, NULL);
 	return 0;
 }
 
@@ -13,6 +13,7 @@ extern "C" {
 #include "rapidxml.hpp"
 #include "objects.hpp"
 #include "../data.hpp"
+#include "../twrpMountTable.hpp"
 
 GUIObject::GUIObject(xml_node<>* node)
 {
@@ -183,24 +184,5 @@ bool GUIObject::UpdateConditions(std::vector<Condition>& conditions, const std::
 
 bool GUIObject::isMounted(string vol)
 {
-	FILE *fp;
-	char tmpOutput[255];
-
-	fp = fopen("/proc/mounts", "rt");
-	while (fgets(tmpOutput,255,fp) != NULL)
-	{
-		char* mnt = tmpOutput;
-		while (*mnt > 32)			mnt++;
-		while (*mnt > 0 && *mnt <= 32)	mnt++;
-		char* pos = mnt;
-		while (*pos > 32)   pos++;
-		*pos = 0;
-		if (vol == mnt)
-		{
-			fclose(fp);
-			return true;
-		}
-	}
-	fclose(fp);
-	return false;
+	return twrpMountTable::Is_Mounted(vol);
 }
@@ -27,6 +27,7 @@
 #include <map>
 #include <set>
 #include <time.h>
+#include <pthread.h>
 
 using namespace rapidxml;
 
@@ -328,6 +329,7 @@ protected:
 	int refreshsizes(std::string arg);
 	int nandroid(std::string arg);
 	int fixcontexts(std::string arg);
+	int dedupgc(std::string arg);
 	int fixpermissions(std::string arg);
 	int dd(std::string arg);
 	int partitionsd(std::string arg);
@@ -475,6 +477,9 @@ protected:
 	// render a standard-layout list item with optional icon and text
 	void RenderStdItem(int yPos, bool selected, ImageResource* icon, const char* text, int iconAndTextH = 0);
 
+	// render the fast scroll bar to the right of the listW wide items
+	void RenderFastScroll(int listW);
+
 	enum { NO_ITEM = (size_t)-1 };
 	// returns item index at coordinates or NO_ITEM if there is no item there
 	size_t HitTestItem(int x, int y);
@@ -547,6 +552,7 @@ protected:
 	int fastScroll; // indicates that the inital touch was inside the fastscroll region - makes for easier fast scrolling as the touches don't have to stay within the fast scroll region and you drag your finger
 	int mUpdate; // indicates that a change took place and we need to re-render
 	bool AddLines(std::vector<std::string>* origText, std::vector<std::string>* origColor, size_t* lastCount, std::vector<std::string>* rText, std::vector<std::string>* rColor);
+	size_t WrapLine(const std::string& line, std::vector<std::string>* rText); // appends the word wrapped pieces of line to rText, returns how many
 };
 
 class GUIFileSelector : public GUIScrollList
@@ -582,10 +588,28 @@ protected:
 		time_t lastModified;		// Uses time_t format from stat
 		time_t lastStatChange;	  // Uses time_t format from stat
 	};
+	// Listing of a folder kept until inotify reports a change in it
+	struct CachedFolder {
+		std::vector<FileData> entries;
+		int watch;			  // inotify watch descriptor
+		bool valid;			 // entries are complete and unchanged
+		bool changed;		   // changed since the watch was added
+		bool stated;			// entries have their stat fields filled
+		unsigned long lastUse;
+	};
 
 protected:
 	virtual int GetFileList(const std::string folder);
-	static bool fileSort(FileData d1, FileData d2);
+	static bool fileSort(const FileData& d1, const FileData& d2);
+	static bool NeedsStat();
+	void AddEntries(std::vector<FileData>& entries);
+	bool FetchListing();
+	void StopListing();
+	static void* ListThread(void* cookie);
+	static bool GetCachedFolder(const std::string& folder, bool stated, std::vector<FileData>& entries);
+	static int WatchFolder(const std::string& folder);
+	static void StoreCachedFolder(const std::string& folder, int watch, const std::vector<FileData>& entries, bool stated);
+	static void ReadFolderEvents();
 
 protected:
 	std::vector<FileData> mFolderList;
@@ -602,6 +626,24 @@ protected:
 	ImageResource* mFolderIcon;
 	ImageResource* mFileIcon;
 	bool updateFileList;
+
+	// Folders are listed on mListThread, which hands the entries over in
+	// batches through mListed so that the list is drawn while it grows
+	pthread_t mListThread;
+	pthread_mutex_t mListLock;
+	bool mListing; // the listing has entries left to fetch
+	bool mListThreadStarted; // mListThread has to be joined
+	std::string mListFolder;
+	bool mListStat; // mListThread stats every entry for the sort order
+	volatile bool mListCancel;
+	std::vector<FileData> mListed;
+	bool mListDone;
+	int mListError;
+
+	static std::map<std::string, CachedFolder> mFolderCache;
+	static pthread_mutex_t mFolderCacheLock;
+	static int mInotifyFd;
+	static unsigned long mFolderCacheUse;
 };
 
 class GUIListBox : public GUIScrollList
@@ -736,7 +778,8 @@ public:
 	virtual size_t GetItemCount();
 	virtual void RenderItem(size_t itemindex, int yPos, bool selected);
 	virtual void NotifySelect(size_t item_selected);
-	static void Translate_Now();
+	static void Translate_Now(bool wait = true); // without wait, does nothing if the log is busy
+	static void Clear_Log(); // drops all printed lines, the kept messages are translated again
 protected:
 	enum SlideoutState
 	{
@@ -747,17 +790,20 @@ protected:
 	};
 
 	ImageResource* mSlideoutImage;
-	size_t mLastCount; // lines from gConsole that are already split and copied into rConsole
+	size_t mLastCount; // number of the next log line to split and copy into rConsole
 	bool scrollToEnd; // true if we want to keep tracking the last line
 	int mSlideoutX, mSlideoutY, mSlideoutW, mSlideoutH;
 	int mSlideout;
 	SlideoutState mSlideoutState;
 	std::vector<std::string> rConsole;
-	std::vector<std::string> rConsoleColor;
+	std::vector<unsigned char> rConsoleColor; // index of the log color of each line in rConsole
+	std::vector<COLOR> mColors; // log colors converted so far, by index
 
 protected:
 	int RenderSlideout(void);
 	int RenderConsole(void);
+	bool AddLogLines(void);
+	const COLOR& GetColor(unsigned char index);
 };
 
 class TerminalEngine;
@@ -767,6 +813,10 @@ public:
 	GUITerminal(xml_node<>* node);
 
 public:
+	// Render - Render the full object to the GL surface
+	//  Return 0 on success, <0 on error
+	virtual int Render(void);
+
 	// Update - Update any UI component animations (called <= 30 FPS)
 	//  Return 0 if nothing to update, 1 on success and contiue, >1 if full render required, and <0 on error
 	virtual int Update(void);
@@ -791,10 +841,16 @@ public:
 	virtual void NotifySelect(size_t item_selected);
 protected:
 	void InitAndResize();
+	int RenderChangedRows();
 
 	TerminalEngine* engine; // non-visual parts of the terminal (text buffer etc.), not owned
 	int updateCounter; // to track if anything changed in the back-end
 	bool lastCondition; // to track if the condition became true and we might need to resize the terminal engine
+	int renderedCounter; // engine update counter when the rows on screen were drawn
+	int renderedCursorX, renderedCursorY; // cursor position on screen
+	size_t renderedLines; // line count on screen, for the scroll bar
+	unsigned long droppedLines; // lines the engine had dropped from its scrollback buffer
+	std::string cursorText; // reused when drawing the cursor
 };
 
 // GUIAnimation - Used for animations
@@ -49,6 +49,7 @@ extern "C" {
 #include "rapidxml.hpp"
 #include "objects.hpp"
 #include "blanktimer.hpp"
+#include "themecache.hpp"
 #include "../tw_atomic.hpp"
 
 #define TW_THEME_VERSION 1
@@ -56,11 +57,6 @@ extern "C" {
 
 extern TWAtomicInt gGuiRunning;
 
-// From console.cpp
-extern size_t last_message_count;
-extern std::vector<std::string> gConsole;
-extern std::vector<std::string> gConsoleColor;
-
 std::map<std::string, PageSet*> PageManager::mPageSets;
 PageSet* PageManager::mCurrentSet;
 MouseCursor *PageManager::mMouseCursor = NULL;
@@ -722,15 +718,14 @@ int PageSet::Load(LoadingContext& ctx, const std::string& filename)
 		// ignore already loaded files to prevent crash with cyclic includes
 		return 0;
 
-	// load XML into buffer
-	char* xmlbuffer = PageManager::LoadFileToBuffer(filename, ctx.zip);
-	if (!xmlbuffer)
+	// load and parse XML, or its compiled copy
+	xml_document<>* doc = new xml_document<>();
+	char* xmlbuffer = ThemeCache::Load(filename, ctx.zip, doc);
+	if (!xmlbuffer) {
+		delete doc;
 		return -1; // error already displayed by LoadFileToBuffer
+	}
 	ctx.xmlbuffers.push_back(xmlbuffer);
-
-	// parse XML
-	xml_document<>* doc = new xml_document<>();
-	doc->parse<0>(xmlbuffer);
 	ctx.xmldocs.push_back(doc);
 
 	xml_node<>* root = doc->first_node("recovery");
@@ -1531,9 +1526,7 @@ int PageManager::RunReload() {
 	}
 
 	// This makes the console re-translate
-	last_message_count = 0;
-	gConsole.clear();
-	gConsoleColor.clear();
+	GUIConsole::Clear_Log();
 
 	return ret_val;
 }
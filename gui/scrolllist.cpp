@@ -277,40 +277,44 @@ int GUIScrollList::Render(void)
 	gr_noclip();
 
 	// render fast scroll
-	if (hasScroll) {
-		int fWidth = mRenderW - listW;
-		int fHeight = mRenderH - mHeaderH;
-		int centerX = listW + mRenderX + fWidth / 2;
-
-		// first determine the total list height and where we are in the list
-		int totalHeight = GetItemCount() * actualItemHeight; // total height of the full list in pixels
-		int topPos = firstDisplayedItem * actualItemHeight - y_offset;
-
-		// now scale it proportionally to the scrollbar height
-		int boxH = fHeight * fHeight / totalHeight; // proportional height of the displayed portion
-		boxH = std::max(boxH, mFastScrollRectH); // but keep a minimum height
-		int boxY = (fHeight - boxH) * topPos / (totalHeight - fHeight); // pixels relative to top of list
-		int boxW = mFastScrollRectW;
-
-		int x = centerX - boxW / 2;
-		int y = mRenderY + mHeaderH + boxY;
-
-		// line above and below box (needs to be split because box can be transparent)
-		gr_color(mFastScrollLineColor.red, mFastScrollLineColor.green, mFastScrollLineColor.blue, mFastScrollLineColor.alpha);
-		gr_fill(centerX - mFastScrollLineW / 2, mRenderY + mHeaderH, mFastScrollLineW, boxY);
-		gr_fill(centerX - mFastScrollLineW / 2, y + boxH, mFastScrollLineW, fHeight - boxY - boxH);
-
-		// box
-		gr_color(mFastScrollRectColor.red, mFastScrollRectColor.green, mFastScrollRectColor.blue, mFastScrollRectColor.alpha);
-		gr_fill(x, y, boxW, boxH);
-
-		mFastScrollRectCurrentY = boxY;
-		mFastScrollRectCurrentH = boxH;
-	}
+	if (hasScroll)
+		RenderFastScroll(listW);
 	mUpdate = 0;
 	return 0;
 }
 
+void GUIScrollList::RenderFastScroll(int listW)
+{
+	int fWidth = mRenderW - listW;
+	int fHeight = mRenderH - mHeaderH;
+	int centerX = listW + mRenderX + fWidth / 2;
+
+	// first determine the total list height and where we are in the list
+	int totalHeight = GetItemCount() * actualItemHeight; // total height of the full list in pixels
+	int topPos = firstDisplayedItem * actualItemHeight - y_offset;
+
+	// now scale it proportionally to the scrollbar height
+	int boxH = fHeight * fHeight / totalHeight; // proportional height of the displayed portion
+	boxH = std::max(boxH, mFastScrollRectH); // but keep a minimum height
+	int boxY = (fHeight - boxH) * topPos / (totalHeight - fHeight); // pixels relative to top of list
+	int boxW = mFastScrollRectW;
+
+	int x = centerX - boxW / 2;
+	int y = mRenderY + mHeaderH + boxY;
+
+	// line above and below box (needs to be split because box can be transparent)
+	gr_color(mFastScrollLineColor.red, mFastScrollLineColor.green, mFastScrollLineColor.blue, mFastScrollLineColor.alpha);
+	gr_fill(centerX - mFastScrollLineW / 2, mRenderY + mHeaderH, mFastScrollLineW, boxY);
+	gr_fill(centerX - mFastScrollLineW / 2, y + boxH, mFastScrollLineW, fHeight - boxY - boxH);
+
+	// box
+	gr_color(mFastScrollRectColor.red, mFastScrollRectColor.green, mFastScrollRectColor.blue, mFastScrollRectColor.alpha);
+	gr_fill(x, y, boxW, boxH);
+
+	mFastScrollRectCurrentY = boxY;
+	mFastScrollRectCurrentH = boxH;
+}
+
 void GUIScrollList::RenderItem(size_t itemindex __unused, int yPos, bool selected)
 {
 	RenderStdItem(yPos, selected, NULL, "implement RenderItem!");
@@ -620,33 +624,40 @@ bool GUIScrollList::AddLines(std::vector<std::string>* origText, std::vector<std
 	// Note, that multiple consoles on different GUI pages may be different widths or use different fonts, so the word wrapping
 	// may different in different console windows
 	for (size_t i = prevCount; i < *lastCount; i++) {
-		string curr_line = origText->at(i);
-		string curr_color;
+		size_t lines = WrapLine(origText->at(i), rText);
 		if (origColor)
-			curr_color = origColor->at(i);
-		for(;;) {
-			size_t line_char_width = gr_ttf_maxExW(curr_line.c_str(), mFont->GetResource(), mRenderW);
-			if (line_char_width < curr_line.size()) {
-				//string left = curr_line.substr(0, line_char_width);
-				size_t wrap_pos = curr_line.find_last_of(" ,./:-_;", line_char_width - 1);
-				if (wrap_pos == string::npos)
-					wrap_pos = line_char_width;
-				else if (wrap_pos < line_char_width - 1)
-					wrap_pos++;
-				rText->push_back(curr_line.substr(0, wrap_pos));
-				if (origColor)
-					rColor->push_back(curr_color);
-				curr_line = curr_line.substr(wrap_pos);
-				/* After word wrapping, delete any leading spaces. Note that the word wrapping is not smart enough to know not
-				 * to wrap in the middle of something like ... so some of the ... could appear on the following line. */
-				curr_line.erase(0, curr_line.find_first_not_of(" "));
-			} else {
-				rText->push_back(curr_line);
-				if (origColor)
-					rColor->push_back(curr_color);
-				break;
-			}
-		}
+			rColor->insert(rColor->end(), lines, origColor->at(i));
 	}
 	return true;
 }
+
+size_t GUIScrollList::WrapLine(const std::string& line, std::vector<std::string>* rText)
+{
+	size_t start = 0;
+	size_t count = 0;
+
+	for (;;) {
+		size_t line_char_width = gr_ttf_maxExW(line.c_str() + start, mFont->GetResource(), mRenderW);
+		if (line_char_width < line.size() - start) {
+			if (line_char_width == 0)
+				line_char_width = 1; // always make progress, even if not a single character fits
+			size_t wrap_pos = line.find_last_of(" ,./:-_;", start + line_char_width - 1);
+			if (wrap_pos == string::npos || wrap_pos < start)
+				wrap_pos = line_char_width;
+			else if ((wrap_pos -= start) < line_char_width - 1)
+				wrap_pos++;
+			if (wrap_pos == 0)
+				wrap_pos = line_char_width;
+			rText->push_back(line.substr(start, wrap_pos));
+			count++;
+			/* After word wrapping, skip any leading spaces. Note that the word wrapping is not smart enough to know not
+			 * to wrap in the middle of something like ... so some of the ... could appear on the following line. */
+			start = line.find_first_not_of(" ", start + wrap_pos);
+			if (start == string::npos)
+				start = line.size();
+		} else {
+			rText->push_back(line.substr(start));
+			return count + 1;
+		}
+	}
+}
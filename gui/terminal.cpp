@@ -24,7 +24,9 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <termio.h>
+#include <poll.h>
 
+#include <algorithm>
 #include <string>
 #include <cctype>
 #include <linux/input.h>
@@ -46,6 +48,9 @@ extern "C" {
 
 extern int g_pty_fd; // in gui.cpp where the select is
 
+#define TERMINAL_MAX_LINES 2000     // lines kept in the scrollback buffer
+#define TERMINAL_READ_LIMIT 65536   // bytes read from the pty per frame
+
 /*
 Pseudoterminal handler.
 */
@@ -133,6 +138,18 @@ public:
 		return rc;
 	}
 
+	// Returns true if read() would not block
+	bool readable()
+	{
+		if (!started())
+			return false;
+		struct pollfd pfd;
+		pfd.fd = fdMaster;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+	}
+
 	int write(const char* buffer, size_t size)
 	{
 		if (!started()) {
@@ -281,7 +298,9 @@ public:
 	{
 		std::string text; // in UTF-8 format
 //		std::vector<AttributeRange> attrs;
-		Line() {}
+		int changed; // update counter of the last change, tells the GUI which rows to draw again
+		Line() : changed(0) {}
+		bool changedSince(int counter) const { return (int)((unsigned)changed - (unsigned)counter) > 0; }
 		size_t utf8forward(size_t start) const
 		{
 			if (start >= text.size())
@@ -296,22 +315,13 @@ public:
 			return i;
 		}
 
-		std::string substr(size_t start, size_t n) const
+		// byte offset of character n, or the text size if the line is shorter
+		size_t offset(size_t n) const
 		{
 			size_t i = 0;
-			for (; start && i < text.size(); i = utf8forward(i))
-				--start;
-			size_t s = i;
 			for (; n && i < text.size(); i = utf8forward(i))
 				--n;
-			return text.substr(s, i - s);
-		}
-		size_t length() const
-		{
-			size_t n = 0;
-			for (size_t i = 0; i < text.size(); i = utf8forward(i))
-				++n;
-			return n;
+			return i;
 		}
 	};
 
@@ -337,7 +347,7 @@ public:
 		void eraseTo(size_t x)
 		{
 			if (x > 0)
-				cells.erase(cells.begin(), cells.begin() + x);
+				cells.erase(cells.begin(), cells.begin() + min(x, cells.size()));
 		}
 	};
 
@@ -347,6 +357,9 @@ public:
 		width = 40;
 		height = 10;
 
+		firstLine = lineCount = 0;
+		droppedLines = 0;
+		unpackedY = kNoLine;
 		clear();
 		updateCounter = 0;
 		state = kStateGround;
@@ -371,22 +384,34 @@ public:
 		}
 	}
 
+	// Called once per frame. Takes everything the shell wrote since the last
+	// frame, up to a limit so that a flood of output cannot stall the GUI, so
+	// that the terminal is drawn once for all of it.
 	void readPty()
 	{
-		char buffer[1024];
-		int rc = pty.read(buffer, sizeof(buffer));
-		debug_printf("readPty: %d bytes\n", rc);
-		if (rc < 0)
-			output("\r\nChild process exited.\r\n");	// TODO: maybe exit terminal here
-		else
+		char buffer[4096];
+		size_t total = 0;
+		do {
+			int rc = pty.read(buffer, sizeof(buffer));
+			debug_printf("readPty: %d bytes\n", rc);
+			if (rc < 0) {
+				output("\r\nChild process exited.\r\n");	// TODO: maybe exit terminal here
+				return;
+			}
+			if (rc == 0)
+				return;
 			for (int i = 0; i < rc; ++i)
 				output(buffer[i]);
+			total += rc;
+		} while (total < TERMINAL_READ_LIMIT && pty.readable());
 	}
 
 	void clear()
 	{
 		cursorX = cursorY = 0;
-		lines.clear();
+		// the slots of the ring are kept for their buffers
+		firstLine = lineCount = 0;
+		unpackedY = kNoLine;
 		setY(0);
 		unpackLine(0);
 		++updateCounter;
@@ -455,11 +480,12 @@ public:
 		return true;
 	}
 
-	size_t getLinesCount() const { return lines.size(); }
-	const Line& getLine(size_t n) { if (unpackedY == n) packLine(); return lines[n]; }
+	size_t getLinesCount() const { return lineCount; }
+	const Line& getLine(size_t n) { if (unpackedY == n) packLine(); return line(n); }
 	int getCursorX() const { return cursorX; }
 	int getCursorY() const { return cursorY; }
 	int getUpdateCounter() const { return updateCounter; }
+	unsigned long getDroppedLines() const { return droppedLines; } // lines that went off the top of the scrollback buffer so far
 
 	void setX(int x)
 	{
@@ -472,9 +498,17 @@ public:
 	{
 		//y = min(height, max(y, 0));
 		y = max(y, 0);
+		// going further down than that just leaves a buffer of empty lines
+		y = min(y, (int)lineCount + TERMINAL_MAX_LINES);
+		while (lineCount <= (size_t) y) {
+			if (lineCount == TERMINAL_MAX_LINES) {
+				// the oldest line scrolls out, the rest move up
+				dropLines(1);
+				--y;
+			}
+			appendLine();
+		}
 		cursorY = y;
-		while (lines.size() <= (size_t) y)
-			lines.push_back(Line());
 		++updateCounter;
 	}
 
@@ -484,9 +518,49 @@ public:
 	void right(int n = 1) { setX(cursorX + n); }
 
 private:
+	enum { kNoLine = (size_t)-1 };
+
+	Line& line(size_t n) { return lines[(firstLine + n) % lines.size()]; }
+
+	// the line being edited changed
+	void lineChanged() { line(unpackedY).changed = ++updateCounter; }
+
+	void appendLine()
+	{
+		if (lineCount < lines.size()) {
+			// reuse the slot of a dropped or erased line
+			line(lineCount).text.clear();
+		} else {
+			if (firstLine != 0) {
+				// only after erasing from the top, before the ring was full
+				std::rotate(lines.begin(), lines.begin() + firstLine, lines.end());
+				firstLine = 0;
+			}
+			lines.push_back(Line());
+		}
+		++lineCount;
+		line(lineCount - 1).changed = ++updateCounter;
+	}
+
+	// Removes the n oldest lines, the line numbers of the others go down by n
+	void dropLines(size_t n)
+	{
+		n = min(n, lineCount);
+		if (n == 0)
+			return;
+		if (unpackedY != kNoLine)
+			unpackedY = unpackedY >= n ? unpackedY - n : kNoLine;
+		firstLine = (firstLine + n) % lines.size();
+		lineCount -= n;
+		droppedLines += n;
+		++updateCounter;
+	}
+
 	void packLine()
 	{
-		std::string& s = lines[unpackedY].text;
+		if (unpackedY == kNoLine)
+			return;
+		std::string& s = line(unpackedY).text;
 		s.clear();
 		for (size_t i = 0; i < unpackedLine.cells.size(); ++i) {
 			Cell& c = unpackedLine.cells[i];
@@ -498,7 +572,7 @@ private:
 	void unpackLine(size_t y)
 	{
 		uint32_t u8state = 0, u8cp = 0;
-		std::string& s = lines[y].text;
+		std::string& s = line(y).text;
 		unpackedLine.cells.clear();
 		for(size_t i = 0; i < s.size(); ++i) {
 			uint32_t rc = utf8decode(&u8state, &u8cp, (unsigned char)s[i]);
@@ -586,6 +660,7 @@ private:
 		if (unpackedLine.cells.size() <= (size_t)cursorX)
 			unpackedLine.cells.resize(cursorX+1);
 		unpackedLine.cells[cursorX].cp = cp;
+		lineChanged();
 
 		right();
 		if (cursorX >= width)
@@ -699,13 +774,17 @@ private:
 						default:
 						case 0:
 							unpackedLine.eraseFrom(cursorX);
-							if (lines.size() > (size_t)cursorY+1)
-								lines.erase(lines.begin() + cursorY+1, lines.end());
+							lineChanged();
+							if (lineCount > (size_t)cursorY+1) {
+								lineCount = cursorY+1;
+								++updateCounter;
+							}
 							break;
 						case 1:
 							unpackedLine.eraseTo(cursorX);
+							lineChanged();
 							if (cursorY > 0) {
-								lines.erase(lines.begin(), lines.begin() + cursorY-1);
+								dropLines(cursorY-1);
 								cursorY = 0;
 							}
 							break;
@@ -732,6 +811,7 @@ private:
 							unpackedLine.cells.clear();
 							break;
 					}
+					lineChanged();
 				}
 				break;
 			// case 'L': // IL - insert line
@@ -745,9 +825,14 @@ private:
 private:
 	int cursorX, cursorY; // 0-based, char based. TODO: decide how to handle scrollback
 	int width, height; // window size in chars
-	std::vector<Line> lines; // the text buffer
+	// The text buffer, a ring of up to TERMINAL_MAX_LINES lines: line n is in
+	// lines[(firstLine + n) % lines.size()]
+	std::vector<Line> lines;
+	size_t firstLine;
+	size_t lineCount;
+	unsigned long droppedLines;
 	UnpackedLine unpackedLine; // current line for editing
-	size_t unpackedY; // number of current line
+	size_t unpackedY; // number of current line, or kNoLine
 	int updateCounter; // changes whenever terminal could require redraw
 
 	Pseudoterminal pty;
@@ -781,6 +866,10 @@ GUITerminal::GUITerminal(xml_node<>* node) : GUIScrollList(node)
 
 	engine = &gEngine;
 	updateCounter = 0;
+	renderedCounter = 0;
+	renderedCursorX = renderedCursorY = -1;
+	renderedLines = 0;
+	droppedLines = engine->getDroppedLines();
 }
 
 int GUITerminal::Update(void)
@@ -794,22 +883,112 @@ int GUITerminal::Update(void)
 		lastCondition = true;
 		// we're becoming visible, so we might need to resize the terminal content
 		InitAndResize();
+		mUpdate = 1;
+	}
+
+	if (droppedLines != engine->getDroppedLines()) {
+		// lines went off the top of the buffer, keep showing the same text
+		int dropped = (int)min(engine->getDroppedLines() - droppedLines, (unsigned long)TERMINAL_MAX_LINES);
+		droppedLines = engine->getDroppedLines();
+		firstDisplayedItem -= dropped;
+		if (firstDisplayedItem < 0) {
+			firstDisplayedItem = 0;
+			y_offset = 0;
+		}
+		mUpdate = 1;
 	}
 
 	if (updateCounter != engine->getUpdateCounter()) {
-		// try to keep the cursor in view
+		// try to keep the cursor in view, which only needs a full render if
+		// the list had to scroll
+		int oldFirst = firstDisplayedItem, oldOffset = y_offset, oldUpdate = mUpdate;
 		SetVisibleListLocation(engine->getCursorY());
+		if (firstDisplayedItem == oldFirst && y_offset == oldOffset)
+			mUpdate = oldUpdate;
 		updateCounter = engine->getUpdateCounter();
 	}
+	if (engine->getLinesCount() != renderedLines)
+		mUpdate = 1; // the scroll bar changes
 
 	GUIScrollList::Update();
 
 	if (mUpdate) {
+		// Render() is called along with the rest of the page
 		mUpdate = 0;
-		if (Render() == 0)
-			return 2;
+		return 2;
 	}
-	return 0;
+	return RenderChangedRows();
+}
+
+int GUITerminal::Render(void)
+{
+	if(!isConditionTrue())
+		return 0;
+
+	int ret = GUIScrollList::Render();
+	renderedCounter = engine->getUpdateCounter();
+	renderedCursorX = engine->getCursorX();
+	renderedCursorY = engine->getCursorY();
+	renderedLines = engine->getLinesCount();
+	return ret;
+}
+
+// Draws the rows whose lines changed since the last render, and the rows
+// the cursor left and entered, over the last frame instead of drawing the
+// whole page again. Returns like Update, 2 if the page has to be rendered.
+int GUITerminal::RenderChangedRows()
+{
+	if (renderedCounter == engine->getUpdateCounter())
+		return 0;
+	// a background image or a translucent background cannot be drawn again
+	// for a single row
+	if ((mBackground && mBackground->GetResource()) || mBackgroundColor.alpha != 255)
+		return 2;
+	// rows are drawn over the last frame, which back ends that flip between
+	// buffers do not give back
+	if (!gr_flip_keeps_frame())
+		return 2;
+
+	int cursorX = engine->getCursorX();
+	int cursorY = engine->getCursorY();
+	bool cursorMoved = cursorX != renderedCursorX || cursorY != renderedCursorY;
+	size_t listSize = GetItemCount();
+	size_t rows = GetDisplayItemCount() + (hasScroll ? 2 : 0);
+	int listW = hasScroll ? mRenderW - mFastScrollW : mRenderW;
+	int listTop = mRenderY + mHeaderH;
+	int listBottom = mRenderY + mRenderH;
+	int yPos = listTop + y_offset;
+	int drawn = 0;
+
+	for (size_t row = 0; row < rows; row++, yPos += actualItemHeight) {
+		size_t itemindex = row + firstDisplayedItem;
+		if (itemindex >= listSize)
+			break;
+		bool cursorRow = itemindex == (size_t)cursorY || itemindex == (size_t)renderedCursorY;
+		if (!(cursorMoved && cursorRow) && !engine->getLine(itemindex).changedSince(renderedCounter))
+			continue;
+
+		// the same steps as in GUIScrollList::Render, for this row only
+		int top = max(yPos, listTop);
+		int bottom = min(yPos + actualItemHeight, listBottom);
+		if (top >= bottom)
+			continue;
+		gr_clip(mRenderX, top, mRenderW, bottom - top);
+		gr_color(mBackgroundColor.red, mBackgroundColor.green, mBackgroundColor.blue, mBackgroundColor.alpha);
+		gr_fill(mRenderX, top, mRenderW, bottom - top);
+		RenderItem(itemindex, yPos, itemindex == selectedItem);
+		gr_color(mSeparatorColor.red, mSeparatorColor.green, mSeparatorColor.blue, mSeparatorColor.alpha);
+		gr_fill(mRenderX, yPos + actualItemHeight - mSeparatorH, listW, mSeparatorH);
+		if (hasScroll)
+			RenderFastScroll(listW);
+		drawn++;
+	}
+	gr_noclip();
+
+	renderedCounter = engine->getUpdateCounter();
+	renderedCursorX = cursorX;
+	renderedCursorY = cursorY;
+	return drawn ? 1 : 0;
 }
 
 // NotifyTouch - Notify of a touch event
@@ -834,16 +1013,14 @@ int GUITerminal::NotifyKey(int key, bool down)
 	if (!HasInputFocus)
 		return 1;
 	if (down)
-		if (engine->inputKey(key))
-			mUpdate = 1;
+		engine->inputKey(key); // the echo from the shell updates the screen
 	return 0;
 }
 
 // character input
 int GUITerminal::NotifyCharInput(int ch)
 {
-	if (engine->inputChar(ch))
-		mUpdate = 1;
+	engine->inputChar(ch);
 	return 0;
 }
 
@@ -865,16 +1042,19 @@ void GUITerminal::RenderItem(size_t itemindex, int yPos, bool selected)
 
 	if (itemindex == (size_t) engine->getCursorY()) {
 		// render cursor
-		int cursorX = engine->getCursorX();
-		std::string leftOfCursor = line.substr(0, cursorX);
-		int x = gr_ttf_measureEx(leftOfCursor.c_str(), mFont->GetResource());
+		size_t start = line.offset(engine->getCursorX());
+		cursorText.assign(line.text, 0, start);
+		int x = gr_ttf_measureEx(cursorText.c_str(), mFont->GetResource());
 		// note that this single character can be a UTF-8 sequence
-		std::string atCursor = (size_t)cursorX < line.length() ? line.substr(cursorX, 1) : " ";
-		int w = gr_ttf_measureEx(atCursor.c_str(), mFont->GetResource());
+		if (start < line.text.size())
+			cursorText.assign(line.text, start, line.utf8forward(start) - start);
+		else
+			cursorText = " ";
+		int w = gr_ttf_measureEx(cursorText.c_str(), mFont->GetResource());
 		gr_color(mFontColor.red, mFontColor.green, mFontColor.blue, mFontColor.alpha);
 		gr_fill(mRenderX + x, yPos, w, actualItemHeight);
 		gr_color(mBackgroundColor.red, mBackgroundColor.green, mBackgroundColor.blue, mBackgroundColor.alpha);
-		gr_textEx_scaleW(mRenderX + x, yPos, atCursor.c_str(), mFont->GetResource(), mRenderW, TOP_LEFT, 0);
+		gr_textEx_scaleW(mRenderX + x, yPos, cursorText.c_str(), mFont->GetResource(), mRenderW, TOP_LEFT, 0);
 	}
 }
 
@@ -0,0 +1,313 @@
+/*
+	Copyright 2016 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// themecache.cpp - Compiled copies of parsed theme XML files
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
+
+extern "C" {
+#include "../twcommon.h"
+#include "../minzip/Zip.h"
+}
+
+#include "../data.hpp"
+#include "../partitions.hpp"
+#include "../set_metadata.h"
+#include "../twrp-functions.hpp"
+#include "../twrpTrace.hpp"
+#include "pages.hpp"
+#include "themecache.hpp"
+
+// Bump when the compiled format or the way the DOM is built changes
+#define THEME_CACHE_VERSION 1
+// Kept on the settings storage so that the next boot finds them, or in /tmp
+// while the storage is not available
+#define THEME_CACHE_FOLDER "/TWRP/.themecache/"
+#define THEME_CACHE_TMP_FOLDER "/tmp/themecache/"
+
+static const char theme_cache_magic[4] = { 'T', 'W', 'X', 'C' };
+
+char* ThemeCache::Load(const std::string& filename, ZipArchive* package, xml_document<>* doc)
+{
+	twrpTraceSpan span("theme", "Load XML", filename);
+	char* source = NULL;
+	uint64_t source_hash;
+	uint32_t source_size;
+
+	// Zip entries come with a CRC, so an unchanged file in a zip theme does
+	// not even have to be extracted. Files are hashed.
+	if (package) {
+		const ZipEntry* zipentry = mzFindZipEntry(package, filename.c_str());
+		if (zipentry == NULL) {
+			LOGERR("Unable to locate '%s' in zip file\n", filename.c_str());
+			return NULL;
+		}
+		source_hash = (uint32_t)zipentry->crc32;
+		source_size = mzGetZipEntryUncompLen(zipentry);
+	} else {
+		source = PageManager::LoadFileToBuffer(filename, NULL);
+		if (!source)
+			return NULL;
+		source_size = strlen(source);
+		source_hash = Hash(source, source_size);
+	}
+
+	std::string cache_file = Cache_File(filename, package);
+	char* compiled = Read(cache_file, source_hash, source_size, doc);
+	if (compiled) {
+		LOGINFO("Loaded compiled '%s'\n", cache_file.c_str());
+		free(source);
+		return compiled;
+	}
+
+	if (!source) {
+		source = PageManager::LoadFileToBuffer(filename, package);
+		if (!source)
+			return NULL;
+	}
+	doc->parse<0>(source);
+	Write(cache_file, source_hash, source_size, doc);
+	return source;
+}
+
+std::string ThemeCache::Cache_File(const std::string& filename, ZipArchive* package)
+{
+	std::string folder = DataManager::GetSettingsStoragePath();
+	std::string name = (package ? "zip" : "") + filename;
+
+	if (!folder.empty() && PartitionManager.Is_Mounted_By_Path(folder))
+		folder += THEME_CACHE_FOLDER;
+	else
+		folder = THEME_CACHE_TMP_FOLDER;
+	for (size_t i = 0; i < name.size(); i++) {
+		if (name[i] == '/')
+			name[i] = '_';
+	}
+	return folder + name + ".bin";
+}
+
+// 64 bit FNV-1a
+uint64_t ThemeCache::Hash(const char* data, size_t size)
+{
+	uint64_t hash = 14695981039346656037ULL;
+
+	for (size_t i = 0; i < size; i++) {
+		hash ^= (unsigned char)data[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+char* ThemeCache::Read(const std::string& cache_file, uint64_t source_hash, uint32_t source_size, xml_document<>* doc)
+{
+	struct stat st;
+	Header header;
+
+	int fd = open(cache_file.c_str(), O_RDONLY);
+	if (fd < 0)
+		return NULL;
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Header)
+		|| read(fd, &header, sizeof(Header)) != (ssize_t)sizeof(Header)
+		|| memcmp(header.magic, theme_cache_magic, sizeof(header.magic)) != 0
+		|| header.version != THEME_CACHE_VERSION
+		|| header.source_hash != source_hash || header.source_size != source_size
+		|| header.node_count == 0 || header.node_count > 0x1000000 || header.attribute_count > 0x1000000
+		|| header.text_size == 0 || header.text_size > 0x10000000) {
+		close(fd);
+		return NULL;
+	}
+	size_t size = (size_t)header.node_count * sizeof(Node) + (size_t)header.attribute_count * sizeof(Attribute) + header.text_size;
+	if ((off_t)(sizeof(Header) + size) != st.st_size) {
+		close(fd);
+		return NULL;
+	}
+	char* buffer = (char*)malloc(size);
+	if (!buffer) {
+		close(fd);
+		return NULL;
+	}
+	if (read(fd, buffer, size) != (ssize_t)size) {
+		LOGINFO("Unable to read '%s': %s\n", cache_file.c_str(), strerror(errno));
+		free(buffer);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+
+	Reader reader;
+	reader.nodes = (const Node*)buffer;
+	reader.attributes = (const Attribute*)(buffer + header.node_count * sizeof(Node));
+	reader.text = buffer + header.node_count * sizeof(Node) + header.attribute_count * sizeof(Attribute);
+	reader.node_count = header.node_count;
+	reader.attribute_count = header.attribute_count;
+	reader.text_size = header.text_size;
+	reader.next_node = 0;
+	reader.next_attribute = 0;
+
+	// The first node is the document itself
+	if (reader.nodes[0].type != node_document || !Build(reader, doc, doc)
+		|| reader.next_node != reader.node_count || reader.next_attribute != reader.attribute_count) {
+		LOGINFO("Ignoring damaged '%s'\n", cache_file.c_str());
+		doc->clear();
+		free(buffer);
+		return NULL;
+	}
+	return buffer;
+}
+
+bool ThemeCache::Check_String(const Reader& reader, uint32_t offset, uint32_t size)
+{
+	// Strings are null terminated for the users of value()
+	return offset < reader.text_size && size < reader.text_size - offset && reader.text[offset + size] == 0;
+}
+
+// Fills node from the next entry of the node table and recurses into its
+// children
+bool ThemeCache::Build(Reader& reader, xml_document<>* doc, xml_node<>* node)
+{
+	if (reader.next_node >= reader.node_count)
+		return false;
+	const Node& entry = reader.nodes[reader.next_node++];
+	if (!Check_String(reader, entry.name, entry.name_size) || !Check_String(reader, entry.value, entry.value_size)
+		|| entry.attributes > reader.attribute_count - reader.next_attribute)
+		return false;
+	if (node != doc) {
+		node->name(reader.text + entry.name, entry.name_size);
+		node->value(reader.text + entry.value, entry.value_size);
+	}
+
+	for (uint32_t i = 0; i < entry.attributes; i++) {
+		const Attribute& attribute = reader.attributes[reader.next_attribute++];
+		if (!Check_String(reader, attribute.name, attribute.name_size) || !Check_String(reader, attribute.value, attribute.value_size))
+			return false;
+		node->append_attribute(doc->allocate_attribute(reader.text + attribute.name, reader.text + attribute.value, attribute.name_size, attribute.value_size));
+	}
+
+	for (uint32_t i = 0; i < entry.children; i++) {
+		if (reader.next_node >= reader.node_count)
+			return false;
+		uint32_t type = reader.nodes[reader.next_node].type;
+		if (type == node_document || type > node_pi)
+			return false;
+		xml_node<>* child = doc->allocate_node((node_type)type);
+		node->append_node(child);
+		if (!Build(reader, doc, child))
+			return false;
+	}
+	return true;
+}
+
+void ThemeCache::Write(const std::string& cache_file, uint64_t source_hash, uint32_t source_size, xml_document<>* doc)
+{
+	Compiled compiled;
+	Header header;
+
+	Add_Node(compiled, doc);
+
+	memcpy(header.magic, theme_cache_magic, sizeof(header.magic));
+	header.version = THEME_CACHE_VERSION;
+	header.source_hash = source_hash;
+	header.source_size = source_size;
+	header.node_count = compiled.nodes.size();
+	header.attribute_count = compiled.attributes.size();
+	header.text_size = compiled.text.size();
+
+	std::string folder = TWFunc::Get_Path(cache_file);
+	if (!TWFunc::Path_Exists(folder) && !TWFunc::Recursive_Mkdir(folder))
+		return;
+	// the cache on the settings storage is in user storage
+	bool user_storage = folder != THEME_CACHE_TMP_FOLDER;
+	if (user_storage)
+		tw_set_default_metadata(folder.c_str());
+	// Written next to the old copy and renamed so that a reboot while
+	// writing leaves no partial file behind
+	std::string temp_file = cache_file + ".tmp";
+	int fd = open(temp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		LOGINFO("Unable to open '%s': %s\n", temp_file.c_str(), strerror(errno));
+		return;
+	}
+	size_t nodes_size = compiled.nodes.size() * sizeof(Node);
+	size_t attributes_size = compiled.attributes.size() * sizeof(Attribute);
+	bool ok = write(fd, &header, sizeof(Header)) == (ssize_t)sizeof(Header)
+		&& write(fd, &compiled.nodes[0], nodes_size) == (ssize_t)nodes_size
+		&& (attributes_size == 0 || write(fd, &compiled.attributes[0], attributes_size) == (ssize_t)attributes_size)
+		&& write(fd, compiled.text.data(), compiled.text.size()) == (ssize_t)compiled.text.size();
+	if (close(fd) != 0)
+		ok = false;
+	if (!ok || rename(temp_file.c_str(), cache_file.c_str()) != 0) {
+		LOGINFO("Unable to write '%s': %s\n", cache_file.c_str(), strerror(errno));
+		unlink(temp_file.c_str());
+		return;
+	}
+	if (user_storage)
+		tw_set_default_metadata(cache_file.c_str());
+	LOGINFO("Wrote compiled '%s'\n", cache_file.c_str());
+}
+
+// Appends node and then its children to the node table
+void ThemeCache::Add_Node(Compiled& compiled, xml_node<>* node)
+{
+	Node entry;
+
+	entry.type = node->type();
+	entry.name = Add_String(compiled, node->name(), node->name_size());
+	entry.name_size = node->name_size();
+	entry.value = Add_String(compiled, node->value(), node->value_size());
+	entry.value_size = node->value_size();
+	entry.attributes = 0;
+	entry.children = 0;
+	for (xml_attribute<>* attr = node->first_attribute(); attr; attr = attr->next_attribute()) {
+		Attribute attribute;
+		attribute.name = Add_String(compiled, attr->name(), attr->name_size());
+		attribute.name_size = attr->name_size();
+		attribute.value = Add_String(compiled, attr->value(), attr->value_size());
+		attribute.value_size = attr->value_size();
+		compiled.attributes.push_back(attribute);
+		entry.attributes++;
+	}
+	for (xml_node<>* child = node->first_node(); child; child = child->next_sibling())
+		entry.children++;
+
+	compiled.nodes.push_back(entry);
+	for (xml_node<>* child = node->first_node(); child; child = child->next_sibling())
+		Add_Node(compiled, child);
+}
+
+// Themes repeat the same names and values a lot, each is stored once
+uint32_t ThemeCache::Add_String(Compiled& compiled, const char* str, size_t size)
+{
+	std::string value(str, size);
+	std::map<std::string, uint32_t>::iterator it = compiled.strings.find(value);
+
+	if (it != compiled.strings.end())
+		return it->second;
+	uint32_t offset = compiled.text.size();
+	compiled.text.append(value);
+	compiled.text.push_back(0);
+	compiled.strings[value] = offset;
+	return offset;
+}
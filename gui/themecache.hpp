@@ -0,0 +1,92 @@
+/*
+	Copyright 2016 TeamWin
+	This file is part of TWRP/TeamWin Recovery Project.
+
+	TWRP is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	TWRP is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// themecache.hpp - Compiled copies of parsed theme XML files
+
+#ifndef _THEMECACHE_HEADER
+#define _THEMECACHE_HEADER
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+
+#include "rapidxml.hpp"
+
+struct ZipArchive;
+
+using namespace rapidxml;
+
+// The first load of a theme XML file parses it and writes its DOM to a
+// compiled file: a node table, an attribute table and a string table. Later
+// loads of the unchanged file read the compiled file in one go and point the
+// nodes into it instead of running the XML parser again.
+class ThemeCache
+{
+public:
+	// Loads filename from package, or directly if package is NULL, into doc.
+	// Returns the buffer that holds the text of doc, which the caller frees
+	// once doc is no longer used, or NULL on error.
+	static char* Load(const std::string& filename, ZipArchive* package, xml_document<>* doc);
+
+private:
+	struct Header {
+		char magic[4];
+		uint32_t version;
+		uint64_t source_hash;                   // hash of the XML file, or its zip CRC
+		uint32_t source_size;
+		uint32_t node_count;
+		uint32_t attribute_count;
+		uint32_t text_size;
+	};
+	struct Node {
+		uint32_t type;
+		uint32_t name, name_size;               // offsets and sizes in the string table
+		uint32_t value, value_size;
+		uint32_t attributes;                    // attributes of the node, in order in the attribute table
+		uint32_t children;                      // child nodes, following the node in the node table
+	};
+	struct Attribute {
+		uint32_t name, name_size;
+		uint32_t value, value_size;
+	};
+	struct Compiled {
+		std::vector<Node> nodes;
+		std::vector<Attribute> attributes;
+		std::string text;
+		std::map<std::string, uint32_t> strings;
+	};
+	struct Reader {
+		const Node* nodes;
+		const Attribute* attributes;
+		char* text;
+		uint32_t node_count, attribute_count, text_size;
+		uint32_t next_node, next_attribute;
+	};
+
+	static std::string Cache_File(const std::string& filename, ZipArchive* package);
+	static uint64_t Hash(const char* data, size_t size);
+	static char* Read(const std::string& cache_file, uint64_t source_hash, uint32_t source_size, xml_document<>* doc);
+	static bool Build(Reader& reader, xml_document<>* doc, xml_node<>* node);
+	static bool Check_String(const Reader& reader, uint32_t offset, uint32_t size);
+	static void Write(const std::string& cache_file, uint64_t source_hash, uint32_t source_size, xml_document<>* doc);
+	static void Add_Node(Compiled& compiled, xml_node<>* node);
+	static uint32_t Add_String(Compiled& compiled, const char* str, size_t size);
+};
+
+#endif  // _THEMECACHE_HEADER
@@ -37,3 +37,15 @@ ifeq ($(TWHAVE_SELINUX), true)
 endif
 
 include $(BUILD_STATIC_LIBRARY)
+
+# Build host static library for twrpTar_host
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := libtar_host
+LOCAL_MODULE_TAGS := optional
+LOCAL_CFLAGS := -D_GNU_SOURCE
+LOCAL_SRC_FILES = append.c block.c decode.c encode.c extract.c handle.c output.c util.c wrapper.c basename.c strmode.c libtar_hash.c libtar_list.c dirname.c
+LOCAL_C_INCLUDES += $(LOCAL_PATH) \
+					external/zlib
+
+include $(BUILD_HOST_STATIC_LIBRARY)
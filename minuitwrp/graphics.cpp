@@ -275,8 +275,20 @@ unsigned int gr_get_height(gr_surface surface) {
     return ((GGLSurface*) surface)->height;
 }
 
+// Back ends that draw into memory and copy it to the display return the
+// same surface from every flip, still holding the frame just shown. Those
+// that flip between display buffers return another one.
+static bool gr_draw_swapped = false;
+
+bool gr_flip_keeps_frame() {
+    return !gr_draw_swapped;
+}
+
 void gr_flip() {
+    GRSurface* last_draw = gr_draw;
     gr_draw = gr_backend->flip(gr_backend);
+    if (gr_draw != last_draw)
+        gr_draw_swapped = true;
     // On double buffered back ends, when we flip, we need to tell
     // pixel flinger to draw to the other buffer
     gr_mem_surface.data = (GGLubyte*)gr_draw->data;
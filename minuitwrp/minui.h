@@ -19,6 +19,7 @@
 
 #include "../gui/placement.h"
 #include <stdbool.h>
+#include <linux/types.h>
 
 struct GRSurface {
     int width;
@@ -42,6 +43,7 @@ int gr_fb_width(void);
 int gr_fb_height(void);
 gr_pixel *gr_fb_data(void);
 void gr_flip(void);
+bool gr_flip_keeps_frame(void);
 void gr_fb_blank(bool blank);
 
 void gr_color(unsigned char r, unsigned char g, unsigned char b, unsigned char a);
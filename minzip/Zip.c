@@ -13,6 +13,7 @@
 #include <stdlib.h>
 #include <sys/stat.h>   // for S_ISLNK()
 #include <unistd.h>
+#include <pthread.h>
 
 #define LOG_TAG "minzip"
 #include "Zip.h"
@@ -806,6 +807,141 @@ static const char *targetEntryPath(MzPathHelper *helper, ZipEntry *pEntry)
     return helper->buf;
 }
 
+#define UNZIP_DIRMODE 0755
+#define UNZIP_FILEMODE 0644
+#define MZ_EXTRACT_THREADS_MAX 8
+
+/* An entry to extract and where to, set up in archive order.
+ */
+typedef struct {
+    const ZipEntry *pEntry;
+    char *targetFile;
+    char *secontext;    // looked up before the threads start
+    bool isFile;        // directory entries are only passed to the callback
+} MzExtractJob;
+
+typedef struct {
+    const ZipArchive *pArchive;
+    const struct utimbuf *timestamp;
+    MzExtractJob *jobs;
+    unsigned int numJobs;
+    unsigned int nextJob;
+    bool failed;
+    pthread_mutex_t lock;
+} MzExtractWork;
+
+#if SORT_ENTRIES
+/* Returns the index of the first entry that is not sorted before prefix,
+ * which is where the entries starting with prefix begin. Compares the
+ * same way as the sort in parseZipArchive.
+ */
+static unsigned int findFirstEntry(const ZipArchive *pArchive,
+        const char *prefix, unsigned int prefixLen)
+{
+    unsigned int low = 0;
+    unsigned int high = pArchive->numEntries;
+
+    while (low < high) {
+        unsigned int mid = low + (high - low) / 2;
+        const ZipEntry *pEntry = &pArchive->pEntries[mid];
+        unsigned int diffLen = pEntry->fileNameLen < prefixLen ?
+                pEntry->fileNameLen : prefixLen;
+        int diff = strncmp(pEntry->fileName, prefix, diffLen);
+        if (diff == 0) {
+            diff = (int)pEntry->fileNameLen - (int)prefixLen;
+        }
+        if (diff < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    return low;
+}
+#endif
+
+/*
+ * Creates and fills the target file of one entry. setfscreatecon() only
+ * affects the calling thread, so workers label their files independently.
+ */
+static bool extractJob(const ZipArchive *pArchive, const MzExtractJob *job,
+        const struct utimbuf *timestamp)
+{
+    const ZipEntry *pEntry = job->pEntry;
+    const char *targetFile = job->targetFile;
+
+    /*
+     * The entry is a regular file or a symlink. Open the target for writing.
+     *
+     * TODO: This behavior for symlinks seems rather bizarre. For a
+     * symlink foo/bar/baz -> foo/tar/taz, we will create a file called
+     * "foo/bar/baz" whose contents are the literal "foo/tar/taz". We
+     * warn about this for now and preserve older behavior.
+     */
+    if (mzIsZipEntrySymlink(pEntry)) {
+        LOGE("Symlink entry \"%.*s\" will be output as a regular file.",
+             pEntry->fileNameLen, pEntry->fileName);
+    }
+
+    if (job->secontext) {
+        setfscreatecon(job->secontext);
+    }
+
+    int fd = creat(targetFile, UNZIP_FILEMODE);
+
+    if (job->secontext) {
+        setfscreatecon(NULL);
+    }
+
+    if (fd < 0) {
+        LOGE("Can't create target file \"%s\": %s\n",
+                targetFile, strerror(errno));
+        return false;
+    }
+
+    bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
+    close(fd);
+    if (!ok) {
+        LOGE("Error extracting \"%s\"\n", targetFile);
+        return false;
+    }
+
+    if (timestamp != NULL && utime(targetFile, timestamp)) {
+        LOGE("Error touching \"%s\"\n", targetFile);
+        return false;
+    }
+
+    LOGV("Extracted file \"%s\"\n", targetFile);
+    return true;
+}
+
+/* Takes entries off the shared list until it is empty or one failed.
+ */
+static void *extractWorker(void *cookie)
+{
+    MzExtractWork *work = (MzExtractWork *)cookie;
+
+    while (true) {
+        pthread_mutex_lock(&work->lock);
+        while (work->nextJob < work->numJobs && !work->jobs[work->nextJob].isFile) {
+            work->nextJob++;
+        }
+        if (work->failed || work->nextJob >= work->numJobs) {
+            pthread_mutex_unlock(&work->lock);
+            break;
+        }
+        const MzExtractJob *job = &work->jobs[work->nextJob++];
+        pthread_mutex_unlock(&work->lock);
+
+        if (!extractJob(work->pArchive, job, work->timestamp)) {
+            pthread_mutex_lock(&work->lock);
+            work->failed = true;
+            pthread_mutex_unlock(&work->lock);
+        }
+    }
+    return NULL;
+}
+
 /*
  * Inflate all entries under zipDir to the directory specified by
  * targetDir, which must exist and be a writable directory.
@@ -876,51 +1012,41 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
     helper.buf = NULL;
     helper.bufLen = 0;
 
-    /* Walk through the entries and extract anything whose path begins
-     * with zpath.
-    //TODO: since the entries are sorted, binary search for the first match
-    //      and stop after the first non-match.
+    /* Walk through the entries and collect anything whose path begins
+     * with zpath. Directories are created and file contexts looked up
+     * here, in order, so that both come out the same on every run.
      */
     unsigned int i;
-    bool seenMatch = false;
     int ok = true;
     int extractCount = 0;
-    for (i = 0; i < pArchive->numEntries; i++) {
-        ZipEntry *pEntry = pArchive->pEntries + i;
-        if (pEntry->fileNameLen < zipDirLen) {
-       //TODO: look out for a single empty directory entry that matches zpath, but
-       //      missing the trailing slash.  Most zip files seem to include
-       //      the trailing slash, but I think it's legal to leave it off.
-       //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
-            /* No chance of matching.
-             */
+    MzExtractJob *jobs = NULL;
+    unsigned int numJobs = 0;
+    unsigned int maxJobs = 0;
 #if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
+    i = findFirstEntry(pArchive, zpath, zipDirLen);
+#else
+    i = 0;
 #endif
-            continue;
-        }
+    for (; i < pArchive->numEntries; i++) {
+        ZipEntry *pEntry = pArchive->pEntries + i;
+        //TODO: look out for a single empty directory entry that matches zpath, but
+        //      missing the trailing slash.  Most zip files seem to include
+        //      the trailing slash, but I think it's legal to leave it off.
+        //      e.g., zpath "a/b/", entry "a/b", with no children of the entry.
         /* If zpath is empty, this strncmp() will match everything,
          * which is what we want.
          */
-        if (strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
+        if (pEntry->fileNameLen < zipDirLen ||
+                strncmp(pEntry->fileName, zpath, zipDirLen) != 0) {
 #if SORT_ENTRIES
-            if (seenMatch) {
-                /* Since the entries are sorted, we can give up
-                 * on the first mismatch after the first match.
-                 */
-                break;
-            }
-#endif
+            /* Since the entries are sorted, the matches end with the first
+             * mismatch after the first match.
+             */
+            break;
+#else
             continue;
+#endif
         }
-        /* This entry begins with zipDir, so we'll extract it.
-         */
-        seenMatch = true;
 
         /* Find the target location of the entry.
          */
@@ -932,8 +1058,29 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
             break;
         }
 
-#define UNZIP_DIRMODE 0755
-#define UNZIP_FILEMODE 0644
+        if (numJobs == maxJobs) {
+            unsigned int newMax = maxJobs ? maxJobs * 2 : 64;
+            MzExtractJob *newJobs = (MzExtractJob *)realloc(jobs, newMax * sizeof(MzExtractJob));
+            if (newJobs == NULL) {
+                LOGE("Can't allocate the list of entries to extract\n");
+                ok = false;
+                break;
+            }
+            jobs = newJobs;
+            maxJobs = newMax;
+        }
+        MzExtractJob *job = &jobs[numJobs];
+        job->pEntry = pEntry;
+        job->targetFile = strdup(targetFile);
+        job->secontext = NULL;
+        job->isFile = false;
+        if (job->targetFile == NULL) {
+            LOGE("Can't allocate target path for \"%s\"\n", targetFile);
+            ok = false;
+            break;
+        }
+        numJobs++;
+
         /*
          * Create the file or directory. We ignore directory entries
          * because we recursively create paths to each file entry we encounter
@@ -956,61 +1103,55 @@ bool mzExtractRecursive(const ZipArchive *pArchive,
                 ok = false;
                 break;
             }
-
-            /*
-             * The entry is a regular file or a symlink. Open the target for writing.
-             *
-             * TODO: This behavior for symlinks seems rather bizarre. For a
-             * symlink foo/bar/baz -> foo/tar/taz, we will create a file called
-             * "foo/bar/baz" whose contents are the literal "foo/tar/taz". We
-             * warn about this for now and preserve older behavior.
-             */
-            if (mzIsZipEntrySymlink(pEntry)) {
-                LOGE("Symlink entry \"%.*s\" will be output as a regular file.",
-                     pEntry->fileNameLen, pEntry->fileName);
-            }
-
-            char *secontext = NULL;
-
             if (sehnd) {
-                selabel_lookup(sehnd, &secontext, targetFile, UNZIP_FILEMODE);
-                setfscreatecon(secontext);
-            }
-
-            int fd = creat(targetFile, UNZIP_FILEMODE);
-
-            if (secontext) {
-                freecon(secontext);
-                setfscreatecon(NULL);
-            }
-
-            if (fd < 0) {
-                LOGE("Can't create target file \"%s\": %s\n",
-                        targetFile, strerror(errno));
-                ok = false;
-                break;
-            }
-
-            bool ok = mzExtractZipEntryToFile(pArchive, pEntry, fd);
-            close(fd);
-            if (!ok) {
-                LOGE("Error extracting \"%s\"\n", targetFile);
-                ok = false;
-                break;
+                selabel_lookup(sehnd, &job->secontext, targetFile, UNZIP_FILEMODE);
             }
-
-            if (timestamp != NULL && utime(targetFile, timestamp)) {
-                LOGE("Error touching \"%s\"\n", targetFile);
-                ok = false;
-                break;
-            }
-
-            LOGV("Extracted file \"%s\"\n", targetFile);
+            job->isFile = true;
             ++extractCount;
         }
+    }
+
+    /* Inflate the files. Entries are independent, so they are spread over
+     * a few threads, the calling thread being one of them.
+     */
+    if (ok && extractCount > 0) {
+        MzExtractWork work;
+        pthread_t threads[MZ_EXTRACT_THREADS_MAX];
+        int numThreads = 0;
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        int wanted = cpus > 1 ? (int)cpus : 1;
+        if (wanted > MZ_EXTRACT_THREADS_MAX)
+            wanted = MZ_EXTRACT_THREADS_MAX;
+        if (wanted > extractCount)
+            wanted = extractCount;
+
+        work.pArchive = pArchive;
+        work.timestamp = timestamp;
+        work.jobs = jobs;
+        work.numJobs = numJobs;
+        work.nextJob = 0;
+        work.failed = false;
+        pthread_mutex_init(&work.lock, NULL);
+        while (numThreads < wanted - 1 &&
+                pthread_create(&threads[numThreads], NULL, extractWorker, &work) == 0) {
+            numThreads++;
+        }
+        extractWorker(&work);
+        while (numThreads > 0) {
+            pthread_join(threads[--numThreads], NULL);
+        }
+        pthread_mutex_destroy(&work.lock);
+        if (work.failed)
+            ok = false;
+    }
 
-        if (callback != NULL) callback(targetFile, cookie);
+    for (i = 0; i < numJobs; i++) {
+        if (ok && callback != NULL) callback(jobs[i].targetFile, cookie);
+        free(jobs[i].targetFile);
+        if (jobs[i].secontext)
+            freecon(jobs[i].secontext);
     }
+    free(jobs);
 
     LOGD("Extracted %d file(s)\n", extractCount);
 
@@ -27,6 +27,7 @@ LOCAL_SRC_FILES = \
     MtpStorage.cpp \
     MtpStorageInfo.cpp \
     MtpStringBuffer.cpp \
+    MtpThumbnailCache.cpp \
     MtpUtils.cpp \
     mtp_MtpServer.cpp \
     twrpMtp.cpp \
@@ -70,6 +71,7 @@ LOCAL_SRC_FILES = \
     MtpStorage.cpp \
     MtpStorageInfo.cpp \
     MtpStringBuffer.cpp \
+    MtpThumbnailCache.cpp \
     MtpUtils.cpp \
     mtp_MtpServer.cpp \
     twrpMtp.cpp \
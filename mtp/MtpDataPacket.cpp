@@ -321,6 +321,18 @@ void MtpDataPacket::putAUInt64(const uint64_t* values, int count) {
 		putUInt64(*values++);
 }
 
+void MtpDataPacket::putData(const void* data, size_t length) {
+	allocate(mOffset + length);
+	memcpy(mBuffer + mOffset, data, length);
+	mOffset += length;
+	if (mPacketSize < mOffset)
+		mPacketSize = mOffset;
+}
+
+void MtpDataPacket::setUInt32(uint64_t offset, uint32_t value) {
+	MtpPacket::putUInt32(offset, value);
+}
+
 void MtpDataPacket::putString(const MtpStringBuffer& string) {
 	string.writeToPacket(this);
 }
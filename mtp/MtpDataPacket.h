@@ -93,6 +93,13 @@ public:
     void                putString(const uint16_t* string);
     inline void         putEmptyString() { putUInt8(0); }
     inline void         putEmptyArray() { putUInt32(0); }
+    // appends already serialized data
+    void                putData(const void* data, size_t length);
+
+    // offset of the next put, for patching values once they are known
+    inline uint64_t     getOffset() const { return mOffset; }
+    inline const uint8_t* getBuffer(uint64_t offset) const { return mBuffer + offset; }
+    void                setUInt32(uint64_t offset, uint32_t value);
 
 
 #ifdef MTP_DEVICE
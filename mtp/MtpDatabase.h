@@ -89,6 +89,13 @@ public:
 
     virtual void*                   getThumbnail(MtpObjectHandle handle, size_t& outThumbSize) = 0;
 
+    // location of the thumbnail in the file of the object, so that it can be
+    // sent from the file directly. outThumbSize is 0 if there is none.
+    virtual MtpResponseCode         getThumbnailRange(MtpObjectHandle handle,
+                                            MtpString& outFilePath,
+                                            uint64_t& outOffset,
+                                            size_t& outThumbSize) = 0;
+
     virtual MtpResponseCode         getObjectFilePath(MtpObjectHandle handle,
                                             MtpString& outFilePath,
                                             int64_t& outFileLength,
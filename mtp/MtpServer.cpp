@@ -871,21 +871,43 @@ MtpResponseCode MtpServer::doGetObject() {
 }
 
 MtpResponseCode MtpServer::doGetThumb() {
+	if (!hasStorage())
+		return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 	MtpObjectHandle handle = mRequest.getParameter(1);
+	MtpString pathBuf;
+	uint64_t offset;
 	size_t thumbSize;
 	mDatabase->lockMutex();
-	void* thumb = mDatabase->getThumbnail(handle, thumbSize);
+	int result = mDatabase->getThumbnailRange(handle, pathBuf, offset, thumbSize);
 	mDatabase->unlockMutex();
-	if (thumb) {
-		// send data
-		mData.setOperationCode(mRequest.getOperationCode());
-		mData.setTransactionID(mRequest.getTransactionID());
-		mData.writeData(mFD, thumb, thumbSize);
-		free(thumb);
-		return MTP_RESPONSE_OK;
-	} else {
+	if (result != MTP_RESPONSE_OK)
+		return result;
+	if (thumbSize == 0)
+		return MTP_RESPONSE_NO_THUMBNAIL_PRESENT;
+
+	// the thumbnail is a part of the file, send it the way GetPartialObject
+	// sends a range instead of reading it in first
+	const char* filePath = (const char *)pathBuf;
+	mtp_file_range  mfr;
+	mfr.fd = open(filePath, O_RDONLY | O_CLOEXEC);
+	if (mfr.fd < 0) {
 		return MTP_RESPONSE_GENERAL_ERROR;
 	}
+	mfr.offset = offset;
+	mfr.length = thumbSize;
+	mfr.command = mRequest.getOperationCode();
+	mfr.transaction_id = mRequest.getTransactionID();
+
+	int ret = ioctl(mFD, MTP_SEND_FILE_WITH_HEADER, (unsigned long)&mfr);
+	MTPD("MTP_SEND_FILE_WITH_HEADER returned %d\n", ret);
+	close(mfr.fd);
+	if (ret < 0) {
+		if (errno == ECANCELED)
+			return MTP_RESPONSE_TRANSACTION_CANCELLED;
+		else
+			return MTP_RESPONSE_GENERAL_ERROR;
+	}
+	return MTP_RESPONSE_OK;
 }
 
 MtpResponseCode MtpServer::doGetPartialObject(MtpOperationCode operation) {
@@ -914,7 +936,10 @@ MtpResponseCode MtpServer::doGetPartialObject(MtpOperationCode operation) {
 	if (result != MTP_RESPONSE_OK) {
 		return result;
 	}
-	if (offset + length > (uint64_t)fileLength)
+	// an offset past the end reads nothing rather than wrapping length around
+	if (offset > (uint64_t)fileLength)
+		length = 0;
+	else if (offset + length > (uint64_t)fileLength)
 		length = fileLength - offset;
 
 	const char* filePath = (const char *)pathBuf;
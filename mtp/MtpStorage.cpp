@@ -22,6 +22,7 @@
 #include "MtpServer.h"
 #include "MtpEventPacket.h"
 #include "MtpDatabase.h"
+#include "MtpThumbnailCache.h"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -39,6 +40,8 @@
 #include "../tw_atomic.hpp"
 
 #define WATCH_FLAGS ( IN_CREATE | IN_DELETE | IN_MOVE | IN_MODIFY )
+// upper bound for all cached GetObjectPropList responses of a storage
+#define PROPLIST_CACHE_MAX ( 4 * 1024 * 1024 )
 
 MtpStorage::MtpStorage(MtpStorageID id, const char* filePath,
 		const char* description, uint64_t reserveSpace,
@@ -59,6 +62,7 @@ MtpStorage::MtpStorage(MtpStorageID id, const char* filePath,
 	inotify_thread_kill.set_value(0);
 	sendEvents = false;
 	handleCurrentlySending = 0;
+	propListCacheSize = 0;
 	use_mutex = true;
 	if (pthread_mutex_init(&mtpMutex, NULL) != 0) {
 		MTPE("Failed to init mtpMutex\n");
@@ -178,6 +182,7 @@ MtpObjectHandleList* MtpStorage::getObjectList(MtpStorageID storageID, MtpObject
 	}
 
 	mtpmap[parent]->getmtpids(list);
+	prefetchThumbnails(tree, list);
 	MTPD("returning %u objects in %s.\n", list->size(), tree->getName().c_str());
 	return list;
 }
@@ -196,9 +201,14 @@ int MtpStorage::getObjectInfo(MtpObjectHandle handle, MtpObjectInfo& info) {
 	MTPD("info.mStorageID: %u\n", info.mStorageID);
 	info.mParent = node->getMtpParentId();
 	MTPD("mParent: %u\n", info.mParent);
-	// TODO: do we want to lstat again here, or read from the node properties?
-	if (lstat(getNodePath(node).c_str(), &st) == 0)
+	// lstat again here rather than trusting the cached stat fields, the
+	// client uses this to refresh its view of the object
+	std::string path = getNodePath(node);
+	memset(&st, 0, sizeof(st));
+	if (lstat(path.c_str(), &st) == 0) {
 		size = st.st_size;
+		node->setStat(st.st_size, st.st_mtime);
+	}
 	MTPD("size is: %llu\n", size);
 	info.mCompressedSize = (size > 0xFFFFFFFFLL ? 0xFFFFFFFF : size);
 	info.mDateModified = st.st_mtime;
@@ -206,7 +216,20 @@ int MtpStorage::getObjectInfo(MtpObjectHandle handle, MtpObjectInfo& info) {
 		info.mFormat = MTP_FORMAT_ASSOCIATION;
 	}
 	else {
-		info.mFormat = MTP_FORMAT_UNDEFINED;
+		info.mFormat = node->getFormat();
+		MtpThumbnailCache::Info thumb;
+		if (info.mFormat == MTP_FORMAT_EXIF_JPEG && S_ISREG(st.st_mode)) {
+			// without a thumbnail format clients download the whole picture for a preview
+			if (MtpThumbnailCache::find(path, st, thumb)) {
+				info.mThumbFormat = MTP_FORMAT_EXIF_JPEG;
+				info.mThumbCompressedSize = thumb.size;
+				info.mThumbPixWidth = thumb.width;
+				info.mThumbPixHeight = thumb.height;
+			}
+			info.mImagePixWidth = thumb.imageWidth;
+			info.mImagePixHeight = thumb.imageHeight;
+			info.mImagePixDepth = thumb.imageDepth;
+		}
 	}
 	info.mName = strdup(node->getName().c_str());
 	MTPD("MtpStorage::getObjectInfo found, Exiting getObjectInfo()\n");
@@ -254,7 +277,9 @@ void MtpStorage::endSendObject(const char* path, MtpObjectHandle handle, MtpObje
 	if (!node)
 		return;	// just ignore if this is for another storage
 
-	node->addProperties(path, mStorageID);
+	// the upload changed size and mtime, re-read them on the next query
+	node->invalidateStat();
+	invalidatePropListCache(node->getMtpParentId());
 	handleCurrentlySending = 0;
 	// TODO: are we supposed to send an event about an upload by the initiator?
 	if (sendEvents)
@@ -277,14 +302,41 @@ int MtpStorage::getObjectFilePath(MtpObjectHandle handle, MtpString& outFilePath
 		outFileLength = 0;
 	outFilePath = getNodePath(node).c_str();
 	MTPD("outFilePath: %s\n", outFilePath.string());
-	outFormat = node->isDir() ? MTP_FORMAT_ASSOCIATION : MTP_FORMAT_UNDEFINED;
+	outFormat = node->getFormat();
+	return 0;
+}
+
+int MtpStorage::getThumbnailInfo(MtpObjectHandle handle, MtpString& outFilePath, MtpThumbnailCache::Info& info) {
+	Node* node = findNode(handle);
+	if (!node)
+		return -1;
+	outFilePath = getNodePath(node).c_str();
+	struct stat st;
+	if (node->getFormat() != MTP_FORMAT_EXIF_JPEG || lstat((const char*)outFilePath, &st) != 0
+			|| !S_ISREG(st.st_mode) || !MtpThumbnailCache::find((const char*)outFilePath, st, info))
+		info.size = 0;
 	return 0;
 }
 
+// the client asks for the info of the objects it just listed next, parse
+// the pictures among them while it does
+void MtpStorage::prefetchThumbnails(Tree* tree, MtpObjectHandleList* list) {
+	std::vector<std::string> paths;
+	std::string path;
+	for (MtpObjectHandleList::iterator it = list->begin(); it != list->end(); ++it) {
+		Node* node = tree->findNode(*it);
+		if (!node || node->getFormat() != MTP_FORMAT_EXIF_JPEG)
+			continue;
+		if (path.empty())
+			path = getNodePath(tree);
+		paths.push_back(path + "/" + node->getName());
+	}
+	MtpThumbnailCache::prefetch(paths);
+}
+
 int MtpStorage::readDir(const std::string& path, Tree* tree)
 {
 	struct dirent *de;
-	int storageID = getStorageID();
 	MtpObjectHandle parent = tree->Mtpid();
 
 	DIR *d = opendir(path.c_str());
@@ -295,21 +347,25 @@ int MtpStorage::readDir(const std::string& path, Tree* tree)
 	}
 	// TODO: for refreshing dirs: capture old entries here
 	while ((de = readdir(d)) != NULL) {
-		// Because exfat-fuse causes issues with dirent, we will use stat
-		// for some things that dirent should be able to do
-		std::string item = path + "/" + de->d_name;
-		struct stat st;
-		if (lstat(item.c_str(), &st)) {
-			MTPE("Error running lstat on '%s'\n", item.c_str());
-			return -1;
-		}
 		// TODO: if we want to use this for refreshing dirs too, first find existing name and overwrite
 		if (strcmp(de->d_name, ".") == 0)
 			continue;
 		if (strcmp(de->d_name, "..") == 0)
 			continue;
-		Node* node = addNewNode(st.st_mode & S_IFDIR, tree, de->d_name);
-		node->addProperties(item, storageID);
+		// Only stat when dirent can't tell us the type (exfat-fuse and
+		// some other file systems); size and mtime are read on demand.
+		bool isDir;
+		if (de->d_type == DT_UNKNOWN) {
+			struct stat st;
+			if (fstatat(dirfd(d), de->d_name, &st, AT_SYMLINK_NOFOLLOW)) {
+				MTPE("Error running fstatat on '%s/%s'\n", path.c_str(), de->d_name);
+				continue;
+			}
+			isDir = S_ISDIR(st.st_mode);
+		} else {
+			isDir = de->d_type == DT_DIR;
+		}
+		addNewNode(isDir, tree, de->d_name);
 		//if (sendEvents)
 		//	mServer->sendObjectAdded(node->Mtpid());
 		//	sending events here makes simple-mtpfs very slow, and it is probably the wrong thing to do anyway
@@ -337,7 +393,9 @@ int MtpStorage::deleteFile(MtpObjectHandle handle) {
 	if (node->isDir()) {
 		MTPD("deleting tree from mtpmap: %u\n", handle);
 		mtpmap.erase(handle);
+		invalidatePropListCache(handle);
 	}
+	invalidatePropListCache(parent);
 
 	MTPD("deleting handle: %u\n", handle);
 	tree->deleteNode(handle);
@@ -345,26 +403,100 @@ int MtpStorage::deleteFile(MtpObjectHandle handle) {
 	return 0;
 }
 
-void MtpStorage::queryNodeProperties(std::vector<MtpStorage::PropEntry>& results, Node* node, uint32_t property, int groupCode, MtpStorageID storageID)
+void MtpStorage::statNode(Node* node)
 {
-	MTPD("queryNodeProperties handle %u, path: %s\n", node->Mtpid(), getNodePath(node).c_str());
-	PropEntry pe;
+	if (node->hasStat())
+		return;
+	struct stat st;
+	if (lstat(getNodePath(node).c_str(), &st) == 0)
+		node->setStat(st.st_size, st.st_mtime);
+	else
+		node->setStat(0, 0);
+}
+
+bool MtpStorage::getNodeProperty(Node* node, uint32_t property, PropEntry& pe)
+{
+	Node::mtpProperty prop;
+	if (property == MTP_PROPERTY_OBJECT_SIZE || property == MTP_PROPERTY_DATE_MODIFIED || property == MTP_PROPERTY_DATE_ADDED)
+		statNode(node);
+	if (!node->getProperty(property, mStorageID, prop))
+		return false;
 	pe.handle = node->Mtpid();
 	pe.property = property;
+	pe.datatype = prop.dataType;
+	pe.intvalue = prop.valueInt;
+	pe.strvalue = prop.valueStr;
+	return true;
+}
 
+void MtpStorage::writeProperty(MtpDataPacket& packet, const PropEntry& p)
+{
+	MTPD("handle: %u, propertyCode: %x = %s, datatype: %x, value: %llu\n",
+			p.handle, p.property, MtpDebug::getObjectPropCodeName(p.property),
+			p.datatype, p.intvalue);
+	packet.putUInt32(p.handle);
+	packet.putUInt16(p.property);
+	packet.putUInt16(p.datatype);
+	switch (p.datatype) {
+		case MTP_TYPE_INT8:
+			packet.putInt8(p.intvalue);
+			break;
+		case MTP_TYPE_UINT8:
+			packet.putUInt8(p.intvalue);
+			break;
+		case MTP_TYPE_INT16:
+			packet.putInt16(p.intvalue);
+			break;
+		case MTP_TYPE_UINT16:
+			packet.putUInt16(p.intvalue);
+			break;
+		case MTP_TYPE_INT32:
+			packet.putInt32(p.intvalue);
+			break;
+		case MTP_TYPE_UINT32:
+			packet.putUInt32(p.intvalue);
+			break;
+		case MTP_TYPE_INT64:
+			packet.putInt64(p.intvalue);
+			break;
+		case MTP_TYPE_UINT64:
+			packet.putUInt64(p.intvalue);
+			break;
+		case MTP_TYPE_INT128:
+			packet.putInt128(p.intvalue);
+			break;
+		case MTP_TYPE_UINT128:
+			packet.putUInt128(p.intvalue);
+			break;
+		case MTP_TYPE_STR:
+			MTPD("MTP_TYPE_STR: %s\n", p.strvalue.c_str());
+			packet.putString(p.strvalue.c_str());
+			break;
+		default:
+			MTPE("bad or unsupported data type: %x in MtpStorage::writeProperty", p.datatype);
+			break;
+	}
+}
+
+uint32_t MtpStorage::writeNodeProperties(MtpDataPacket& packet, Node* node, uint32_t format, uint32_t property)
+{
+	MTPD("writeNodeProperties handle %u, name: %s\n", node->Mtpid(), node->getName().c_str());
+	if (format != 0 && format != node->getFormat())
+		return 0;
+
+	PropEntry pe;
+	uint32_t count = 0;
 	if (property == 0xffffffff)
 	{
 		// add all properties
-		MTPD("MtpStorage::queryNodeProperties for all properties\n");
-		std::vector<Node::mtpProperty> mtpprop = node->getMtpProps();
-		for (size_t i = 0; i < mtpprop.size(); ++i) {
-			pe.property = mtpprop[i].property;
-			pe.datatype = mtpprop[i].dataType;
-			pe.intvalue = mtpprop[i].valueInt;
-			pe.strvalue = mtpprop[i].valueStr;
-			results.push_back(pe);
+		statNode(node);
+		for (size_t i = 0; i < Node::allPropertiesCount; ++i) {
+			if (getNodeProperty(node, Node::allProperties[i], pe)) {
+				writeProperty(packet, pe);
+				++count;
+			}
 		}
-		return;
+		return count;
 	}
 	else if (property == 0)
 	{
@@ -372,49 +504,70 @@ void MtpStorage::queryNodeProperties(std::vector<MtpStorage::PropEntry>& results
 	}
 
 	// single property
-	// TODO: this should probably be moved to the Node class and/or merged with getObjectPropertyValue
-	switch (property) {
-//		case MTP_PROPERTY_OBJECT_FORMAT:
-//			pe.datatype = MTP_TYPE_UINT16;
-//			pe.intvalue = node->getIntProperty(MTP_PROPERTY_OBJECT_FORMAT);
-//			break;
-
-		case MTP_PROPERTY_STORAGE_ID:
-			pe.datatype = MTP_TYPE_UINT32;
-			pe.intvalue = storageID;
-			break;
+	// TODO: all the special case stuff in MyMtpDatabase::getObjectPropertyValue is missing here
+	if (!getNodeProperty(node, property, pe)) {
+		MTPD("writeNodeProperties: unknown property %x\n", property);
+		return 0;
+	}
+	writeProperty(packet, pe);
+	return 1;
+}
 
-		case MTP_PROPERTY_PROTECTION_STATUS:
-			pe.datatype = MTP_TYPE_UINT16;
-			pe.intvalue = 0;
-			break;
+uint32_t MtpStorage::writeTreeProperties(MtpDataPacket& packet, Tree* tree, uint32_t format, uint32_t property)
+{
+	if (!tree->wasAlreadyRead())
+		readDir(getNodePath(tree), tree);
+
+	// only the full property list for all formats is cached, that is what
+	// desktop clients ask for when opening a folder
+	bool cacheable = (format == 0 && property == 0xffffffff);
+	if (cacheable) {
+		std::map<MtpObjectHandle, PropListCache>::iterator it = propListCache.find(tree->Mtpid());
+		if (it != propListCache.end()) {
+			MTPD("writeTreeProperties: using cached property list for %u\n", tree->Mtpid());
+			packet.putData(it->second.data.data(), it->second.data.size());
+			return it->second.count;
+		}
+	}
 
-		case MTP_PROPERTY_OBJECT_SIZE:
-		{
-			pe.datatype = MTP_TYPE_UINT64;
-			struct stat st;
-			pe.intvalue = 0;
-			if (lstat(getNodePath(node).c_str(), &st) == 0)
-				pe.intvalue = st.st_size;
+	uint64_t start = packet.getOffset();
+	uint32_t count = 0;
+	MtpObjectHandleList list;
+	tree->getmtpids(&list);
+	prefetchThumbnails(tree, &list);
+	for (MtpObjectHandleList::iterator it = list.begin(); it != list.end(); ++it) {
+		Node* node = tree->findNode(*it);
+		if (!node) {
+			MTPE("BUG: node not found for tree entry with handle %u\n", *it);
 			break;
 		}
+		count += writeNodeProperties(packet, node, format, property);
+	}
 
-		default:
-		{
-			const Node::mtpProperty& prop = node->getProperty(property);
-			if (prop.property != property)
-			{
-				MTPD("queryNodeProperties: unknown property %x\n", property);
-				return;
-			}
-			pe.datatype = prop.dataType;
-			pe.intvalue = prop.valueInt;
-			pe.strvalue = prop.valueStr;
-			// TODO: all the special case stuff in MyMtpDatabase::getObjectPropertyValue is missing here
+	if (cacheable) {
+		size_t length = packet.getOffset() - start;
+		if (propListCacheSize + length > PROPLIST_CACHE_MAX) {
+			MTPD("writeTreeProperties: property list cache full, flushing\n");
+			propListCache.clear();
+			propListCacheSize = 0;
+		}
+		if (length <= PROPLIST_CACHE_MAX) {
+			PropListCache& entry = propListCache[tree->Mtpid()];
+			entry.count = count;
+			entry.data.assign((const char*)packet.getBuffer(start), length);
+			propListCacheSize += length;
 		}
+	}
+	return count;
+}
 
+void MtpStorage::invalidatePropListCache(MtpObjectHandle handle)
+{
+	std::map<MtpObjectHandle, PropListCache>::iterator it = propListCache.find(handle);
+	if (it != propListCache.end()) {
+		propListCacheSize -= it->second.data.size();
+		propListCache.erase(it);
 	}
-	results.push_back(pe);
 }
 
 int MtpStorage::getObjectPropertyList(MtpObjectHandle handle, uint32_t format, uint32_t property, int groupCode, int depth, MtpDataPacket& packet) {
@@ -425,102 +578,46 @@ int MtpStorage::getObjectPropertyList(MtpObjectHandle handle, uint32_t format, u
 		return -1; // TODO: RESPONSE_SPECIFICATION_BY_GROUP_UNSUPPORTED
 	}
 	// TODO: support all the special stuff, like:
-	// handle == 0 -> all objects at the root level
 	// handle == 0xffffffff -> all objects (on all storages? how could we support that?)
-	// format == 0 -> all formats, otherwise filter by ObjectFormatCode
 	// property == 0xffffffff -> all properties except those with group code 0xffffffff
 	// if property == 0 then use groupCode
 	//   groupCode == 0 -> return Specification_By_Group_Unsupported
 	// depth == 0xffffffff -> all objects incl. and below handle
 
-	std::vector<PropEntry> results;
-
+	// Entries are written straight into the packet; the count comes first,
+	// so reserve it and patch it in once all entries are written.
+	// Nothing may be written before we know the handle is on this storage.
+	Tree* tree = NULL;
+	Node* node = NULL;
 	if (handle == 0xffffffff) {
 		// TODO: all object on all storages (needs a different design, result packet needs to be built by server instead of storage)
 	} else if (handle == 0)	{
 		// all objects at the root level
-		Tree* root = mtpmap[0];
-		MtpObjectHandleList list;
-		root->getmtpids(&list);
-		for (MtpObjectHandleList::iterator it = list.begin(); it != list.end(); ++it) {
-			Node* node = root->findNode(*it);
-			if (!node) {
-				MTPE("BUG: node not found for root entry with handle %u\n", *it);
-				break;
-			}
-			queryNodeProperties(results, node, property, groupCode, mStorageID);
-		}
+		tree = mtpmap[0];
 	} else {
-		// single object
-		Node* node = findNode(handle);
+		node = findNode(handle);
 		if (!node) {
 			// Item is not on this storage device
 			return -1;
 		}
-		queryNodeProperties(results, node, property, groupCode, mStorageID);
-	}
-
-	MTPD("count: %u\n", results.size());
-	packet.putUInt32(results.size());
-
-	for (size_t i = 0; i < results.size(); ++i) {
-		PropEntry& p = results[i];
-		MTPD("handle: %u, propertyCode: %x = %s, datatype: %x, value: %llu\n",
-				p.handle, p.property, MtpDebug::getObjectPropCodeName(p.property),
-				p.datatype, p.intvalue);
-		packet.putUInt32(p.handle);
-		packet.putUInt16(p.property);
-		packet.putUInt16(p.datatype);
-		switch (p.datatype) {
-			case MTP_TYPE_INT8:
-				MTPD("MTP_TYPE_INT8\n");
-				packet.putInt8(p.intvalue);
-				break;
-			case MTP_TYPE_UINT8:
-				MTPD("MTP_TYPE_UINT8\n");
-				packet.putUInt8(p.intvalue);
-				break;
-			case MTP_TYPE_INT16:
-				MTPD("MTP_TYPE_INT16\n");
-				packet.putInt16(p.intvalue);
-				break;
-			case MTP_TYPE_UINT16:
-				MTPD("MTP_TYPE_UINT16\n");
-				packet.putUInt16(p.intvalue);
-				break;
-			case MTP_TYPE_INT32:
-				MTPD("MTP_TYPE_INT32\n");
-				packet.putInt32(p.intvalue);
-				break;
-			case MTP_TYPE_UINT32:
-				MTPD("MTP_TYPE_UINT32\n");
-				packet.putUInt32(p.intvalue);
-				break;
-			case MTP_TYPE_INT64:
-				MTPD("MTP_TYPE_INT64\n");
-				packet.putInt64(p.intvalue);
-				break;
-			case MTP_TYPE_UINT64:
-				MTPD("MTP_TYPE_UINT64\n");
-				packet.putUInt64(p.intvalue);
-				break;
-			case MTP_TYPE_INT128:
-				MTPD("MTP_TYPE_INT128\n");
-				packet.putInt128(p.intvalue);
-				break;
-			case MTP_TYPE_UINT128:
-				MTPD("MTP_TYPE_UINT128\n");
-				packet.putUInt128(p.intvalue);
-				break;
-			case MTP_TYPE_STR:
-				MTPD("MTP_TYPE_STR: %s\n", p.strvalue.c_str());
-				packet.putString(p.strvalue.c_str());
-				break;
-			default:
-				MTPE("bad or unsupported data type: %x in MyMtpDatabase::getObjectPropertyList", p.datatype);
-				break;
+		if (depth == 1) {
+			// immediate children of the object
+			if (!node->isDir())
+				node = NULL;
+			else
+				tree = static_cast<Tree*>(node);
 		}
 	}
+
+	uint64_t countOffset = packet.getOffset();
+	uint32_t count = 0;
+	packet.putUInt32(0);
+	if (tree)
+		count = writeTreeProperties(packet, tree, format, property);
+	else if (node)
+		count = writeNodeProperties(packet, node, format, property);
+	MTPD("count: %u\n", count);
+	packet.setUInt32(countOffset, count);
 	return 0;
 }
 
@@ -539,6 +636,7 @@ int MtpStorage::renameObject(MtpObjectHandle handle, std::string newName) {
 				MTPD("old: '%s', new: '%s'\n", oldName.c_str(), newFullName.c_str());
 				if (rename(oldName.c_str(), newFullName.c_str()) == 0) {
 					node->rename(newName);
+					invalidatePropListCache(node->getMtpParentId());
 					return 0;
 				} else {
 					MTPE("MtpStorage::renameObject failed, handle: %u, new name: '%s'\n", handle, newName.c_str());
@@ -552,25 +650,16 @@ int MtpStorage::renameObject(MtpObjectHandle handle, std::string newName) {
 }
 
 int MtpStorage::getObjectPropertyValue(MtpObjectHandle handle, MtpObjectProperty property, MtpStorage::PropEntry& pe) {
-	Node *node;
-	for (iter i = mtpmap.begin(); i != mtpmap.end(); i++) {
-		node = i->second->findNode(handle);
-		if (node != NULL) {
-			const Node::mtpProperty& prop = node->getProperty(property);
-			if (prop.property != property) {
-				MTPD("getObjectPropertyValue: unknown property %x for handle %u\n", property, handle);
-				return -1;
-			}
-			pe.datatype = prop.dataType;
-			pe.intvalue = prop.valueInt;
-			pe.strvalue = prop.valueStr;
-			pe.handle = handle;
-			pe.property = property;
-			return 0;
-		}
+	Node *node = findNode(handle);
+	if (!node) {
+		// handle not found on this storage
+		return -1;
 	}
-	// handle not found on this storage
-	return -1;
+	if (!getNodeProperty(node, property, pe)) {
+		MTPD("getObjectPropertyValue: unknown property %x for handle %u\n", property, handle);
+		return -1;
+	}
+	return 0;
 }
 
 pthread_t MtpStorage::inotify(void) {
@@ -619,6 +708,8 @@ void MtpStorage::handleInotifyEvent(struct inotify_event* event)
 	}
 	Tree* tree = it->second;
 	MTPD("inotify_t tree: %x '%s'\n", tree, tree->getName().c_str());
+	// any change in the directory makes its cached property list stale
+	invalidatePropListCache(tree->Mtpid());
 	Node* node = tree->findEntryByName(basename(event->name));
 	if (node && node->Mtpid() == handleCurrentlySending) {
 		MTPD("ignoring inotify event for currently uploading file, handle: %u\n", node->Mtpid());
@@ -632,8 +723,6 @@ void MtpStorage::handleInotifyEvent(struct inotify_event* event)
 		}
 		if (node == NULL) {
 			node = addNewNode(event->mask & IN_ISDIR, tree, event->name);
-			std::string item = getNodePath(tree) + "/" + event->name;
-			node->addProperties(item, getStorageID());
 			mServer->sendObjectAdded(node->Mtpid());
 		} else {
 			MTPD("inotify_t item already exists.\n");
@@ -669,15 +758,17 @@ void MtpStorage::handleInotifyEvent(struct inotify_event* event)
 	} else if (event->mask & IN_MODIFY) {
 		MTPD("inotify_t item %s modified.\n", event->name);
 		if (node != NULL) {
-			uint64_t orig_size = node->getProperty(MTP_PROPERTY_OBJECT_SIZE).valueInt;
-			struct stat st;
-			uint64_t new_size = 0;
-			if (lstat(getNodePath(node).c_str(), &st) == 0)
-				new_size = (uint64_t)st.st_size;
-			if (orig_size != new_size) {
-				MTPD("size changed from %llu to %llu on mtpid: %u\n", orig_size, new_size, node->Mtpid());
-				node->updateProperty(MTP_PROPERTY_OBJECT_SIZE, new_size, "", MTP_TYPE_UINT64);
-				mServer->sendObjectUpdated(node->Mtpid());
+			// if nobody has asked for the size yet there is nothing to update,
+			// it will be read fresh on the next query
+			if (node->hasStat()) {
+				uint64_t orig_size = node->getSize();
+				node->invalidateStat();
+				statNode(node);
+				uint64_t new_size = node->getSize();
+				if (orig_size != new_size) {
+					MTPD("size changed from %llu to %llu on mtpid: %u\n", orig_size, new_size, node->Mtpid());
+					mServer->sendObjectUpdated(node->Mtpid());
+				}
 			}
 		} else {
 			MTPE("inotify_t modified item not found\n");
@@ -783,6 +874,7 @@ Node* MtpStorage::addNewNode(bool isDir, Tree* tree, const std::string& name)
 	++mtpid;
 	MTPD("adding new %s node for %s, new handle: %u\n", isDir ? "dir" : "file", name.c_str(), mtpid);
 	MtpObjectHandle parent = tree->Mtpid();
+	invalidatePropListCache(parent);
 	MTPD("parent tree: %x, handle: %u, name: %s\n", tree, parent, tree->getName().c_str());
 	Node* node;
 	if (isDir)
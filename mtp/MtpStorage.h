@@ -28,6 +28,7 @@
 #include <pthread.h>
 #include "btree.hpp"
 #include "MtpServer.h"
+#include "MtpThumbnailCache.h"
 #include "../tw_atomic.hpp"
 
 class MtpDatabase;
@@ -84,6 +85,7 @@ public:
 	void endSendObject(const char* path, MtpObjectHandle handle, MtpObjectFormat format, bool succeeded);
 	int getObjectPropertyList(MtpObjectHandle handle, uint32_t format, uint32_t property, int groupCode, int depth, MtpDataPacket& packet);
 	int getObjectFilePath(MtpObjectHandle handle, MtpString& outFilePath, int64_t& outFileLength, MtpObjectFormat& outFormat);
+	int getThumbnailInfo(MtpObjectHandle handle, MtpString& outFilePath, MtpThumbnailCache::Info& info);
 	int deleteFile(MtpObjectHandle handle);
 	int renameObject(MtpObjectHandle handle, std::string newName);
 	int getObjectPropertyValue(MtpObjectHandle handle, MtpObjectProperty property, PropEntry& prop);
@@ -108,8 +110,23 @@ private:
 	Node* findNode(MtpObjectHandle handle);
 	Node* findNodeByPath(const std::string& path);
 	std::string getNodePath(Node* node);
+	void prefetchThumbnails(Tree* tree, MtpObjectHandleList* list);
 
-	void queryNodeProperties(std::vector<PropEntry>& results, Node* node, uint32_t property, int groupCode, MtpStorageID storageID);
+	void statNode(Node* node);
+	bool getNodeProperty(Node* node, uint32_t property, PropEntry& pe);
+	void writeProperty(MtpDataPacket& packet, const PropEntry& p);
+	uint32_t writeNodeProperties(MtpDataPacket& packet, Node* node, uint32_t format, uint32_t property);
+	uint32_t writeTreeProperties(MtpDataPacket& packet, Tree* tree, uint32_t format, uint32_t property);
+
+	// serialized GetObjectPropList entries (all properties) for the children
+	// of a directory, dropped whenever the directory changes
+	struct PropListCache {
+		uint32_t count;
+		std::string data;
+	};
+	std::map<MtpObjectHandle, PropListCache> propListCache;
+	size_t propListCacheSize;
+	void invalidatePropListCache(MtpObjectHandle handle);
 
 	bool use_mutex;
 	pthread_mutex_t inMutex; // inotify mutex
@@ -0,0 +1,267 @@
+/*
+ * Copyright (C) 2016 TeamWin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <deque>
+#include <map>
+
+#include "MtpDebug.h"
+#include "MtpThumbnailCache.h"
+
+// parsed files remembered, the oldest are dropped first
+#define THUMBNAIL_CACHE_MAX 4096
+// files queued for the worker at most
+#define THUMBNAIL_PREFETCH_MAX 1024
+// the frame header follows the APPn segments, give up on files with more
+#define JPEG_MAX_SEGMENTS 64
+
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_changed = PTHREAD_COND_INITIALIZER;
+static std::map<MtpThumbnailCache::Key, MtpThumbnailCache::Info> cache_entries;
+static std::deque<MtpThumbnailCache::Key> cache_order;
+static std::deque<std::string> prefetch_queue;
+static bool worker_started = false;
+
+bool MtpThumbnailCache::Key::operator<(const Key& other) const {
+	if (ino != other.ino)
+		return ino < other.ino;
+	if (dev != other.dev)
+		return dev < other.dev;
+	if (mtime != other.mtime)
+		return mtime < other.mtime;
+	return size < other.size;
+}
+
+MtpThumbnailCache::Key MtpThumbnailCache::makeKey(const struct stat& st) {
+	Key key;
+	key.dev = st.st_dev;
+	key.ino = st.st_ino;
+	key.mtime = st.st_mtime;
+	key.size = st.st_size;
+	return key;
+}
+
+bool MtpThumbnailCache::isJpeg(const std::string& name) {
+	size_t dot = name.find_last_of('.');
+	if (dot == std::string::npos)
+		return false;
+	const char* ext = name.c_str() + dot + 1;
+	return strcasecmp(ext, "jpg") == 0 || strcasecmp(ext, "jpeg") == 0;
+}
+
+bool MtpThumbnailCache::find(const std::string& path, const struct stat& st, Info& info) {
+	Key key = makeKey(st);
+
+	pthread_mutex_lock(&cache_lock);
+	std::map<Key, Info>::iterator it = cache_entries.find(key);
+	if (it != cache_entries.end()) {
+		info = it->second;
+		pthread_mutex_unlock(&cache_lock);
+		return info.size != 0;
+	}
+	pthread_mutex_unlock(&cache_lock);
+
+	// parsed without the lock, at worst the worker parses the same file
+	parse(path, info);
+
+	pthread_mutex_lock(&cache_lock);
+	if (cache_entries.insert(std::make_pair(key, info)).second) {
+		cache_order.push_back(key);
+		if (cache_order.size() > THUMBNAIL_CACHE_MAX) {
+			cache_entries.erase(cache_order.front());
+			cache_order.pop_front();
+		}
+	}
+	pthread_mutex_unlock(&cache_lock);
+	return info.size != 0;
+}
+
+void MtpThumbnailCache::prefetch(const std::vector<std::string>& paths) {
+	if (paths.empty())
+		return;
+	pthread_mutex_lock(&cache_lock);
+	prefetch_queue.clear();
+	for (size_t i = 0; i < paths.size() && i < THUMBNAIL_PREFETCH_MAX; i++)
+		prefetch_queue.push_back(paths[i]);
+	if (!worker_started) {
+		pthread_t thread;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, workerThread, NULL) == 0) {
+			worker_started = true;
+		} else {
+			// find() still parses on demand
+			MTPE("unable to start the thumbnail worker\n");
+			prefetch_queue.clear();
+		}
+		pthread_attr_destroy(&attr);
+	}
+	pthread_cond_signal(&queue_changed);
+	pthread_mutex_unlock(&cache_lock);
+}
+
+void* MtpThumbnailCache::workerThread(void* cookie __unused) {
+	for (;;) {
+		pthread_mutex_lock(&cache_lock);
+		while (prefetch_queue.empty())
+			pthread_cond_wait(&queue_changed, &cache_lock);
+		std::string path = prefetch_queue.front();
+		prefetch_queue.pop_front();
+		pthread_mutex_unlock(&cache_lock);
+
+		struct stat st;
+		Info info;
+		if (lstat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+			find(path, st, info);
+	}
+	return NULL;
+}
+
+// Walks the segments up to the frame header. Only the EXIF segment is read
+// as a whole, it holds the thumbnail and is at most 64k.
+void MtpThumbnailCache::parse(const std::string& path, Info& info) {
+	unsigned char header[6];
+	uint64_t pos = 2;
+
+	memset(&info, 0, sizeof(info));
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		MTPD("unable to open '%s': %s\n", path.c_str(), strerror(errno));
+		return;
+	}
+	if (pread(fd, header, 2, 0) != 2 || header[0] != 0xFF || header[1] != 0xD8) {
+		close(fd);
+		return;
+	}
+	for (int segments = 0; segments < JPEG_MAX_SEGMENTS; segments++) {
+		if (pread(fd, header, 4, pos) != 4 || header[0] != 0xFF)
+			break;
+		unsigned char marker = header[1];
+		if (marker == 0xFF) {
+			// fill byte
+			pos++;
+			continue;
+		}
+		if (marker == 0xDA || marker == 0xD9)
+			break; // start of scan or end of image, no frame header seen
+		uint32_t length = (header[2] << 8) | header[3];
+		if (length < 2)
+			break;
+		if (marker == 0xE1 && info.size == 0 && length > 8) {
+			std::vector<unsigned char> segment(length - 2);
+			if (pread(fd, &segment[0], segment.size(), pos + 4) != (ssize_t)segment.size())
+				break;
+			if (memcmp(&segment[0], "Exif\0\0", 6) == 0)
+				parseExif(&segment[6], segment.size() - 6, pos + 4 + 6, info);
+		} else if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+			// start of frame: precision, height, width, components
+			if (length >= 8 && pread(fd, header, 6, pos + 4) == 6) {
+				info.imageHeight = (header[1] << 8) | header[2];
+				info.imageWidth = (header[3] << 8) | header[4];
+				info.imageDepth = header[0] * header[5];
+			}
+			break;
+		}
+		pos += 2 + length;
+	}
+	close(fd);
+	MTPD("'%s': thumbnail %u bytes at %llu, %ux%u\n", path.c_str(), info.size,
+			(unsigned long long)info.offset, info.width, info.height);
+}
+
+// IFD1 of the TIFF structure in the EXIF segment describes the thumbnail.
+// base is the offset of tiff in the file.
+void MtpThumbnailCache::parseExif(const unsigned char* tiff, size_t size, uint64_t base, Info& info) {
+	if (size < 8)
+		return;
+	bool little;
+	if (tiff[0] == 'I' && tiff[1] == 'I')
+		little = true;
+	else if (tiff[0] == 'M' && tiff[1] == 'M')
+		little = false;
+	else
+		return;
+#define GET16(p) (little ? (uint32_t)((p)[0] | ((p)[1] << 8)) : (uint32_t)(((p)[0] << 8) | (p)[1]))
+#define GET32(p) (little ? ((uint32_t)GET16(p) | (GET16((p) + 2) << 16)) : ((GET16(p) << 16) | (uint32_t)GET16((p) + 2)))
+	if (GET16(tiff + 2) != 42)
+		return;
+
+	// IFD0 describes the main image, the offset of IFD1 follows it
+	uint32_t ifd = GET32(tiff + 4);
+	if (ifd < 8 || ifd > size - 6)
+		return;
+	uint32_t entries = GET16(tiff + ifd);
+	if (entries * 12 > size - ifd - 6)
+		return;
+	ifd = GET32(tiff + ifd + 2 + entries * 12);
+	if (ifd < 8 || ifd > size - 2)
+		return;
+	entries = GET16(tiff + ifd);
+	if (entries * 12 > size - ifd - 2)
+		return;
+
+	uint32_t offset = 0, length = 0;
+	for (uint32_t i = 0; i < entries; i++) {
+		const unsigned char* entry = tiff + ifd + 2 + i * 12;
+		uint32_t tag = GET16(entry);
+		uint32_t value = (GET16(entry + 2) == 3 ? GET16(entry + 8) : GET32(entry + 8));
+		if (tag == 0x0201)	// JPEGInterchangeFormat
+			offset = value;
+		else if (tag == 0x0202)	// JPEGInterchangeFormatLength
+			length = value;
+	}
+#undef GET16
+#undef GET32
+	if (offset == 0 || length < 4 || offset > size || length > size - offset)
+		return;
+	if (tiff[offset] != 0xFF || tiff[offset + 1] != 0xD8)
+		return;
+	info.offset = base + offset;
+	info.size = length;
+	parseFrameSize(tiff + offset, length, info.width, info.height);
+}
+
+bool MtpThumbnailCache::parseFrameSize(const unsigned char* data, size_t size, uint32_t& width, uint32_t& height) {
+	size_t pos = 2;
+
+	while (pos + 4 <= size && data[pos] == 0xFF) {
+		unsigned char marker = data[pos + 1];
+		if (marker == 0xFF) {
+			pos++;
+			continue;
+		}
+		if (marker == 0xDA || marker == 0xD9)
+			break;
+		size_t length = (data[pos + 2] << 8) | data[pos + 3];
+		if (length < 2)
+			break;
+		if (marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC) {
+			if (length < 7 || pos + 9 > size)
+				break;
+			height = (data[pos + 5] << 8) | data[pos + 6];
+			width = (data[pos + 7] << 8) | data[pos + 8];
+			return true;
+		}
+		pos += 2 + length;
+	}
+	return false;
+}
@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2016 TeamWin
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *    http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef _MTP_THUMBNAIL_CACHE_H
+#define _MTP_THUMBNAIL_CACHE_H
+
+#include <stdint.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <string>
+#include <vector>
+
+// Camera JPEGs carry a small JPEG of their own in the EXIF header. Its
+// location in the file is all that is needed to answer GetThumb, so the
+// thumbnail is sent from the file like any other range of it instead of
+// the client pulling the whole picture. Locations are cached by inode and
+// modification time, and the pictures of a folder that is being listed are
+// parsed on a worker thread ahead of the client asking for them.
+class MtpThumbnailCache {
+public:
+	struct Info {
+		uint64_t offset;			// of the thumbnail in the file
+		uint32_t size;				// 0 if the file has no thumbnail
+		uint32_t width, height;			// of the thumbnail
+		uint32_t imageWidth, imageHeight, imageDepth;
+	};
+	// a changed file gets a new key
+	struct Key {
+		dev_t dev;
+		ino_t ino;
+		time_t mtime;
+		off_t size;
+		bool operator<(const Key& other) const;
+	};
+
+	static bool isJpeg(const std::string& name);
+	// Fills info for the file at path, which was just stat'ed into st.
+	// Returns false if it has no thumbnail.
+	static bool find(const std::string& path, const struct stat& st, Info& info);
+	// Queues paths for the worker thread, replacing the ones it has not
+	// got to yet, as the client has moved on to another folder
+	static void prefetch(const std::vector<std::string>& paths);
+
+private:
+	static Key makeKey(const struct stat& st);
+	static void parse(const std::string& path, Info& info);
+	static void parseExif(const unsigned char* tiff, size_t size, uint64_t base, Info& info);
+	static bool parseFrameSize(const unsigned char* data, size_t size, uint32_t& width, uint32_t& height);
+	static void* workerThread(void* cookie);
+};
+
+#endif // _MTP_THUMBNAIL_CACHE_H
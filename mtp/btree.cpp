@@ -15,6 +15,7 @@
  */
 
 #include <utils/threads.h>
+#include <algorithm>
 #include "btree.hpp"
 #include "MtpDebug.h"
 
@@ -25,8 +26,8 @@ Tree::Tree(MtpObjectHandle handle, MtpObjectHandle parent, const std::string& na
 
 // Destructor
 Tree::~Tree() {
-	for (std::map<MtpObjectHandle, Node*>::iterator it = entries.begin(); it != entries.end(); ++it)
-		delete it->second;
+	for (std::vector<Node*>::iterator it = entries.begin(); it != entries.end(); ++it)
+		delete *it;
 	entries.clear();
 }
 
@@ -36,6 +37,14 @@ int Tree::getCount(void) {
 	return count;
 }
 
+static bool compareHandle(const Node* node, MtpObjectHandle handle) {
+	return node->Mtpid() < handle;
+}
+
+std::vector<Node*>::iterator Tree::findEntry(MtpObjectHandle handle) {
+	return std::lower_bound(entries.begin(), entries.end(), handle, compareHandle);
+}
+
 void Tree::addEntry(Node* node) {
 	if (node->Mtpid() == 0) {
 		MTPE("Tree::addEntry: not adding node with 0 handle.\n");
@@ -45,13 +54,21 @@ void Tree::addEntry(Node* node) {
 		MTPE("Tree::addEntry: not adding node with handle %u == parent.\n", node->Mtpid());
 		return;
 	}
-	entries[node->Mtpid()] = node;
+	if (entries.empty() || entries.back()->Mtpid() < node->Mtpid()) {
+		entries.push_back(node);
+		return;
+	}
+	std::vector<Node*>::iterator it = findEntry(node->Mtpid());
+	if (it != entries.end() && (*it)->Mtpid() == node->Mtpid())
+		*it = node;
+	else
+		entries.insert(it, node);
 }
 
 Node* Tree::findEntryByName(std::string name) {
-	for (std::map<MtpObjectHandle, Node*>::iterator it = entries.begin(); it != entries.end(); ++it)
+	for (std::vector<Node*>::iterator it = entries.begin(); it != entries.end(); ++it)
 	{
-		Node* node = it->second;
+		Node* node = *it;
 		if (node->getName().compare(name) == 0 && node->Mtpid() > 0)
 			return node;
 	}
@@ -59,21 +76,21 @@ Node* Tree::findEntryByName(std::string name) {
 }
 
 Node* Tree::findNode(MtpObjectHandle handle) {
-	std::map<MtpObjectHandle, Node*>::iterator it = entries.find(handle);
-	if (it != entries.end())
-		return it->second;
+	std::vector<Node*>::iterator it = findEntry(handle);
+	if (it != entries.end() && (*it)->Mtpid() == handle)
+		return *it;
 	return NULL;
 }
 
 void Tree::getmtpids(MtpObjectHandleList* mtpids) {
-	for (std::map<MtpObjectHandle, Node*>::iterator it = entries.begin(); it != entries.end(); ++it)
-		mtpids->push_back(it->second->Mtpid());
+	for (std::vector<Node*>::iterator it = entries.begin(); it != entries.end(); ++it)
+		mtpids->push_back((*it)->Mtpid());
 }
 
 void Tree::deleteNode(MtpObjectHandle handle) {
-	std::map<MtpObjectHandle, Node*>::iterator it = entries.find(handle);
-	if (it != entries.end()) {
-		delete it->second;
+	std::vector<Node*>::iterator it = findEntry(handle);
+	if (it != entries.end() && (*it)->Mtpid() == handle) {
+		delete *it;
 		entries.erase(it);
 	}
 }
@@ -19,7 +19,7 @@
 
 #include <vector>
 #include <string>
-#include <map>
+#include <time.h>
 #include "MtpTypes.h"
 
 // A directory entry
@@ -27,6 +27,10 @@ class Node {
 	MtpObjectHandle handle;
 	MtpObjectHandle parent;
 	std::string name;	// name only without path
+	// stat fields, filled in on demand by MtpStorage::statNode()
+	uint64_t size;
+	time_t mtime;
+	bool statValid;
 
 public:
 	Node();
@@ -34,16 +38,20 @@ public:
 	virtual ~Node() {}
 
 	virtual bool isDir() const { return false; }
+	// from the name, directories are associations
+	MtpObjectFormat getFormat() const;
 
 	void rename(const std::string& newName);
 	MtpObjectHandle Mtpid() const;
 	MtpObjectHandle getMtpParentId() const;
 	const std::string& getName() const;
 
-	void addProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType);
-	void updateProperty(MtpPropertyCode property, uint64_t valueInt, std::string valueStr, MtpDataType dataType);
-	void addProperties(const std::string& path, int storageID);
-	uint64_t getIntProperty(MtpPropertyCode property);
+	bool hasStat() const { return statValid; }
+	void setStat(uint64_t newSize, time_t newMtime);
+	void invalidateStat() { statValid = false; }
+	uint64_t getSize() const { return size; }
+	time_t getMtime() const { return mtime; }
+
 	struct mtpProperty {
 		MtpPropertyCode property;
 		MtpDataType dataType;
@@ -51,15 +59,23 @@ public:
 		std::string valueStr;
 		mtpProperty() : property(0), dataType(0), valueInt(0) {}
 	};
-	std::vector<mtpProperty>& getMtpProps();
-	std::vector<mtpProperty> mtpProp;
-	const mtpProperty& getProperty(MtpPropertyCode property);
+	// Properties are not stored per node, they are computed from the stat
+	// fields at query time. Returns false for unsupported properties.
+	bool getProperty(MtpPropertyCode property, MtpStorageID storageID, mtpProperty& prop) const;
+
+	// properties reported when a client asks for all properties of an object
+	static const MtpPropertyCode allProperties[];
+	static const size_t allPropertiesCount;
 };
 
 // A directory
 class Tree : public Node {
-	std::map<MtpObjectHandle, Node*> entries;
+	// sorted by handle; handles are allocated in increasing order, so new
+	// entries are normally appended
+	std::vector<Node*> entries;
 	bool alreadyRead;
+
+	std::vector<Node*>::iterator findEntry(MtpObjectHandle handle);
 public:
 	Tree(MtpObjectHandle handle, MtpObjectHandle parent, const std::string& name);
 	~Tree();
@@ -19,6 +19,8 @@
 #include <utils/Log.h>
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <limits.h>
 #include <unistd.h>
@@ -663,12 +665,39 @@ MtpResponseCode MyMtpDatabase::getObjectInfo(MtpObjectHandle handle, MtpObjectIn
 
 void* MyMtpDatabase::getThumbnail(MtpObjectHandle handle, size_t& outThumbSize) {
 	MtpString path;
-	int64_t length;
-	MtpObjectFormat format;
+	uint64_t offset;
 	void* result = NULL;
-	outThumbSize = 0;
-	MTPE("MyMtpDatabase::getThumbnail not implemented, returning 0\n");
-	return 0;
+	if (getThumbnailRange(handle, path, offset, outThumbSize) != MTP_RESPONSE_OK || outThumbSize == 0)
+		return NULL;
+	int fd = open((const char*)path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		MTPE("MyMtpDatabase::getThumbnail unable to open '%s': %s\n", (const char*)path, strerror(errno));
+		return NULL;
+	}
+	result = malloc(outThumbSize);
+	if (result && pread(fd, result, outThumbSize, offset) != (ssize_t)outThumbSize) {
+		free(result);
+		result = NULL;
+	}
+	close(fd);
+	if (!result)
+		outThumbSize = 0;
+	return result;
+}
+
+MtpResponseCode MyMtpDatabase::getThumbnailRange(MtpObjectHandle handle, MtpString& outFilePath, uint64_t& outOffset, size_t& outThumbSize) {
+	std::map<int, MtpStorage*>::iterator storit;
+	MtpThumbnailCache::Info info;
+	for (storit = storagemap.begin(); storit != storagemap.end(); storit++) {
+		if (storit->second->getThumbnailInfo(handle, outFilePath, info) == 0) {
+			outOffset = info.offset;
+			outThumbSize = info.size;
+			MTPD("MyMtpDatabase::getThumbnailRange %u bytes at %llu\n", info.size, (unsigned long long)info.offset);
+			return MTP_RESPONSE_OK;
+		}
+	}
+	MTPE("MyMtpDatabase::getThumbnailRange MTP_RESPONSE_INVALID_OBJECT_HANDLE %i\n", handle);
+	return MTP_RESPONSE_INVALID_OBJECT_HANDLE;
 }
 
 MtpResponseCode MyMtpDatabase::getObjectFilePath(MtpObjectHandle handle, MtpString& outFilePath, int64_t& outFileLength, MtpObjectFormat& outFormat) {
@@ -118,6 +118,11 @@ public:
 
     virtual void*                   getThumbnail(MtpObjectHandle handle, size_t& outThumbSize);
 
+    virtual MtpResponseCode         getThumbnailRange(MtpObjectHandle handle,
+                                            MtpString& outFilePath,
+                                            uint64_t& outOffset,
+                                            size_t& outThumbSize);
+
     virtual MtpResponseCode         getObjectFilePath(MtpObjectHandle handle,
                                             MtpString& outFilePath,
                                             int64_t& outFileLength,
@@ -36,4 +36,25 @@ ifneq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
 	LOCAL_SRC_FILES = src/oaes_lib.c src/isaac/rand.c src/ftime.c
 	LOCAL_STATIC_LIBRARIES = libc
 	include $(BUILD_STATIC_LIBRARY)
+
+	# Build host static library and binary for twrpTar_host, glibc
+	# still has ftime
+	include $(CLEAR_VARS)
+	LOCAL_MODULE := libopenaes_host
+	LOCAL_MODULE_TAGS := optional
+	LOCAL_C_INCLUDES := \
+		$(commands_recovery_local_path)/openaes/src/isaac \
+		$(commands_recovery_local_path)/openaes/inc
+	LOCAL_SRC_FILES = src/oaes_lib.c src/isaac/rand.c
+	include $(BUILD_HOST_STATIC_LIBRARY)
+
+	include $(CLEAR_VARS)
+	LOCAL_SRC_FILES:= src/oaes.c
+	LOCAL_C_INCLUDES := \
+		$(commands_recovery_local_path)/openaes/src/isaac \
+		$(commands_recovery_local_path)/openaes/inc
+	LOCAL_MODULE := openaes
+	LOCAL_MODULE_TAGS := optional
+	LOCAL_STATIC_LIBRARIES = libopenaes_host
+	include $(BUILD_HOST_EXECUTABLE)
 endif
@@ -403,6 +403,33 @@ int OpenRecoveryScript::run_script_file(void) {
 				ret_val = PartitionManager.Fix_Contexts();
 				if (ret_val != 0)
 					ret_val = 1; // failure
+			} else if (strcmp(command, "dedupgc") == 0) {
+				ret_val = PartitionManager.Collect_Chunk_Garbage();
+			} else if (strcmp(command, "restorefiles") == 0) {
+				// restorefiles <backup folder> <path> [<path> ...]
+				vector<string> Paths;
+				string Folder;
+				Paths = TWFunc::Split_String(value, " ");
+				if (!Paths.empty()) {
+					Folder = Paths.front();
+					Paths.erase(Paths.begin());
+				}
+				if (Paths.empty()) {
+					LOGERR("restorefiles needs a backup folder and at least one path\n");
+					ret_val = 1;
+					continue;
+				}
+				if (Folder[0] != '/') {
+					PartitionManager.Mount_Current_Storage(true);
+					Folder = DataManager::GetStrValue(TW_BACKUPS_FOLDER_VAR) + "/" + Folder;
+				}
+				if (!TWFunc::Path_Exists(Folder)) {
+					gui_msg(Msg(msg::kError, "locate_backup_err=Unable to locate backup '{1}'")(Folder));
+					ret_val = 1;
+					continue;
+				}
+				DataManager::SetValue("tw_action_text2", gui_parse_text("{@restore}"));
+				ret_val = PartitionManager.Restore_Files(Folder, Paths);
 			} else if (strcmp(command, "decrypt") == 0) {
 				if (*value) {
 					ret_val = PartitionManager.Decrypt_Device(value);
@@ -757,6 +784,7 @@ int OpenRecoveryScript::Restore_ADB_Backup(void) {
 	int orsfd = open(ORS_OUTPUT_FILE, O_WRONLY);
 
 	part_settings.total_restore_size = 0;
+	part_settings.inline_md5 = false;
 
 	PartitionManager.Mount_All_Storage();
 	DataManager::SetValue(TW_SKIP_MD5_CHECK_VAR, 0);
@@ -30,6 +30,7 @@
 #include <sstream>
 #include <sys/param.h>
 #include <fcntl.h>
+#include <pthread.h>
 
 #ifdef TW_INCLUDE_CRYPTO
 	#include "cutils/properties.h"
@@ -44,6 +45,9 @@
 #include "twrpDigest.hpp"
 #include "twrpTar.hpp"
 #include "twrpDU.hpp"
+#include "fixContexts.hpp"
+#include "twrpTrace.hpp"
+#include "twrpMountTable.hpp"
 #include "infomanager.hpp"
 #include "set_metadata.h"
 #include "gui/gui.hpp"
@@ -79,6 +83,9 @@ using namespace std;
 extern struct selabel_handle *selinux_handle;
 extern bool datamedia;
 
+// Images up to this size are verified in memory during an inline md5 restore
+#define TW_MD5_STAGE_SIZE (64 * 1048576LLU)
+
 struct flag_list {
 	const char *name;
 	unsigned flag;
@@ -231,6 +238,9 @@ TWPartition::TWPartition() {
 	Mount_Read_Only = false;
 	Is_Adopted_Storage = false;
 	Adopted_GUID = "";
+	Probe_Result = 0;
+	Mounted_Generation = 0;
+	Mounted_State = false;
 }
 
 TWPartition::~TWPartition(void) {
@@ -1036,85 +1046,154 @@ unsigned long long TWPartition::IOCTL_Get_Block_Size() {
 	return TWFunc::IOCTL_Get_Block_Size(Actual_Block_Device.c_str());
 }
 
-bool TWPartition::Find_Partition_Size(void) {
+// Snapshot of the partition tables, see Snapshot_Partition_Tables
+static bool partition_tables_loaded = false;
+static vector<pair<string, unsigned long long> > dumchar_sizes;
+static vector<pair<string, unsigned long long> > proc_partition_sizes;
+
+// Reads the block devices and their sizes in bytes from /proc/dumchar_info
+// on MTK devices, in file order
+static void Read_Dumchar_Sizes(vector<pair<string, unsigned long long> >& Sizes) {
 	FILE* fp;
 	char line[512];
-	string tmpdevice;
 
+	Sizes.clear();
 	fp = fopen("/proc/dumchar_info", "rt");
-	if (fp != NULL) {
-		while (fgets(line, sizeof(line), fp) != NULL)
-		{
-			char label[32], device[32];
-			unsigned long size = 0;
+	if (fp == NULL)
+		return;
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		char label[32], device[32];
+		unsigned long size = 0;
 
-			sscanf(line, "%s %lx %*x %*u %s", label, &size, device);
+		device[0] = 0;
+		sscanf(line, "%31s %lx %*x %*u %31s", label, &size, device);
 
-			// Skip header, annotation	and blank lines
-			if ((strncmp(device, "/dev/", 5) != 0) || (strlen(line) < 8))
-				continue;
+		// Skip header, annotation	and blank lines
+		if ((strncmp(device, "/dev/", 5) != 0) || (strlen(line) < 8))
+			continue;
 
-			tmpdevice = "/dev/";
-			tmpdevice += label;
-			if (tmpdevice == Primary_Block_Device || tmpdevice == Alternate_Block_Device) {
-				Size = size;
-				fclose(fp);
-				return true;
-			}
-		}
+		Sizes.push_back(make_pair(string("/dev/") + label, (unsigned long long)size));
 	}
+	fclose(fp);
+}
 
-	unsigned long long ioctl_size = IOCTL_Get_Block_Size();
-	if (ioctl_size) {
-		Size = ioctl_size;
-		return true;
-	}
+// Reads the block devices and their sizes in bytes from /proc/partitions
+static bool Read_Proc_Partition_Sizes(vector<pair<string, unsigned long long> >& Sizes) {
+	FILE* fp;
+	char line[512];
 
-	// In this case, we'll first get the partitions we care about (with labels)
+	Sizes.clear();
 	fp = fopen("/proc/partitions", "rt");
 	if (fp == NULL)
 		return false;
-
 	while (fgets(line, sizeof(line), fp) != NULL)
 	{
 		unsigned long major, minor, blocks;
 		char device[512];
-		char tmpString[64];
 
 		if (strlen(line) < 7 || line[0] == 'm')	 continue;
-		sscanf(line + 1, "%lu %lu %lu %s", &major, &minor, &blocks, device);
-
-		tmpdevice = "/dev/block/";
-		tmpdevice += device;
-		if (tmpdevice == Primary_Block_Device || tmpdevice == Alternate_Block_Device) {
-			// Adjust block size to byte size
-			Size = blocks * 1024ULL;
-			fclose(fp);
+		if (sscanf(line + 1, "%lu %lu %lu %511s", &major, &minor, &blocks, device) != 4)
+			continue;
+
+		// Adjust block size to byte size
+		Sizes.push_back(make_pair(string("/dev/block/") + device, blocks * 1024ULL));
+	}
+	fclose(fp);
+	return true;
+}
+
+// Every partition in the fstab looks its size up while the fstab is
+// processed, so the tables are read once for all of them then
+void TWPartition::Snapshot_Partition_Tables(bool Enable) {
+	partition_tables_loaded = false;
+	if (Enable) {
+		Read_Dumchar_Sizes(dumchar_sizes);
+		Read_Proc_Partition_Sizes(proc_partition_sizes);
+		partition_tables_loaded = true;
+	} else {
+		dumchar_sizes.clear();
+		proc_partition_sizes.clear();
+	}
+}
+
+bool TWPartition::Find_Partition_Size(void) {
+	vector<pair<string, unsigned long long> > sizes;
+	vector<pair<string, unsigned long long> >::const_iterator entry;
+	const vector<pair<string, unsigned long long> >* table = &dumchar_sizes;
+
+	if (!partition_tables_loaded) {
+		Read_Dumchar_Sizes(sizes);
+		table = &sizes;
+	}
+	for (entry = table->begin(); entry != table->end(); entry++) {
+		if (entry->first == Primary_Block_Device || entry->first == Alternate_Block_Device) {
+			Size = entry->second;
+			return true;
+		}
+	}
+
+	unsigned long long ioctl_size = IOCTL_Get_Block_Size();
+	if (ioctl_size) {
+		Size = ioctl_size;
+		return true;
+	}
+
+	// In this case, we'll first get the partitions we care about (with labels)
+	table = &proc_partition_sizes;
+	if (!partition_tables_loaded) {
+		if (!Read_Proc_Partition_Sizes(sizes))
+			return false;
+		table = &sizes;
+	}
+	for (entry = table->begin(); entry != table->end(); entry++) {
+		if (entry->first == Primary_Block_Device || entry->first == Alternate_Block_Device) {
+			Size = entry->second;
 			return true;
 		}
 	}
-	fclose(fp);
 	return false;
 }
 
+// Partitions are checked from several backup threads at once
+static pthread_mutex_t mounted_state_lock = PTHREAD_MUTEX_INITIALIZER;
+
 bool TWPartition::Is_Mounted(void) {
 	if (!Can_Be_Mounted)
 		return false;
 
 	struct stat st1, st2;
 	string test_path;
+	unsigned generation;
 
+	// Nothing was mounted or unmounted since the last check
+	bool have_generation = twrpMountTable::Get_Generation(generation);
+	if (have_generation) {
+		pthread_mutex_lock(&mounted_state_lock);
+		bool cached = (generation == Mounted_Generation);
+		bool state = Mounted_State;
+		pthread_mutex_unlock(&mounted_state_lock);
+		if (cached)
+			return state;
+	}
+
+	bool ret = false;
 	// Check to see if the mount point directory exists
 	test_path = Mount_Point + "/.";
-	if (stat(test_path.c_str(), &st1) != 0)  return false;
-
-	// Check to see if the directory above the mount point exists
-	test_path = Mount_Point + "/../.";
-	if (stat(test_path.c_str(), &st2) != 0)  return false;
-
-	// Compare the device IDs -- if they match then we're (probably) using tmpfs instead of an actual device
-	int ret = (st1.st_dev != st2.st_dev) ? true : false;
+	if (stat(test_path.c_str(), &st1) == 0) {
+		// Check to see if the directory above the mount point exists
+		test_path = Mount_Point + "/../.";
+		// Compare the device IDs -- if they match then we're (probably) using tmpfs instead of an actual device
+		if (stat(test_path.c_str(), &st2) == 0)
+			ret = (st1.st_dev != st2.st_dev);
+	}
 
+	if (have_generation) {
+		pthread_mutex_lock(&mounted_state_lock);
+		Mounted_State = ret;
+		Mounted_Generation = generation;
+		pthread_mutex_unlock(&mounted_state_lock);
+	}
 	return ret;
 }
 
@@ -1135,6 +1214,7 @@ bool TWPartition::Mount(bool Display_Error) {
 	} else if (!Can_Be_Mounted) {
 		return false;
 	}
+	twrpTraceSpan span("mount", "Mount", Mount_Point);
 
 	Find_Actual_Block_Device();
 
@@ -1323,6 +1403,7 @@ bool TWPartition::Wipe(string New_File_System) {
 	bool wiped = false, update_crypt = false, recreate_media = true;
 	int check;
 	string Layout_Filename = Mount_Point + "/.layout_version";
+	twrpTraceSpan span("wipe", "Wipe", Mount_Point + " " + New_File_System);
 
 	if (!Can_Be_Wiped) {
 		gui_msg(Msg(msg::kError, "cannot_wipe=Partition {1} cannot be wiped.")(Display_Name));
@@ -1617,6 +1698,7 @@ bool TWPartition::Check_MD5(PartitionSettings *part_settings) {
 	char split_filename[512];
 	int index = 0;
 	twrpDigest md5sum;
+	twrpTraceSpan span("restore", "Check_MD5", Backup_FileName);
 
 	sync();
 
@@ -1802,10 +1884,28 @@ bool TWPartition::Wipe_Encryption() {
 	return false;
 }
 
-void TWPartition::Check_FS_Type() {
+int TWPartition::Probe_Block_Device(const string& Device, string& File_System) {
 	const char* type;
 	blkid_probe pr;
 
+	pr = blkid_new_probe_from_filename(Device.c_str());
+	if (blkid_do_fullprobe(pr)) {
+		blkid_free_probe(pr);
+		return -1;
+	}
+	if (blkid_probe_lookup_value(pr, "TYPE", &type, NULL) < 0) {
+		blkid_free_probe(pr);
+		return -2;
+	}
+	File_System = type;
+	blkid_free_probe(pr);
+	return 0;
+}
+
+void TWPartition::Check_FS_Type() {
+	string type;
+	int ret;
+
 	if (Fstab_File_System == "yaffs2" || Fstab_File_System == "mtd" || Fstab_File_System == "bml" || Ignore_Blkid)
 		return; // Running blkid on some mtd devices causes a massive crash or needs to be skipped
 
@@ -1813,21 +1913,24 @@ void TWPartition::Check_FS_Type() {
 	if (!Is_Present)
 		return;
 
-	pr = blkid_new_probe_from_filename(Actual_Block_Device.c_str());
-	if (blkid_do_fullprobe(pr)) {
-		blkid_free_probe(pr);
+	if (!Probed_Block_Device.empty() && Probed_Block_Device == Actual_Block_Device) {
+		// Probed while the fstab was processed, see TWPartitionManager::Probe_File_Systems
+		ret = Probe_Result;
+		type = Probed_File_System;
+	} else {
+		ret = Probe_Block_Device(Actual_Block_Device, type);
+	}
+	Probed_Block_Device.clear();
+
+	if (ret == -1) {
 		LOGINFO("Can't probe device %s\n", Actual_Block_Device.c_str());
 		return;
 	}
-
-	if (blkid_probe_lookup_value(pr, "TYPE", &type, NULL) < 0) {
-		blkid_free_probe(pr);
+	if (ret == -2) {
 		LOGINFO("can't find filesystem on device %s\n", Actual_Block_Device.c_str());
 		return;
 	}
-
 	Current_File_System = type;
-	blkid_free_probe(pr);
 }
 
 bool TWPartition::Wipe_EXT23(string File_System) {
@@ -2142,6 +2245,7 @@ bool TWPartition::Wipe_Data_Without_Wiping_Media_Func(const string& parent __unu
 bool TWPartition::Backup_Tar(PartitionSettings *part_settings, pid_t *tar_fork_pid) {
 	string Full_FileName;
 	twrpTar tar;
+	twrpTraceSpan span("backup", "Backup_Tar", Backup_Display_Name);
 
 	if (!Mount(true))
 		return false;
@@ -2150,6 +2254,11 @@ bool TWPartition::Backup_Tar(PartitionSettings *part_settings, pid_t *tar_fork_p
 	gui_msg(Msg("backing_up=Backing up {1}...")(Backup_Display_Name));
 
 	DataManager::GetValue(TW_USE_COMPRESSION_VAR, tar.use_compression);
+	string Compression_Type = DataManager::GetStrValue(TW_COMPRESSION_TYPE_VAR);
+	if (Compression_Type == "lz4")
+		tar.compression_type = LZ4_COMPRESSED;
+	else if (Compression_Type == "zstd")
+		tar.compression_type = ZSTD_COMPRESSED;
 
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	if (Can_Encrypt_Backup) {
@@ -2175,6 +2284,19 @@ bool TWPartition::Backup_Tar(PartitionSettings *part_settings, pid_t *tar_fork_p
 	tar.setsize(Backup_Size);
 	tar.partition_name = Backup_Name;
 	tar.backup_folder = part_settings->Backup_Folder;
+	tar.write_manifest = !part_settings->adbbackup;
+	tar.write_index = !part_settings->adbbackup && DataManager::GetIntValue(TW_TAR_INDEX_VAR) != 0;
+	if (tar.write_manifest && DataManager::GetIntValue(TW_INCREMENTAL_BACKUP_VAR) != 0) {
+		string Base_Folder = DataManager::GetStrValue(TW_INCREMENTAL_BASE_VAR);
+		if (!Base_Folder.empty() && Base_Folder[0] != '/')
+			Base_Folder = TWFunc::Get_Path(part_settings->Backup_Folder) + Base_Folder;
+		if (!Base_Folder.empty() && TWFunc::Path_Exists(Base_Folder + "/" + Backup_Name + ".manifest")) {
+			gui_msg(Msg("incremental_backup=Creating incremental backup of {1} based on {2}")(Backup_Display_Name)(TWFunc::Get_Filename(Base_Folder)));
+			tar.incremental_base = Base_Folder;
+		} else {
+			gui_msg(Msg(msg::kWarning, "incremental_no_base=No base backup found for {1}, creating a full backup.")(Backup_Display_Name));
+		}
+	}
 	if (tar.createTarFork(tar_fork_pid) != 0)
 		return false;
 	return true;
@@ -2203,7 +2325,12 @@ bool TWPartition::Backup_Image(PartitionSettings *part_settings) {
 			return false;
 	}
 
-	if (!Raw_Read_Write(part_settings))
+	vector<bool> Used_Blocks;
+	uint32_t Block_Size;
+	if (!part_settings->adbbackup && DataManager::GetIntValue(TW_SPARSE_IMAGE_BACKUP_VAR) != 0 && Get_Used_Blocks(Used_Blocks, Block_Size)) {
+		if (!Write_Sparse_Image(part_settings, Used_Blocks, Block_Size))
+			return false;
+	} else if (!Raw_Read_Write(part_settings))
 		return false;
 
 	if (part_settings->adbbackup) {
@@ -2213,14 +2340,230 @@ bool TWPartition::Backup_Image(PartitionSettings *part_settings) {
 	return true;
 }
 
+static uint16_t Get_LE16(const unsigned char* buf) {
+	return buf[0] | (buf[1] << 8);
+}
+
+static uint32_t Get_LE32(const unsigned char* buf) {
+	return buf[0] | (buf[1] << 8) | (buf[2] << 16) | ((uint32_t)buf[3] << 24);
+}
+
+static void Mark_Used(vector<bool>& Used, uint64_t Start, uint64_t Count) {
+	for (uint64_t block = Start; block < Start + Count && block < Used.size(); block++)
+		Used[block] = true;
+}
+
+// Groups holding a backup superblock and group descriptors
+static bool Ext4_Has_Super(uint64_t Group, bool Sparse_Super) {
+	if (!Sparse_Super || Group <= 1)
+		return true;
+	for (uint64_t base = 3; base <= 7; base += 2) {
+		uint64_t power = base;
+		while (power < Group)
+			power *= base;
+		if (power == Group)
+			return true;
+	}
+	return false;
+}
+
+// Reads the block bitmaps of the ext4 file system on fd. Blocks past the end
+// of the file system, like a crypto footer, are always used. Returns false
+// for anything that is not an ext4 layout this understands.
+static bool Get_Ext4_Used_Blocks(int fd, unsigned long long Dev_Size, uint32_t& Block_Size, vector<bool>& Used) {
+	unsigned char sb[1024];
+
+	if (pread64(fd, sb, sizeof(sb), 1024) != sizeof(sb) || Get_LE16(sb + 0x38) != 0xef53)
+		return false;
+	uint32_t incompat = Get_LE32(sb + 0x60), ro_compat = Get_LE32(sb + 0x64);
+	if (Get_LE32(sb + 0x18) > 6 || (incompat & 0x10) || (ro_compat & 0x200)) {
+		LOGINFO("ext4 uses meta_bg or bigalloc, backing up the whole image\n");
+		return false;
+	}
+	Block_Size = 1024 << Get_LE32(sb + 0x18);
+	uint64_t blocks = Get_LE32(sb + 0x04);
+	uint32_t desc_size = 32;
+	if (incompat & 0x80) {
+		blocks |= (uint64_t)Get_LE32(sb + 0x150) << 32;
+		desc_size = Get_LE16(sb + 0xfe);
+	}
+	uint32_t first_block = Get_LE32(sb + 0x14), per_group = Get_LE32(sb + 0x20);
+	uint32_t inode_size = Get_LE32(sb + 0x4c) == 0 ? 128 : Get_LE16(sb + 0x58);
+	if (Dev_Size % Block_Size != 0 || blocks > Dev_Size / Block_Size || blocks <= first_block
+		|| per_group == 0 || per_group > Block_Size * 8 || desc_size < 32 || desc_size > Block_Size)
+		return false;
+	uint64_t groups = (blocks - first_block + per_group - 1) / per_group;
+	uint64_t gdt_blocks = (groups * desc_size + Block_Size - 1) / Block_Size;
+	uint64_t itable_blocks = ((uint64_t)Get_LE32(sb + 0x28) * inode_size + Block_Size - 1) / Block_Size;
+	uint32_t reserved_gdt = Get_LE16(sb + 0xce);
+
+	vector<unsigned char> gdt(gdt_blocks * Block_Size), bitmap(Block_Size);
+	if (pread64(fd, &gdt[0], gdt.size(), (off64_t)(first_block + 1) * Block_Size) != (ssize_t)gdt.size())
+		return false;
+
+	Used.assign(Dev_Size / Block_Size, true);
+	for (uint64_t block = first_block; block < blocks; block++)
+		Used[block] = false;
+	for (uint64_t group = 0; group < groups; group++) {
+		const unsigned char* desc = &gdt[group * desc_size];
+		uint64_t start = first_block + group * per_group;
+		uint64_t count = blocks - start < per_group ? blocks - start : per_group;
+		uint64_t block_bitmap = Get_LE32(desc), inode_bitmap = Get_LE32(desc + 0x04), inode_table = Get_LE32(desc + 0x08);
+
+		if (desc_size >= 64) {
+			block_bitmap |= (uint64_t)Get_LE32(desc + 0x20) << 32;
+			inode_bitmap |= (uint64_t)Get_LE32(desc + 0x24) << 32;
+			inode_table |= (uint64_t)Get_LE32(desc + 0x28) << 32;
+		}
+		// Group metadata is kept whatever the bitmaps say
+		Mark_Used(Used, block_bitmap, 1);
+		Mark_Used(Used, inode_bitmap, 1);
+		Mark_Used(Used, inode_table, itable_blocks);
+		if (Get_LE16(desc + 0x12) & 0x2) {
+			// EXT4_BG_BLOCK_UNINIT, the bitmap was never written. Without
+			// flex_bg the group holds its own tables, keep all of it.
+			if (!(incompat & 0x200))
+				Mark_Used(Used, start, count);
+			else if (Ext4_Has_Super(group, ro_compat & 0x1))
+				Mark_Used(Used, start, 1 + gdt_blocks + reserved_gdt);
+			continue;
+		}
+		if (block_bitmap >= blocks || pread64(fd, &bitmap[0], Block_Size, (off64_t)block_bitmap * Block_Size) != (ssize_t)Block_Size)
+			return false;
+		for (uint64_t i = 0; i < count; i++) {
+			if (bitmap[i >> 3] & (1 << (i & 7)))
+				Used[start + i] = true;
+		}
+	}
+	return true;
+}
+
+bool TWPartition::Get_Used_Blocks(vector<bool>& Used, uint32_t& Block_Size) {
+	int fd = open(Actual_Block_Device.c_str(), O_RDONLY | O_LARGEFILE);
+	if (fd < 0)
+		return false;
+	bool ret = Get_Ext4_Used_Blocks(fd, Backup_Size, Block_Size, Used);
+	close(fd);
+	return ret;
+}
+
+bool TWPartition::Write_Sparse_Image(PartitionSettings *part_settings, const vector<bool>& Used, uint32_t Block_Size) {
+	string destfn = part_settings->Backup_Folder + "/" + Backup_FileName;
+	uint64_t total_blocks = Used.size(), used_blocks = 0, pos, end;
+	uint64_t max_run = (64 * 1048576LLU) / Block_Size;              // keeps total_sz of a chunk well within 32 bits
+	sparse_header_t header;
+	chunk_header_t chunk;
+	int src_fd = -1, dest_fd = -1;
+	bool ret = false;
+	char* buffer = NULL;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = SPARSE_HEADER_MAGIC;
+	header.major_version = 1;
+	header.minor_version = 0;
+	header.file_hdr_sz = sizeof(sparse_header_t);
+	header.chunk_hdr_sz = sizeof(chunk_header_t);
+	header.blk_sz = Block_Size;
+	header.total_blks = total_blocks;
+	for (pos = 0; pos < total_blocks; pos = end) {
+		for (end = pos + 1; end < total_blocks && Used[end] == Used[pos] && (!Used[pos] || end - pos < max_run); end++);
+		if (Used[pos])
+			used_blocks += end - pos;
+		header.total_chunks++;
+	}
+	LOGINFO("%s uses %llu of %llu blocks\n", Backup_Display_Name.c_str(), (unsigned long long)used_blocks, (unsigned long long)total_blocks);
+
+	src_fd = open(Actual_Block_Device.c_str(), O_RDONLY | O_LARGEFILE);
+	if (src_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Actual_Block_Device)(strerror(errno)));
+		return false;
+	}
+	dest_fd = open(destfn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR);
+	if (dest_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(destfn)(strerror(errno)));
+		goto exit;
+	}
+	buffer = (char*)malloc(1048576);
+	if (!buffer) {
+		LOGINFO("Write_Sparse_Image failed to malloc\n");
+		goto exit;
+	}
+	if (write(dest_fd, &header, sizeof(header)) != sizeof(header)) {
+		LOGINFO("Error writing destination fd (%s)\n", strerror(errno));
+		goto exit;
+	}
+	if (part_settings->progress)
+		part_settings->progress->SetPartitionSize(part_settings->total_restore_size);
+
+	for (pos = 0; pos < total_blocks; pos = end) {
+		for (end = pos + 1; end < total_blocks && Used[end] == Used[pos] && (!Used[pos] || end - pos < max_run); end++);
+		memset(&chunk, 0, sizeof(chunk));
+		chunk.chunk_type = Used[pos] ? CHUNK_TYPE_RAW : CHUNK_TYPE_DONT_CARE;
+		chunk.chunk_sz = end - pos;
+		chunk.total_sz = sizeof(chunk) + (Used[pos] ? (end - pos) * Block_Size : 0);
+		if (write(dest_fd, &chunk, sizeof(chunk)) != sizeof(chunk)) {
+			LOGINFO("Error writing destination fd (%s)\n", strerror(errno));
+			goto exit;
+		}
+		if (Used[pos]) {
+			unsigned long long Remain = (end - pos) * Block_Size;
+			if (lseek64(src_fd, (off64_t)pos * Block_Size, SEEK_SET) < 0) {
+				LOGINFO("Error seeking source fd (%s)\n", strerror(errno));
+				goto exit;
+			}
+			while (Remain > 0) {
+				ssize_t bs = Remain < 1048576 ? (ssize_t)Remain : 1048576;
+				if (read(src_fd, buffer, bs) != bs) {
+					LOGINFO("Error reading source fd (%s)\n", strerror(errno));
+					goto exit;
+				}
+				if (write(dest_fd, buffer, bs) != bs) {
+					LOGINFO("Error writing destination fd (%s)\n", strerror(errno));
+					goto exit;
+				}
+				Remain -= bs;
+			}
+		}
+		if (part_settings->progress)
+			part_settings->progress->UpdateSize(end * Block_Size);
+		if (PartitionManager.Check_Backup_Cancel() != 0)
+			goto exit;
+	}
+	if (part_settings->progress)
+		part_settings->progress->UpdateDisplayDetails(true);
+	fsync(dest_fd);
+	ret = true;
+exit:
+	if (src_fd >= 0)
+		close(src_fd);
+	if (dest_fd >= 0)
+		close(dest_fd);
+	if (buffer)
+		free(buffer);
+	return ret;
+}
+
+// Writes Buffer at Offset unless the device already holds the same data.
+// Reading is cheaper than writing on eMMC and UFS and saves wear.
+static bool Write_If_Changed(int fd, const void* Buffer, ssize_t Size, off64_t Offset, void* Compare_Buffer, unsigned long long& Unchanged) {
+	if (pread64(fd, Compare_Buffer, Size, Offset) == Size && memcmp(Buffer, Compare_Buffer, Size) == 0) {
+		Unchanged += Size;
+		return true;
+	}
+	return pwrite64(fd, Buffer, Size, Offset) == Size;
+}
+
 bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 	unsigned long long RW_Block_Size, Remain = Backup_Size;
 	int src_fd = -1, dest_fd = -1;
 	ssize_t bs;
 	bool ret = false;
 	void* buffer = NULL;
-	unsigned long long backedup_size = 0;
+	void* compare_buffer = NULL;
+	unsigned long long backedup_size = 0, unchanged_size = 0;
 	string srcfn, destfn;
+	bool compare = part_settings->PM_Method == PM_RESTORE && !part_settings->adbbackup && DataManager::GetIntValue(TW_COMPARE_IMAGE_RESTORE_VAR) != 0;
+	twrpTraceSpan span(part_settings->PM_Method == PM_BACKUP ? "backup" : "restore", "Raw_Read_Write", Backup_Display_Name);
 
 	if (part_settings->PM_Method == PM_BACKUP) {
 		srcfn = Actual_Block_Device;
@@ -2245,13 +2588,16 @@ bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 		return false;
 	}
 
-	dest_fd = open(destfn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR);
+	if (compare)
+		dest_fd = open(destfn.c_str(), O_RDWR | O_LARGEFILE);
+	else
+		dest_fd = open(destfn.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, S_IRUSR | S_IWUSR);
 	if (dest_fd < 0) {
 		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(destfn.c_str())(strerror(errno)));
 		goto exit;
 	}
 	
-	LOGINFO("Reading '%s', writing '%s'\n", srcfn.c_str(), destfn.c_str());
+	LOGINFO("Reading '%s', writing '%s'%s\n", srcfn.c_str(), destfn.c_str(), compare ? " where it differs" : "");
 
 	if (part_settings->adbbackup) {
 		RW_Block_Size = MAX_ADB_READ;
@@ -2263,7 +2609,9 @@ bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 	}
 
 	buffer = malloc((size_t)bs);
-	if (!buffer) {
+	if (compare)
+		compare_buffer = malloc((size_t)bs);
+	if (!buffer || (compare && !compare_buffer)) {
 		LOGINFO("Raw_Read_Write failed to malloc\n");
 		goto exit;
 	}
@@ -2278,7 +2626,12 @@ bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 			LOGINFO("Error reading source fd (%s)\n", strerror(errno));
 			goto exit;
 		}
-		if (write(dest_fd, buffer, bs) != bs) {
+		if (compare) {
+			if (!Write_If_Changed(dest_fd, buffer, bs, (off64_t)backedup_size, compare_buffer, unchanged_size)) {
+				LOGINFO("Error writing destination fd (%s)\n", strerror(errno));
+				goto exit;
+			}
+		} else if (write(dest_fd, buffer, bs) != bs) {
 			LOGINFO("Error writing destination fd (%s)\n", strerror(errno));
 			goto exit;
 		}
@@ -2291,6 +2644,8 @@ bool TWPartition::Raw_Read_Write(PartitionSettings *part_settings) {
 	}
 	if (part_settings->progress)
 		part_settings->progress->UpdateDisplayDetails(true);
+	if (compare)
+		LOGINFO("%llu of %llu bytes were already on '%s'\n", unchanged_size, backedup_size, destfn.c_str());
 	fsync(dest_fd);
 	ret = true;
 exit:
@@ -2300,6 +2655,99 @@ exit:
 		close(dest_fd);
 	if (buffer)
 		free(buffer);
+	if (compare_buffer)
+		free(compare_buffer);
+	return ret;
+}
+
+// Reads the image into memory while hashing it, so that the backup is read
+// only once and the partition is left alone unless the md5 matches
+bool TWPartition::Raw_Restore_Verified(PartitionSettings *part_settings) {
+	string srcfn = part_settings->Backup_Folder + "/" + Backup_FileName;
+	string md5file = srcfn + ".md5", md5_line;
+	unsigned long long Size = part_settings->total_restore_size, Pos = 0, restored_size = 0, unchanged_size = 0;
+	int src_fd = -1, dest_fd = -1;
+	ssize_t bs;
+	bool ret = false, compare;
+	unsigned char* buffer = NULL;
+	void* compare_buffer = NULL;
+	twrpDigest md5sum;
+
+	if (TWFunc::read_file(md5file, md5_line) != 0) {
+		gui_msg(Msg(msg::kError, "no_md5_found=No md5 file found for '{1}'. Please unselect Enable MD5 verification to restore.")(md5file));
+		return false;
+	}
+	src_fd = open(srcfn.c_str(), O_RDONLY | O_LARGEFILE);
+	if (src_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(srcfn.c_str())(strerror(errno)));
+		return false;
+	}
+	buffer = (unsigned char*)malloc(Size > 0 ? (size_t)Size : 1);
+	if (!buffer) {
+		LOGINFO("Raw_Restore_Verified failed to malloc\n");
+		goto exit;
+	}
+
+	md5sum.initMD5();
+	while (Pos < Size) {
+		bs = (ssize_t)(Size - Pos < 1048576LLU ? Size - Pos : 1048576LLU);
+		if (read(src_fd, buffer + Pos, bs) != bs) {
+			LOGINFO("Error reading source fd (%s)\n", strerror(errno));
+			goto exit;
+		}
+		md5sum.updateMD5stream(buffer + Pos, bs);
+		Pos += (unsigned long long)(bs);
+	}
+	md5sum.finalizeMD5stream();
+	if (md5_line.compare(0, 32, md5sum.createMD5string()) != 0) {
+		gui_msg(Msg(msg::kError, "md5_fail_match=MD5 failed to match on '{1}'.")(srcfn));
+		goto exit;
+	}
+	gui_msg("md5_match=MD5 matched");
+
+	compare = DataManager::GetIntValue(TW_COMPARE_IMAGE_RESTORE_VAR) != 0;
+	if (compare)
+		compare_buffer = malloc(1048576);
+	dest_fd = open(Actual_Block_Device.c_str(), compare_buffer ? O_RDWR | O_LARGEFILE : O_WRONLY | O_LARGEFILE);
+	if (dest_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Actual_Block_Device)(strerror(errno)));
+		goto exit;
+	}
+	LOGINFO("Writing verified '%s' to '%s'\n", srcfn.c_str(), Actual_Block_Device.c_str());
+	if (part_settings->progress)
+		part_settings->progress->SetPartitionSize(Size);
+	while (restored_size < Size) {
+		bs = (ssize_t)(Size - restored_size < 1048576LLU ? Size - restored_size : 1048576LLU);
+		if (compare_buffer) {
+			if (!Write_If_Changed(dest_fd, buffer + restored_size, bs, (off64_t)restored_size, compare_buffer, unchanged_size)) {
+				LOGINFO("Error writing destination fd (%s)\n", strerror(errno));
+				goto exit;
+			}
+		} else if (write(dest_fd, buffer + restored_size, bs) != bs) {
+			LOGINFO("Error writing destination fd (%s)\n", strerror(errno));
+			goto exit;
+		}
+		restored_size += (unsigned long long)(bs);
+		if (part_settings->progress)
+			part_settings->progress->UpdateSize(restored_size);
+		if (PartitionManager.Check_Backup_Cancel() != 0)
+			goto exit;
+	}
+	if (part_settings->progress)
+		part_settings->progress->UpdateDisplayDetails(true);
+	if (compare_buffer)
+		LOGINFO("%llu of %llu bytes were already on '%s'\n", unchanged_size, restored_size, Actual_Block_Device.c_str());
+	fsync(dest_fd);
+	ret = true;
+exit:
+	if (src_fd >= 0)
+		close(src_fd);
+	if (dest_fd >= 0)
+		close(dest_fd);
+	if (buffer)
+		free(buffer);
+	if (compare_buffer)
+		free(compare_buffer);
 	return ret;
 }
 
@@ -2335,9 +2783,18 @@ bool TWPartition::Backup_Dump_Image(PartitionSettings *part_settings) {
 
 unsigned long long TWPartition::Get_Restore_Size(PartitionSettings *part_settings) {
 	if (!part_settings->adbbackup) {
-		InfoManager restore_info(part_settings->Backup_Folder + "/" + Backup_Name + ".info");
-		if (restore_info.LoadValues() == 0) {
-			if (restore_info.GetValue("backup_size", Restore_Size) == 0) {
+		vector<string> Folders;
+		unsigned long long Folder_Size;
+
+		if (!Get_Restore_Chain(part_settings, Folders))
+			Folders.assign(1, part_settings->Backup_Folder);
+		Restore_Size = 0;
+		for (vector<string>::iterator folder = Folders.begin(); folder != Folders.end(); folder++) {
+			InfoManager restore_info(*folder + "/" + Backup_Name + ".info");
+			if (restore_info.LoadValues() != 0 || restore_info.GetValue("backup_size", Folder_Size) != 0)
+				break;
+			Restore_Size += Folder_Size;
+			if (folder + 1 == Folders.end()) {
 				LOGINFO("Read info file, restore size is %llu\n", Restore_Size);
 				return Restore_Size;
 			}
@@ -2373,6 +2830,7 @@ bool TWPartition::Restore_Tar(PartitionSettings *part_settings) {
 	string Full_FileName;
 	bool ret = false;
 	string Restore_File_System = Get_Restore_File_System(part_settings);
+	twrpTraceSpan span("restore", "Restore_Tar", Backup_Display_Name);
 
 	if (Has_Android_Secure) {
 		if (!Wipe_AndSec())
@@ -2395,23 +2853,43 @@ bool TWPartition::Restore_Tar(PartitionSettings *part_settings) {
 	if (!ReMount_RW(true))
 		return false;
 
-	Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
-	twrpTar tar;
-	tar.part_settings = part_settings;
-	tar.setdir(Backup_Path);
-	tar.setfn(Full_FileName);
-	tar.backup_name = Backup_Name;
+	vector<string> Folders;
+	if (!Get_Restore_Chain(part_settings, Folders))
+		return false;
+	part_settings->progress->SetPartitionSize(Get_Restore_Size(part_settings));
+	ret = true;
+	for (vector<string>::iterator folder = Folders.begin(); folder != Folders.end() && ret; folder++) {
+		twrpManifest manifest;
+		string Archive_Name = Backup_FileName;
+
+		if (manifest.Load(*folder + "/" + Backup_Name + ".manifest") && !manifest.Archive_Name.empty())
+			Archive_Name = manifest.Archive_Name;
+		if (Folders.size() > 1)
+			gui_msg(Msg("restoring_increment=Restoring {1} from {2}")(Backup_Display_Name)(TWFunc::Get_Filename(*folder)));
+		Full_FileName = *folder + "/" + Archive_Name;
+		twrpTar tar;
+		tar.part_settings = part_settings;
+		tar.setdir(Backup_Path);
+		tar.setfn(Full_FileName);
+		tar.backup_name = Backup_Name;
+		tar.verify_md5 = part_settings->inline_md5;
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
-	string Password;
-	DataManager::GetValue("tw_restore_password", Password);
-	if (!Password.empty())
-		tar.setpassword(Password);
+		string Password;
+		DataManager::GetValue("tw_restore_password", Password);
+		if (!Password.empty())
+			tar.setpassword(Password);
 #endif
-	part_settings->progress->SetPartitionSize(Get_Restore_Size(part_settings));
-	if (tar.extractTarFork() != 0)
-		ret = false;
-	else
-		ret = true;
+		if (tar.extractTarFork() != 0)
+			ret = false;
+		else if (!manifest.Base_Folder.empty()) {
+			int Removed;
+			if (!manifest.Apply_Deletions(Removed)) {
+				LOGERR("Unable to remove all entries deleted since '%s' from %s\n", manifest.Base_Folder.c_str(), Backup_Path.c_str());
+				ret = false;
+			}
+			LOGINFO("Removed %i entries deleted since '%s'\n", Removed, manifest.Base_Folder.c_str());
+		}
+	}
 #ifdef HAVE_CAPABILITIES
 	// Restore capabilities to the run-as binary
 	if (Mount_Point == "/system" && Mount(true) && TWFunc::Path_Exists("/system/bin/run-as")) {
@@ -2438,9 +2916,90 @@ bool TWPartition::Restore_Tar(PartitionSettings *part_settings) {
 	return ret;
 }
 
+// Extracts Paths from the archives of this partition without wiping it.
+// Incremental backups are applied oldest first so the newest copy wins.
+bool TWPartition::Restore_Selected(PartitionSettings *part_settings, const vector<string>& Paths) {
+	int extracted = 0;
+
+	if (!Is_File_System(Get_Restore_File_System(part_settings))) {
+		gui_msg(Msg(msg::kError, "selective_image=Files cannot be restored individually from the image backup of {1}.")(Backup_Display_Name));
+		return false;
+	}
+	TWFunc::GUI_Operation_Text(TW_RESTORE_TEXT, Backup_Display_Name, gui_parse_text("{@restoring_hdr}"));
+	if (!ReMount_RW(true))
+		return false;
+
+	vector<string> Folders;
+	if (!Get_Restore_Chain(part_settings, Folders))
+		return false;
+	for (vector<string>::iterator folder = Folders.begin(); folder != Folders.end(); folder++) {
+		twrpManifest manifest;
+		string Archive_Name = Backup_FileName;
+
+		if (manifest.Load(*folder + "/" + Backup_Name + ".manifest") && !manifest.Archive_Name.empty())
+			Archive_Name = manifest.Archive_Name;
+		twrpTar tar;
+		tar.part_settings = part_settings;
+		tar.setdir(Backup_Path);
+		tar.setfn(*folder + "/" + Archive_Name);
+		tar.backup_name = Backup_Name;
+#ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
+		string Password;
+		DataManager::GetValue("tw_restore_password", Password);
+		if (!Password.empty())
+			tar.setpassword(Password);
+#endif
+		int ret = tar.extractSelected(Paths);
+		if (ret < 0)
+			return false;
+		extracted += ret;
+	}
+	gui_msg(Msg("selective_restored=Restored {1} entries to {2}")(extracted)(Backup_Display_Name));
+#ifdef HAVE_SELINUX
+	// Storage files may come from backups made without their contexts,
+	// label them like Fix Contexts would
+	if (Has_Data_Media) {
+		string Media_Path = Mount_Point + "/media";
+		for (vector<string>::const_iterator path = Paths.begin(); path != Paths.end(); path++) {
+			if ((*path == Media_Path || path->compare(0, Media_Path.size() + 1, Media_Path + "/") == 0) && TWFunc::Path_Exists(*path))
+				fixContexts::Relabel_Tree(*path);
+		}
+	}
+#endif
+	if (Mount_Read_Only || Mount_Flags & MS_RDONLY)
+		ReMount(true);
+	return true;
+}
+
+// Follows the base folder recorded in the manifest of an incremental backup
+// back to the full backup. Folders ends with the backup being restored.
+bool TWPartition::Get_Restore_Chain(PartitionSettings *part_settings, vector<string>& Folders) {
+	string Folder = part_settings->Backup_Folder;
+
+	Folders.clear();
+	while (!Folder.empty()) {
+		twrpManifest manifest;
+
+		if (Folders.size() >= 100) {
+			LOGINFO("Incremental backup chain for %s is too long\n", Backup_Name.c_str());
+			return false;
+		}
+		Folders.insert(Folders.begin(), Folder);
+		if (!manifest.Load(Folder + "/" + Backup_Name + ".manifest"))
+			break;
+		Folder = manifest.Base_Folder;
+		if (!Folder.empty() && !TWFunc::Path_Exists(Folder + "/" + Backup_Name + ".manifest")) {
+			gui_msg(Msg(msg::kError, "incremental_base_missing=Base backup '{1}' needed to restore {2} is missing.")(Folder)(Backup_Display_Name));
+			return false;
+		}
+	}
+	return true;
+}
+
 bool TWPartition::Restore_Image(PartitionSettings *part_settings) {
 	string Full_FileName;
 	string Restore_File_System = Get_Restore_File_System(part_settings);
+	twrpTraceSpan span("restore", "Restore_Image", Backup_Display_Name);
 
 	TWFunc::GUI_Operation_Text(TW_RESTORE_TEXT, Backup_Display_Name, gui_parse_text("{@restoring_hdr}"));
 	gui_msg(Msg("restoring=Restoring {1}...")(Backup_Display_Name));
@@ -2450,12 +3009,28 @@ bool TWPartition::Restore_Image(PartitionSettings *part_settings) {
 	else
 		Full_FileName = part_settings->Backup_Folder + "/" + Backup_FileName;
 
-	if (Restore_File_System == "emmc") {
+	if (Restore_File_System == "emmc" && !part_settings->adbbackup && Is_Sparse_Image(Full_FileName)) {
+		// Sparse backups only hold the used blocks, see Write_Sparse_Image
+		if (part_settings->inline_md5 && !Check_MD5(part_settings))
+			return false;
+		if (!Flash_Sparse_Image(Full_FileName))
+			return false;
+	} else if (Restore_File_System == "emmc") {
 		if (!part_settings->adbbackup)
 			part_settings->total_restore_size = (uint64_t)(TWFunc::Get_File_Size(Full_FileName));
-		if (!Raw_Read_Write(part_settings))
-			return false;
+		if (part_settings->inline_md5 && !part_settings->adbbackup && part_settings->total_restore_size <= TW_MD5_STAGE_SIZE) {
+			if (!Raw_Restore_Verified(part_settings))
+				return false;
+		} else {
+			// Too big to hold in memory, verify before anything is written
+			if (part_settings->inline_md5 && !part_settings->adbbackup && !Check_MD5(part_settings))
+				return false;
+			if (!Raw_Read_Write(part_settings))
+				return false;
+		}
 	} else if (Restore_File_System == "mtd" || Restore_File_System == "bml") {
+		if (part_settings->inline_md5 && !Check_MD5(part_settings))
+			return false;
 		if (!Flash_Image_FI(Full_FileName, part_settings->progress))
 			return false;
 	}
@@ -20,8 +20,10 @@
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/sysmacros.h>
 #include <sys/vfs.h>
 #include <unistd.h>
+#include <map>
 #include <vector>
 #include <dirent.h>
 #include <time.h>
@@ -41,6 +43,10 @@
 #include "fixContexts.hpp"
 #include "twrpDigest.hpp"
 #include "twrpDU.hpp"
+#include "twrpChunkStore.hpp"
+#include "twrpManifest.hpp"
+#include "twrpTrace.hpp"
+#include "twrpMountTable.hpp"
 #include "set_metadata.h"
 #include "tw_atomic.hpp"
 #include "gui/gui.hpp"
@@ -84,6 +90,7 @@ int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error)
 		LOGERR("Critical Error: Unable to open fstab at '%s'.\n", Fstab_Filename.c_str());
 		return false;
 	}
+	TWPartition::Snapshot_Partition_Tables(true);
 
 	while (fgets(fstab_line, sizeof(fstab_line), fstabFile) != NULL) {
 		if (fstab_line[0] != '/')
@@ -101,6 +108,7 @@ int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error)
 		memset(fstab_line, 0, sizeof(fstab_line));
 	}
 	fclose(fstabFile);
+	Probe_File_Systems();
 
 	std::vector<TWPartition*>::iterator iter;
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
@@ -182,9 +190,78 @@ int TWPartitionManager::Process_Fstab(string Fstab_Filename, bool Display_Error)
 #endif
 	Update_System_Details();
 	UnMount_Main_Partitions();
+	// Sizes and file systems change with wipes and repartitioning from now on
+	TWPartition::Snapshot_Partition_Tables(false);
+	for (iter = Partitions.begin(); iter != Partitions.end(); iter++)
+		(*iter)->Probed_Block_Device.clear();
 	return true;
 }
 
+// Block devices probed by the threads of Probe_File_Systems
+struct Probe_Job {
+	std::vector<TWPartition*> Parts;
+	size_t Next;
+	pthread_mutex_t Lock;
+};
+
+void* TWPartitionManager::Probe_Thread(void *cookie) {
+	Probe_Job* job = (Probe_Job*) cookie;
+
+	for (;;) {
+		pthread_mutex_lock(&job->Lock);
+		if (job->Next >= job->Parts.size()) {
+			pthread_mutex_unlock(&job->Lock);
+			return NULL;
+		}
+		TWPartition* Part = job->Parts[job->Next++];
+		pthread_mutex_unlock(&job->Lock);
+		Part->Probe_Result = TWPartition::Probe_Block_Device(Part->Probed_Block_Device, Part->Probed_File_System);
+	}
+}
+
+// A full blkid probe of every partition as it is first mounted adds up on
+// devices with many partitions. Probing them all at the same time before
+// the partitions are set up lets the first Check_FS_Type of each use
+// the result instead.
+void TWPartitionManager::Probe_File_Systems() {
+	Probe_Job job;
+	std::vector<pthread_t> threads;
+	std::vector<TWPartition*>::iterator iter;
+
+	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
+		TWPartition* Part = *iter;
+
+		if (!Part->Can_Be_Mounted || Part->Ignore_Blkid || Part->Fstab_File_System == "yaffs2" || Part->Fstab_File_System == "mtd" || Part->Fstab_File_System == "bml")
+			continue;
+		Part->Find_Actual_Block_Device();
+		if (!Part->Is_Present)
+			continue;
+		Part->Probed_Block_Device = Part->Actual_Block_Device;
+		job.Parts.push_back(Part);
+	}
+	if (job.Parts.empty())
+		return;
+
+	job.Next = 0;
+	pthread_mutex_init(&job.Lock, NULL);
+	long cores = sysconf(_SC_NPROCESSORS_ONLN);
+	size_t count = cores > 1 ? (size_t)cores : 1;
+	if (count > 8)
+		count = 8;
+	if (count > job.Parts.size())
+		count = job.Parts.size();
+	threads.resize(count);
+	size_t started = 0;
+	while (started < count && pthread_create(&threads[started], NULL, Probe_Thread, (void*)&job) == 0)
+		started++;
+	if (started == 0)
+		Probe_Thread((void*)&job);
+	for (size_t i = 0; i < started; i++)
+		pthread_join(threads[i], NULL);
+	pthread_mutex_destroy(&job.Lock);
+	LOGINFO("Probed %lu block devices with %lu threads\n", (unsigned long)job.Parts.size(), (unsigned long)(started ? started : 1));
+}
+
 int TWPartitionManager::Write_Fstab(void) {
 	FILE *fp;
 	std::vector<TWPartition*>::iterator iter;
@@ -371,6 +448,7 @@ int TWPartitionManager::UnMount_By_Path(string Path, bool Display_Error) {
 	int ret = false;
 	bool found = false;
 	string Local_Path = TWFunc::Get_Root_Path(Path);
+	twrpTraceSpan span("mount", "UnMount_By_Path", Path);
 
 	// Iterate through all partitions
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
@@ -536,29 +614,156 @@ bool TWPartitionManager::Make_MD5(PartitionSettings *part_settings)
 	return true;
 }
 
+void TWPartitionManager::Get_Archive_Files(const string& Full_File, const string& Extension, vector<string>& Files) {
+	char filename[512];
+
+	Files.clear();
+	if (TWFunc::Path_Exists(Full_File + Extension)) {
+		Files.push_back(Full_File);
+		return;
+	}
+	for (int index = 0; index < 1000; index++) {
+		sprintf(filename, "%s%03i", Full_File.c_str(), index);
+		if (TWFunc::Path_Exists(string(filename) + Extension))
+			Files.push_back(filename);
+	}
+}
+
+bool TWPartitionManager::Store_Chunks(PartitionSettings *part_settings) {
+	if (part_settings->Part == NULL || !part_settings->dedup || part_settings->adbbackup)
+		return true;
 
-bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
+	string Full_File = part_settings->Backup_Folder + "/" + part_settings->Part->Backup_FileName;
+	twrpChunkStore chunks(TWFunc::Get_Path(part_settings->Backup_Folder));
+	vector<string> Files;
+
+	Get_Archive_Files(Full_File, "", Files);
+	if (Files.empty())
+		return true;
+	// Encrypted archives never share any data, leave them as they are
+	if (TWFunc::Get_File_Type(Files[0]) == ENCRYPTED) {
+		LOGINFO("Not deduplicating encrypted backup of %s\n", part_settings->Part->Backup_Display_Name.c_str());
+		return true;
+	}
+	TWFunc::GUI_Operation_Text(TW_BACKUP_TEXT, part_settings->Part->Backup_Display_Name, gui_parse_text("{@dedup_storing}"));
+	gui_msg(Msg("dedup_storing_part= * Deduplicating {1}...")(part_settings->Part->Backup_Display_Name));
+	for (vector<string>::iterator file = Files.begin(); file != Files.end(); file++) {
+		if (!chunks.Store_File(*file))
+			return false;
+	}
+	return true;
+}
+
+bool TWPartitionManager::Restore_Chunks(PartitionSettings *part_settings, TWPartition* Part, twrpChunkStore* chunks) {
+	vector<string> Folders, Files;
+
+	// An incremental backup also needs the archives of its base backups
+	if (!Part->Get_Restore_Chain(part_settings, Folders))
+		Folders.assign(1, part_settings->Backup_Folder);
+	for (vector<string>::iterator folder = Folders.begin(); folder != Folders.end(); folder++) {
+		twrpManifest manifest;
+		string Archive_Name = Part->Backup_FileName;
+
+		if (manifest.Load(*folder + "/" + Part->Backup_Name + ".manifest") && !manifest.Archive_Name.empty())
+			Archive_Name = manifest.Archive_Name;
+		Get_Archive_Files(*folder + "/" + Archive_Name, twrpChunkStore::Index_Extension, Files);
+		if (Files.empty())
+			continue;
+		TWFunc::GUI_Operation_Text(TW_RESTORE_TEXT, Part->Backup_Display_Name, gui_parse_text("{@dedup_reassembling}"));
+		gui_msg(Msg("dedup_reassembling_part=Reassembling {1} from the chunk store...")(Part->Backup_Display_Name));
+		for (vector<string>::iterator file = Files.begin(); file != Files.end(); file++) {
+			if (!chunks->Restore_File(*file))
+				return false;
+		}
+	}
+	return true;
+}
+
+int TWPartitionManager::Collect_Chunk_Garbage() {
+	string Backups_Folder;
+
+	if (!Mount_Current_Storage(true))
+		return 1;
+	DataManager::GetValue(TW_BACKUPS_FOLDER_VAR, Backups_Folder);
+	twrpChunkStore chunks(Backups_Folder + "/");
+	gui_msg("dedup_gc=Removing unused chunks...");
+	if (chunks.Collect_Garbage() < 0) {
+		gui_err("dedup_gc_error=Unable to remove unused chunks.");
+		return 1;
+	}
+	return 0;
+}
+
+// Restores individual files and folders from the indexed archives of a
+// backup, leaving everything else on the partitions untouched
+int TWPartitionManager::Restore_Files(const string& Restore_Name, const vector<string>& Paths) {
+	PartitionSettings part_settings;
+	map<TWPartition*, vector<string> > Selected;
+
+	part_settings.Backup_Folder = Restore_Name;
+	part_settings.Part = NULL;
+	part_settings.partition_count = 0;
+	part_settings.total_restore_size = 0;
+	part_settings.adbbackup = false;
+	part_settings.dedup = false;
+	part_settings.inline_md5 = false;
+	part_settings.progress = NULL;
+	part_settings.PM_Method = PM_RESTORE;
+	twrpChunkStore chunks(TWFunc::Get_Path(Restore_Name));
+
+	if (!Mount_Current_Storage(true))
+		return 1;
+	gui_msg(Msg("restore_folder=Restore folder: '{1}'")(Restore_Name));
+	Set_Restore_Files(Restore_Name);
+	for (vector<string>::const_iterator path = Paths.begin(); path != Paths.end(); path++) {
+		string Path = *path;
+		while (Path.size() > 1 && Path[Path.size() - 1] == '/')
+			Path.resize(Path.size() - 1);
+		TWPartition* Part = Find_Partition_By_Path(Path);
+		if (Part == NULL || Part->Backup_FileName.empty()) {
+			gui_msg(Msg(msg::kError, "selective_no_part=No backup of a partition holding '{1}' found.")(Path));
+			return 1;
+		}
+		Selected[Part].push_back(Path);
+	}
+	for (map<TWPartition*, vector<string> >::iterator part = Selected.begin(); part != Selected.end(); part++) {
+		part_settings.Part = part->first;
+		if (!Restore_Chunks(&part_settings, part->first, &chunks))
+			return 1;
+		if (!part->first->Restore_Selected(&part_settings, part->second))
+			return 1;
+	}
+	return 0;
+}
+
+// Jobs of Backup_Concurrently share the backup folder and the performance
+// mode with the other jobs, Backup_Concurrently sees to both once they are done
+bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings, pid_t *fork_pid, bool In_Job) {
 	time_t start, stop;
 	int use_compression, adb_control_bu_fd;
-	string backup_log = part_settings->Backup_Folder + "/recovery.log";
 
 	if (part_settings->Part == NULL)
 		return true;
+	if (fork_pid == NULL)
+		fork_pid = &tar_fork_pid;
+	twrpTraceSpan span("backup", "Backup_Partition", part_settings->Part->Backup_Display_Name);
 
 	DataManager::GetValue(TW_USE_COMPRESSION_VAR, use_compression);
 
-	TWFunc::SetPerformanceMode(true);
+	if (!In_Job)
+		TWFunc::SetPerformanceMode(true);
 	time(&start);
 
-	if (part_settings->Part->Backup(part_settings, &tar_fork_pid)) {
+	if (part_settings->Part->Backup(part_settings, fork_pid)) {
 		bool md5Success = false;
 		if (part_settings->adbbackup) {
 			md5Success = true;
 		}
 		else
-			md5Success = Make_MD5(part_settings);
+			md5Success = Make_MD5(part_settings) && Store_Chunks(part_settings);
 
-		TWFunc::SetPerformanceMode(false);
+		if (!In_Job)
+			TWFunc::SetPerformanceMode(false);
 		if (part_settings->Part->Has_SubPartition) {
 			std::vector<TWPartition*>::iterator subpart;
 			TWPartition *parentPart = part_settings->Part;
@@ -566,20 +771,16 @@ bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
 			for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
 				if ((*subpart)->Can_Be_Backed_Up && (*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == parentPart->Mount_Point) {
 					part_settings->Part = *subpart;
-					if (!(*subpart)->Backup(part_settings, &tar_fork_pid)) {
-						TWFunc::SetPerformanceMode(false);
-						Clean_Backup_Folder(part_settings->Backup_Folder);
-						TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
-						tw_set_default_metadata(backup_log.c_str());
+					if (!(*subpart)->Backup(part_settings, fork_pid)) {
+						if (!In_Job)
+							Backup_Failed(part_settings);
 						return false;
 					}
 					sync();
 					sync();
 					if (!part_settings->adbbackup) {
-						if (!Make_MD5(part_settings)) {
-							TWFunc::SetPerformanceMode(false);
+						if (!Make_MD5(part_settings) || !Store_Chunks(part_settings))
 							return false;
-						}
 					}
 				}
 			}
@@ -597,15 +798,24 @@ bool TWPartitionManager::Backup_Partition(PartitionSettings *part_settings) {
 
 		return md5Success;
 	} else {
-		Clean_Backup_Folder(part_settings->Backup_Folder);
-		TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
-		tw_set_default_metadata(backup_log.c_str());
-		TWFunc::SetPerformanceMode(false);
+		if (!In_Job) {
+			Backup_Failed(part_settings);
+			TWFunc::SetPerformanceMode(false);
+		}
 		return false;
 	}
 	return 0;
 }
 
+void TWPartitionManager::Backup_Failed(PartitionSettings *part_settings) {
+	string backup_log = part_settings->Backup_Folder + "/recovery.log";
+
+	Clean_Backup_Folder(part_settings->Backup_Folder);
+	TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
+	tw_set_default_metadata(backup_log.c_str());
+	twrpTrace::Copy_Trace(part_settings->Backup_Folder + "/recovery_trace.json");
+}
+
 void TWPartitionManager::Clean_Backup_Folder(string Backup_Folder) {
 	DIR *d = opendir(Backup_Folder.c_str());
 	struct dirent *p;
@@ -625,7 +835,7 @@ void TWPartitionManager::Clean_Backup_Folder(string Backup_Folder) {
 		string path = Backup_Folder + "/" + p->d_name;
 
 		size_t dot = path.find_last_of(".") + 1;
-		if (path.substr(dot) == "win" || path.substr(dot) == "md5" || path.substr(dot) == "info") {
+		if (path.substr(dot) == "win" || path.substr(dot) == "md5" || path.substr(dot) == "info" || path.substr(dot) == "manifest" || path.substr(dot) == "chunks" || path.substr(dot) == "index") {
 			r = unlink(path.c_str());
 			if (r != 0) {
 				LOGINFO("Unable to unlink '%s: %s'\n", path.c_str(), strerror(errno));
@@ -635,6 +845,159 @@ void TWPartitionManager::Clean_Backup_Folder(string Backup_Folder) {
 	closedir(d);
 }
 
+// Names the disk a block device is on, e.g. mmcblk0 for mmcblk0p12 or the
+// disk under a dm device, so that partitions sharing a disk are not read at
+// the same time. Anything that is not a block device shares one group.
+static string Get_Disk_Name(const string& Block_Device) {
+	struct stat st;
+	char sys_path[PATH_MAX], link[PATH_MAX];
+	ssize_t len;
+
+	if (stat(Block_Device.c_str(), &st) != 0 || !S_ISBLK(st.st_mode))
+		return "other";
+	sprintf(sys_path, "/sys/dev/block/%u:%u", major(st.st_rdev), minor(st.st_rdev));
+	len = readlink(sys_path, link, sizeof(link) - 1);
+	if (len <= 0)
+		return TWFunc::to_string(major(st.st_rdev));
+	link[len] = 0;
+	string Disk = link;
+	if (TWFunc::Path_Exists(string(sys_path) + "/partition"))
+		Disk = Disk.substr(0, Disk.rfind('/'));
+	Disk = Disk.substr(Disk.rfind('/') + 1);
+
+	DIR* d = opendir((string(sys_path) + "/slaves").c_str());
+	if (d != NULL) {
+		struct dirent* de;
+		while ((de = readdir(d)) != NULL) {
+			if (de->d_name[0] != '.') {
+				Disk = Get_Disk_Name("/dev/block/" + string(de->d_name));
+				break;
+			}
+		}
+		closedir(d);
+	}
+	return Disk;
+}
+
+// Partitions of one disk, backed up one after the other by Backup_Job_Thread
+struct Backup_Job {
+	TWPartitionManager* Manager;
+	string Disk;
+	std::vector<TWPartition*> Parts;
+	PartitionSettings Settings;
+	ProgressTracking* Progress;
+	pid_t Fork_Pid;
+	pthread_t Thread;
+	bool Threaded;
+	bool Success;
+};
+
+// Running tar forks of concurrent jobs, killed by Cancel_Backup
+static std::vector<pid_t*> backup_job_pids;
+static pthread_mutex_t backup_job_lock = PTHREAD_MUTEX_INITIALIZER;
+// Tar backups already keep every core busy with pigz, only one runs at a time
+static pthread_mutex_t backup_files_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set when a job failed so that the other disks stop after their current partition
+static TWAtomicInt backup_job_failed;
+
+void* TWPartitionManager::Backup_Job_Thread(void *cookie) {
+	Backup_Job* job = (Backup_Job*) cookie;
+
+	job->Success = true;
+	for (std::vector<TWPartition*>::iterator part = job->Parts.begin(); part != job->Parts.end() && job->Success; part++) {
+		if (job->Manager->Check_Backup_Cancel() != 0 || backup_job_failed.get_value() != 0) {
+			job->Success = false;
+			break;
+		}
+		bool files = (*part)->Backup_Method == BM_FILES;
+		job->Settings.Part = *part;
+		if (files)
+			pthread_mutex_lock(&backup_files_lock);
+		job->Success = job->Manager->Backup_Partition(&job->Settings, &job->Fork_Pid, true);
+		if (files)
+			pthread_mutex_unlock(&backup_files_lock);
+		// the fork is gone, its pid may be reused
+		pthread_mutex_lock(&backup_job_lock);
+		job->Fork_Pid = 0;
+		pthread_mutex_unlock(&backup_job_lock);
+	}
+	if (!job->Success)
+		backup_job_failed.set_value(1);
+	return NULL;
+}
+
+bool TWPartitionManager::Backup_Concurrently(PartitionSettings *part_settings, std::vector<TWPartition*>& Parts) {
+	std::vector<Backup_Job*> Jobs;
+	bool ret = true;
+
+	for (std::vector<TWPartition*>::iterator part = Parts.begin(); part != Parts.end(); part++) {
+		string Disk = Get_Disk_Name((*part)->Actual_Block_Device);
+		Backup_Job* job = NULL;
+
+		for (std::vector<Backup_Job*>::iterator j = Jobs.begin(); j != Jobs.end(); j++) {
+			if ((*j)->Disk == Disk)
+				job = *j;
+		}
+		if (job == NULL) {
+			job = new Backup_Job;
+			job->Manager = this;
+			job->Disk = Disk;
+			job->Settings = *part_settings;
+			job->Progress = new ProgressTracking(part_settings->progress);
+			job->Settings.progress = job->Progress;
+			job->Settings.img_time = 0;
+			job->Settings.file_time = 0;
+			job->Settings.fork_pid_lock = &backup_job_lock;
+			job->Fork_Pid = 0;
+			job->Threaded = false;
+			job->Success = false;
+			Jobs.push_back(job);
+		}
+		job->Parts.push_back(*part);
+		LOGINFO("Backing up %s from disk %s\n", (*part)->Backup_Display_Name.c_str(), Disk.c_str());
+	}
+
+	backup_job_failed.set_value(0);
+	pthread_mutex_lock(&backup_job_lock);
+	for (std::vector<Backup_Job*>::iterator j = Jobs.begin(); j != Jobs.end(); j++)
+		backup_job_pids.push_back(&(*j)->Fork_Pid);
+	pthread_mutex_unlock(&backup_job_lock);
+
+	LOGINFO("Backing up %lu disks concurrently\n", (unsigned long)Jobs.size());
+	TWFunc::SetPerformanceMode(true);
+	for (std::vector<Backup_Job*>::iterator j = Jobs.begin(); j != Jobs.end(); j++) {
+		if (j + 1 != Jobs.end() && pthread_create(&(*j)->Thread, NULL, Backup_Job_Thread, (void*)*j) == 0)
+			(*j)->Threaded = true;
+		else
+			Backup_Job_Thread((void*)*j);
+	}
+	for (std::vector<Backup_Job*>::iterator j = Jobs.begin(); j != Jobs.end(); j++) {
+		if ((*j)->Threaded && pthread_join((*j)->Thread, NULL) != 0) {
+			LOGINFO("Error joining backup thread for %s\n", (*j)->Disk.c_str());
+			(*j)->Success = false;
+		}
+	}
+
+	TWFunc::SetPerformanceMode(false);
+
+	pthread_mutex_lock(&backup_job_lock);
+	backup_job_pids.clear();
+	pthread_mutex_unlock(&backup_job_lock);
+
+	for (std::vector<Backup_Job*>::iterator j = Jobs.begin(); j != Jobs.end(); j++) {
+		part_settings->img_time += (*j)->Settings.img_time;
+		part_settings->file_time += (*j)->Settings.file_time;
+		if (!(*j)->Success)
+			ret = false;
+		delete (*j)->Progress;
+		delete *j;
+	}
+	// only now that no job writes into the folder any more
+	if (!ret)
+		Backup_Failed(part_settings);
+	return ret;
+}
+
 int TWPartitionManager::Check_Backup_Cancel() {
 	return stop_backup.get_value();
 }
@@ -659,6 +1022,16 @@ int TWPartitionManager::Cancel_Backup() {
 		tar_fork_pid = 0;
 	}
 
+	pthread_mutex_lock(&backup_job_lock);
+	for (std::vector<pid_t*>::iterator pid = backup_job_pids.begin(); pid != backup_job_pids.end(); pid++) {
+		pid_t job_pid = **pid;
+		if (job_pid > 0) {
+			LOGINFO("Killing pid: %d\n", job_pid);
+			kill(job_pid, SIGUSR2);
+		}
+	}
+	pthread_mutex_unlock(&backup_job_lock);
+
 	return 0;
 }
 
@@ -673,6 +1046,7 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 	struct tm *t;
 	time_t start, stop, seconds, total_start, total_stop;
 	size_t start_pos = 0, end_pos = 0;
+	twrpTraceSpan span("backup", "Run_Backup");
 	stop_backup.set_value(0);
 	seconds = time(0);
 	t = localtime(&seconds);
@@ -703,6 +1077,8 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 		part_settings.generate_md5 = true;
 	else
 		part_settings.generate_md5 = false;
+	part_settings.dedup = DataManager::GetIntValue(TW_DEDUP_BACKUP_VAR) != 0;
+	part_settings.inline_md5 = false;
 
 	DataManager::GetValue(TW_BACKUPS_FOLDER_VAR, part_settings.Backup_Folder);
 	DataManager::GetValue(TW_BACKUP_NAME, Backup_Name);
@@ -800,6 +1176,8 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 
 	DataManager::SetProgress(0.0);
 
+	std::vector<TWPartition*> Concurrent_Parts;
+	bool concurrent = !adbbackup && DataManager::GetIntValue(TW_CONCURRENT_BACKUP_VAR) != 0;
 	start_pos = 0;
 	end_pos = Backup_List.find(";", start_pos);
 	while (end_pos != string::npos && start_pos < Backup_List.size()) {
@@ -808,7 +1186,9 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 		backup_path = Backup_List.substr(start_pos, end_pos - start_pos);
 		part_settings.Part = Find_Partition_By_Path(backup_path);
 		if (part_settings.Part != NULL) {
-			if (!Backup_Partition(&part_settings))
+			if (concurrent)
+				Concurrent_Parts.push_back(part_settings.Part);
+			else if (!Backup_Partition(&part_settings))
 
 				return false;
 		} else {
@@ -817,6 +1197,8 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 		start_pos = end_pos + 1;
 		end_pos = Backup_List.find(";", start_pos);
 	}
+	if (!Concurrent_Parts.empty() && !Backup_Concurrently(&part_settings, Concurrent_Parts))
+		return false;
 
 	// Average BPS
 	if (part_settings.img_time == 0)
@@ -867,6 +1249,7 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 	string backup_log = part_settings.Backup_Folder + "/recovery.log";
 	TWFunc::copy_file("/tmp/recovery.log", backup_log, 0644);
 	tw_set_default_metadata(backup_log.c_str());
+	twrpTrace::Copy_Trace(part_settings.Backup_Folder + "/recovery_trace.json");
 
 	if (part_settings.adbbackup) {
 		if (twadbbu::Write_ADB_Stream_Trailer() == false) {
@@ -881,6 +1264,7 @@ int TWPartitionManager::Run_Backup(bool adbbackup) {
 
 bool TWPartitionManager::Restore_Partition(PartitionSettings *part_settings) {
 	time_t Start, Stop;
+	twrpTraceSpan span("restore", "Restore_Partition", part_settings->Part->Backup_Display_Name);
 
 	TWFunc::SetPerformanceMode(true);
 
@@ -915,20 +1299,26 @@ bool TWPartitionManager::Restore_Partition(PartitionSettings *part_settings) {
 
 int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 	PartitionSettings part_settings;
-	int check_md5, check, partition_count = 0;
+	int check_md5, inline_md5, check, partition_count = 0;
 	TWPartition* restore_part = NULL;
 
 	time_t rStart, rStop;
 	time(&rStart);
 	string Restore_List, restore_path;
 	size_t start_pos = 0, end_pos;
+	twrpTraceSpan span("restore", "Run_Restore", Restore_Name);
 
 	part_settings.Backup_Folder = Restore_Name;
 	part_settings.Part = NULL;
 	part_settings.partition_count = 0;
 	part_settings.total_restore_size = 0;
 	part_settings.adbbackup = false;
+	part_settings.dedup = false;
+	part_settings.inline_md5 = false;
 	part_settings.PM_Method = PM_RESTORE;
+	// Archives reassembled from the chunk store are removed again when
+	// this goes out of scope
+	twrpChunkStore chunks(TWFunc::Get_Path(Restore_Name));
 
 	gui_msg("restore_started=[RESTORE STARTED]");
 	gui_msg(Msg("restore_folder=Restore folder: '{1}'")(Restore_Name));
@@ -937,7 +1327,12 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 		return false;
 
 	DataManager::GetValue(TW_SKIP_MD5_CHECK_VAR, check_md5);
-	if (check_md5 > 0) {
+	DataManager::GetValue(TW_INLINE_MD5_CHECK_VAR, inline_md5);
+	if (check_md5 > 0 && inline_md5 > 0) {
+		// Archives are verified as they are restored, see TWPartition::Restore_Tar and Restore_Image
+		part_settings.inline_md5 = true;
+		gui_msg("verifying_md5_inline=Verifying MD5 during restore");
+	} else if (check_md5 > 0) {
 		// Check MD5 files first before restoring to ensure that all of them match before starting a restore
 		TWFunc::GUI_Operation_Text(TW_VERIFY_MD5_TEXT, gui_parse_text("{@verifying_md5}"));
 		gui_msg("verifying_md5=Verifying MD5");
@@ -958,7 +1353,9 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 					return false;
 				}
 
-				if (check_md5 > 0 && !part_settings.Part->Check_MD5(&part_settings))
+				if (!Restore_Chunks(&part_settings, part_settings.Part, &chunks))
+					return false;
+				if (check_md5 > 0 && !part_settings.inline_md5 && !part_settings.Part->Check_MD5(&part_settings))
 					return false;
 				part_settings.partition_count++;
 				part_settings.total_restore_size += part_settings.Part->Get_Restore_Size(&part_settings);
@@ -969,7 +1366,9 @@ int TWPartitionManager::Run_Restore(const string& Restore_Name) {
 					for (subpart = Partitions.begin(); subpart != Partitions.end(); subpart++) {
 						part_settings.Part = *subpart;
 						if ((*subpart)->Is_SubPartition && (*subpart)->SubPartition_Of == parentPart->Mount_Point) {
-							if (check_md5 > 0 && !(*subpart)->Check_MD5(&part_settings))
+							if (!Restore_Chunks(&part_settings, *subpart, &chunks))
+								return false;
+							if (check_md5 > 0 && !part_settings.inline_md5 && !(*subpart)->Check_MD5(&part_settings))
 								return false;
 							part_settings.total_restore_size += (*subpart)->Get_Restore_Size(&part_settings);
 						}
@@ -1051,17 +1450,29 @@ void TWPartitionManager::Set_Restore_Files(string Restore_Name) {
 		if (strlen(str) <= 2)
 			continue;
 
+		// Archives in the chunk store are listed under their original name
+		string d_name = de->d_name;
+		size_t ext_len = strlen(twrpChunkStore::Index_Extension);
+		if (d_name.size() > ext_len && d_name.compare(d_name.size() - ext_len, ext_len, twrpChunkStore::Index_Extension) == 0) {
+			d_name.resize(d_name.size() - ext_len);
+			if (TWFunc::Path_Exists(Restore_Name + "/" + d_name))
+				continue;
+			str[d_name.size()] = 0;
+		}
+
 		if (get_date) {
 			char file_path[255];
 			struct stat st;
 
+			// the entry itself, which may be the .chunks manifest
 			strcpy(file_path, Restore_Name.c_str());
 			strcat(file_path, "/");
-			strcat(file_path, str);
-			stat(file_path, &st);
-			string backup_date = ctime((const time_t*)(&st.st_mtime));
-			DataManager::SetValue(TW_RESTORE_FILE_DATE, backup_date);
-			get_date = false;
+			strcat(file_path, de->d_name);
+			if (stat(file_path, &st) == 0) {
+				string backup_date = ctime((const time_t*)(&st.st_mtime));
+				DataManager::SetValue(TW_RESTORE_FILE_DATE, backup_date);
+				get_date = false;
+			}
 		}
 
 		label = str;
@@ -1087,9 +1498,9 @@ void TWPartitionManager::Set_Restore_Files(string Restore_Name) {
 		if (extnlength >= 3 && strncmp(extn, "win", 3) != 0) continue;
 		//if (extnlength == 6 && strncmp(extn, "win000", 6) != 0) continue;
 
-		if (check_encryption) {
+		if (check_encryption && d_name == de->d_name) {
 			string filename = Restore_Name + "/";
-			filename += de->d_name;
+			filename += d_name;
 			if (TWFunc::Get_File_Type(filename) == 2) {
 				LOGINFO("'%s' is encrypted\n", filename.c_str());
 				DataManager::SetValue("tw_restore_encrypted", 1);
@@ -1104,7 +1515,7 @@ void TWPartitionManager::Set_Restore_Files(string Restore_Name) {
 			continue;
 		}
 
-		Part->Backup_FileName = de->d_name;
+		Part->Backup_FileName = d_name;
 		if (strlen(extn) > 3) {
 			Part->Backup_FileName.resize(Part->Backup_FileName.size() - strlen(extn) + 3);
 		}
@@ -1125,6 +1536,7 @@ int TWPartitionManager::Wipe_By_Path(string Path) {
 	int ret = false;
 	bool found = false;
 	string Local_Path = TWFunc::Get_Root_Path(Path);
+	twrpTraceSpan span("wipe", "Wipe_By_Path", Path);
 
 	// Iterate through all partitions
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
@@ -1173,6 +1585,7 @@ int TWPartitionManager::Wipe_By_Path(string Path, string New_File_System) {
 int TWPartitionManager::Factory_Reset(void) {
 	std::vector<TWPartition*>::iterator iter;
 	int ret = true;
+	twrpTraceSpan span("wipe", "Factory_Reset");
 
 	for (iter = Partitions.begin(); iter != Partitions.end(); iter++) {
 		if ((*iter)->Wipe_During_Factory_Reset && (*iter)->Is_Present) {
@@ -2031,6 +2444,8 @@ TWPartition *TWPartitionManager::Get_Default_Storage_Partition()
 
 bool TWPartitionManager::Enable_MTP(void) {
 #ifdef TW_HAS_MTP
+	static bool listening = false;
+
 	if (mtppid) {
 		gui_err("mtp_already_enabled=MTP already enabled");
 		return true;
@@ -2069,6 +2484,10 @@ bool TWPartitionManager::Enable_MTP(void) {
 		mtp_write_fd = mtppipe[1];
 		DataManager::SetValue("tw_mtp_enabled", 1);
 		Add_All_MTP_Storage();
+		if (!listening) {
+			twrpMountTable::Add_Listener(MTP_Mount_Changed, NULL);
+			listening = true;
+		}
 		return true;
 	} else {
 		close(mtppipe[0]);
@@ -2083,6 +2502,19 @@ bool TWPartitionManager::Enable_MTP(void) {
 	return false;
 }
 
+// Takes storage out of MTP when it goes away without TWRP unmounting it,
+// like a USB drive that is pulled out. Storage is only added by Mount,
+// which knows when it is ready.
+void TWPartitionManager::MTP_Mount_Changed(const twrpMountTable::Mount_Entry& Entry, bool Mounted, void* Cookie __unused) {
+	if (Mounted)
+		return;
+	TWPartition* Part = PartitionManager.Find_Partition_By_Path(Entry.Mount_Point);
+	if (Part && Part->Mount_Point == Entry.Mount_Point && Part->MTP_Storage_ID && !Part->Is_Mounted()) {
+		LOGINFO("'%s' was unmounted, removing it from MTP\n", Entry.Mount_Point.c_str());
+		PartitionManager.Remove_MTP_Storage(Part->MTP_Storage_ID);
+	}
+}
+
 void TWPartitionManager::Add_All_MTP_Storage(void) {
 #ifdef TW_HAS_MTP
 	std::vector<TWPartition*>::iterator iter;
@@ -2275,6 +2707,7 @@ bool TWPartitionManager::Flash_Image(string& path, string& filename) {
 	ProgressTracking progress(total_bytes);
 	part_settings.progress = &progress;
 	part_settings.adbbackup = false;
+	part_settings.inline_md5 = false;
 	part_settings.PM_Method = PM_RESTORE;
 
 	gui_msg("calc_restore=Calculating restore details...");
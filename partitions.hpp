@@ -19,11 +19,13 @@
 #ifndef __TWRP_Partition_Manager
 #define __TWRP_Partition_Manager
 
+#include <pthread.h>
 #include <vector>
 #include <string>
 #include "twrpDU.hpp"
 #include "tw_atomic.hpp"
 #include "progresstracking.hpp"
+#include "twrpMountTable.hpp"
 
 #define MAX_FSTAB_LINE_LENGTH 2048
 
@@ -41,6 +43,7 @@ enum PartitionManager_Op {
 };
 
 class TWPartition;
+class twrpChunkStore;
 
 struct PartitionSettings {                                                        // Settings for backup session
 	TWPartition* Part;                                                        // Partition to pass to the partition backup loop
@@ -48,6 +51,8 @@ struct PartitionSettings {
 	bool adbbackup;                                                           // tell the system we are backing up over adb
 	bool adb_compression;                                                     // 0 == uncompressed, 1 == compressed
 	bool generate_md5;                                                        // tell system to create md5 for partitions
+	bool dedup;                                                               // move the archives into the shared chunk store after backup
+	bool inline_md5;                                                          // verify md5s while restoring instead of before
 	uint64_t total_restore_size;                                              // Total size of restored backup
 	uint64_t img_bytes_remaining;                                             // remaining img/emmc bytes to backup for progress indicator
 	uint64_t file_bytes_remaining;                                            // remaining file bytes to backup for progress indicator
@@ -58,6 +63,9 @@ struct PartitionSettings {
 	int partition_count;                                                      // Number of partitions to restore
 	ProgressTracking *progress;                                               // Keep track of progress in GUI
 	enum PartitionManager_Op PM_Method;                                       // Current operation of backup or restore
+	pthread_mutex_t *fork_pid_lock;                                           // held while the tar fork pid is set, if another thread reads it
+
+	PartitionSettings() : fork_pid_lock(NULL) {}
 };
 
 enum Backup_Method_enum {
@@ -138,6 +146,8 @@ private:
 	void Find_Real_Block_Device(string& Block_Device, bool Display_Error);    // Checks the block device given and follows symlinks until it gets to the real block device
 	unsigned long long IOCTL_Get_Block_Size();                                // Finds the partition size using ioctl
 	bool Find_Partition_Size();                                               // Finds the partition size from /proc/partitions
+	static void Snapshot_Partition_Tables(bool Enable);                       // Makes Find_Partition_Size read /proc/dumchar_info and /proc/partitions only once until disabled
+	static int Probe_Block_Device(const string& Device, string& File_System); // Finds the file system on Device with blkid, -1 if it can't be probed, -2 if there is none
 	unsigned long long Get_Size_Via_du(string Path, bool Display_Error);      // Uses du to get sizes
 	bool Wipe_EXT23(string File_System);                                      // Formats as ext3 or ext2
 	bool Wipe_EXT4();                                                         // Formats using ext4, uses make_ext4fs when present
@@ -152,9 +162,14 @@ private:
 	bool Backup_Tar(PartitionSettings *part_settings, pid_t *tar_fork_pid);   // Backs up using tar for file systems
 	bool Backup_Image(PartitionSettings *part_settings);                      // Backs up using raw read/write for emmc memory types
 	bool Raw_Read_Write(PartitionSettings *part_settings);
+	bool Raw_Restore_Verified(PartitionSettings *part_settings);              // Restores a small image from memory once its md5 matched
+	bool Get_Used_Blocks(vector<bool>& Used, uint32_t& Block_Size);           // Finds the blocks an ext4 image partition uses, false if it is not ext4
+	bool Write_Sparse_Image(PartitionSettings *part_settings, const vector<bool>& Used, uint32_t Block_Size); // Backs up only the used blocks as a sparse image
 	bool Backup_Dump_Image(PartitionSettings *part_settings);                 // Backs up using dump_image for MTD memory types
 	string Get_Restore_File_System(PartitionSettings *part_settings);         // Returns the file system that was in place at the time of the backup
 	bool Restore_Tar(PartitionSettings *part_settings);                       // Restore using tar for file systems
+	bool Get_Restore_Chain(PartitionSettings *part_settings, vector<string>& Folders); // Lists the backup folders an incremental backup is built on, oldest first
+	bool Restore_Selected(PartitionSettings *part_settings, const vector<string>& Paths); // Restores only Paths from an indexed file system backup
 	bool Restore_Image(PartitionSettings *part_settings);                     // Restore using dd for images
 	bool Get_Size_Via_statfs(bool Display_Error);                             // Get Partition size, used, and free space using statfs
 	bool Get_Size_Via_df(bool Display_Error);                                 // Get Partition size, used, and free space using df command
@@ -214,6 +229,11 @@ private:
 	bool Can_Flash_Img;                                                       // Indicates if this partition can have images flashed to it via the GUI
 	bool Mount_Read_Only;                                                     // Only mount this partition as read-only
 	bool Is_Adopted_Storage;                                                  // Indicates that this partition is for adopted storage (android_expand)
+	string Probed_Block_Device;                                               // Block device probed ahead of the first Check_FS_Type while the fstab is processed
+	string Probed_File_System;                                                // File system found on Probed_Block_Device
+	int Probe_Result;                                                         // Result of Probe_Block_Device for Probed_Block_Device
+	unsigned Mounted_Generation;                                              // Mount table generation Mounted_State was found for
+	bool Mounted_State;                                                       // Result of the last Is_Mounted
 
 friend class TWPartitionManager;
 friend class DataManager;
@@ -266,6 +286,8 @@ public:
 	int Check_Backup_Cancel();                                                // Returns the value of stop_backup
 	int Cancel_Backup();                                                      // Signals partition backup to cancel
 	void Clean_Backup_Folder(string Backup_Folder);                           // Clean Backup Folder on Error
+	int Collect_Chunk_Garbage();                                              // Removes chunks that are no longer used by any backup
+	int Restore_Files(const string& Restore_Name, const vector<string>& Paths); // Restores individual files and folders from a backup
 	int Fix_Contexts();
 	void Get_Partition_List(string ListType, std::vector<PartitionList> *Partition_List);
 	int Fstab_Processed();                                                    // Indicates if the fstab has been processed or not
@@ -291,10 +313,19 @@ private:
 	void Setup_Settings_Storage_Partition(TWPartition* Part);                 // Sets up settings storage
 	void Setup_Android_Secure_Location(TWPartition* Part);                    // Sets up .android_secure if needed
 	bool Make_MD5(struct PartitionSettings *part_settings);                   // Generates an MD5 after a backup is made
-	bool Backup_Partition(struct PartitionSettings *part_settings);           // Backup the partitions based on type
+	bool Store_Chunks(struct PartitionSettings *part_settings);               // Moves the archives of a backup into the chunk store
+	bool Restore_Chunks(struct PartitionSettings *part_settings, TWPartition* Part, twrpChunkStore* chunks); // Reassembles the archives of a partition from the chunk store
+	void Get_Archive_Files(const string& Full_File, const string& Extension, vector<string>& Files); // Lists a single or split archive
+	bool Backup_Partition(struct PartitionSettings *part_settings, pid_t *fork_pid = NULL, bool In_Job = false); // Backup the partitions based on type
+	void Backup_Failed(struct PartitionSettings *part_settings);              // Cleans the backup folder and saves the log after a failed backup
+	bool Backup_Concurrently(struct PartitionSettings *part_settings, std::vector<TWPartition*>& Parts); // Backs up partitions on different disks at the same time
+	static void* Backup_Job_Thread(void *cookie);                             // Backs up the partitions of one disk for Backup_Concurrently
+	void Probe_File_Systems();                                                // Probes the block devices of all mountable partitions at the same time
+	static void* Probe_Thread(void *cookie);                                  // Probes block devices for Probe_File_Systems
 	void Output_Partition(TWPartition* Part);                                 // Outputs partition details to the log
 	TWPartition* Find_Partition_By_MTP_Storage_ID(unsigned int Storage_ID);   // Returns a pointer to a partition based on MTP Storage ID
 	bool Add_Remove_MTP_Storage(TWPartition* Part, int message_type);         // Adds or removes an MTP Storage partition
+	static void MTP_Mount_Changed(const twrpMountTable::Mount_Entry& Entry, bool Mounted, void* Cookie); // Mount table listener that removes storage unmounted behind our back
 	TWPartition* Find_Next_Storage(string Path, bool Exclude_Data_Media);
 	int Open_Lun_File(string Partition_Path, string Lun_File);
 	pid_t mtppid;
@@ -38,9 +38,30 @@ ProgressTracking::ProgressTracking(const unsigned long long backup_size) {
 	current_count = 0;
 	previous_partitions_size = 0;
 	display_file_count = false;
+	merge_into = NULL;
+	merged_size = 0;
+	pthread_mutex_init(&merge_lock, NULL);
 	clock_gettime(CLOCK_MONOTONIC, &last_update);
 }
 
+ProgressTracking::ProgressTracking(ProgressTracking* merge_into_tracker) {
+	total_backup_size = 0;
+	partition_size = 0;
+	file_count = 0;
+	current_size = 0;
+	current_count = 0;
+	previous_partitions_size = 0;
+	display_file_count = false;
+	merge_into = merge_into_tracker;
+	merged_size = 0;
+	pthread_mutex_init(&merge_lock, NULL);
+	clock_gettime(CLOCK_MONOTONIC, &last_update);
+}
+
+ProgressTracking::~ProgressTracking() {
+	pthread_mutex_destroy(&merge_lock);
+}
+
 void ProgressTracking::SetPartitionSize(const unsigned long long part_size) {
 	previous_partitions_size += partition_size;
 	partition_size = part_size;
@@ -71,7 +92,29 @@ void ProgressTracking::DisplayFileCount(const bool display) {
 	UpdateDisplayDetails(true);
 }
 
+// Adds the progress a job made since its last report, the jobs run on
+// different threads so this is serialized
+void ProgressTracking::Merge(ProgressTracking* job, const bool force) {
+	unsigned long long job_size = job->previous_partitions_size + job->current_size;
+
+	pthread_mutex_lock(&merge_lock);
+	previous_partitions_size += job_size - job->merged_size;
+	job->merged_size = job_size;
+	// The file count of the last tar job stays up while images are running
+	if (job->display_file_count) {
+		file_count = job->file_count;
+		current_count = job->current_count;
+		display_file_count = true;
+	}
+	UpdateDisplayDetails(force);
+	pthread_mutex_unlock(&merge_lock);
+}
+
 void ProgressTracking::UpdateDisplayDetails(const bool force) {
+	if (merge_into) {
+		merge_into->Merge(this, force);
+		return;
+	}
 #ifndef BUILD_TWRPTAR_MAIN
 	if (!force) {
 		// Do something to check the time frame and only update periodically to reduce the total number of GUI updates
@@ -20,12 +20,15 @@
 #define __PROGRESSTRACKING_HPP
 
 #include <time.h>
+#include <pthread.h>
 
 // Progress tracking class for tracking backup progess and updating the progress bar as appropriate
 class ProgressTracking
 {
 public:
 	ProgressTracking(const unsigned long long backup_size);
+	ProgressTracking(ProgressTracking* merge_into);    // Tracks one of several concurrent jobs, merge_into shows the combined progress
+	~ProgressTracking();
 
 	void SetPartitionSize(const unsigned long long part_size);
 	void SetSizeCount(const unsigned long long part_size, unsigned long long f_count);
@@ -49,6 +52,11 @@ private:
 
 	bool display_file_count;                           // Inidicates if we will display the file count text
 	timespec last_update;                              // Tracks last update of the displayed progress (frequent updates tax the CPU and slow us down)
+
+	void Merge(ProgressTracking* job, const bool force);
+	ProgressTracking* merge_into;                      // Tracker of the whole backup when this one tracks a concurrent job
+	unsigned long long merged_size;                    // Progress of this job already added to merge_into
+	pthread_mutex_t merge_lock;
 };
 
 #endif //__PROGRESSTRACKING_HPP
@@ -0,0 +1,267 @@
+#!/usr/bin/env python3
+#
+# Copyright 2016 TeamWin
+# This file is part of TWRP/TeamWin Recovery Project.
+#
+# TWRP is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# TWRP is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+
+# Benchmarks twrpTar backups and restores of synthetic trees on a Linux host.
+# See scripts/README for usage.
+
+import argparse
+import hashlib
+import json
+import os
+import random
+import resource
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+HELP_TREE = """tree layout as comma separated count:minsize-maxsize groups, sizes
+take K, M and G suffixes. Presets: apps (many small files like /data/data),
+media (a few large files like /data/media) and mixed (both)"""
+
+PRESETS = {
+	"apps": "20000:512-64K",
+	"media": "40:8M-64M",
+	"mixed": "20000:512-64K,40:8M-64M",
+}
+
+COMPRESSION_ARGS = {
+	"none": [],
+	"gzip": ["-z"],
+	"lz4": ["-Z", "lz4"],
+	"zstd": ["-Z", "zstd"],
+}
+
+def parse_size(text):
+	units = {"K": 1024, "M": 1024 * 1024, "G": 1024 * 1024 * 1024}
+	text = text.strip().upper()
+	if text[-1] in units:
+		return int(float(text[:-1]) * units[text[-1]])
+	return int(text)
+
+def parse_tree(spec):
+	spec = PRESETS.get(spec, spec)
+	groups = []
+	for group in spec.split(","):
+		count, sizes = group.split(":")
+		low, high = sizes.split("-")
+		groups.append((int(count), parse_size(low), parse_size(high)))
+	return groups
+
+def generate_tree(root, groups, compressible, seed):
+	# Files are spread over directories of at most 64 entries, like app data.
+	# compressible is the fraction of each file filled with repeated text.
+	rng = random.Random(seed)
+	text = b"TWRP benchmark data " * 4096
+	total_size = 0
+	file_count = 0
+	for group_id, (count, low, high) in enumerate(groups):
+		for i in range(count):
+			folder = os.path.join(root, "group%d" % group_id, "d%d" % (i // 4096), "d%d" % (i // 64))
+			if i % 64 == 0:
+				os.makedirs(folder, exist_ok=True)
+			size = rng.randint(low, high)
+			text_size = int(size * compressible)
+			with open(os.path.join(folder, "f%d" % i), "wb") as f:
+				written = 0
+				while written < text_size:
+					chunk = min(len(text), text_size - written)
+					f.write(text[:chunk])
+					written += chunk
+				f.write(os.urandom(size - text_size))
+			total_size += size
+			file_count += 1
+	return total_size, file_count
+
+def tree_digest(root):
+	# Digest of all paths, modes, sizes and contents to verify restores
+	digest = hashlib.sha256()
+	for folder, dirs, files in os.walk(root):
+		dirs.sort()
+		for name in sorted(files):
+			path = os.path.join(folder, name)
+			st = os.lstat(path)
+			digest.update(("%s %o %d\n" % (os.path.relpath(path, root), st.st_mode, st.st_size)).encode())
+			with open(path, "rb") as f:
+				while True:
+					data = f.read(1 << 20)
+					if not data:
+						break
+					digest.update(data)
+	return digest.hexdigest()
+
+def drop_caches():
+	try:
+		subprocess.call(["sync"])
+		with open("/proc/sys/vm/drop_caches", "w") as f:
+			f.write("3\n")
+		return True
+	except (IOError, OSError):
+		return False
+
+def count_syscalls(strace_file):
+	# Last line of strace -c is the total: "100.00 time seconds usecs calls errors total"
+	calls = 0
+	with open(strace_file) as f:
+		for line in f:
+			fields = line.split()
+			if fields and fields[-1] == "total":
+				calls = int(fields[3])
+	return calls
+
+def measure(command, env, strace):
+	# Runs command in a forked helper so that the rusage of its children,
+	# twrpTar and the compressors it starts, covers this run only
+	read_fd, write_fd = os.pipe()
+	pid = os.fork()
+	if pid == 0:
+		os.close(read_fd)
+		result = {}
+		strace_file = None
+		if strace:
+			strace_file = tempfile.mktemp(prefix="twrptar_strace_")
+			command = ["strace", "-f", "-c", "-o", strace_file] + command
+		with open(os.devnull, "w") as devnull:
+			start = time.time()
+			result["status"] = subprocess.call(command, env=env, stdout=devnull, stderr=devnull)
+			result["seconds"] = time.time() - start
+		usage = resource.getrusage(resource.RUSAGE_CHILDREN)
+		result["user_seconds"] = usage.ru_utime
+		result["system_seconds"] = usage.ru_stime
+		result["peak_rss_kb"] = usage.ru_maxrss
+		result["voluntary_switches"] = usage.ru_nvcsw
+		result["involuntary_switches"] = usage.ru_nivcsw
+		if strace_file:
+			result["syscalls"] = count_syscalls(strace_file)
+			os.unlink(strace_file)
+		os.write(write_fd, json.dumps(result).encode())
+		os._exit(0)
+	os.close(write_fd)
+	data = b""
+	while True:
+		chunk = os.read(read_fd, 4096)
+		if not chunk:
+			break
+		data += chunk
+	os.close(read_fd)
+	os.waitpid(pid, 0)
+	return json.loads(data.decode())
+
+def main():
+	parser = argparse.ArgumentParser(description="Benchmark twrpTar backups and restores on synthetic trees.")
+	parser.add_argument("--twrptar", default="twrpTar", help="twrpTar binary, default is twrpTar in PATH")
+	parser.add_argument("--work-dir", default=None, help="folder for the trees and archives, default is a new temporary folder")
+	parser.add_argument("--tree", action="append", default=None, help=HELP_TREE)
+	parser.add_argument("--compressible", type=float, default=0.5, help="fraction of each file that compresses well, default 0.5")
+	parser.add_argument("--compression", default="none,gzip", help="comma separated list of none, gzip, lz4 and zstd")
+	parser.add_argument("--encryption", default="none", help="comma separated list of none, aes (-e) and userdata (-e -u)")
+	parser.add_argument("--threads", default="0", help="comma separated thread counts passed with -T, 0 for one per core")
+	parser.add_argument("--repeat", type=int, default=1, help="runs of each combination")
+	parser.add_argument("--password", default="benchmark", help="password for encrypted runs")
+	parser.add_argument("--strace", action="store_true", help="count system calls with strace -f -c, this slows the runs down")
+	parser.add_argument("--drop-caches", action="store_true", help="drop the page cache before each run, needs root")
+	parser.add_argument("--seed", type=int, default=1, help="seed for the file sizes")
+	parser.add_argument("--output", default="-", help="file for the JSON results, default is stdout")
+	args = parser.parse_args()
+
+	env = dict(os.environ)
+	twrptar = shutil.which(args.twrptar) if os.sep not in args.twrptar else os.path.abspath(args.twrptar)
+	if not twrptar or not os.access(twrptar, os.X_OK):
+		sys.exit("twrpTar binary '%s' not found" % args.twrptar)
+	# twrpTar finds pigz, lz4, zstd and openaes in PATH, look next to it first
+	env["PATH"] = os.path.dirname(twrptar) + os.pathsep + env.get("PATH", "")
+
+	work_dir = os.path.abspath(args.work_dir or tempfile.mkdtemp(prefix="twrptar_bench_"))
+	if work_dir.count(os.sep) < 2:
+		sys.exit("work dir must be at least two levels deep, e.g. /tmp/bench")
+	# twrpTar leaves the first folder of the path out of single archives and
+	# keeps full paths in split ones, extracting to the top folder restores
+	# both kinds to where they came from
+	extract_dir = os.sep + work_dir.split(os.sep)[1]
+
+	results = []
+	for tree_spec in (args.tree or ["mixed"]):
+		tree = os.path.join(work_dir, "tree")
+		if os.path.exists(tree):
+			shutil.rmtree(tree)
+		total_size, file_count = generate_tree(tree, parse_tree(tree_spec), args.compressible, args.seed)
+		digest = tree_digest(tree)
+		saved = os.path.join(work_dir, "tree.orig")
+		if os.path.exists(saved):
+			shutil.rmtree(saved)
+		os.rename(tree, saved)
+
+		for compression in args.compression.split(","):
+			for encryption in args.encryption.split(","):
+				for threads in args.threads.split(","):
+					for run in range(args.repeat):
+						shutil.copytree(saved, tree, symlinks=True)
+						archive_dir = os.path.join(work_dir, "archive")
+						if os.path.exists(archive_dir):
+							shutil.rmtree(archive_dir)
+						os.makedirs(archive_dir)
+						archive = os.path.join(archive_dir, "tree.win")
+						options = list(COMPRESSION_ARGS[compression])
+						if encryption != "none":
+							options += ["-e", args.password]
+						if encryption == "userdata":
+							options += ["-u"]
+						options += ["-T", threads]
+
+						result = {
+							"tree": tree_spec,
+							"files": file_count,
+							"bytes": total_size,
+							"compression": compression,
+							"encryption": encryption,
+							"threads": int(threads),
+							"run": run,
+						}
+						if args.drop_caches:
+							drop_caches()
+						backup = measure([twrptar, "-c", "-d", tree, "-t", archive] + options, env, args.strace)
+						backup["archive_bytes"] = sum(os.path.getsize(os.path.join(archive_dir, name)) for name in os.listdir(archive_dir))
+						shutil.rmtree(tree)
+						if args.drop_caches:
+							drop_caches()
+						restore = measure([twrptar, "-x", "-d", extract_dir, "-t", archive] + options, env, args.strace)
+						restore["verified"] = os.path.isdir(tree) and tree_digest(tree) == digest
+						for name, measured in (("backup", backup), ("restore", restore)):
+							if measured["seconds"] > 0:
+								measured["mb_per_second"] = total_size / measured["seconds"] / (1024 * 1024)
+						result["backup"] = backup
+						result["restore"] = restore
+						results.append(result)
+						sys.stderr.write("%s %s %s threads %s run %d: backup %.2fs, restore %.2fs%s\n" % (tree_spec, compression, encryption, threads, run, backup["seconds"], restore["seconds"], "" if restore["verified"] else ", RESTORE DIFFERS"))
+						if os.path.exists(tree):
+							shutil.rmtree(tree)
+		shutil.rmtree(saved)
+
+	output = json.dumps({"twrptar": twrptar, "results": results}, indent=2, sort_keys=True)
+	if args.output == "-":
+		print(output)
+	else:
+		with open(args.output, "w") as f:
+			f.write(output + "\n")
+	if not args.work_dir:
+		shutil.rmtree(work_dir)
+	return 0 if all(r["backup"]["status"] == 0 and r["restore"]["status"] == 0 and r["restore"]["verified"] for r in results) else 1
+
+if __name__ == "__main__":
+	sys.exit(main())
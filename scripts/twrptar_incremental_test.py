@@ -0,0 +1,138 @@
+#!/usr/bin/env python3
+#
+# Copyright 2016 TeamWin
+# This file is part of TWRP/TeamWin Recovery Project.
+#
+# TWRP is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# TWRP is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+
+# Restores an incremental twrpTar backup on top of its base on a Linux host
+# and checks that the result matches the tree that was backed up.
+# See scripts/README for usage.
+
+import argparse
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+
+# The base is always unencrypted, the increment uses each of these
+INCREMENT_ARGS = {
+	"none": [],
+	"aes": ["-e", "incremental"],
+	"userdata": ["-e", "incremental", "-u"],
+}
+
+def write_file(path, data):
+	os.makedirs(os.path.dirname(path), exist_ok=True)
+	with open(path, "wb") as f:
+		f.write(data)
+
+def create_tree(root):
+	# app and dalvik-cache are left unencrypted by userdata encryption
+	write_file(os.path.join(root, "app", "com.example", "base.apk"), b"apk" * 1000)
+	write_file(os.path.join(root, "dalvik-cache", "arm", "classes.dex"), b"dex" * 1000)
+	write_file(os.path.join(root, "data", "com.example", "files", "kept"), b"kept")
+	write_file(os.path.join(root, "data", "com.example", "files", "changed"), b"before")
+	write_file(os.path.join(root, "data", "com.example", "files", "deleted"), b"deleted")
+	write_file(os.path.join(root, "removed", "stale"), b"stale")
+	write_file(os.path.join(root, "system.prop"), b"prop")
+
+def change_tree(root):
+	os.unlink(os.path.join(root, "data", "com.example", "files", "deleted"))
+	shutil.rmtree(os.path.join(root, "removed"))
+	write_file(os.path.join(root, "data", "com.example", "files", "changed"), b"after, and longer")
+	write_file(os.path.join(root, "data", "com.example", "files", "added"), b"added")
+
+def list_tree(root):
+	# Every path with its type and, for files, the contents
+	entries = {}
+	for folder, dirs, files in os.walk(root):
+		for name in dirs:
+			entries[os.path.relpath(os.path.join(folder, name), root)] = "dir"
+		for name in files:
+			with open(os.path.join(folder, name), "rb") as f:
+				entries[os.path.relpath(os.path.join(folder, name), root)] = f.read()
+	return entries
+
+def run(command, env):
+	with open(os.devnull, "w") as devnull:
+		return subprocess.call(command, env=env, stdout=devnull, stderr=devnull) == 0
+
+def test_increment(twrptar, env, work_dir, extract_dir, encryption):
+	tree = os.path.join(work_dir, "tree")
+	base = os.path.join(work_dir, "base")
+	increment = os.path.join(work_dir, "increment")
+	for path in (tree, base, increment):
+		if os.path.exists(path):
+			shutil.rmtree(path)
+	os.makedirs(base)
+	os.makedirs(increment)
+	base_archive = os.path.join(base, "data.ext4.win")
+	increment_archive = os.path.join(increment, "data.ext4.win")
+	options = INCREMENT_ARGS[encryption] + ["-T", "2"]
+
+	create_tree(tree)
+	if not run([twrptar, "-c", "-d", tree, "-t", base_archive, "-M"], env):
+		return "base backup failed"
+	change_tree(tree)
+	if not run([twrptar, "-c", "-d", tree, "-t", increment_archive, "-i", base] + options, env):
+		return "incremental backup failed"
+	expected = list_tree(tree)
+
+	shutil.rmtree(tree)
+	if not run([twrptar, "-x", "-d", extract_dir, "-t", base_archive, "-M"], env):
+		return "base restore failed"
+	if not run([twrptar, "-x", "-d", extract_dir, "-t", increment_archive, "-M"] + options, env):
+		return "incremental restore failed"
+	restored = list_tree(tree) if os.path.isdir(tree) else {}
+	if restored != expected:
+		missing = sorted(set(expected) - set(restored))
+		extra = sorted(set(restored) - set(expected))
+		changed = sorted(path for path in set(expected) & set(restored) if expected[path] != restored[path])
+		return "restored tree differs: missing %s, extra %s, changed %s" % (missing, extra, changed)
+	return None
+
+def main():
+	parser = argparse.ArgumentParser(description="Check incremental twrpTar backups against their base.")
+	parser.add_argument("--twrptar", default="twrpTar", help="twrpTar binary, default is twrpTar in PATH")
+	parser.add_argument("--work-dir", default=None, help="folder for the trees and archives, default is a new temporary folder")
+	parser.add_argument("--encryption", default="none,aes,userdata", help="comma separated list of none, aes (-e) and userdata (-e -u) for the increment")
+	args = parser.parse_args()
+
+	env = dict(os.environ)
+	twrptar = shutil.which(args.twrptar) if os.sep not in args.twrptar else os.path.abspath(args.twrptar)
+	if not twrptar or not os.access(twrptar, os.X_OK):
+		sys.exit("twrpTar binary '%s' not found" % args.twrptar)
+	# twrpTar finds openaes in PATH, look next to it first
+	env["PATH"] = os.path.dirname(twrptar) + os.pathsep + env.get("PATH", "")
+
+	work_dir = os.path.abspath(args.work_dir or tempfile.mkdtemp(prefix="twrptar_incremental_"))
+	if work_dir.count(os.sep) < 2:
+		sys.exit("work dir must be at least two levels deep, e.g. /tmp/incremental")
+	# Archives are restored to where they came from, see twrptar_benchmark.py
+	extract_dir = os.sep + work_dir.split(os.sep)[1]
+
+	failures = 0
+	for encryption in args.encryption.split(","):
+		error = test_increment(twrptar, env, work_dir, extract_dir, encryption)
+		sys.stderr.write("unencrypted base, %s increment: %s\n" % (encryption, error or "ok"))
+		if error:
+			failures += 1
+	if not args.work_dir:
+		shutil.rmtree(work_dir)
+	return 1 if failures else 0
+
+if __name__ == "__main__":
+	sys.exit(main())
@@ -40,6 +40,7 @@
 #include "partitions.hpp"
 #include "twrpDigest.hpp"
 #include "twrp-functions.hpp"
+#include "twrpTrace.hpp"
 #include "gui/gui.hpp"
 #include "gui/pages.hpp"
 extern "C" {
@@ -293,6 +294,7 @@ extern "C" int TWinstall_zip(const char* path, int* wipe_cache) {
 		LOGERR("Failed to get adb sideload file: '%s'\n", path);
 		return INSTALL_CORRUPT;
 	}
+	twrpTraceSpan span("install", "TWinstall_zip", path);
 
 	gui_msg(Msg("installing_zip=Installing zip file '{1}'")(path));
 	if (strlen(path) < 9 || strncmp(path, "/sideload", 9) != 0) {
@@ -18,6 +18,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string>
 #include <unistd.h>
 #include <vector>
@@ -152,21 +153,24 @@ bool TWFunc::Path_Exists(string Path) {
 }
 
 Archive_Type TWFunc::Get_File_Type(string fn) {
-	string::size_type i = 0;
-	int firstbyte = 0, secondbyte = 0;
-	char header[3];
+	static const unsigned char lz4_magic[4] = { 0x04, 0x22, 0x4d, 0x18 };
+	static const unsigned char zstd_magic[4] = { 0x28, 0xb5, 0x2f, 0xfd };
+	unsigned char header[4];
 
+	memset(header, 0, sizeof(header));
 	ifstream f;
 	f.open(fn.c_str(), ios::in | ios::binary);
-	f.get(header, 3);
+	f.read((char*)header, sizeof(header));
 	f.close();
-	firstbyte = header[i] & 0xff;
-	secondbyte = header[++i] & 0xff;
 
-	if (firstbyte == 0x1f && secondbyte == 0x8b)
+	if (header[0] == 0x1f && header[1] == 0x8b)
 		return COMPRESSED;
-	else if (firstbyte == 0x4f && secondbyte == 0x41)
+	else if (header[0] == 0x4f && header[1] == 0x41)
 		return ENCRYPTED;
+	else if (memcmp(header, lz4_magic, sizeof(lz4_magic)) == 0)
+		return LZ4_COMPRESSED;
+	else if (memcmp(header, zstd_magic, sizeof(zstd_magic)) == 0)
+		return ZSTD_COMPRESSED;
 	return UNCOMPRESSED; // default
 }
 
@@ -352,6 +356,92 @@ int32_t TWFunc::timespec_diff_ms(timespec& start, timespec& end)
 			((start.tv_sec * 1000) + start.tv_nsec/1000000);
 }
 
+int TWFunc::removeDir(const string path, bool skipParent) {
+	DIR *d = opendir(path.c_str());
+	int r = 0;
+	string new_path;
+
+	if (d == NULL) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(path)(strerror(errno)));
+		return -1;
+	}
+
+	if (d) {
+		struct dirent *p;
+		while (!r && (p = readdir(d))) {
+			if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
+				continue;
+			new_path = path + "/";
+			new_path.append(p->d_name);
+			if (p->d_type == DT_DIR) {
+				r = removeDir(new_path, true);
+				if (!r) {
+					if (p->d_type == DT_DIR)
+						r = rmdir(new_path.c_str());
+					else
+						LOGINFO("Unable to removeDir '%s': %s\n", new_path.c_str(), strerror(errno));
+				}
+			} else if (p->d_type == DT_REG || p->d_type == DT_LNK || p->d_type == DT_FIFO || p->d_type == DT_SOCK) {
+				r = unlink(new_path.c_str());
+				if (r != 0) {
+					LOGINFO("Unable to unlink '%s: %s'\n", new_path.c_str(), strerror(errno));
+				}
+			}
+		}
+		closedir(d);
+
+		if (!r) {
+			if (skipParent)
+				return 0;
+			else
+				r = rmdir(path.c_str());
+		}
+	}
+	return r;
+}
+
+int TWFunc::read_file(string fn, string& results) {
+	ifstream file;
+	file.open(fn.c_str(), ios::in);
+
+	if (file.is_open()) {
+		file >> results;
+		file.close();
+		return 0;
+	}
+
+	LOGINFO("Cannot find file %s\n", fn.c_str());
+	return -1;
+}
+
+int TWFunc::read_file(string fn, vector<string>& results) {
+	ifstream file;
+	string line;
+	file.open(fn.c_str(), ios::in);
+	if (file.is_open()) {
+		while (getline(file, line))
+			results.push_back(line);
+		file.close();
+		return 0;
+	}
+	LOGINFO("Cannot find file %s\n", fn.c_str());
+	return -1;
+}
+
+int TWFunc::read_file(string fn, uint64_t& results) {
+	ifstream file;
+	file.open(fn.c_str(), ios::in);
+
+	if (file.is_open()) {
+		file >> results;
+		file.close();
+		return 0;
+	}
+
+	LOGINFO("Cannot find file %s\n", fn.c_str());
+	return -1;
+}
+
 #ifndef BUILD_TWRPTAR_MAIN
 
 // Returns "/path" from a full /path/to/file.name
@@ -595,50 +685,6 @@ void TWFunc::check_and_run_script(const char* script_file, const char* display_n
 	}
 }
 
-int TWFunc::removeDir(const string path, bool skipParent) {
-	DIR *d = opendir(path.c_str());
-	int r = 0;
-	string new_path;
-
-	if (d == NULL) {
-		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(path)(strerror(errno)));
-		return -1;
-	}
-
-	if (d) {
-		struct dirent *p;
-		while (!r && (p = readdir(d))) {
-			if (!strcmp(p->d_name, ".") || !strcmp(p->d_name, ".."))
-				continue;
-			new_path = path + "/";
-			new_path.append(p->d_name);
-			if (p->d_type == DT_DIR) {
-				r = removeDir(new_path, true);
-				if (!r) {
-					if (p->d_type == DT_DIR)
-						r = rmdir(new_path.c_str());
-					else
-						LOGINFO("Unable to removeDir '%s': %s\n", new_path.c_str(), strerror(errno));
-				}
-			} else if (p->d_type == DT_REG || p->d_type == DT_LNK || p->d_type == DT_FIFO || p->d_type == DT_SOCK) {
-				r = unlink(new_path.c_str());
-				if (r != 0) {
-					LOGINFO("Unable to unlink '%s: %s'\n", new_path.c_str(), strerror(errno));
-				}
-			}
-		}
-		closedir(d);
-
-		if (!r) {
-			if (skipParent)
-				return 0;
-			else
-				r = rmdir(path.c_str());
-		}
-	}
-	return r;
-}
-
 int TWFunc::copy_file(string src, string dst, int mode) {
 	LOGINFO("Copying file %s to %s\n", src.c_str(), dst.c_str());
 	ifstream srcfile(src.c_str(), ios::binary);
@@ -672,48 +718,6 @@ unsigned int TWFunc::Get_D_Type_From_Stat(string Path) {
 	return DT_UNKNOWN;
 }
 
-int TWFunc::read_file(string fn, string& results) {
-	ifstream file;
-	file.open(fn.c_str(), ios::in);
-
-	if (file.is_open()) {
-		file >> results;
-		file.close();
-		return 0;
-	}
-
-	LOGINFO("Cannot find file %s\n", fn.c_str());
-	return -1;
-}
-
-int TWFunc::read_file(string fn, vector<string>& results) {
-	ifstream file;
-	string line;
-	file.open(fn.c_str(), ios::in);
-	if (file.is_open()) {
-		while (getline(file, line))
-			results.push_back(line);
-		file.close();
-		return 0;
-	}
-	LOGINFO("Cannot find file %s\n", fn.c_str());
-	return -1;
-}
-
-int TWFunc::read_file(string fn, uint64_t& results) {
-	ifstream file;
-	file.open(fn.c_str(), ios::in);
-
-	if (file.is_open()) {
-		file >> results;
-		file.close();
-		return 0;
-	}
-
-	LOGINFO("Cannot find file %s\n", fn.c_str());
-	return -1;
-}
-
 int TWFunc::write_file(string fn, string& line) {
 	FILE *file;
 	file = fopen(fn.c_str(), "w");
@@ -0,0 +1,415 @@
+/*
+        Copyright 2016 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "twrpChunkStore.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+#include "gui/gui.hpp"
+#include "mincrypt/sha256.h"
+
+using namespace std;
+
+/* Index file format:
+ *   twrp-chunks 1 <archive size>
+ *   <sha256> <chunk size>
+ *   ...
+ * Chunks are stored as CHUNKS/<first two hex digits>/<sha256>.
+ */
+#define CHUNK_INDEX_MAGIC "twrp-chunks 1"
+
+// Chunk boundaries are found with a gear rolling hash. A boundary is cut
+// when the upper 16 bits of the hash are zero, giving an average chunk of
+// about 64KiB after the minimum size.
+#define CHUNK_MIN_SIZE (16 * 1024)
+#define CHUNK_MAX_SIZE (256 * 1024)
+#define CHUNK_MASK 0xffff0000
+#define CHUNK_READ_SIZE (1024 * 1024)
+
+const char* twrpChunkStore::Index_Extension = ".chunks";
+
+static uint32_t gear[256];
+
+static void Init_Gear() {
+	// The table has to be identical for every backup or nothing will
+	// deduplicate, so it is generated from a fixed seed
+	uint32_t x = 0x2545f491;
+
+	if (gear[0] != 0)
+		return;
+	for (int i = 0; i < 256; i++) {
+		x ^= x << 13;
+		x ^= x >> 17;
+		x ^= x << 5;
+		gear[i] = x;
+	}
+}
+
+twrpChunkStore::twrpChunkStore(const string& Backups_Folder) {
+	string Folder = Backups_Folder;
+
+	while (Folder.size() > 1 && Folder[Folder.size() - 1] == '/')
+		Folder.resize(Folder.size() - 1);
+	Backups_Root = TWFunc::Get_Path(Folder);
+	Folder = Backups_Root.substr(0, Backups_Root.size() - 1);
+	Store_Folder = TWFunc::Get_Path(Folder) + "CHUNKS";
+	Init_Gear();
+}
+
+twrpChunkStore::~twrpChunkStore() {
+	for (vector<string>::iterator file = Restored_Files.begin(); file != Restored_Files.end(); file++) {
+		if (unlink(file->c_str()) != 0)
+			LOGINFO("Unable to remove '%s': %s\n", file->c_str(), strerror(errno));
+	}
+}
+
+string twrpChunkStore::Chunk_Path(const string& Hash) {
+	return Store_Folder + "/" + Hash.substr(0, 2) + "/" + Hash;
+}
+
+// Creates a new file next to Path to be renamed over it, returns its fd
+int twrpChunkStore::Create_Temp(const string& Path, string& Temp_Path) {
+	string Template = Path + ".XXXXXX";
+	vector<char> name(Template.begin(), Template.end());
+
+	name.push_back('\0');
+	int fd = mkstemp(&name[0]);
+	if (fd < 0) {
+		LOGINFO("Unable to create '%s': %s\n", Template.c_str(), strerror(errno));
+		return -1;
+	}
+	fchmod(fd, 0644);
+	Temp_Path = &name[0];
+	return fd;
+}
+
+bool twrpChunkStore::Write_Chunk(const unsigned char* Data, uint32_t Size, string& Hash, unsigned long long& New_Size) {
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	char hex[SHA256_DIGEST_SIZE * 2 + 1];
+	struct stat st;
+
+	SHA256_hash(Data, Size, digest);
+	for (int i = 0; i < SHA256_DIGEST_SIZE; i++)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+	Hash = hex;
+
+	string Path = Chunk_Path(Hash);
+	if (stat(Path.c_str(), &st) == 0 && st.st_size == (off_t)Size)
+		return true;
+
+	string Folder = TWFunc::Get_Path(Path);
+	if (mkdir(Folder.c_str(), 0777) != 0 && errno != EEXIST) {
+		LOGINFO("Unable to create '%s': %s\n", Folder.c_str(), strerror(errno));
+		return false;
+	}
+	// Write to a temporary name first so an interrupted backup never
+	// leaves a truncated chunk behind under a valid hash. Partitions
+	// backed up concurrently may write the same chunk, so the name is
+	// unique to this writer.
+	string Temp_Path;
+	int fd = Create_Temp(Path, Temp_Path);
+	if (fd < 0)
+		return false;
+	if (write(fd, Data, Size) != (ssize_t)Size) {
+		LOGINFO("Unable to write '%s': %s\n", Temp_Path.c_str(), strerror(errno));
+		close(fd);
+		unlink(Temp_Path.c_str());
+		return false;
+	}
+	close(fd);
+	if (rename(Temp_Path.c_str(), Path.c_str()) != 0) {
+		int rename_errno = errno;
+		unlink(Temp_Path.c_str());
+		// another writer got there first
+		if (stat(Path.c_str(), &st) == 0 && st.st_size == (off_t)Size)
+			return true;
+		LOGINFO("Unable to rename '%s': %s\n", Temp_Path.c_str(), strerror(rename_errno));
+		return false;
+	}
+	New_Size += Size;
+	return true;
+}
+
+bool twrpChunkStore::Store_File(const string& Filename) {
+	string Index_File = Filename + Index_Extension;
+	string Temp_Index;
+	unsigned long long Total_Size = 0, New_Size = 0;
+	unsigned char *buf, *chunk;
+	uint32_t chunk_len = 0, h = 0;
+	ssize_t len;
+	string Hash;
+	bool ret = false;
+	FILE* fp;
+
+	if (!TWFunc::Recursive_Mkdir(Store_Folder))
+		return false;
+	int fd = open(Filename.c_str(), O_RDONLY | O_LARGEFILE);
+	if (fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Filename)(strerror(errno)));
+		return false;
+	}
+	int index_fd = Create_Temp(Index_File, Temp_Index);
+	fp = (index_fd < 0 ? NULL : fdopen(index_fd, "w"));
+	if (!fp) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Index_File)(strerror(errno)));
+		if (index_fd >= 0) {
+			close(index_fd);
+			unlink(Temp_Index.c_str());
+		}
+		close(fd);
+		return false;
+	}
+	buf = (unsigned char*)malloc(CHUNK_READ_SIZE);
+	chunk = (unsigned char*)malloc(CHUNK_MAX_SIZE);
+	if (!buf || !chunk) {
+		LOGINFO("Unable to allocate chunk buffers\n");
+		goto exit;
+	}
+	// The archive size is filled in once it is known
+	fprintf(fp, "%s %020" PRIu64 "\n", CHUNK_INDEX_MAGIC, (uint64_t)0);
+
+	while ((len = read(fd, buf, CHUNK_READ_SIZE)) > 0) {
+		for (ssize_t i = 0; i < len; i++) {
+			chunk[chunk_len++] = buf[i];
+			h = (h << 1) + gear[buf[i]];
+			if ((chunk_len >= CHUNK_MIN_SIZE && (h & CHUNK_MASK) == 0) || chunk_len == CHUNK_MAX_SIZE) {
+				if (!Write_Chunk(chunk, chunk_len, Hash, New_Size))
+					goto exit;
+				fprintf(fp, "%s %u\n", Hash.c_str(), chunk_len);
+				Total_Size += chunk_len;
+				chunk_len = 0;
+				h = 0;
+			}
+		}
+	}
+	if (len < 0) {
+		LOGINFO("Error reading '%s': %s\n", Filename.c_str(), strerror(errno));
+		goto exit;
+	}
+	if (chunk_len > 0) {
+		if (!Write_Chunk(chunk, chunk_len, Hash, New_Size))
+			goto exit;
+		fprintf(fp, "%s %u\n", Hash.c_str(), chunk_len);
+		Total_Size += chunk_len;
+	}
+	rewind(fp);
+	fprintf(fp, "%s %020llu\n", CHUNK_INDEX_MAGIC, Total_Size);
+	ret = true;
+
+exit:
+	free(buf);
+	free(chunk);
+	close(fd);
+	if (fclose(fp) != 0)
+		ret = false;
+	if (ret && rename(Temp_Index.c_str(), Index_File.c_str()) != 0) {
+		LOGINFO("Unable to rename '%s': %s\n", Temp_Index.c_str(), strerror(errno));
+		ret = false;
+	}
+	if (!ret) {
+		unlink(Temp_Index.c_str());
+		gui_msg(Msg(msg::kError, "dedup_store_error=Unable to store '{1}' in the chunk store.")(Filename));
+		return false;
+	}
+	unlink(Filename.c_str());
+	LOGINFO("Stored '%s': %llu bytes, %llu bytes of new chunks\n", Filename.c_str(), Total_Size, New_Size);
+	return true;
+}
+
+bool twrpChunkStore::Load_Index(const string& Index_File, vector<Chunk>& Chunks, uint64_t& Total_Size) {
+	FILE* fp = fopen(Index_File.c_str(), "r");
+	char hash[SHA256_DIGEST_SIZE * 2 + 1];
+	char magic[32];
+	int version;
+	Chunk chunk;
+
+	if (!fp) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Index_File)(strerror(errno)));
+		return false;
+	}
+	Chunks.clear();
+	if (fscanf(fp, "%31s %d %" SCNu64, magic, &version, &Total_Size) != 3 || strncmp(CHUNK_INDEX_MAGIC, magic, strlen(magic)) != 0 || version != 1) {
+		LOGINFO("'%s' is not a chunk index\n", Index_File.c_str());
+		fclose(fp);
+		return false;
+	}
+	while (fscanf(fp, "%64s %u", hash, &chunk.size) == 2) {
+		chunk.hash = hash;
+		if (chunk.hash.size() != SHA256_DIGEST_SIZE * 2) {
+			LOGINFO("Invalid chunk '%s' in '%s'\n", hash, Index_File.c_str());
+			fclose(fp);
+			return false;
+		}
+		Chunks.push_back(chunk);
+	}
+	fclose(fp);
+	return true;
+}
+
+bool twrpChunkStore::Restore_File(const string& Filename) {
+	vector<Chunk> Chunks;
+	uint64_t Total_Size, Written = 0;
+	uint8_t digest[SHA256_DIGEST_SIZE];
+	unsigned char* buf;
+	bool ret = false;
+
+	if (!Load_Index(Filename + Index_Extension, Chunks, Total_Size))
+		return false;
+	int fd = open(Filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0644);
+	if (fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Filename)(strerror(errno)));
+		return false;
+	}
+	Restored_Files.push_back(Filename);
+	buf = (unsigned char*)malloc(CHUNK_MAX_SIZE);
+	if (!buf) {
+		LOGINFO("Unable to allocate chunk buffer\n");
+		close(fd);
+		return false;
+	}
+	for (vector<Chunk>::iterator chunk = Chunks.begin(); chunk != Chunks.end(); chunk++) {
+		string Path = Chunk_Path(chunk->hash);
+		char hex[SHA256_DIGEST_SIZE * 2 + 1];
+
+		if (chunk->size > CHUNK_MAX_SIZE) {
+			LOGINFO("Chunk '%s' is too large\n", chunk->hash.c_str());
+			goto exit;
+		}
+		int chunk_fd = open(Path.c_str(), O_RDONLY);
+		if (chunk_fd < 0) {
+			gui_msg(Msg(msg::kError, "dedup_missing_chunk=Chunk '{1}' is missing from the chunk store.")(chunk->hash));
+			goto exit;
+		}
+		ssize_t len = read(chunk_fd, buf, chunk->size);
+		close(chunk_fd);
+		SHA256_hash(buf, chunk->size, digest);
+		for (int i = 0; i < SHA256_DIGEST_SIZE; i++)
+			sprintf(hex + i * 2, "%02x", digest[i]);
+		if (len != (ssize_t)chunk->size || chunk->hash != hex) {
+			gui_msg(Msg(msg::kError, "dedup_bad_chunk=Chunk '{1}' is damaged.")(chunk->hash));
+			goto exit;
+		}
+		if (write(fd, buf, chunk->size) != (ssize_t)chunk->size) {
+			LOGINFO("Error writing '%s': %s\n", Filename.c_str(), strerror(errno));
+			goto exit;
+		}
+		Written += chunk->size;
+	}
+	if (Written != Total_Size) {
+		LOGINFO("'%s' reassembled to %" PRIu64 " bytes, expected %" PRIu64 "\n", Filename.c_str(), Written, Total_Size);
+		goto exit;
+	}
+	ret = true;
+
+exit:
+	free(buf);
+	if (close(fd) != 0)
+		ret = false;
+	return ret;
+}
+
+bool twrpChunkStore::Find_Referenced(const string& Path, vector<string>& Hashes) {
+	DIR* d = opendir(Path.c_str());
+	struct dirent* de;
+	size_t ext_len = strlen(Index_Extension);
+	bool ret = true;
+
+	if (d == NULL) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Path)(strerror(errno)));
+		return false;
+	}
+	while (ret && (de = readdir(d)) != NULL) {
+		string name = de->d_name;
+		string Full_Path = Path + "/" + name;
+
+		if (name == "." || name == "..")
+			continue;
+		if (de->d_type == DT_DIR) {
+			ret = Find_Referenced(Full_Path, Hashes);
+		} else if (name.size() > ext_len && name.compare(name.size() - ext_len, ext_len, Index_Extension) == 0) {
+			vector<Chunk> Chunks;
+			uint64_t Total_Size;
+
+			ret = Load_Index(Full_Path, Chunks, Total_Size);
+			for (vector<Chunk>::iterator chunk = Chunks.begin(); chunk != Chunks.end(); chunk++)
+				Hashes.push_back(chunk->hash);
+		}
+	}
+	closedir(d);
+	return ret;
+}
+
+int twrpChunkStore::Collect_Garbage() {
+	vector<string> Hashes;
+	unsigned long long Freed = 0;
+	int count = 0;
+	DIR* d;
+	struct dirent* de;
+
+	if (!TWFunc::Path_Exists(Store_Folder))
+		return 0;
+	// Never delete anything unless every index could be read, a damaged
+	// index would otherwise take its chunks with it
+	if (!Find_Referenced(Backups_Root.substr(0, Backups_Root.size() - 1), Hashes))
+		return -1;
+	sort(Hashes.begin(), Hashes.end());
+	Hashes.erase(unique(Hashes.begin(), Hashes.end()), Hashes.end());
+
+	d = opendir(Store_Folder.c_str());
+	if (d == NULL) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Store_Folder)(strerror(errno)));
+		return -1;
+	}
+	while ((de = readdir(d)) != NULL) {
+		if (de->d_type != DT_DIR || de->d_name[0] == '.')
+			continue;
+		string Folder = Store_Folder + "/" + de->d_name;
+		DIR* sub = opendir(Folder.c_str());
+		struct dirent* chunk;
+		struct stat st;
+
+		if (sub == NULL)
+			continue;
+		while ((chunk = readdir(sub)) != NULL) {
+			if (chunk->d_type != DT_REG || binary_search(Hashes.begin(), Hashes.end(), string(chunk->d_name)))
+				continue;
+			string Path = Folder + "/" + chunk->d_name;
+			if (lstat(Path.c_str(), &st) == 0 && unlink(Path.c_str()) == 0) {
+				Freed += st.st_size;
+				count++;
+			}
+		}
+		closedir(sub);
+		rmdir(Folder.c_str());
+	}
+	closedir(d);
+	gui_msg(Msg("dedup_gc_done=Removed {1} unused chunks, {2}MB freed")(count)(Freed / 1048576));
+	return count;
+}
@@ -0,0 +1,61 @@
+/*
+        Copyright 2016 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TWRPCHUNKSTORE_HPP
+#define TWRPCHUNKSTORE_HPP
+
+#include <sys/types.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Deduplicating storage for backup archives. Archives are split into
+// content defined chunks which are stored once in a chunk folder shared by
+// all backups of all devices on the storage. The archive itself is
+// replaced by an index file listing its chunks.
+class twrpChunkStore {
+
+public:
+	twrpChunkStore(const string& Backups_Folder);                             // Backups_Folder is the per device folder, e.g. TWRP/BACKUPS/<serial>
+	~twrpChunkStore();                                                        // Removes the archives reassembled by Restore_File
+	bool Store_File(const string& Filename);                                  // Splits Filename into the store and replaces it with Filename.chunks
+	bool Restore_File(const string& Filename);                                // Reassembles Filename from Filename.chunks until this object is destroyed
+	int Collect_Garbage();                                                    // Removes chunks no longer referenced by any backup, returns -1 on error
+
+public:
+	static const char* Index_Extension;                                       // ".chunks"
+
+private:
+	struct Chunk {
+		string hash;                                                      // sha256 of the data as hex
+		uint32_t size;
+	};
+	string Chunk_Path(const string& Hash);
+	static int Create_Temp(const string& Path, string& Temp_Path);
+	bool Write_Chunk(const unsigned char* Data, uint32_t Size, string& Hash, unsigned long long& New_Size);
+	bool Load_Index(const string& Index_File, vector<Chunk>& Chunks, uint64_t& Total_Size);
+	bool Find_Referenced(const string& Path, vector<string>& Hashes);
+
+	string Backups_Root;                                                      // TWRP/BACKUPS, holds the backups of every device
+	string Store_Folder;                                                      // TWRP/CHUNKS
+	vector<string> Restored_Files;
+};
+
+#endif
@@ -0,0 +1,180 @@
+/*
+        Copyright 2016 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <inttypes.h>
+#include <string>
+#include <vector>
+#include "twrpManifest.hpp"
+#include "twrp-functions.hpp"
+#include "twcommon.h"
+
+using namespace std;
+
+/* Manifest file format, one record per line:
+ *   twrp-manifest 1
+ *   base <folder>
+ *   archive <file name>
+ *   <type> <size> <mtime> <ctime> <inode> <path>
+ *   - <path>
+ * The path is always the last field so it may contain spaces. Lines
+ * starting with '-' list entries deleted since the base backup.
+ */
+#define MANIFEST_MAGIC "twrp-manifest 1"
+
+twrpManifest::twrpManifest() {
+}
+
+static char Entry_Type(mode_t mode) {
+	if (S_ISDIR(mode))
+		return 'd';
+	if (S_ISLNK(mode))
+		return 'l';
+	return 'f';
+}
+
+bool twrpManifest::Load(const string& Filename) {
+	FILE* fp = fopen(Filename.c_str(), "r");
+	if (!fp) {
+		LOGINFO("Unable to open manifest '%s': %s\n", Filename.c_str(), strerror(errno));
+		return false;
+	}
+
+	char* line = NULL;
+	size_t len = 0;
+	ssize_t read;
+	bool ret = false;
+
+	entries.clear();
+	deletions.clear();
+	Base_Folder.clear();
+	Archive_Name.clear();
+
+	if ((read = getline(&line, &len, fp)) <= 0 || strncmp(line, MANIFEST_MAGIC, strlen(MANIFEST_MAGIC)) != 0) {
+		LOGINFO("'%s' is not a backup manifest\n", Filename.c_str());
+		goto exit;
+	}
+	while ((read = getline(&line, &len, fp)) > 0) {
+		if (line[read - 1] == '\n')
+			line[--read] = 0;
+		if (strncmp(line, "base ", 5) == 0) {
+			Base_Folder = line + 5;
+		} else if (strncmp(line, "archive ", 8) == 0) {
+			Archive_Name = line + 8;
+		} else if (strncmp(line, "- ", 2) == 0) {
+			deletions.push_back(line + 2);
+		} else {
+			Entry e;
+			int path_offset = 0;
+			if (sscanf(line, "%c %" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %n", &e.type, &e.size, &e.mtime, &e.ctime, &e.inode, &path_offset) != 5 || path_offset == 0) {
+				LOGINFO("Invalid manifest line in '%s': '%s'\n", Filename.c_str(), line);
+				goto exit;
+			}
+			entries[line + path_offset] = e;
+		}
+	}
+	ret = true;
+exit:
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+bool twrpManifest::Save(const string& Filename) {
+	FILE* fp = fopen(Filename.c_str(), "w");
+	if (!fp) {
+		LOGINFO("Unable to create manifest '%s': %s\n", Filename.c_str(), strerror(errno));
+		return false;
+	}
+	fprintf(fp, MANIFEST_MAGIC "\n");
+	if (!Base_Folder.empty())
+		fprintf(fp, "base %s\n", Base_Folder.c_str());
+	if (!Archive_Name.empty())
+		fprintf(fp, "archive %s\n", Archive_Name.c_str());
+	for (map<string, Entry>::const_iterator it = entries.begin(); it != entries.end(); ++it) {
+		const Entry& e = it->second;
+		fprintf(fp, "%c %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %s\n", e.type, e.size, e.mtime, e.ctime, e.inode, it->first.c_str());
+	}
+	for (vector<string>::const_iterator it = deletions.begin(); it != deletions.end(); ++it)
+		fprintf(fp, "- %s\n", it->c_str());
+	if (fclose(fp) != 0) {
+		LOGINFO("Error writing manifest '%s': %s\n", Filename.c_str(), strerror(errno));
+		return false;
+	}
+	return true;
+}
+
+void twrpManifest::Add_Entry(const string& Path, const struct stat& st) {
+	Entry& e = entries[Path];
+	e.type = Entry_Type(st.st_mode);
+	e.size = S_ISDIR(st.st_mode) ? 0 : (uint64_t)st.st_size;
+	e.mtime = (uint64_t)st.st_mtime;
+	e.ctime = (uint64_t)st.st_ctime;
+	e.inode = (uint64_t)st.st_ino;
+}
+
+bool twrpManifest::Is_Unchanged(const string& Path, const struct stat& st) const {
+	// Directories are always archived so that their metadata is restored
+	if (S_ISDIR(st.st_mode))
+		return false;
+	map<string, Entry>::const_iterator it = entries.find(Path);
+	if (it == entries.end())
+		return false;
+	const Entry& e = it->second;
+	return e.type == Entry_Type(st.st_mode) && e.size == (uint64_t)st.st_size &&
+		e.mtime == (uint64_t)st.st_mtime && e.ctime == (uint64_t)st.st_ctime &&
+		e.inode == (uint64_t)st.st_ino;
+}
+
+void twrpManifest::Find_Deletions(const twrpManifest& Base) {
+	deletions.clear();
+	for (map<string, Entry>::const_iterator it = Base.entries.begin(); it != Base.entries.end(); ++it) {
+		if (entries.find(it->first) == entries.end())
+			deletions.push_back(it->first);
+	}
+}
+
+bool twrpManifest::Apply_Deletions(int& Removed) const {
+	int failed = 0;
+	Removed = 0;
+	for (vector<string>::const_iterator it = deletions.begin(); it != deletions.end(); ++it) {
+		struct stat st;
+		if (lstat(it->c_str(), &st) != 0)
+			continue; // already gone, e.g. removed with its parent directory
+		LOGINFO("Removing '%s', deleted since the base backup\n", it->c_str());
+		if (S_ISDIR(st.st_mode)) {
+			if (TWFunc::removeDir(*it, false) != 0) {
+				LOGINFO("Unable to remove '%s'\n", it->c_str());
+				failed++;
+				continue;
+			}
+		} else if (unlink(it->c_str()) != 0) {
+			LOGINFO("Unable to unlink '%s': %s\n", it->c_str(), strerror(errno));
+			failed++;
+			continue;
+		}
+		Removed++;
+	}
+	return failed == 0;
+}
@@ -0,0 +1,62 @@
+/*
+        Copyright 2016 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TWRPMANIFEST_HPP
+#define TWRPMANIFEST_HPP
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Per partition list of every entry in a file based backup. A manifest
+// always describes the complete tree at backup time so that any backup can
+// serve as the base for the next incremental one.
+class twrpManifest {
+
+public:
+	twrpManifest();
+	bool Load(const string& Filename);                                        // Reads a manifest written by Save()
+	bool Save(const string& Filename);                                        // Writes the manifest, returns false on error
+	void Add_Entry(const string& Path, const struct stat& st);                // Records the current state of Path
+	bool Is_Unchanged(const string& Path, const struct stat& st) const;       // True if Path is a file or link with the same state as recorded
+	void Find_Deletions(const twrpManifest& Base);                            // Records entries in Base that are no longer present
+	bool Apply_Deletions(int& Removed) const;                                 // Removes the recorded deletions after restoring this increment, false if any could not be removed
+	bool Empty() const { return entries.empty(); }
+
+public:
+	string Base_Folder;                                                       // Backup folder this one is an increment of, empty for a full backup
+	string Archive_Name;                                                      // File name of the archive in the backup folder, e.g. data.ext4.win
+
+private:
+	struct Entry {
+		char type;                                                        // 'f' file, 'd' directory, 'l' symlink
+		uint64_t size;
+		uint64_t mtime;
+		uint64_t ctime;
+		uint64_t inode;
+	};
+	map<string, Entry> entries;
+	vector<string> deletions;
+};
+
+#endif
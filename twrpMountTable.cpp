@@ -0,0 +1,292 @@
+/*
+        Copyright 2016 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/sysmacros.h>
+#include <unistd.h>
+#include "twrpMountTable.hpp"
+#include "twcommon.h"
+
+#define MOUNTINFO_FILE "/proc/self/mountinfo"
+
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+static int table_fd = -1;
+static bool table_loaded = false;
+static unsigned table_generation = 0;
+static map<string, twrpMountTable::Mount_Entry> table_entries;
+static bool watcher_started = false;
+static pthread_once_t table_once = PTHREAD_ONCE_INIT;
+
+// Forked children such as the tar processes of a backup share the open
+// file and with it the change state, so they must not poll it
+static void Lock_Before_Fork() {
+	pthread_mutex_lock(&table_lock);
+}
+
+static void Unlock_After_Fork() {
+	pthread_mutex_unlock(&table_lock);
+}
+
+static void Reset_After_Fork() {
+	if (table_fd >= 0)
+		close(table_fd);
+	table_fd = -1;
+	table_loaded = false;
+	watcher_started = false;
+	pthread_mutex_unlock(&table_lock);
+}
+
+static void Register_Fork_Handlers() {
+	pthread_atfork(Lock_Before_Fork, Unlock_After_Fork, Reset_After_Fork);
+}
+
+// Must be called with table_lock held. Each open file of mountinfo keeps
+// its own change state, so this file only reports changes to this table.
+bool twrpMountTable::Refresh_Locked() {
+	if (table_fd < 0) {
+		pthread_once(&table_once, Register_Fork_Handlers);
+		table_fd = open(MOUNTINFO_FILE, O_RDONLY | O_CLOEXEC);
+		if (table_fd < 0) {
+			LOGINFO("Unable to open '%s': %s\n", MOUNTINFO_FILE, strerror(errno));
+			return false;
+		}
+	} else if (table_loaded) {
+		struct pollfd pfd;
+		pfd.fd = table_fd;
+		pfd.events = POLLPRI;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, 0) <= 0 || !(pfd.revents & (POLLPRI | POLLERR)))
+			return true; // unchanged
+	}
+	Table entries;
+	if (!Read_Table(table_fd, entries)) {
+		close(table_fd);
+		table_fd = -1;
+		table_loaded = false;
+		return false;
+	}
+	table_entries.swap(entries);
+	table_loaded = true;
+	table_generation++;
+	return true;
+}
+
+bool twrpMountTable::Read_Table(int fd, Table& Entries) {
+	char buffer[4096];
+	string data;
+	ssize_t len;
+
+	if (lseek(fd, 0, SEEK_SET) != 0)
+		return false;
+	while ((len = read(fd, buffer, sizeof(buffer))) > 0)
+		data.append(buffer, len);
+	if (len < 0) {
+		LOGINFO("Unable to read '%s': %s\n", MOUNTINFO_FILE, strerror(errno));
+		return false;
+	}
+
+	size_t start = 0;
+	while (start < data.size()) {
+		size_t end = data.find('\n', start);
+		if (end == string::npos)
+			end = data.size();
+		Mount_Entry entry;
+		// Later lines are mounted on top of earlier ones
+		if (Parse_Line(data.substr(start, end - start), entry))
+			Entries[entry.Mount_Point] = entry;
+		start = end + 1;
+	}
+	return true;
+}
+
+// 36 35 98:0 /mnt1 /mnt2 rw,noatime master:1 - ext3 /dev/root rw,errors=continue
+bool twrpMountTable::Parse_Line(const string& Line, Mount_Entry& Entry) {
+	vector<string> fields;
+	size_t start = 0;
+
+	while (start < Line.size()) {
+		size_t end = Line.find(' ', start);
+		if (end == string::npos)
+			end = Line.size();
+		if (end > start)
+			fields.push_back(Line.substr(start, end - start));
+		start = end + 1;
+	}
+	// The optional fields end with a single -
+	size_t separator = 6;
+	while (separator < fields.size() && fields[separator] != "-")
+		separator++;
+	if (separator + 2 >= fields.size())
+		return false;
+
+	unsigned int major_id, minor_id;
+	if (sscanf(fields[2].c_str(), "%u:%u", &major_id, &minor_id) != 2)
+		return false;
+	Entry.Dev = makedev(major_id, minor_id);
+	Entry.Mount_Point = Unescape(fields[4]);
+	Entry.File_System = fields[separator + 1];
+	Entry.Device = Unescape(fields[separator + 2]);
+	Entry.Options = fields[5];
+	if (separator + 3 < fields.size())
+		Entry.Options += "," + fields[separator + 3];
+	return true;
+}
+
+// Spaces, tabs, new lines and backslashes are written as \ooo
+string twrpMountTable::Unescape(const string& Field) {
+	string result;
+
+	for (size_t i = 0; i < Field.size(); i++) {
+		if (Field[i] == '\\' && i + 3 < Field.size()
+			&& Field[i + 1] >= '0' && Field[i + 1] <= '3'
+			&& Field[i + 2] >= '0' && Field[i + 2] <= '7'
+			&& Field[i + 3] >= '0' && Field[i + 3] <= '7') {
+			result += (char)((Field[i + 1] - '0') * 64 + (Field[i + 2] - '0') * 8 + (Field[i + 3] - '0'));
+			i += 3;
+		} else {
+			result += Field[i];
+		}
+	}
+	return result;
+}
+
+bool twrpMountTable::Get_Generation(unsigned& Generation) {
+	pthread_mutex_lock(&table_lock);
+	bool ret = Refresh_Locked();
+	Generation = table_generation;
+	pthread_mutex_unlock(&table_lock);
+	return ret;
+}
+
+bool twrpMountTable::Is_Mounted(const string& Mount_Point) {
+	pthread_mutex_lock(&table_lock);
+	bool ret = Refresh_Locked() && table_entries.find(Mount_Point) != table_entries.end();
+	pthread_mutex_unlock(&table_lock);
+	return ret;
+}
+
+bool twrpMountTable::Find(const string& Mount_Point, Mount_Entry& Entry) {
+	bool ret = false;
+
+	pthread_mutex_lock(&table_lock);
+	if (Refresh_Locked()) {
+		Table::iterator it = table_entries.find(Mount_Point);
+		if (it != table_entries.end()) {
+			Entry = it->second;
+			ret = true;
+		}
+	}
+	pthread_mutex_unlock(&table_lock);
+	return ret;
+}
+
+vector<twrpMountTable::Listener_Entry> twrpMountTable::listeners;
+
+void twrpMountTable::Add_Listener(Listener Callback, void* Cookie) {
+	Listener_Entry listener;
+	pthread_t thread;
+
+	listener.callback = Callback;
+	listener.cookie = Cookie;
+	pthread_mutex_lock(&table_lock);
+	listeners.push_back(listener);
+	if (!watcher_started) {
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&thread, &attr, Watcher_Thread, NULL) == 0)
+			watcher_started = true;
+		else
+			LOGINFO("Unable to start the mount table watcher\n");
+		pthread_attr_destroy(&attr);
+	}
+	pthread_mutex_unlock(&table_lock);
+}
+
+// Waits on a file of its own so that the listeners hear about mounts done
+// by other processes too, and compares the table with the one they were
+// last told about, so every change is reported once whoever read it first
+void* twrpMountTable::Watcher_Thread(void* cookie __unused) {
+	Table notified;
+	int fd = open(MOUNTINFO_FILE, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		LOGINFO("Unable to open '%s': %s\n", MOUNTINFO_FILE, strerror(errno));
+		pthread_mutex_lock(&table_lock);
+		watcher_started = false;
+		pthread_mutex_unlock(&table_lock);
+		return NULL;
+	}
+	pthread_mutex_lock(&table_lock);
+	if (Refresh_Locked())
+		notified = table_entries;
+	pthread_mutex_unlock(&table_lock);
+
+	for (;;) {
+		struct pollfd pfd;
+		pfd.fd = fd;
+		pfd.events = POLLPRI;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			LOGINFO("Mount table watcher stopped: %s\n", strerror(errno));
+			break;
+		}
+		if (!(pfd.revents & (POLLPRI | POLLERR)))
+			continue;
+
+		Table current;
+		vector<Listener_Entry> callbacks;
+		pthread_mutex_lock(&table_lock);
+		if (Refresh_Locked())
+			current = table_entries;
+		callbacks = listeners;
+		pthread_mutex_unlock(&table_lock);
+		if (current.empty())
+			continue; // unreadable, try again on the next change
+
+		vector<pair<Mount_Entry, bool> > changes;
+		for (Table::iterator it = notified.begin(); it != notified.end(); ++it) {
+			Table::iterator now = current.find(it->first);
+			if (now == current.end() || now->second.Dev != it->second.Dev)
+				changes.push_back(make_pair(it->second, false));
+		}
+		for (Table::iterator it = current.begin(); it != current.end(); ++it) {
+			Table::iterator before = notified.find(it->first);
+			if (before == notified.end() || before->second.Dev != it->second.Dev)
+				changes.push_back(make_pair(it->second, true));
+		}
+		notified.swap(current);
+
+		for (size_t i = 0; i < changes.size(); i++) {
+			for (size_t l = 0; l < callbacks.size(); l++)
+				callbacks[l].callback(changes[i].first, changes[i].second, callbacks[l].cookie);
+		}
+	}
+	close(fd);
+	pthread_mutex_lock(&table_lock);
+	watcher_started = false;
+	pthread_mutex_unlock(&table_lock);
+	return NULL;
+}
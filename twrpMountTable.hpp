@@ -0,0 +1,63 @@
+/*
+        Copyright 2016 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TWRPMOUNTTABLE_HPP
+#define TWRPMOUNTTABLE_HPP
+
+#include <sys/types.h>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Copy of /proc/self/mountinfo. The kernel flags the open file with POLLPRI
+// when anything is mounted or unmounted, so the table is only read again
+// after a change instead of stat'ing or parsing on every question.
+class twrpMountTable {
+public:
+	struct Mount_Entry {
+		string Mount_Point;
+		string Device;                                                    // mount source, e.g. /dev/block/mmcblk0p25
+		string File_System;
+		string Options;                                                   // mount options followed by the super block options
+		dev_t Dev;
+	};
+	typedef void (*Listener)(const Mount_Entry& Entry, bool Mounted, void* Cookie);
+
+	static bool Get_Generation(unsigned& Generation);                         // changes with every change of the table, false if it cannot be read
+	static bool Is_Mounted(const string& Mount_Point);
+	static bool Find(const string& Mount_Point, Mount_Entry& Entry);          // the topmost mount on Mount_Point
+	static void Add_Listener(Listener Callback, void* Cookie);               // called on a watcher thread for every mount and unmount
+
+private:
+	typedef map<string, Mount_Entry> Table;
+	struct Listener_Entry {
+		Listener callback;
+		void* cookie;
+	};
+	static bool Refresh_Locked();
+	static bool Read_Table(int fd, Table& Entries);
+	static bool Parse_Line(const string& Line, Mount_Entry& Entry);
+	static string Unescape(const string& Field);
+	static void* Watcher_Thread(void* cookie);
+
+	static vector<Listener_Entry> listeners;                                  // guarded by the table lock
+};
+
+#endif // TWRPMOUNTTABLE_HPP
@@ -48,6 +48,7 @@ extern "C" {
 #include "twrp-functions.hpp"
 #include "gui/gui.hpp"
 #include "progresstracking.hpp"
+#include "twrpTrace.hpp"
 #ifndef BUILD_TWRPTAR_MAIN
 #include "data.hpp"
 #include "infomanager.hpp"
@@ -58,10 +59,23 @@ extern "C" {
 
 using namespace std;
 
+// Archives being created, indexed by the fd libtar writes them to
+#define MAX_STREAM_FD 1024
+static twrpTar* stream_by_fd[MAX_STREAM_FD];
+
+// Indexed compressed archives are restarted this often so that a selective
+// restore never decompresses more than this to reach an entry
+#define TW_INDEX_SEEK_INTERVAL (32ULL * 1024 * 1024)
+
+// Position in the tar stream while extracting selected entries
+static uint64_t index_stream_pos;
+
 twrpTar::twrpTar(void) {
+	part_settings = NULL;
 	use_encryption = 0;
 	userdata_encryption = 0;
 	use_compression = 0;
+	compression_type = COMPRESSED;
 	split_archives = 0;
 	has_data_media = 0;
 	pigz_pid = 0;
@@ -71,6 +85,15 @@ twrpTar::twrpTar(void) {
 	include_root_dir = true;
 	input_fd = -1;
 	output_fd = -1;
+	write_manifest = 0;
+	verify_md5 = false;
+	feeder_pid = 0;
+	stream_fd = -1;
+	stream_size = 0;
+	stream_file_count = 0;
+	write_index = 0;
+	thread_count = 0;
+	last_seek_point = 0;
 }
 
 twrpTar::~twrpTar(void) {
@@ -109,6 +132,31 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 
 	file_count = 0;
 
+	if (part_settings->adbbackup)
+		write_manifest = 0;
+	if (use_compression && compression_type != COMPRESSED) {
+		string Compressor = string("/sbin/") + Compressor_Name(compression_type);
+		if (use_encryption || part_settings->adbbackup) {
+			// openaes and the adb backup stream only handle gzip
+			LOGINFO("Using gzip instead of %s for encrypted or adb backups\n", Compressor_Name(compression_type));
+			compression_type = COMPRESSED;
+		}
+#ifndef BUILD_TWRPTAR_MAIN
+		// twrpTar run on a host finds the compressor in PATH instead
+		else if (!TWFunc::Path_Exists(Compressor)) {
+			LOGINFO("'%s' not found, using gzip\n", Compressor.c_str());
+			compression_type = COMPRESSED;
+		}
+#endif
+	}
+	if (write_manifest && !incremental_base.empty()) {
+		string Base_Manifest = incremental_base + "/" + partition_name + ".manifest";
+		if (!base_manifest.Load(Base_Manifest)) {
+			LOGINFO("Unable to load base manifest '%s', creating a full backup\n", Base_Manifest.c_str());
+			incremental_base.clear();
+		}
+	}
+
 	if (part_settings->adbbackup) {
 		std::string Backup_FileName(tarfn);
 		if (!twadbbu::Write_TWFN(Backup_FileName, Total_Backup_Size, use_compression))
@@ -120,7 +168,12 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 		gui_err("backup_error=Error creating backup.");
 		return -1;
 	}
-	if ((*tar_fork_pid = fork()) == -1) {
+	pid_t pid = fork();
+	if (pid > 0)
+		Set_Fork_Pid(tar_fork_pid, pid);
+	else
+		*tar_fork_pid = pid; // no other thread runs in the child
+	if (pid == -1) {
 		LOGINFO("create tar failed to fork.\n");
 		gui_err("backup_error=Error creating backup.");
 		close(progress_pipe[0]);
@@ -152,7 +205,7 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 			pthread_attr_t tattr;
 			void *thread_return;
 
-			core_count = sysconf(_SC_NPROCESSORS_CONF);
+			core_count = thread_count ? thread_count : sysconf(_SC_NPROCESSORS_CONF);
 			if (core_count > 8)
 				core_count = 8;
 			LOGINFO("   Core Count      : %u\n", core_count);
@@ -173,6 +226,8 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 				if (de->d_type == DT_DIR) {
 					item_len = strlen(de->d_name);
 					if (userdata_encryption && ((item_len >= 3 && strncmp(de->d_name, "app", 3) == 0) || (item_len >= 6 && strncmp(de->d_name, "dalvik", 6) == 0))) {
+						// Generate_TarList only records what is below the folder
+						Manifest_Skip(FileName);
 						ret = Generate_TarList(FileName, &RegularList, &target_size, &regular_thread_id);
 						if (ret < 0) {
 							LOGINFO("Error in Generate_TarList with regular list!\n");
@@ -224,6 +279,7 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 						// Do nothing, we added these to RegularList earlier
 					} else {
 						FileName = tardir + "/" + de->d_name;
+						Manifest_Skip(FileName);
 						ret = Generate_TarList(FileName, &EncryptList, &target_size, &enc_thread_id);
 						if (ret < 0) {
 							LOGINFO("Error in Generate_TarList with encrypted list!\n");
@@ -235,6 +291,8 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 						file_count += (unsigned long long)(ret);
 					}
 				} else if (de->d_type == DT_REG || de->d_type == DT_LNK) {
+					if (Manifest_Skip(FileName))
+						continue;
 					stat(FileName.c_str(), &st);
 					if (de->d_type == DT_REG)
 						Archive_Current_Size += (unsigned long long)(st.st_size);
@@ -256,6 +314,12 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 				}
 			}
 
+			if (!Save_Manifest()) {
+				gui_err("backup_error=Error creating backup.");
+				close(progress_pipe[1]);
+				_exit(-1);
+			}
+
 			// Send file count to parent
 			write(progress_pipe_fd, &file_count, sizeof(file_count));
 			// Send backup size to parent
@@ -272,6 +336,8 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 				reg.split_archives = 1;
 				reg.progress_pipe_fd = progress_pipe_fd;
 				reg.part_settings = part_settings;
+				reg.write_index = write_index;
+				reg.thread_count = thread_count;
 				LOGINFO("Creating unencrypted backup...\n");
 				if (createList((void*)&reg) != 0) {
 					LOGINFO("Error creating unencrypted backup.\n");
@@ -374,6 +440,7 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 			int ret;
 
 			// Generate list of files to back up
+			Archive_Current_Size = 0;
 			ret = Generate_TarList(tardir, &FileList, &target_size, &thread_id);
 			if (ret < 0) {
 				LOGINFO("Error in Generate_TarList!\n");
@@ -382,15 +449,28 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 				_exit(-1);
 			}
 			file_count = (unsigned long long)(ret);
+			if (!Save_Manifest()) {
+				gui_err("backup_error=Error creating backup.");
+				close(progress_pipe[1]);
+				_exit(-1);
+			}
+			if (!incremental_base.empty()) {
+				// Only the changed files are archived
+				LOGINFO("Incremental backup: %llu changed files, %llu bytes\n", file_count, Archive_Current_Size);
+				Total_Backup_Size = Archive_Current_Size;
+			}
 			// Create a backup
 			reg.setfn(tarfn);
 			reg.ItemList = &FileList;
 			reg.thread_id = 0;
 			reg.use_encryption = 0;
 			reg.use_compression = use_compression;
+			reg.compression_type = compression_type;
 			reg.setsize(Total_Backup_Size);
 			reg.progress_pipe_fd = progress_pipe_fd;
 			reg.part_settings = part_settings;
+			reg.write_index = write_index;
+			reg.thread_count = thread_count;
 			if (Total_Backup_Size > MAX_ARCHIVE_SIZE && !part_settings->adbbackup) {
 				gui_msg("split_backup=Breaking backup file into multiple archives...");
 				reg.split_archives = 1;
@@ -452,7 +532,7 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 			else if (use_encryption)
 				backup_info.SetValue("backup_type", ENCRYPTED);
 			else if (use_compression)
-				backup_info.SetValue("backup_type", COMPRESSED);
+				backup_info.SetValue("backup_type", compression_type);
 			else
 				backup_info.SetValue("backup_type", UNCOMPRESSED);
 			backup_info.SetValue("file_count", files_backup);
@@ -465,6 +545,17 @@ int twrpTar::createTarFork(pid_t *tar_fork_pid) {
 	return 0;
 }
 
+// Cancel_Backup kills the forks of concurrent backups from another thread
+void twrpTar::Set_Fork_Pid(pid_t *tar_fork_pid, pid_t pid) {
+	pthread_mutex_t *lock = part_settings ? part_settings->fork_pid_lock : NULL;
+
+	if (lock)
+		pthread_mutex_lock(lock);
+	*tar_fork_pid = pid;
+	if (lock)
+		pthread_mutex_unlock(lock);
+}
+
 int twrpTar::extractTarFork() {
 	int status = 0;
 	pid_t rc_pid, tar_fork_pid;
@@ -485,7 +576,7 @@ int twrpTar::extractTarFork() {
 			progress_pipe_fd = progress_pipe[1];
 			if (TWFunc::Path_Exists(tarfn) || part_settings->adbbackup) {
 				LOGINFO("Single archive\n");
-				if (extract() != 0)
+				if (extractVerified("", false) != 0)
 					_exit(-1);
 				else {
 					_exit(0);
@@ -516,6 +607,7 @@ int twrpTar::extractTarFork() {
 					tars[0].thread_id = 0;
 					tars[0].progress_pipe_fd = progress_pipe_fd;
 					tars[0].part_settings = part_settings;
+					tars[0].verify_md5 = verify_md5;
 					if (extractMulti((void*)&tars[0]) != 0) {
 						LOGINFO("Error extracting split archive.\n");
 						gui_err("restore_error=Error during restore process.");
@@ -558,6 +650,7 @@ int twrpTar::extractTarFork() {
 						tars[i].thread_id = i;
 						tars[i].progress_pipe_fd = progress_pipe_fd;
 						tars[i].part_settings = part_settings;
+						tars[i].verify_md5 = verify_md5;
 						LOGINFO("Creating extract thread ID %i\n", i);
 						ret = pthread_create(&tar_thread[i], &tattr, extractMulti, (void*)&tars[i]);
 						if (ret) {
@@ -662,12 +755,15 @@ int twrpTar::Generate_TarList(string Path, std::vector<TarListStruct> *TarList,
 		TarItem.fn = FileName;
 		TarItem.thread_id = *thread_id;
 		if (de->d_type == DT_DIR) {
+			Manifest_Skip(FileName);
 			TarList->push_back(TarItem);
 			ret = Generate_TarList(FileName, TarList, Target_Size, thread_id);
 			if (ret < 0)
 				return -1;
 			file_count += ret;
 		} else if (de->d_type == DT_REG || de->d_type == DT_LNK) {
+			if (Manifest_Skip(FileName))
+				continue;
 			stat(FileName.c_str(), &st);
 			TarList->push_back(TarItem);
 			if (de->d_type == DT_REG) {
@@ -684,8 +780,34 @@ int twrpTar::Generate_TarList(string Path, std::vector<TarListStruct> *TarList,
 	return file_count;
 }
 
+// Records FileName in the manifest, returns true if it is unchanged since
+// the base backup and can be left out of an incremental backup
+bool twrpTar::Manifest_Skip(const string& FileName) {
+	struct stat st;
+
+	if (!write_manifest)
+		return false;
+	if (lstat(FileName.c_str(), &st) != 0) {
+		LOGINFO("Unable to lstat '%s': %s\n", FileName.c_str(), strerror(errno));
+		return false;
+	}
+	manifest.Add_Entry(FileName, st);
+	return !incremental_base.empty() && base_manifest.Is_Unchanged(FileName, st);
+}
+
+bool twrpTar::Save_Manifest() {
+	if (!write_manifest)
+		return true;
+	manifest.Archive_Name = TWFunc::Get_Filename(tarfn);
+	manifest.Base_Folder = incremental_base;
+	if (!incremental_base.empty())
+		manifest.Find_Deletions(base_manifest);
+	return manifest.Save(backup_folder + "/" + partition_name + ".manifest");
+}
+
 int twrpTar::extractTar() {
 	char* charRootDir = (char*) tardir.c_str();
+	twrpTraceSpan span("restore", "extractTar", tarfn);
 	if (openTar() == -1)
 		return -1;
 	if (tar_extract_all(t, charRootDir, &progress_pipe_fd) != 0) {
@@ -722,7 +844,18 @@ int twrpTar::extract() {
 		LOGINFO("Extracting gzipped tar\n");
 		int ret = extractTar();
 		return ret;
+	} else if (current_archive_type == LZ4_COMPRESSED || current_archive_type == ZSTD_COMPRESSED) {
+		LOGINFO("Extracting %s compressed tar\n", Compressor_Name(current_archive_type));
+		return extractTar();
 	} else if (current_archive_type == ENCRYPTED) {
+		twrpArchiveFooter footer;
+		if (Read_Footer(tarfn, footer)) {
+			// The footer records whether the data is compressed, so
+			// nothing has to be decrypted to find out
+			current_archive_type = (Archive_Type)footer.archive_type;
+			LOGINFO("Extracting %s tar.\n", current_archive_type == COMPRESSED_ENCRYPTED ? "encrypted and compressed" : "encrypted");
+			return extractTar();
+		}
 		int ret = TWFunc::Try_Decrypting_File(tarfn, password);
 		if (ret < 1) {
 			gui_msg(Msg(msg::kError, "fail_decrypt_tar=Failed to decrypt tar file '{1}'")(tarfn));
@@ -753,6 +886,7 @@ int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
 	char actual_filename[PATH_MAX];
 	char *ptr;
 	unsigned long long fs;
+	twrpTraceSpan span("backup", "tarList", tarfn);
 
 	if (split_archives) {
 		basefn = tarfn;
@@ -774,6 +908,7 @@ int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
 		gui_err("backup_error=Error creating backup.");
 		return -2;
 	}
+	Start_Stream(t->fd);
 	Archive_Current_Size = 0;
 
 	while (i < list_size) {
@@ -802,18 +937,29 @@ int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
 						gui_err("backup_error=Error creating backup.");
 						return -2;
 					}
+					Start_Stream(t->fd);
 					Archive_Current_Size = 0;
 				}
 				Archive_Current_Size += fs;
+				stream_file_count++;
 				fs = 0; // Sending a 0 size to the pipe tells it to increment the file counter
 				write(progress_pipe_fd, &fs, sizeof(fs));
 			}
 			LOGINFO("addFile '%s' including root: %i\n", buf, include_root_dir);
+			uint64_t entry_offset = stream_size;
 			if (addFile(buf, include_root_dir) != 0) {
 				LOGINFO("Error adding file '%s' to '%s'\n", buf, tarfn.c_str());
 				gui_err("backup_error=Error creating backup.");
 				return -1;
 			}
+			if (write_index && stream_fd >= 0) {
+				Add_Index_Entry(buf, st, entry_offset);
+				if (stream_size - last_seek_point >= TW_INDEX_SEEK_INTERVAL && Restart_Compressor() != 0) {
+					LOGINFO("Error restarting %s for '%s'\n", Compressor_Name(current_archive_type), tarfn.c_str());
+					gui_err("backup_error=Error creating backup.");
+					return -1;
+				}
+			}
 		}
 		i++;
 	}
@@ -828,6 +974,9 @@ int twrpTar::tarList(std::vector<TarListStruct> *TarList, unsigned thread_id) {
 
 void* twrpTar::createList(void *cookie) {
 	twrpTar* threadTar = (twrpTar*) cookie;
+	char thread_name[32];
+	sprintf(thread_name, "backup thread %u", threadTar->thread_id);
+	twrpTrace::Set_Thread_Name(thread_name);
 	if (threadTar->tarList(threadTar->ItemList, threadTar->thread_id) != 0) {
 		LOGINFO("ERROR tarList for thread ID %i\n", threadTar->thread_id);
 		return (void*)-2;
@@ -840,11 +989,18 @@ void* twrpTar::extractMulti(void *cookie) {
 	twrpTar* threadTar = (twrpTar*) cookie;
 	int archive_count = 0;
 	string temp = threadTar->basefn + "%i%02i";
-	char actual_filename[255];
+	char actual_filename[255], next_filename[255];
+	char thread_name[32];
+	sprintf(thread_name, "restore thread %u", threadTar->thread_id);
+	twrpTrace::Set_Thread_Name(thread_name);
 	sprintf(actual_filename, temp.c_str(), threadTar->thread_id, archive_count);
 	while (TWFunc::Path_Exists(actual_filename)) {
 		threadTar->tarfn = actual_filename;
-		if (threadTar->extract() != 0) {
+		sprintf(next_filename, temp.c_str(), threadTar->thread_id, archive_count + 1);
+		if (archive_count + 1 > 99 || !TWFunc::Path_Exists(next_filename))
+			next_filename[0] = 0;
+		// Every volume but the first was verified while the one before it was extracted
+		if (threadTar->extractVerified(next_filename, archive_count > 0) != 0) {
 			LOGINFO("Error extracting '%s' in thread ID %i\n", actual_filename, threadTar->thread_id);
 			return (void*)-2;
 		}
@@ -857,6 +1013,86 @@ void* twrpTar::extractMulti(void *cookie) {
 	return (void*)0;
 }
 
+// Extracts tarfn. With verify_md5 set, tarfn (unless Current_Verified) and
+// then Next_Volume are checked against their .md5 files on another core in
+// the meantime, which fails the extraction if either does not match.
+int twrpTar::extractVerified(const string& Next_Volume, bool Current_Verified) {
+	verify_data_struct verify;
+	pthread_t verify_thread;
+	void *thread_return;
+	int ret;
+
+	if (!verify_md5 || (part_settings && part_settings->adbbackup))
+		return extract();
+	if (!Current_Verified)
+		verify.Files.push_back(tarfn);
+	if (!Next_Volume.empty())
+		verify.Files.push_back(Next_Volume);
+	if (verify.Files.empty())
+		return extract();
+	if (pthread_create(&verify_thread, NULL, verifyMulti, (void*)&verify) != 0) {
+		LOGINFO("Unable to create md5 thread, verifying before extracting\n");
+		if (verifyMulti((void*)&verify) != NULL)
+			return -1;
+		return extract();
+	}
+	ret = extract();
+	if (pthread_join(verify_thread, &thread_return) != 0) {
+		LOGINFO("Error joining md5 thread\n");
+		return -1;
+	}
+	if (thread_return != NULL)
+		return -1;
+	return ret;
+}
+
+void* twrpTar::verifyMulti(void *cookie) {
+	verify_data_struct* verify = (verify_data_struct*) cookie;
+
+	twrpTrace::Set_Thread_Name("md5 thread");
+	for (vector<string>::iterator file = verify->Files.begin(); file != verify->Files.end(); file++) {
+		if (!Verify_MD5(*file))
+			return (void*)-1;
+	}
+	return NULL;
+}
+
+bool twrpTar::Verify_MD5(const string& Filename) {
+	string md5file = Filename + ".md5", md5_line;
+	struct MD5Context md5c;
+	unsigned char digest[16], buf[65536];
+	char hex[33];
+	ssize_t len;
+	twrpTraceSpan span("restore", "Verify_MD5", Filename);
+
+	if (TWFunc::read_file(md5file, md5_line) != 0) {
+		gui_msg(Msg(msg::kError, "no_md5_found=No md5 file found for '{1}'. Please unselect Enable MD5 verification to restore.")(md5file));
+		return false;
+	}
+	int md5_fd = open(Filename.c_str(), O_RDONLY | O_LARGEFILE);
+	if (md5_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Filename)(strerror(errno)));
+		return false;
+	}
+	MD5Init(&md5c);
+	while ((len = read(md5_fd, buf, sizeof(buf))) > 0)
+		MD5Update(&md5c, buf, len);
+	close(md5_fd);
+	if (len < 0) {
+		LOGINFO("Error reading '%s' (%s)\n", Filename.c_str(), strerror(errno));
+		return false;
+	}
+	MD5Final(digest, &md5c);
+	for (int i = 0; i < 16; i++)
+		sprintf(hex + i * 2, "%02x", digest[i]);
+	if (md5_line.compare(0, 32, hex) != 0) {
+		gui_msg(Msg(msg::kError, "md5_fail_match=MD5 failed to match on '{1}'.")(Filename));
+		return false;
+	}
+	LOGINFO("MD5 matched on '%s'\n", Filename.c_str());
+	return true;
+}
+
 int twrpTar::addFilesToExistingTar(vector <string> files, string fn) {
 	char* charTarFile = (char*) fn.c_str();
 
@@ -979,8 +1215,8 @@ int twrpTar::createTar() {
 		}
 	} else if (use_compression) {
 		// Compressed
-		current_archive_type = COMPRESSED;
-		LOGINFO("Using compression...\n");
+		current_archive_type = part_settings->adbbackup ? COMPRESSED : compression_type;
+		LOGINFO("Using %s compression...\n", Compressor_Name(current_archive_type));
 		int pigzfd[2];
 		if (part_settings->adbbackup) {
 			LOGINFO("opening TW_ADB_BACKUP compressed stream\n");
@@ -1015,17 +1251,19 @@ int twrpTar::createTar() {
 			close(pigzfd[1]);   // close unused output pipe
 			dup2(pigzfd[0], fileno(stdin)); // remap stdin
 			dup2(output_fd, fileno(stdout)); // remap stdout to output file
-			if (execlp("pigz", "pigz", "-", NULL) < 0) {
-				LOGINFO("execlp pigz ERROR!\n");
-				gui_err("backup_error=Error creating backup.");
-				close(output_fd);
-				close(pigzfd[0]);
-				_exit(-1);
-			}
+			Exec_Compressor(current_archive_type, false, thread_count);
+			LOGINFO("execlp %s ERROR!\n", Compressor_Name(current_archive_type));
+			gui_err("backup_error=Error creating backup.");
+			close(output_fd);
+			close(pigzfd[0]);
+			_exit(-1);
 		} else {
 			// Parent
 			close(pigzfd[0]); // close parent input
 			fd = pigzfd[1];   // copy parent output
+			// Restart_Compressor() waits for pigz to see the end of this
+			// pipe, compressors forked by other threads must not inherit it
+			fcntl(fd, F_SETFD, FD_CLOEXEC);
 			init_libtar_no_buffer(progress_pipe_fd);
 			tar_type = { open, close, read, write_tar_no_buffer };
 			if(tar_fdopen(&t, fd, charRootDir, &tar_type, O_WRONLY | O_CREAT | O_EXCL | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TAR_GNU | TAR_STORE_SELINUX) != 0) {
@@ -1119,7 +1357,7 @@ int twrpTar::openTar() {
 	if (current_archive_type == COMPRESSED_ENCRYPTED) {
 		LOGINFO("Opening encrypted and compressed backup...\n");
 		int i, pipes[4];
-		input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
+		input_fd = Open_Archive_Data();
 		if (input_fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
@@ -1212,7 +1450,7 @@ int twrpTar::openTar() {
 	} else if (current_archive_type == ENCRYPTED) {
 		LOGINFO("Opening encrypted backup...\n");
 		int oaesfd[2];
-		input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
+		input_fd = Open_Archive_Data();
 		if (input_fd < 0) {
 			gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
 			return -1;
@@ -1258,10 +1496,10 @@ int twrpTar::openTar() {
 				return -1;
 			}
 		}
-	} else if (current_archive_type == COMPRESSED) {
+	} else if (current_archive_type == COMPRESSED || current_archive_type == LZ4_COMPRESSED || current_archive_type == ZSTD_COMPRESSED) {
 		int pigzfd[2];
 
-		LOGINFO("Opening as a gzip...\n");
+		LOGINFO("Opening as %s...\n", Compressor_Name(current_archive_type));
 		if (part_settings->adbbackup)  {
 			LOGINFO("opening TW_ADB_RESTORE compressed stream\n");
 			input_fd = open(TW_ADB_RESTORE, O_RDONLY | O_LARGEFILE);
@@ -1294,13 +1532,12 @@ int twrpTar::openTar() {
 			close(pigzfd[0]);
 			dup2(pigzfd[1], fileno(stdout)); // remap stdout
 			dup2(input_fd, fileno(stdin)); // remap input fd to stdin
-			if (execlp("pigz", "pigz", "-d", "-c", NULL) < 0) {
-				close(pigzfd[1]);
-				close(input_fd);
-				LOGINFO("execlp openaes ERROR!\n");
-				gui_err("restore_error=Error during restore process.");
-				_exit(-1);
-			}
+			Exec_Compressor(current_archive_type, true);
+			close(pigzfd[1]);
+			close(input_fd);
+			LOGINFO("execlp %s ERROR!\n", Compressor_Name(current_archive_type));
+			gui_err("restore_error=Error during restore process.");
+			_exit(-1);
 		} else {
 			// Parent
 			close(pigzfd[1]); // close parent output
@@ -1370,7 +1607,11 @@ int twrpTar::addFile(string fn, bool include_root) {
 int twrpTar::closeTar() {
 	LOGINFO("Closing tar\n");
 	flush_libtar_buffer(t->fd);
-	if (tar_append_eof(t) != 0) {
+	// the EOF blocks are part of the stream the footer describes
+	int eof_ret = tar_append_eof(t);
+	if (stream_fd >= 0 && stream_fd < MAX_STREAM_FD)
+		stream_by_fd[stream_fd] = NULL;
+	if (eof_ret != 0) {
 		LOGINFO("tar_append_eof(): %s\n", strerror(errno));
 		tar_close(t);
 		return -1;
@@ -1386,6 +1627,11 @@ int twrpTar::closeTar() {
 			return -1;
 		if (oaes_pid > 0 && TWFunc::Wait_For_Child(oaes_pid, &status, "openaes") != 0)
 			return -1;
+		if (feeder_pid > 0) {
+			// The feeder only copies the file, openaes reports any problem with the data
+			waitpid(feeder_pid, &status, 0);
+			feeder_pid = 0;
+		}
 	}
 	free_libtar_buffer();
 	if (!part_settings->adbbackup) {
@@ -1399,6 +1645,13 @@ int twrpTar::closeTar() {
 			gui_msg(Msg(msg::kError, "backup_size=Backup file size for '{1}' is 0 bytes.")(tarfn));
 			return -1;
 		}
+		if (stream_fd >= 0) {
+			stream_fd = -1;
+			if (Write_Footer() != 0)
+				return -1;
+			if (!Save_Index())
+				return -1;
+		}
 #ifndef BUILD_TWRPTAR_MAIN
 		tw_set_default_metadata(tarfn.c_str());
 #endif
@@ -1496,7 +1749,12 @@ unsigned long long twrpTar::uncompressedSize(string filename) {
 	unsigned long long total_size = 0;
 	string Tar, Command, result;
 	vector<string> split;
+	twrpArchiveFooter footer;
 
+	if (Read_Footer(filename, footer)) {
+		LOGINFO("'%s' is %llu bytes with %llu files\n", filename.c_str(), (unsigned long long)footer.size, (unsigned long long)footer.file_count);
+		return footer.size;
+	}
 	Set_Archive_Type(TWFunc::Get_File_Type(tarfn));
 	if (current_archive_type == UNCOMPRESSED) {
 		total_size = TWFunc::Get_File_Size(filename);
@@ -1546,15 +1804,497 @@ unsigned long long twrpTar::uncompressedSize(string filename) {
 		} else {
 			total_size = TWFunc::Get_File_Size(filename);
 		}
+	} else if (current_archive_type == LZ4_COMPRESSED || current_archive_type == ZSTD_COMPRESSED) {
+		// Streamed frames do not record the original size, the .info
+		// file normally has it so this is only a rough fallback
+		total_size = TWFunc::Get_File_Size(filename);
 	}
 
 	return total_size;
 }
 
+const char* twrpTar::Compressor_Name(Archive_Type type) {
+	switch (type) {
+		case LZ4_COMPRESSED:
+			return "lz4";
+		case ZSTD_COMPRESSED:
+			return "zstd";
+		default:
+			return "pigz";
+	}
+}
+
+// Replaces the current process with the compressor reading stdin and
+// writing stdout. Only returns if the exec failed. threads limits the
+// compression threads, 0 uses one per core.
+void twrpTar::Exec_Compressor(Archive_Type type, bool decompress, unsigned threads) {
+	char thread_arg[16];
+
+	if (threads == 0) {
+		long cores = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = cores > 0 ? cores : 1;
+	}
+	if (type == LZ4_COMPRESSED) {
+		if (decompress)
+			execlp("lz4", "lz4", "-d", "-c", NULL);
+		else
+			execlp("lz4", "lz4", "-1", "-c", NULL);
+	} else if (type == ZSTD_COMPRESSED) {
+		if (decompress) {
+			execlp("zstd", "zstd", "-d", "-c", NULL);
+		} else {
+			// zstd splits the stream into independently compressed
+			// jobs, one per thread
+			snprintf(thread_arg, sizeof(thread_arg), "-T%u", threads);
+			execlp("zstd", "zstd", "-1", thread_arg, "-c", NULL);
+		}
+	} else {
+		if (decompress) {
+			execlp("pigz", "pigz", "-d", "-c", NULL);
+		} else {
+			snprintf(thread_arg, sizeof(thread_arg), "%u", threads);
+			execlp("pigz", "pigz", "-p", thread_arg, "-", NULL);
+		}
+	}
+}
+
+void twrpTar::Start_Stream(int fd) {
+	if (part_settings->adbbackup || fd < 0 || fd >= MAX_STREAM_FD)
+		return;
+	stream_fd = fd;
+	stream_size = 0;
+	stream_file_count = 0;
+	MD5Init(&stream_md5);
+	stream_by_fd[fd] = this;
+	index_lines.clear();
+	last_seek_point = 0;
+	if (write_index)
+		index_lines.push_back("S 0 0");
+}
+
+// Called by the libtar write callbacks, each thread writes to its own fd
+void twrpTar::Account_Stream(int fd, const void *buffer, size_t size) {
+	twrpTar* tar;
+
+	if (fd < 0 || fd >= MAX_STREAM_FD || (tar = stream_by_fd[fd]) == NULL)
+		return;
+	tar->stream_size += size;
+	MD5Update(&tar->stream_md5, (unsigned char const*)buffer, size);
+}
+
+static void Put_LE(unsigned char* buf, uint32_t value, int bytes) {
+	for (int i = 0; i < bytes; i++)
+		buf[i] = (value >> (i * 8)) & 0xff;
+}
+
+int twrpTar::Write_Footer() {
+	twrpArchiveFooter footer;
+	unsigned char trailer[sizeof(footer) + 32];
+	size_t len = 0;
+
+	memset(&footer, 0, sizeof(footer));
+	memcpy(footer.magic, TW_ARCHIVE_FOOTER_MAGIC, sizeof(footer.magic));
+	footer.version = 1;
+	footer.archive_type = current_archive_type;
+	footer.size = stream_size;
+	footer.file_count = stream_file_count;
+	MD5Final(footer.md5, &stream_md5);
+
+	if (current_archive_type == COMPRESSED) {
+		// An empty gzip member with the footer in its extra field, pigz
+		// decompresses it to nothing
+		static const unsigned char gz_header[10] = { 0x1f, 0x8b, 8, 4, 0, 0, 0, 0, 0, 3 };
+		footer.trailer_size = sizeof(gz_header) + 2 + 4 + sizeof(footer) + 2 + 8;
+		memcpy(trailer, gz_header, sizeof(gz_header));
+		len = sizeof(gz_header);
+		Put_LE(trailer + len, 4 + sizeof(footer), 2);
+		len += 2;
+		trailer[len++] = 'T';
+		trailer[len++] = 'W';
+		Put_LE(trailer + len, sizeof(footer), 2);
+		len += 2;
+		memcpy(trailer + len, &footer, sizeof(footer));
+		len += sizeof(footer);
+		trailer[len++] = 3; // final, empty fixed huffman block
+		trailer[len++] = 0;
+		memset(trailer + len, 0, 8); // crc32 and length of no data
+		len += 8;
+	} else if (current_archive_type == LZ4_COMPRESSED || current_archive_type == ZSTD_COMPRESSED) {
+		// Skippable frame, lz4 and zstd share the format
+		footer.trailer_size = 8 + sizeof(footer);
+		Put_LE(trailer, 0x184d2a5e, 4);
+		Put_LE(trailer + 4, sizeof(footer), 4);
+		memcpy(trailer + 8, &footer, sizeof(footer));
+		len = 8 + sizeof(footer);
+	} else {
+		// libtar stops at the end of archive blocks, encrypted archives
+		// are fed to openaes without the footer by Open_Archive_Data()
+		footer.trailer_size = sizeof(footer);
+		memcpy(trailer, &footer, sizeof(footer));
+		len = sizeof(footer);
+	}
+
+	int footer_fd = open(tarfn.c_str(), O_WRONLY | O_APPEND | O_LARGEFILE);
+	if (footer_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
+		return -1;
+	}
+	if (write(footer_fd, trailer, len) != (ssize_t)len) {
+		LOGINFO("Unable to write footer to '%s': %s\n", tarfn.c_str(), strerror(errno));
+		close(footer_fd);
+		return -1;
+	}
+	close(footer_fd);
+	return 0;
+}
+
+bool twrpTar::Read_Footer(const string& Filename, twrpArchiveFooter& footer) {
+	struct stat st;
+	bool ret = false;
+
+	int footer_fd = open(Filename.c_str(), O_RDONLY | O_LARGEFILE);
+	if (footer_fd < 0)
+		return false;
+	if (fstat(footer_fd, &st) == 0) {
+		// The gzip wrapper ends with 10 more bytes, the others end with the footer
+		off_t offsets[2] = { st.st_size - (off_t)sizeof(footer), st.st_size - (off_t)sizeof(footer) - 10 };
+		for (int i = 0; i < 2 && !ret; i++) {
+			if (offsets[i] < 0 || pread(footer_fd, &footer, sizeof(footer), offsets[i]) != sizeof(footer))
+				continue;
+			ret = memcmp(footer.magic, TW_ARCHIVE_FOOTER_MAGIC, sizeof(footer.magic)) == 0 && footer.version == 1 && footer.trailer_size <= st.st_size;
+		}
+	}
+	close(footer_fd);
+	return ret;
+}
+
+// Opens tarfn for reading. openaes would choke on the footer, so encrypted
+// archives are copied to it through a pipe that stops in front of it.
+int twrpTar::Open_Archive_Data() {
+	twrpArchiveFooter footer;
+	struct stat st;
+	int feedfd[2];
+
+	int file_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
+	if (file_fd < 0 || (current_archive_type != ENCRYPTED && current_archive_type != COMPRESSED_ENCRYPTED) || !Read_Footer(tarfn, footer))
+		return file_fd;
+	if (fstat(file_fd, &st) != 0 || pipe(feedfd) < 0) {
+		LOGINFO("Error creating pipe\n");
+		close(file_fd);
+		return -1;
+	}
+	feeder_pid = fork();
+	if (feeder_pid < 0) {
+		LOGINFO("fork() failed\n");
+		close(file_fd);
+		close(feedfd[0]);
+		close(feedfd[1]);
+		return -1;
+	} else if (feeder_pid == 0) {
+		// Child
+		uint64_t remaining = st.st_size - footer.trailer_size;
+		char buf[65536];
+
+		close(feedfd[0]);
+		while (remaining > 0) {
+			ssize_t len = read(file_fd, buf, remaining < sizeof(buf) ? remaining : sizeof(buf));
+			if (len <= 0 || write(feedfd[1], buf, len) != len)
+				_exit(-1);
+			remaining -= len;
+		}
+		close(feedfd[1]);
+		_exit(0);
+	}
+	// Parent
+	close(file_fd);
+	close(feedfd[1]);
+	return feedfd[0];
+}
+
+// The index is a text file next to each archive. "S <tar offset> <file
+// offset>" lines are points where decompression can start, "E <offset>
+// <size> <type> <path>" lines are the archive members in stream order.
+void twrpTar::Add_Index_Entry(const string& Path, const struct stat& st, uint64_t Offset) {
+	char line[64];
+	char type = S_ISDIR(st.st_mode) ? 'd' : S_ISLNK(st.st_mode) ? 'l' : S_ISREG(st.st_mode) ? 'f' : 'o';
+
+	snprintf(line, sizeof(line), "E %llu %llu %c ", (unsigned long long)Offset, (unsigned long long)st.st_size, type);
+	index_lines.push_back(line + Path);
+}
+
+bool twrpTar::Save_Index() {
+	if (!write_index || index_lines.empty())
+		return true;
+	string Index_File = tarfn + ".index";
+	FILE* index = fopen(Index_File.c_str(), "w");
+	if (index == NULL) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(Index_File)(strerror(errno)));
+		return false;
+	}
+	for (vector<string>::iterator line = index_lines.begin(); line != index_lines.end(); line++)
+		fprintf(index, "%s\n", line->c_str());
+	if (fclose(index) != 0) {
+		LOGINFO("Error writing '%s': %s\n", Index_File.c_str(), strerror(errno));
+		return false;
+	}
+	index_lines.clear();
+#ifndef BUILD_TWRPTAR_MAIN
+	tw_set_default_metadata(Index_File.c_str());
+#endif
+	return true;
+}
+
+// Ends the current gzip member or lz4/zstd frame and starts a new one so
+// that decompression can begin at this point of the archive. The new
+// compressor shares output_fd and appends to what the old one wrote.
+int twrpTar::Restart_Compressor() {
+	struct stat st;
+	int status, pigzfd[2];
+
+	if (current_archive_type != COMPRESSED && current_archive_type != LZ4_COMPRESSED && current_archive_type != ZSTD_COMPRESSED)
+		return 0;
+	// libtar keeps writing to fd, so the old pipe is closed by replacing it
+	int null_fd = open("/dev/null", O_WRONLY);
+	if (null_fd < 0)
+		return -1;
+	dup2(null_fd, fd);
+	close(null_fd);
+	if (TWFunc::Wait_For_Child(pigz_pid, &status, Compressor_Name(current_archive_type)) != 0)
+		return -1;
+	if (fstat(output_fd, &st) != 0 || pipe(pigzfd) < 0) {
+		LOGINFO("Error creating pipe\n");
+		return -1;
+	}
+	pigz_pid = fork();
+	if (pigz_pid < 0) {
+		LOGINFO("fork() failed\n");
+		close(pigzfd[0]);
+		close(pigzfd[1]);
+		return -1;
+	} else if (pigz_pid == 0) {
+		// Child
+		close(pigzfd[1]);
+		dup2(pigzfd[0], fileno(stdin));
+		dup2(output_fd, fileno(stdout));
+		Exec_Compressor(current_archive_type, false, thread_count);
+		LOGINFO("execlp %s ERROR!\n", Compressor_Name(current_archive_type));
+		_exit(-1);
+	}
+	// Parent
+	close(pigzfd[0]);
+	dup2(pigzfd[1], fd);
+	close(pigzfd[1]);
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	char line[64];
+	snprintf(line, sizeof(line), "S %llu %llu", (unsigned long long)stream_size, (unsigned long long)st.st_size);
+	index_lines.push_back(line);
+	last_seek_point = stream_size;
+	return 0;
+}
+
+static ssize_t read_index_stream(int fd, void *buffer, size_t size) {
+	ssize_t ret = read(fd, buffer, size);
+	if (ret > 0)
+		index_stream_pos += ret;
+	return ret;
+}
+
+static bool Index_Match(const string& Path, const vector<string>& Paths) {
+	for (vector<string>::const_iterator p = Paths.begin(); p != Paths.end(); p++) {
+		if (Path == *p || (Path.size() > p->size() && Path.compare(0, p->size(), *p) == 0 && Path[p->size()] == '/'))
+			return true;
+	}
+	return false;
+}
+
+// Starts decompressing tarfn at Compressed_Offset, returns the fd to read
+// the tar stream from
+int twrpTar::Open_Index_Stream(uint64_t Compressed_Offset) {
+	int pigzfd[2];
+
+	input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
+	if (input_fd < 0) {
+		gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
+		return -1;
+	}
+	if (lseek64(input_fd, Compressed_Offset, SEEK_SET) < 0 || pipe(pigzfd) < 0) {
+		LOGINFO("Error seeking in '%s'\n", tarfn.c_str());
+		close(input_fd);
+		return -1;
+	}
+	pigz_pid = fork();
+	if (pigz_pid < 0) {
+		LOGINFO("fork() failed\n");
+		close(input_fd);
+		close(pigzfd[0]);
+		close(pigzfd[1]);
+		return -1;
+	} else if (pigz_pid == 0) {
+		// Child
+		close(pigzfd[0]);
+		dup2(pigzfd[1], fileno(stdout));
+		dup2(input_fd, fileno(stdin));
+		Exec_Compressor(current_archive_type, true);
+		LOGINFO("execlp %s ERROR!\n", Compressor_Name(current_archive_type));
+		_exit(-1);
+	}
+	// Parent
+	close(input_fd);
+	input_fd = -1;
+	close(pigzfd[1]);
+	return pigzfd[0];
+}
+
+int twrpTar::extractSelected(const vector<string>& Paths) {
+	vector<string> Volumes;
+	char actual_filename[PATH_MAX];
+	int ret, extracted = 0;
+
+	if (TWFunc::Path_Exists(tarfn)) {
+		Volumes.push_back(tarfn);
+	} else {
+		string temp = tarfn + "%i%02i";
+		for (int thread = 0; thread < 9; thread++) {
+			for (int archive = 0; archive < 100; archive++) {
+				sprintf(actual_filename, temp.c_str(), thread, archive);
+				if (!TWFunc::Path_Exists(actual_filename))
+					break;
+				Volumes.push_back(actual_filename);
+			}
+		}
+	}
+	for (vector<string>::iterator volume = Volumes.begin(); volume != Volumes.end(); volume++) {
+		ret = Extract_Volume_Selected(*volume, Paths);
+		if (ret < 0)
+			return -1;
+		extracted += ret;
+	}
+	return extracted;
+}
+
+// Extracts the entries of Volume matching Paths, seeking to them with the
+// help of the volume's index instead of reading the whole archive
+int twrpTar::Extract_Volume_Selected(const string& Volume, const vector<string>& Paths) {
+	struct Index_Entry {
+		uint64_t offset;
+		size_t seek_point;
+	};
+	vector<pair<uint64_t, uint64_t> > seek_points;
+	vector<Index_Entry> selected;
+	vector<string> lines;
+	unsigned long long first, second, size;
+	char type;
+	int pos;
+
+	if (TWFunc::read_file(Volume + ".index", lines) != 0) {
+		gui_msg(Msg(msg::kError, "selective_no_index=No index found for '{1}', the backup was made without one.")(Volume));
+		return -1;
+	}
+	for (vector<string>::iterator line = lines.begin(); line != lines.end(); line++) {
+		if (sscanf(line->c_str(), "S %llu %llu", &first, &second) == 2) {
+			seek_points.push_back(make_pair((uint64_t)first, (uint64_t)second));
+		} else if (sscanf(line->c_str(), "E %llu %llu %c %n", &first, &size, &type, &pos) == 3 && !seek_points.empty()) {
+			if (Index_Match(line->substr(pos), Paths)) {
+				Index_Entry entry = { first, seek_points.size() - 1 };
+				selected.push_back(entry);
+			}
+		}
+	}
+	if (selected.empty())
+		return 0;
+
+	tarfn = Volume;
+	Set_Archive_Type(TWFunc::Get_File_Type(tarfn));
+	if (current_archive_type == ENCRYPTED || current_archive_type == COMPRESSED_ENCRYPTED) {
+		gui_msg(Msg(msg::kError, "selective_encrypted=Files cannot be restored individually from encrypted archive '{1}'.")(tarfn));
+		return -1;
+	}
+	bool compressed = (current_archive_type != UNCOMPRESSED);
+	char* charRootDir = (char*) tardir.c_str();
+	char path[PATH_MAX];
+	char discard[65536];
+	int no_progress = 0, extracted = 0, ret = 0;
+	bool is_open = false;
+
+	tar_type = { open, close, read_index_stream, write };
+	LOGINFO("Extracting %zu entries from '%s'\n", selected.size(), tarfn.c_str());
+	for (vector<Index_Entry>::iterator entry = selected.begin(); entry != selected.end(); entry++) {
+		if (!compressed) {
+			if (!is_open) {
+				input_fd = open(tarfn.c_str(), O_RDONLY | O_LARGEFILE);
+				if (input_fd < 0 || tar_fdopen(&t, input_fd, charRootDir, &tar_type, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TAR_GNU | TAR_STORE_SELINUX) != 0) {
+					gui_msg(Msg(msg::kError, "error_opening_strerr=Error opening: '{1}' ({2})")(tarfn)(strerror(errno)));
+					return -1;
+				}
+				input_fd = -1;
+				is_open = true;
+			}
+			if (lseek64(t->fd, entry->offset, SEEK_SET) < 0) {
+				ret = -1;
+				break;
+			}
+			index_stream_pos = entry->offset;
+		} else {
+			const pair<uint64_t, uint64_t>& seek_point = seek_points[entry->seek_point];
+			// Start over from the nearest seek point unless the entry is
+			// just ahead in the stream that is already being read
+			if (!is_open || index_stream_pos > entry->offset || seek_point.first > index_stream_pos) {
+				if (is_open) {
+					tar_close(t);
+					waitpid(pigz_pid, NULL, 0);
+				}
+				fd = Open_Index_Stream(seek_point.second);
+				if (fd < 0 || tar_fdopen(&t, fd, charRootDir, &tar_type, O_RDONLY | O_LARGEFILE, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH, TAR_GNU | TAR_STORE_SELINUX) != 0) {
+					is_open = false;
+					ret = -1;
+					break;
+				}
+				index_stream_pos = seek_point.first;
+				is_open = true;
+			}
+			while (index_stream_pos < entry->offset) {
+				uint64_t remaining = entry->offset - index_stream_pos;
+				if (read_index_stream(t->fd, discard, remaining < sizeof(discard) ? remaining : sizeof(discard)) <= 0) {
+					ret = -1;
+					break;
+				}
+			}
+			if (ret != 0)
+				break;
+		}
+		if (th_read(t) != 0) {
+			ret = -1;
+			break;
+		}
+		snprintf(path, sizeof(path), "%s/%s", charRootDir, th_get_pathname(t));
+		if (tar_extract_file(t, path, charRootDir, &no_progress) != 0) {
+			LOGINFO("Unable to extract '%s'\n", path);
+			ret = -1;
+			break;
+		}
+		extracted++;
+	}
+	if (is_open) {
+		tar_close(t);
+		// The decompressor gets SIGPIPE if the rest of the stream is not needed
+		if (compressed)
+			waitpid(pigz_pid, NULL, 0);
+	}
+	if (ret != 0) {
+		LOGINFO("Error extracting selected entries from '%s'\n", tarfn.c_str());
+		gui_err("restore_error=Error during restore process.");
+		return -1;
+	}
+	return extracted;
+}
+
 extern "C" ssize_t write_tar(int fd, const void *buffer, size_t size) {
+	twrpTar::Account_Stream(fd, buffer, size);
 	return (ssize_t) write_libtar_buffer(fd, buffer, size);
 }
 
 extern "C" ssize_t write_tar_no_buffer(int fd, const void *buffer, size_t size) {
+	twrpTar::Account_Stream(fd, buffer, size);
 	return (ssize_t) write_libtar_no_buffer(fd, buffer, size);
 }
@@ -18,9 +18,11 @@
 
 extern "C" {
 	#include "libtar/libtar.h"
+	#include "digest/md5.h"
 }
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <stdint.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
@@ -28,6 +30,7 @@ extern "C" {
 #include <string>
 #include <vector>
 #include "twrpDU.hpp"
+#include "twrpManifest.hpp"
 #include "progresstracking.hpp"
 #include "partitions.hpp"
 #include "twrp-functions.hpp"
@@ -44,6 +47,25 @@ struct thread_data_struct {
 	unsigned thread_id;
 };
 
+struct verify_data_struct {
+	std::vector<std::string> Files;
+};
+
+// Record appended to the end of every archive so that restores can be
+// planned without decompressing or decrypting it. It is wrapped so that
+// pigz, lz4 and zstd skip it, see twrpTar::Write_Footer().
+#define TW_ARCHIVE_FOOTER_MAGIC "TWRPMETA"
+struct twrpArchiveFooter {
+	char magic[8];
+	uint32_t version;
+	uint32_t archive_type;                                                          // Archive_Type of the data in front of the footer
+	uint64_t size;                                                                  // uncompressed size of the tar stream
+	uint64_t file_count;                                                            // regular files in this archive
+	uint8_t md5[16];                                                                // md5 of the uncompressed tar stream
+	uint32_t trailer_size;                                                          // bytes following the archive data, including any wrapping
+	uint32_t reserved;
+} __attribute__((packed));
+
 
 class twrpTar {
 public:
@@ -57,11 +79,15 @@ public:
 	void setpassword(string pass);
 	unsigned long long get_size();
 	void Set_Archive_Type(Archive_Type archive_type);
+	static bool Read_Footer(const string& Filename, twrpArchiveFooter& footer);
+	static void Account_Stream(int fd, const void *buffer, size_t size);
+	int extractSelected(const vector<string>& Paths);                              // extracts only Paths and anything below them using the archive indexes, returns the number of entries or -1
 
 public:
 	int use_encryption;
 	int userdata_encryption;
 	int use_compression;
+	Archive_Type compression_type;                                                  // COMPRESSED (gzip), LZ4_COMPRESSED or ZSTD_COMPRESSED
 	int split_archives;
 	int has_data_media;
 	string backup_name;
@@ -69,6 +95,11 @@ public:
 	string partition_name;
 	string backup_folder;
 	PartitionSettings *part_settings;
+	int write_manifest;                                                             // write a manifest of all entries to backup_folder
+	string incremental_base;                                                        // backup folder to compare against, only changed entries are archived
+	bool verify_md5;                                                                // check the .md5 of each archive while extracting
+	int write_index;                                                                // write an index of member offsets next to each archive
+	unsigned thread_count;                                                          // threads for compression and userdata encryption, 0 for one per core
 
 private:
 	int extract();
@@ -84,9 +115,25 @@ private:
 	int Generate_TarList(string Path, std::vector<TarListStruct> *TarList, unsigned long long *Target_Size, unsigned *thread_id);
 	static void* createList(void *cookie);
 	static void* extractMulti(void *cookie);
+	int extractVerified(const string& Next_Volume, bool Current_Verified);
+	static void* verifyMulti(void *cookie);
+	static bool Verify_MD5(const string& Filename);
 	int tarList(std::vector<TarListStruct> *TarList, unsigned thread_id);
+	bool Manifest_Skip(const string& FileName);
+	bool Save_Manifest();
 	unsigned long long uncompressedSize(string filename);
+	static const char* Compressor_Name(Archive_Type type);
+	void Set_Fork_Pid(pid_t *tar_fork_pid, pid_t pid);
+	void Start_Stream(int stream_fd);
+	int Write_Footer();
+	int Open_Archive_Data();
+	static void Exec_Compressor(Archive_Type type, bool decompress, unsigned threads = 0);
 	static void Signal_Kill(int signum);
+	int Restart_Compressor();
+	void Add_Index_Entry(const string& Path, const struct stat& st, uint64_t Offset);
+	bool Save_Index();
+	int Open_Index_Stream(uint64_t Compressed_Offset);
+	int Extract_Volume_Selected(const string& Volume, const vector<string>& Paths);
 
 	enum Archive_Type current_archive_type;
 	unsigned long long Archive_Current_Size;
@@ -98,7 +145,16 @@ private:
 	int input_fd;                                                                   // this stores the fd for libtar to write to
 	pid_t pigz_pid;
 	pid_t oaes_pid;
+	pid_t feeder_pid;
 	unsigned long long file_count;
+	int stream_fd;                                                                  // fd libtar writes the archive to, -1 when not creating
+	uint64_t stream_size;
+	uint64_t stream_file_count;
+	struct MD5Context stream_md5;
+	vector<string> index_lines;                                                     // index of the archive being created, see Save_Index()
+	uint64_t last_seek_point;                                                       // stream_size when the compressor was last restarted
+	twrpManifest manifest;
+	twrpManifest base_manifest;
 
 	string tardir;
 	string tarfn;
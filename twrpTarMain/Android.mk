@@ -7,8 +7,11 @@ LOCAL_SRC_FILES:= \
 	twrpTarMain.cpp \
 	../twrp-functions.cpp \
 	../twrpTar.cpp \
+	../twrpManifest.cpp \
+	../digest/md5.c \
 	../tarWrite.c \
 	../twrpDU.cpp \
+	../twrpTrace.cpp \
 	../progresstracking.cpp \
 	../gui/twmsg.cpp
 LOCAL_CFLAGS:= -g -c -W -DBUILD_TWRPTAR_MAIN
@@ -53,8 +56,11 @@ LOCAL_SRC_FILES:= \
 	twrpTarMain.cpp \
 	../twrp-functions.cpp \
 	../twrpTar.cpp \
+	../twrpManifest.cpp \
+	../digest/md5.c \
 	../tarWrite.c \
 	../twrpDU.cpp \
+	../twrpTrace.cpp \
 	../progresstracking.cpp \
 	../gui/twmsg.cpp
 LOCAL_CFLAGS:= -g -c -W -DBUILD_TWRPTAR_MAIN
@@ -81,3 +87,34 @@ LOCAL_MODULE_TAGS:= optional
 LOCAL_MODULE_CLASS := UTILITY_EXECUTABLES
 LOCAL_MODULE_PATH := $(PRODUCT_OUT)/utilities
 include $(BUILD_EXECUTABLE)
+
+
+# Build host binary, see scripts/twrptar_benchmark.py
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES:= \
+	twrpTarMain.cpp \
+	../twrp-functions.cpp \
+	../twrpTar.cpp \
+	../twrpManifest.cpp \
+	../digest/md5.c \
+	../tarWrite.c \
+	../twrpDU.cpp \
+	../twrpTrace.cpp \
+	../progresstracking.cpp \
+	../gui/twmsg.cpp \
+	../adbbu/libtwadbbu.cpp \
+	../libcrecovery/popen.c
+LOCAL_CFLAGS:= -g -c -W -DBUILD_TWRPTAR_MAIN -D_GNU_SOURCE
+
+LOCAL_STATIC_LIBRARIES := libtar_host libcutils libz
+ifeq ($(TW_EXCLUDE_ENCRYPTED_BACKUPS), true)
+    LOCAL_CFLAGS += -DTW_EXCLUDE_ENCRYPTED_BACKUPS
+else
+	LOCAL_STATIC_LIBRARIES += libopenaes_host
+endif
+LOCAL_LDLIBS := -lpthread
+
+LOCAL_MODULE:= twrpTar_host
+LOCAL_MODULE_TAGS:= optional
+include $(BUILD_HOST_EXECUTABLE)
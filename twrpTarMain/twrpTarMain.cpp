@@ -19,11 +19,14 @@
 
 #include "../twrp-functions.hpp"
 #include "../twrpTar.hpp"
+#include "../twrpManifest.hpp"
 #include "../twrpDU.hpp"
 #include "../progresstracking.hpp"
 #include "../gui/gui.hpp"
 #include "../gui/twmsg.h"
 #include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 twrpDU du;
 
@@ -74,10 +77,14 @@ void usage() {
 	printf(" -t    output file\n");
 	printf(" -m    skip media subfolder (has data media)\n");
 	printf(" -z    compress backup (/sbin/pigz must be present)\n");
+	printf(" -Z    compress backup using lz4 or zstd followed by the codec name (/sbin/lz4 or /sbin/zstd must be present)\n");
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	printf(" -e    encrypt/decrypt backup followed by password (/sbin/openaes must be present)\n");
 	printf(" -u    encrypt using userdata encryption (must be used with -e)\n");
 #endif
+	printf(" -T    number of threads for compression and userdata encryption, default is one per core\n");
+	printf(" -M    write a manifest next to the output file, or remove the entries it records as deleted after extracting\n");
+	printf(" -i    create an incremental backup based on the manifest in the backup folder that follows (implies -M)\n");
 	printf("\n\n");
 	printf("Example: twrpTar -c -d /cache -t /sdcard/test.tar\n");
 	printf("         twrpTar -x -d /cache -t /sdcard/test.tar\n");
@@ -86,10 +93,13 @@ void usage() {
 int main(int argc, char **argv) {
 	twrpTar tar;
 	int use_encryption = 0, userdata_encryption = 0, has_data_media = 0, use_compression = 0, include_root = 0;
+	Archive_Type compression_type = COMPRESSED;
 	int i, action = 0;
-	unsigned j;
-	string Directory, Tar_Filename;
+	unsigned j, thread_count = 0;
+	string Directory, Tar_Filename, Base_Folder;
+	int write_manifest = 0;
 	ProgressTracking progress(1);
+	PartitionSettings part_settings;
 	pid_t tar_fork_pid = 0;
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	string Password;
@@ -153,6 +163,24 @@ int main(int argc, char **argv) {
 			if (action == 2)
 				printf("NOTE: %s option not needed when extracting.\n", argv[i]);
 			use_compression = 1;
+		} else if (strcmp(argv[i], "-Z") == 0) {
+			i++;
+			if (argc <= i) {
+				printf("No argument specified for %s\n", argv[i - 1]);
+				usage();
+				return -1;
+			} else if (strcmp(argv[i], "lz4") == 0) {
+				compression_type = LZ4_COMPRESSED;
+			} else if (strcmp(argv[i], "zstd") == 0) {
+				compression_type = ZSTD_COMPRESSED;
+			} else {
+				printf("Unknown compression '%s'\n", argv[i]);
+				usage();
+				return -1;
+			}
+			if (action == 2)
+				printf("NOTE: %s option not needed when extracting.\n", argv[i - 1]);
+			use_compression = 1;
 		} else if (strcmp(argv[i], "-u") == 0) {
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 			if (action == 2)
@@ -163,14 +191,60 @@ int main(int argc, char **argv) {
 			usage();
 			return -1;
 #endif
+		} else if (strcmp(argv[i], "-T") == 0) {
+			i++;
+			if (argc <= i) {
+				printf("No argument specified for %s\n", argv[i - 1]);
+				usage();
+				return -1;
+			} else {
+				thread_count = atoi(argv[i]);
+			}
+		} else if (strcmp(argv[i], "-M") == 0) {
+			write_manifest = 1;
+		} else if (strcmp(argv[i], "-i") == 0) {
+			i++;
+			if (argc <= i) {
+				printf("No argument specified for %s\n", argv[i - 1]);
+				usage();
+				return -1;
+			} else {
+				Base_Folder = argv[i];
+				write_manifest = 1;
+				if (action != 1)
+					printf("NOTE: %s option not needed when extracting.\n", argv[i - 1]);
+			}
 		}
 	}
 
+	part_settings.Part = NULL;
+	part_settings.adbbackup = false;
+	part_settings.adb_compression = false;
+	part_settings.generate_md5 = false;
+	part_settings.dedup = false;
+	part_settings.inline_md5 = false;
+	part_settings.total_restore_size = 0;
+	part_settings.partition_count = 1;
+	part_settings.progress = &progress;
+	part_settings.PM_Method = (action == 1 ? PM_BACKUP : PM_RESTORE);
+
 	tar.has_data_media = has_data_media;
 	tar.setdir(Directory);
 	tar.setfn(Tar_Filename);
 	tar.setsize(du.Get_Folder_Size(Directory));
 	tar.use_compression = use_compression;
+	tar.compression_type = compression_type;
+	tar.thread_count = thread_count;
+	tar.part_settings = &part_settings;
+	if (write_manifest) {
+		// Named like partition backups, data.ext4.win has data.manifest
+		size_t slash = Tar_Filename.find_last_of('/');
+		tar.backup_folder = (slash == string::npos ? "." : Tar_Filename.substr(0, slash));
+		tar.partition_name = TWFunc::Get_Filename(Tar_Filename);
+		tar.partition_name = tar.partition_name.substr(0, tar.partition_name.find('.'));
+		tar.write_manifest = 1;
+		tar.incremental_base = Base_Folder;
+	}
 #ifndef TW_EXCLUDE_ENCRYPTED_BACKUPS
 	if (userdata_encryption && !use_encryption) {
 		printf("userdata encryption set without encryption option\n");
@@ -186,17 +260,27 @@ int main(int argc, char **argv) {
 	}
 #endif
 	if (action == 1) {
-		if (tar.createTarFork(&progress, tar_fork_pid) != 0) {
+		if (tar.createTarFork(&tar_fork_pid) != 0) {
 			sync();
 			return -1;
 		}
 		sync();
 		printf("\n\ntar created successfully.\n");
 	} else if (action == 2) {
-		if (tar.extractTarFork(&progress) != 0) {
+		if (tar.extractTarFork() != 0) {
 			sync();
 			return -1;
 		}
+		if (write_manifest) {
+			twrpManifest manifest;
+			int removed;
+			if (manifest.Load(tar.backup_folder + "/" + tar.partition_name + ".manifest") && !manifest.Base_Folder.empty() &&
+			    !manifest.Apply_Deletions(removed)) {
+				printf("Unable to remove the entries deleted since '%s'\n", manifest.Base_Folder.c_str());
+				sync();
+				return -1;
+			}
+		}
 		sync();
 		printf("\n\ntar extracted successfully.\n");
 	}
@@ -0,0 +1,207 @@
+/*
+        Copyright 2016 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "twrpTrace.hpp"
+#include "twcommon.h"
+
+volatile bool twrpTrace::enabled = false;
+
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+void twrpTrace::Set_Enabled(bool enable) {
+	if (enable && !enabled)
+		LOGINFO("Tracing to '%s'\n", TW_TRACE_FILE);
+	enabled = enable;
+}
+
+uint64_t twrpTrace::Now() {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void twrpTrace::Create_Key() {
+	pthread_key_create(&trace_key, Free_Thread_Buffer);
+	pthread_atfork(NULL, NULL, Reset_After_Fork);
+}
+
+// A forked child starts with a copy of the buffer of the forking thread.
+// Its events are written by the parent, and the spans open in the parent
+// never end in the child.
+void twrpTrace::Reset_After_Fork() {
+	Thread_Buffer* buffer = (Thread_Buffer*)pthread_getspecific(trace_key);
+
+	if (buffer != NULL) {
+		buffer->events.clear();
+		buffer->depth = 0;
+	}
+}
+
+// Called when a thread exits
+void twrpTrace::Free_Thread_Buffer(void* buffer) {
+	Thread_Buffer* thread_buffer = (Thread_Buffer*)buffer;
+
+	if (!thread_buffer->events.empty()) {
+		pthread_setspecific(trace_key, thread_buffer);
+		Flush();
+		pthread_setspecific(trace_key, NULL);
+	}
+	delete thread_buffer;
+}
+
+twrpTrace::Thread_Buffer* twrpTrace::Get_Thread_Buffer() {
+	pthread_once(&trace_key_once, Create_Key);
+	Thread_Buffer* buffer = (Thread_Buffer*)pthread_getspecific(trace_key);
+	if (buffer == NULL) {
+		buffer = new Thread_Buffer;
+		buffer->depth = 0;
+		pthread_setspecific(trace_key, buffer);
+	}
+	return buffer;
+}
+
+string twrpTrace::Escape(const string& Text) {
+	string escaped;
+	char hex[8];
+
+	for (string::const_iterator c = Text.begin(); c != Text.end(); c++) {
+		if (*c == '"' || *c == '\\') {
+			escaped += '\\';
+			escaped += *c;
+		} else if ((unsigned char)*c < 0x20) {
+			snprintf(hex, sizeof(hex), "\\u%04x", (unsigned char)*c);
+			escaped += hex;
+		} else {
+			escaped += *c;
+		}
+	}
+	return escaped;
+}
+
+void twrpTrace::Add_Event(Thread_Buffer* buffer, const string& Event) {
+	buffer->events.push_back(Event);
+	// Long running threads without an enclosing span still get written
+	if (buffer->depth == 0 || buffer->events.size() >= 256)
+		Flush();
+}
+
+void twrpTrace::Add_Span(const char* Category, const string& Name, const string& Detail, uint64_t Start, uint64_t Duration) {
+	char fields[160];
+
+	if (!enabled)
+		return;
+	snprintf(fields, sizeof(fields), "\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":%d,\"tid\":%d",
+		(unsigned long long)Start, (unsigned long long)Duration, (int)getpid(), (int)syscall(SYS_gettid));
+	string event = "{\"name\":\"" + Escape(Name) + "\",\"cat\":\"" + Category + "\"," + fields;
+	if (!Detail.empty())
+		event += ",\"args\":{\"detail\":\"" + Escape(Detail) + "\"}";
+	event += "}";
+	Add_Event(Get_Thread_Buffer(), event);
+}
+
+void twrpTrace::Set_Thread_Name(const string& Name) {
+	char fields[64];
+
+	if (!enabled)
+		return;
+	snprintf(fields, sizeof(fields), "\"pid\":%d,\"tid\":%d", (int)getpid(), (int)syscall(SYS_gettid));
+	Add_Event(Get_Thread_Buffer(), string("{\"name\":\"thread_name\",\"ph\":\"M\",") + fields + ",\"args\":{\"name\":\"" + Escape(Name) + "\"}}");
+}
+
+// All events of the thread go out in a single append so that processes
+// and threads writing at the same time do not interleave lines
+void twrpTrace::Flush() {
+	Thread_Buffer* buffer = Get_Thread_Buffer();
+	struct stat st;
+	string data;
+
+	if (buffer->events.empty())
+		return;
+	int fd = open(TW_TRACE_FILE, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		LOGINFO("Unable to open '%s': %s\n", TW_TRACE_FILE, strerror(errno));
+		buffer->events.clear();
+		return;
+	}
+	if (fstat(fd, &st) == 0 && st.st_size == 0)
+		data = "[\n";
+	for (vector<string>::iterator event = buffer->events.begin(); event != buffer->events.end(); event++)
+		data += *event + ",\n";
+	buffer->events.clear();
+	if (write(fd, data.c_str(), data.size()) != (ssize_t)data.size())
+		LOGINFO("Error writing '%s': %s\n", TW_TRACE_FILE, strerror(errno));
+	close(fd);
+}
+
+bool twrpTrace::Copy_Trace(const string& Destination) {
+	char buffer[65536];
+	ssize_t len;
+	bool ret = true;
+
+	if (!enabled)
+		return true;
+	Flush();
+	int source = open(TW_TRACE_FILE, O_RDONLY);
+	if (source < 0)
+		return false;
+	int dest = open(Destination.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (dest < 0) {
+		LOGINFO("Unable to open '%s': %s\n", Destination.c_str(), strerror(errno));
+		close(source);
+		return false;
+	}
+	while ((len = read(source, buffer, sizeof(buffer))) > 0) {
+		if (write(dest, buffer, len) != len) {
+			ret = false;
+			break;
+		}
+	}
+	close(source);
+	close(dest);
+	return ret;
+}
+
+twrpTraceSpan::twrpTraceSpan(const char* Category, const string& Name, const string& Detail) {
+	active = twrpTrace::Enabled();
+	if (!active)
+		return;
+	category = Category;
+	name = Name;
+	detail = Detail;
+	twrpTrace::Get_Thread_Buffer()->depth++;
+	start = twrpTrace::Now();
+}
+
+twrpTraceSpan::~twrpTraceSpan() {
+	if (!active)
+		return;
+	uint64_t end = twrpTrace::Now();
+	twrpTrace::Get_Thread_Buffer()->depth--;
+	twrpTrace::Add_Span(category, name, detail, start, end - start);
+}
@@ -0,0 +1,77 @@
+/*
+        Copyright 2016 TeamWin
+        This file is part of TWRP/TeamWin Recovery Project.
+
+        TWRP is free software: you can redistribute it and/or modify
+        it under the terms of the GNU General Public License as published by
+        the Free Software Foundation, either version 3 of the License, or
+        (at your option) any later version.
+
+        TWRP is distributed in the hope that it will be useful,
+        but WITHOUT ANY WARRANTY; without even the implied warranty of
+        MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+        GNU General Public License for more details.
+
+        You should have received a copy of the GNU General Public License
+        along with TWRP.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef TWRPTRACE_HPP
+#define TWRPTRACE_HPP
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// Chrome trace event file next to recovery.log, open it in
+// chrome://tracing or ui.perfetto.dev. The closing ] of the event array is
+// optional in that format, so the file is valid while it grows.
+#define TW_TRACE_FILE "/tmp/recovery_trace.json"
+
+// Records how long the phases of backups, restores, wipes and installs
+// take. Events are collected per thread and appended to TW_TRACE_FILE when
+// the outermost span of the thread ends, so forked tar processes add their
+// events too.
+class twrpTrace {
+public:
+	static void Set_Enabled(bool enable);
+	static bool Enabled() { return enabled; }
+	static uint64_t Now();                                                    // monotonic clock in microseconds
+	static void Add_Span(const char* Category, const string& Name, const string& Detail, uint64_t Start, uint64_t Duration);
+	static void Set_Thread_Name(const string& Name);                          // names the calling thread in the trace viewer
+	static void Flush();                                                      // writes the pending events of the calling thread
+	static bool Copy_Trace(const string& Destination);                        // copies the trace, e.g. next to the recovery.log of a backup
+
+private:
+	friend class twrpTraceSpan;
+	struct Thread_Buffer {
+		vector<string> events;
+		int depth;                                                        // open spans of the thread
+	};
+	static Thread_Buffer* Get_Thread_Buffer();
+	static void Free_Thread_Buffer(void* buffer);
+	static void Create_Key();
+	static void Reset_After_Fork();
+	static string Escape(const string& Text);
+	static void Add_Event(Thread_Buffer* buffer, const string& Event);
+
+	static volatile bool enabled;
+};
+
+// Measures the time from its construction to the end of its scope
+class twrpTraceSpan {
+public:
+	twrpTraceSpan(const char* Category, const string& Name, const string& Detail = "");
+	~twrpTraceSpan();
+
+private:
+	const char* category;
+	string name;
+	string detail;
+	uint64_t start;
+	bool active;
+};
+
+#endif // TWRPTRACE_HPP
@@ -28,7 +28,9 @@
 #include <fcntl.h>
 #include <time.h>
 #include <selinux/selinux.h>
-#include <ftw.h>
+#include <dirent.h>
+#include <limits.h>
+#include <pthread.h>
 #include <sys/capability.h>
 #include <sys/xattr.h>
 #include <linux/xattr.h>
@@ -58,13 +60,17 @@
 #endif
 
 void uiPrint(State* state, char* buffer) {
-    char* line = strtok(buffer, "\n");
+    char* save = NULL;
+    char* line = strtok_r(buffer, "\n", &save);
     UpdaterInfo* ui = (UpdaterInfo*)(state->cookie);
+    // Keeps the lines of messages from different threads together
+    flockfile(ui->cmd_pipe);
     while (line) {
         fprintf(ui->cmd_pipe, "ui_print %s\n", line);
-        line = strtok(NULL, "\n");
+        line = strtok_r(NULL, "\n", &save);
     }
     fprintf(ui->cmd_pipe, "ui_print\n");
+    funlockfile(ui->cmd_pipe);
 }
 
 __attribute__((__format__(printf, 2, 3))) __nonnull((2))
@@ -771,16 +777,67 @@ static struct perm_parsed_args ParsePermArgs(State * state, int argc, char** arg
     return parsed;
 }
 
-static int ApplyParsedPerms(
+// chown() clears the set-id bits and the file capabilities of anything
+// but a directory, even when the owner stays the same.
+static bool ChownChangesFile(const struct stat *st, int *has_caps, const char* target) {
+    if (S_ISDIR(st->st_mode)) {
+        return false;
+    }
+    if ((st->st_mode & S_ISUID) || (st->st_mode & (S_ISGID | S_IXGRP)) == (S_ISGID | S_IXGRP)) {
+        return true;
+    }
+    if (*has_caps < 0) {
+        *has_caps = lgetxattr(target, XATTR_NAME_CAPS, NULL, 0) >= 0 || errno != ENODATA;
+    }
+    return *has_caps != 0;
+}
+
+static void ChownDone(struct stat *st, int *has_caps) {
+    if (!S_ISDIR(st->st_mode)) {
+        st->st_mode &= ~S_ISUID;
+        if (st->st_mode & S_IXGRP) {
+            st->st_mode &= ~S_ISGID;
+        }
+        *has_caps = 0;
+    }
+}
+
+static bool ModeMatches(const struct stat *st, mode_t mode) {
+    return (st->st_mode & 07777) == (mode & 07777);
+}
+
+// Applies parsed to the entry name of the directory open as dirfd, or to
+// the path name if dirfd is AT_FDCWD. filename is the full path for the
+// messages. Nothing is written that already has the wanted value, with
+// statptr tracking what the earlier calls changed.
+static int ApplyParsedPermsAt(
         State * state,
+        int dirfd,
+        const char* name,
         const char* filename,
         const struct stat *statptr,
         struct perm_parsed_args parsed)
 {
     int bad = 0;
+    struct stat st = *statptr;
+    int has_caps = -1;
+    char target[PATH_MAX];
+
+    // The xattr calls have no *at() versions
+    if (dirfd == AT_FDCWD) {
+        snprintf(target, sizeof(target), "%s", name);
+    } else {
+        snprintf(target, sizeof(target), "/proc/self/fd/%d/%s", dirfd, name);
+    }
 
     if (parsed.has_selabel) {
-        if (lsetfilecon(filename, parsed.selabel) != 0) {
+        char* context = NULL;
+        bool matches = lgetfilecon(target, &context) >= 0 &&
+                strcmp(context, parsed.selabel) == 0;
+        if (context) {
+            freecon(context);
+        }
+        if (!matches && lsetfilecon(target, parsed.selabel) != 0) {
             uiPrintf(state, "ApplyParsedPerms: lsetfilecon of %s to %s failed: %s\n",
                     filename, parsed.selabel, strerror(errno));
             bad++;
@@ -788,53 +845,69 @@ static int ApplyParsedPerms(
     }
 
     /* ignore symlinks */
-    if (S_ISLNK(statptr->st_mode)) {
+    if (S_ISLNK(st.st_mode)) {
         return bad;
     }
 
     if (parsed.has_uid) {
-        if (chown(filename, parsed.uid, -1) < 0) {
-            uiPrintf(state, "ApplyParsedPerms: chown of %s to %d failed: %s\n",
-                    filename, parsed.uid, strerror(errno));
-            bad++;
+        if (st.st_uid != parsed.uid || ChownChangesFile(&st, &has_caps, target)) {
+            if (fchownat(dirfd, name, parsed.uid, -1, 0) < 0) {
+                uiPrintf(state, "ApplyParsedPerms: chown of %s to %d failed: %s\n",
+                        filename, parsed.uid, strerror(errno));
+                bad++;
+            } else {
+                st.st_uid = parsed.uid;
+                ChownDone(&st, &has_caps);
+            }
         }
     }
 
     if (parsed.has_gid) {
-        if (chown(filename, -1, parsed.gid) < 0) {
-            uiPrintf(state, "ApplyParsedPerms: chgrp of %s to %d failed: %s\n",
-                    filename, parsed.gid, strerror(errno));
-            bad++;
+        if (st.st_gid != parsed.gid || ChownChangesFile(&st, &has_caps, target)) {
+            if (fchownat(dirfd, name, -1, parsed.gid, 0) < 0) {
+                uiPrintf(state, "ApplyParsedPerms: chgrp of %s to %d failed: %s\n",
+                        filename, parsed.gid, strerror(errno));
+                bad++;
+            } else {
+                st.st_gid = parsed.gid;
+                ChownDone(&st, &has_caps);
+            }
         }
     }
 
-    if (parsed.has_mode) {
-        if (chmod(filename, parsed.mode) < 0) {
+    if (parsed.has_mode && !ModeMatches(&st, parsed.mode)) {
+        if (fchmodat(dirfd, name, parsed.mode, 0) < 0) {
             uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
                     filename, parsed.mode, strerror(errno));
             bad++;
+        } else {
+            st.st_mode = (st.st_mode & S_IFMT) | (parsed.mode & 07777);
         }
     }
 
-    if (parsed.has_dmode && S_ISDIR(statptr->st_mode)) {
-        if (chmod(filename, parsed.dmode) < 0) {
+    if (parsed.has_dmode && S_ISDIR(st.st_mode) && !ModeMatches(&st, parsed.dmode)) {
+        if (fchmodat(dirfd, name, parsed.dmode, 0) < 0) {
             uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
                     filename, parsed.dmode, strerror(errno));
             bad++;
+        } else {
+            st.st_mode = (st.st_mode & S_IFMT) | (parsed.dmode & 07777);
         }
     }
 
-    if (parsed.has_fmode && S_ISREG(statptr->st_mode)) {
-        if (chmod(filename, parsed.fmode) < 0) {
+    if (parsed.has_fmode && S_ISREG(st.st_mode) && !ModeMatches(&st, parsed.fmode)) {
+        if (fchmodat(dirfd, name, parsed.fmode, 0) < 0) {
             uiPrintf(state, "ApplyParsedPerms: chmod of %s to %d failed: %s\n",
                    filename, parsed.fmode, strerror(errno));
             bad++;
+        } else {
+            st.st_mode = (st.st_mode & S_IFMT) | (parsed.fmode & 07777);
         }
     }
 
-    if (parsed.has_capabilities && S_ISREG(statptr->st_mode)) {
+    if (parsed.has_capabilities && S_ISREG(st.st_mode)) {
         if (parsed.capabilities == 0) {
-            if ((removexattr(filename, XATTR_NAME_CAPS) == -1) && (errno != ENODATA)) {
+            if (has_caps != 0 && (lremovexattr(target, XATTR_NAME_CAPS) == -1) && (errno != ENODATA)) {
                 // Report failure unless it's ENODATA (attribute not set)
                 uiPrintf(state, "ApplyParsedPerms: removexattr of %s to %" PRIx64 " failed: %s\n",
                        filename, parsed.capabilities, strerror(errno));
@@ -842,16 +915,21 @@ static int ApplyParsedPerms(
             }
         } else {
             struct vfs_cap_data cap_data;
+            struct vfs_cap_data current;
             memset(&cap_data, 0, sizeof(cap_data));
             cap_data.magic_etc = VFS_CAP_REVISION | VFS_CAP_FLAGS_EFFECTIVE;
             cap_data.data[0].permitted = (uint32_t) (parsed.capabilities & 0xffffffff);
             cap_data.data[0].inheritable = 0;
             cap_data.data[1].permitted = (uint32_t) (parsed.capabilities >> 32);
             cap_data.data[1].inheritable = 0;
-            if (setxattr(filename, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0) {
-                uiPrintf(state, "ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n",
-                        filename, parsed.capabilities, strerror(errno));
-                bad++;
+            if (has_caps == 0 ||
+                    lgetxattr(target, XATTR_NAME_CAPS, &current, sizeof(current)) != sizeof(cap_data) ||
+                    memcmp(&current, &cap_data, sizeof(cap_data)) != 0) {
+                if (lsetxattr(target, XATTR_NAME_CAPS, &cap_data, sizeof(cap_data), 0) < 0) {
+                    uiPrintf(state, "ApplyParsedPerms: setcap of %s to %" PRIx64 " failed: %s\n",
+                            filename, parsed.capabilities, strerror(errno));
+                    bad++;
+                }
             }
         }
     }
@@ -859,14 +937,231 @@ static int ApplyParsedPerms(
     return bad;
 }
 
-// nftw doesn't allow us to pass along context, so we need to use
-// global variables.  *sigh*
-static struct perm_parsed_args recursive_parsed_args;
-static State* recursive_state;
+static int ApplyParsedPerms(
+        State * state,
+        const char* filename,
+        const struct stat *statptr,
+        struct perm_parsed_args parsed)
+{
+    return ApplyParsedPermsAt(state, AT_FDCWD, filename, filename, statptr, parsed);
+}
+
+#define SET_METADATA_THREADS 8
+#define SET_METADATA_QUEUE_MAX 256
+
+// A directory of a set_metadata_recursive() walk. Like nftw(FTW_DEPTH) the
+// directory itself is changed after everything in it, so it stays open
+// until its entries and subdirectories are done.
+struct perm_dir {
+    struct perm_dir* parent;
+    int fd;
+    char* path;
+    char* name;                 // entry in parent, or path for the top
+    struct stat st;
+    int remaining;              // its own listing plus unfinished subdirectories
+};
+
+// Directories waiting to be listed, shared by the worker threads
+struct perm_job {
+    State* state;
+    struct perm_parsed_args parsed;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct perm_dir* queue[SET_METADATA_QUEUE_MAX];
+    int queued;
+    int pending;                // queued directories plus the ones being listed
+    int bad;
+};
+
+static void FinishPermDir(struct perm_job* job, struct perm_dir* dir) {
+    while (dir != NULL) {
+        pthread_mutex_lock(&job->lock);
+        bool done = --dir->remaining == 0;
+        bool failed = job->bad > 0;
+        pthread_mutex_unlock(&job->lock);
+        if (!done) {
+            return;
+        }
+
+        struct perm_dir* parent = dir->parent;
+        if (!failed) {
+            int bad = ApplyParsedPermsAt(job->state, parent ? parent->fd : AT_FDCWD,
+                    dir->name, dir->path, &dir->st, job->parsed);
+            if (bad) {
+                pthread_mutex_lock(&job->lock);
+                job->bad += bad;
+                pthread_mutex_unlock(&job->lock);
+            }
+        }
+        if (dir->fd >= 0) {
+            close(dir->fd);
+        }
+        free(dir->path);
+        free(dir);
+        dir = parent;
+    }
+}
+
+// Changes everything in dir and queues its subdirectories, or walks them
+// right away when the queue is full.
+static void ApplyPermsToDir(struct perm_job* job, struct perm_dir* dir) {
+    DIR* d = NULL;
+    struct dirent* de;
+    int dupfd = dir->fd >= 0 ? dup(dir->fd) : -1;
+
+    if (dupfd >= 0) {
+        d = fdopendir(dupfd);
+        if (d == NULL) {
+            close(dupfd);
+        }
+    }
+    if (d == NULL) {
+        uiPrintf(job->state, "ApplyParsedPerms: unable to open %s: %s\n",
+                dir->path, strerror(errno));
+        pthread_mutex_lock(&job->lock);
+        job->bad++;
+        pthread_mutex_unlock(&job->lock);
+        FinishPermDir(job, dir);
+        return;
+    }
+
+    while ((de = readdir(d)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        pthread_mutex_lock(&job->lock);
+        bool failed = job->bad > 0;
+        pthread_mutex_unlock(&job->lock);
+        if (failed) {
+            // nftw() stops at the first entry that fails
+            break;
+        }
+
+        size_t path_len = strlen(dir->path);
+        size_t name_len = strlen(de->d_name);
+        char* path = malloc(path_len + name_len + 2);
+        memcpy(path, dir->path, path_len);
+        path[path_len] = '/';
+        memcpy(path + path_len + 1, de->d_name, name_len + 1);
+
+        struct stat st;
+        int bad = 0;
+        if (fstatat(dir->fd, de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            uiPrintf(job->state, "ApplyParsedPerms: unable to stat %s: %s\n",
+                    path, strerror(errno));
+            bad++;
+        } else if (!S_ISDIR(st.st_mode)) {
+            bad += ApplyParsedPermsAt(job->state, dir->fd, de->d_name, path, &st, job->parsed);
+        } else {
+            struct perm_dir* child = malloc(sizeof(struct perm_dir));
+            child->parent = dir;
+            child->fd = openat(dir->fd, de->d_name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            child->path = path;
+            child->name = path + path_len + 1;
+            child->st = st;
+            child->remaining = 1;
+            path = NULL;
+
+            pthread_mutex_lock(&job->lock);
+            dir->remaining++;
+            if (job->queued < SET_METADATA_QUEUE_MAX) {
+                job->queue[job->queued++] = child;
+                job->pending++;
+                pthread_cond_signal(&job->changed);
+                pthread_mutex_unlock(&job->lock);
+            } else {
+                pthread_mutex_unlock(&job->lock);
+                ApplyPermsToDir(job, child);
+            }
+        }
+        free(path);
+        if (bad) {
+            pthread_mutex_lock(&job->lock);
+            job->bad += bad;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+    closedir(d);
+    FinishPermDir(job, dir);
+}
+
+static void* SetMetadataThread(void* cookie) {
+    struct perm_job* job = (struct perm_job*) cookie;
+
+    pthread_mutex_lock(&job->lock);
+    for (;;) {
+        while (job->queued == 0 && job->pending > 0) {
+            pthread_cond_wait(&job->changed, &job->lock);
+        }
+        if (job->queued == 0) {
+            break;
+        }
+        // Taking the newest directory keeps the walk depth first and the
+        // number of open directories low
+        struct perm_dir* dir = job->queue[--job->queued];
+        pthread_mutex_unlock(&job->lock);
+        ApplyPermsToDir(job, dir);
+        pthread_mutex_lock(&job->lock);
+        if (--job->pending == 0) {
+            pthread_cond_broadcast(&job->changed);
+        }
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+// Applies parsed to path and everything below it without following
+// symlinks or leaving the walk to global state. Directories are listed by
+// up to SET_METADATA_THREADS threads.
+static int SetMetadataRecursive(State* state, const char* path, const struct stat* sb,
+        struct perm_parsed_args parsed) {
+    struct perm_job job;
+    pthread_t threads[SET_METADATA_THREADS];
+    int thread_count = 0;
+    int i;
+
+    if (!S_ISDIR(sb->st_mode)) {
+        return ApplyParsedPerms(state, path, sb, parsed);
+    }
+
+    struct perm_dir* top = malloc(sizeof(struct perm_dir));
+    top->parent = NULL;
+    top->fd = open(path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    top->path = strdup(path);
+    top->name = top->path;
+    top->st = *sb;
+    top->remaining = 1;
+
+    job.state = state;
+    job.parsed = parsed;
+    job.queue[0] = top;
+    job.queued = 1;
+    job.pending = 1;
+    job.bad = 0;
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.changed, NULL);
+
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int wanted = cores > 1 ? (int)cores : 1;
+    if (wanted > SET_METADATA_THREADS) {
+        wanted = SET_METADATA_THREADS;
+    }
+    for (i = 0; i < wanted; i++) {
+        if (pthread_create(&threads[thread_count], NULL, SetMetadataThread, &job) != 0) {
+            break;
+        }
+        thread_count++;
+    }
+    if (thread_count == 0) {
+        SetMetadataThread(&job);
+    }
+    for (i = 0; i < thread_count; i++) {
+        pthread_join(threads[i], NULL);
+    }
 
-static int do_SetMetadataRecursive(const char* filename, const struct stat *statptr,
-        int fileflags, struct FTW *pfwt) {
-    return ApplyParsedPerms(recursive_state, filename, statptr, recursive_parsed_args);
+    pthread_cond_destroy(&job.changed);
+    pthread_mutex_destroy(&job.lock);
+    return job.bad;
 }
 
 static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv[]) {
@@ -894,11 +1189,7 @@ static Value* SetMetadataFn(const char* name, State* state, int argc, Expr* argv
     struct perm_parsed_args parsed = ParsePermArgs(state, argc, args);
 
     if (recursive) {
-        recursive_parsed_args = parsed;
-        recursive_state = state;
-        bad += nftw(args[0], do_SetMetadataRecursive, 30, FTW_CHDIR | FTW_DEPTH | FTW_PHYS);
-        memset(&recursive_parsed_args, 0, sizeof(recursive_parsed_args));
-        recursive_state = NULL;
+        bad += SetMetadataRecursive(state, args[0], &sb, parsed);
     } else {
         bad += ApplyParsedPerms(state, args[0], &sb, parsed);
     }
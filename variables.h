@@ -20,6 +20,7 @@
 #define TW_VERSION_STR              "3.0.2-0"
 
 #define TW_USE_COMPRESSION_VAR      "tw_use_compression"
+#define TW_COMPRESSION_TYPE_VAR     "tw_compression_type"
 #define TW_FILENAME                 "tw_filename"
 #define TW_ZIP_INDEX                "tw_zip_index"
 #define TW_ZIP_QUEUE_COUNT       "tw_zip_queue_count"
@@ -69,7 +70,16 @@
 #define TW_ZIP_EXTERNAL_VAR         "tw_zip_external"
 #define TW_FORCE_MD5_CHECK_VAR      "tw_force_md5_check"
 #define TW_SKIP_MD5_CHECK_VAR       "tw_skip_md5_check"
+#define TW_INLINE_MD5_CHECK_VAR     "tw_inline_md5_check"
 #define TW_SKIP_MD5_GENERATE_VAR    "tw_skip_md5_generate"
+#define TW_INCREMENTAL_BACKUP_VAR   "tw_incremental_backup"
+#define TW_INCREMENTAL_BASE_VAR     "tw_incremental_base"
+#define TW_DEDUP_BACKUP_VAR         "tw_dedup_backup"
+#define TW_CONCURRENT_BACKUP_VAR    "tw_concurrent_backup"
+#define TW_SPARSE_IMAGE_BACKUP_VAR  "tw_sparse_image_backup"
+#define TW_COMPARE_IMAGE_RESTORE_VAR "tw_compare_image_restore"
+#define TW_TAR_INDEX_VAR            "tw_tar_index"
+#define TW_TRACE_VAR                "tw_trace"
 #define TW_DISABLE_FREE_SPACE_VAR   "tw_disable_free_space"
 #define TW_SIGNED_ZIP_VERIFY_VAR    "tw_signed_zip_verify"
 #define TW_INSTALL_REBOOT_VAR       "tw_install_reboot"